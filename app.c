@@ -2,31 +2,240 @@
 #define _GNU_SOURCE
 #include "cserver.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
 
 struct option long_options[] =
   {
     { "debug", FALSE, NULL, 'd' },
     { "verbose", FALSE, NULL, 'v' },
     { "quiet",   FALSE, NULL, 'q' },
+    { "engine",  TRUE,  NULL, 'e' },
+    { "min-threads",  TRUE, NULL, 'm' },
+    { "max-threads",  TRUE, NULL, 'M' },
+    { "idle-timeout", TRUE, NULL, 'i' },
+    { "max-queued",   TRUE, NULL, 'Q' },
+    { "admission",    TRUE, NULL, 'A' },
+    { "queue-target", TRUE, NULL, 'T' },
+    { "queue-interval", TRUE, NULL, 'I' },
+    { "conn-idle-timeout", TRUE, NULL, 'c' },
+    { "read-timeout", TRUE, NULL, 'r' },
+    { "write-timeout", TRUE, NULL, 'w' },
+    { "drain-timeout", TRUE, NULL, 'D' },
+    { "allow-shutdown", FALSE, NULL, 'S' },
+    { "listen",       TRUE, NULL, 'l' },
+    { "acceptors",    TRUE, NULL, 'a' },
+    { "backlog",      TRUE, NULL, 'b' },
+    { "tcp-nodelay", FALSE, NULL, 'N' },
+    { "trace",        TRUE, NULL, 't' },
     {NULL, 0, 0, 0}
   };
 
+/* The server the signals act on, while it is serving, and the file
+   SIGUSR2 writes the trace to. */
+static Mutex signal_mutex;
+static Server signal_server;
+static const char *trace_file;
+
+/* Write the trace of `server' to `trace_file'. */
+static void write_trace(const Server server)
+{
+  FILE *out;
+  if (!trace_file)
+    {
+      warning("Tracing is off, start with --trace FILE");
+      return;
+    }
+  if (!(out = fopen(trace_file, "w")))
+    {
+      warning("Failed to open %s: %m", trace_file);
+      return;
+    }
+  char * const text = server_format_trace(server);
+  fputs(text, out);
+  fputc('\n', out);
+  if (fclose(out) != 0)
+    warning("Failed to write %s: %m", trace_file);
+  xfree(text);
+}
+
+/* Take SIGTERM, SIGINT, SIGUSR1 and SIGUSR2, which every other thread
+   blocks, with sigwait() rather than in a handler, so acting on them
+   may lock.  SIGUSR1 prints the metrics and SIGUSR2 writes the trace.
+   The first SIGTERM or SIGINT drains the server; a second one exits at
+   once. */
+static void *signal_thread(void *context)
+{
+  const sigset_t * const signals = context;
+  int signo, count = 0;
+
+  while (sigwait(signals, &signo) == 0)
+    {
+      if (signo != SIGUSR1 && signo != SIGUSR2 && count++)
+        {
+          warning("Got signal %d again, exiting", signo);
+          _exit(1);
+        }
+      DEBUG(("Got signal %d", signo));
+      mutex_lock(signal_mutex);
+      if (signal_server && signo == SIGUSR1)
+        {
+          char * const text = server_format_metrics(signal_server);
+          fputs(text, stdout);
+          fflush(stdout);
+          xfree(text);
+        }
+      else if (signal_server && signo == SIGUSR2)
+        write_trace(signal_server);
+      else if (signal_server)
+        server_shutdown(signal_server);
+      mutex_unlock(signal_mutex);
+    }
+  return NULL;
+}
+
+/* Split "host:port", where host may be empty or a bracketed IPv6
+   address, into `host_ret' (NULL for any) and `port_ret'. */
+static Boolean parse_listen_address(char *address, const char **host_ret,
+                                    int *port_ret)
+{
+  char * const colon = strrchr(address, ':');
+  if (!colon || !colon[1])
+    return FALSE;
+  *colon = '\0';
+  *port_ret = atoi(colon + 1);
+  if (address[0] == '[' && colon[-1] == ']')
+    {
+      colon[-1] = '\0';
+      ++address;
+    }
+  *host_ret = address[0] ? address : NULL;
+  return TRUE;
+}
+
 int main(int argc, char **argv)
 {
   int exit_value = 1;
-  int sock_fd;
+  int *listen_fds = NULL;
   Server server;
   const char *listen_sock = "/tmp/cserver.sock";
+  const char *tcp_host = NULL;
+  int tcp_port = -1, acceptors = 1, backlog = SOMAXCONN;
+  Boolean tcp_nodelay = FALSE;
+  ServerCreateParamsStruct params[1] = { { 0 } };
   int opt;
 
-  while ((opt = getopt_long(argc, argv, "vqd", long_options, NULL)) != -1)
+  while ((opt = getopt_long(argc, argv,
+                            "vqde:m:M:i:Q:A:T:I:c:r:w:D:Sl:a:b:Nt:",
+                            long_options, NULL)) != -1)
     {
       switch (opt)
         {
+        case 'l':
+          if (!parse_listen_address(optarg, &tcp_host, &tcp_port))
+            {
+              warning("Expected host:port to listen on, got `%s'", optarg);
+              return 1;
+            }
+          break;
+
+        case 'a':
+          acceptors = atoi(optarg);
+          break;
+
+        case 'b':
+          backlog = atoi(optarg);
+          break;
+
+        case 'N':
+          tcp_nodelay = TRUE;
+          break;
+
+        case 't':
+          trace_file = optarg;
+          params->trace = TRUE;
+          break;
+
+        case 'e':
+          if (!strcmp(optarg, "threads"))
+            params->engine = SERVER_ENGINE_THREADS;
+          else if (!strcmp(optarg, "epoll"))
+            params->engine = SERVER_ENGINE_EPOLL;
+          else if (!strcmp(optarg, "uring"))
+            params->engine = SERVER_ENGINE_URING;
+          else
+            {
+              warning("Unknown engine `%s', expected threads, epoll or "
+                      "uring", optarg);
+              return 1;
+            }
+          break;
+
+        case 'm':
+          params->min_threads = atoi(optarg);
+          break;
+
+        case 'M':
+          params->max_threads = atoi(optarg);
+          break;
+
+        case 'i':
+          params->idle_timeout_ms = atol(optarg);
+          break;
+
+        case 'Q':
+          params->max_queued = atol(optarg);
+          break;
+
+        case 'A':
+          if (!strcmp(optarg, "reject"))
+            params->admission = SERVER_ADMISSION_REJECT;
+          else if (!strcmp(optarg, "drop-oldest"))
+            params->admission = SERVER_ADMISSION_DROP_OLDEST;
+          else if (!strcmp(optarg, "block"))
+            params->admission = SERVER_ADMISSION_BLOCK;
+          else
+            {
+              warning("Unknown admission policy `%s', expected reject, "
+                      "drop-oldest or block", optarg);
+              return 1;
+            }
+          break;
+
+        case 'T':
+          params->queue_target_ms = atol(optarg);
+          break;
+
+        case 'I':
+          params->queue_interval_ms = atol(optarg);
+          break;
+
+        case 'c':
+          params->conn_idle_timeout_ms = atol(optarg);
+          break;
+
+        case 'r':
+          params->read_timeout_ms = atol(optarg);
+          break;
+
+        case 'w':
+          params->write_timeout_ms = atol(optarg);
+          break;
+
+        case 'D':
+          params->drain_timeout_ms = atol(optarg);
+          break;
+
+        case 'S':
+          params->shutdown_op = TRUE;
+          break;
+
         case 'd':
           set_output_mode(OM_DEBUG);
           break;
@@ -41,49 +250,85 @@ int main(int argc, char **argv)
         }
     }
 
-  /* Cleanup leftover file from previous run. */
-  unlink(listen_sock);
-  sock_fd = create_local_listener(listen_sock);
-  if (sock_fd < 0)
-    {
-      warning("Failed to create listener.");
-      goto error;
-    }
+  /* A client closing early must not kill the server on reply. */
+  signal(SIGPIPE, SIG_IGN);
 
-  server = server_create();
-  if (!server)
-    {
-      warning("Failed to create server.");
-      goto error;
-    }
+  /* Threads created from here on inherit the blocked signals. */
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal_mutex = mutex_create();
+  if (!thread_create(signal_thread, &signals))
+    warning("Failed to start the signal thread");
 
-  while (!server_shutdown_requested(server))
+  if (acceptors < 1)
+    acceptors = 1;
+  listen_fds = xcalloc(acceptors, sizeof(int));
+  for (int i = 0; i < acceptors; ++i)
+    listen_fds[i] = -1;
+  if (tcp_port >= 0)
     {
-      Boolean success;
-      int conn_fd;
-      struct sockaddr saddr = {0};
-      socklen_t saddr_len = sizeof(saddr);
-      char *errors = NULL;
-
-      conn_fd = accept(sock_fd, &saddr, &saddr_len);
-      if (conn_fd < 0)
+      /* One SO_REUSEPORT listener per acceptor; with port 0 the rest
+         join the port the first one got. */
+      for (int i = 0; i < acceptors; ++i)
         {
-          warning("Failed to low-level accept(): %m");
-          continue;
+          listen_fds[i] = create_tcp_listener(tcp_host, tcp_port, backlog,
+                                              TRUE, tcp_nodelay);
+          if (listen_fds[i] < 0)
+            {
+              warning("Failed to create listener.");
+              goto error;
+            }
+          if (!tcp_port)
+            tcp_port = socket_local_port(listen_fds[i]);
         }
-      success = server_accept_connection(server, conn_fd, &errors);
-      if (!success)
+      DEBUG(("Listening on TCP port %d", tcp_port));
+    }
+  else
+    {
+      /* Cleanup leftover file from previous run. */
+      unlink(listen_sock);
+      listen_fds[0] = create_local_listener_with_backlog(listen_sock,
+                                                         backlog);
+      if (listen_fds[0] < 0)
         {
-          warning("Failed to accept connection: %s", errors);
-          close(conn_fd);
+          warning("Failed to create listener.");
+          goto error;
         }
-      xfree(errors);
+      /* A local socket cannot be reused, so the acceptors share it. */
+      for (int i = 1; i < acceptors; ++i)
+        listen_fds[i] = listen_fds[0];
+    }
+
+  server = server_create_with_params(params);
+  if (!server)
+    {
+      warning("Failed to create server.");
+      goto error;
     }
 
+  mutex_lock(signal_mutex);
+  signal_server = server;
+  mutex_unlock(signal_mutex);
+  server_serve_sharded(server, listen_fds, acceptors);
+  mutex_lock(signal_mutex);
+  signal_server = NULL;
+  mutex_unlock(signal_mutex);
   server_destroy(server);
+#ifdef CSERVER_LOCK_PROFILE
+  char * const profile = lock_profile_format();
+  fputs(profile, stdout);
+  xfree(profile);
+#endif
   exit_value = 0;
  error:
-  if (sock_fd >= 0)
-    close(sock_fd);
+  for (int i = 0; i < acceptors && listen_fds; ++i)
+    if (listen_fds[i] >= 0 && (i == 0 || listen_fds[i] != listen_fds[0]))
+      close(listen_fds[i]);
+  xfree(listen_fds);
   return exit_value;
 }
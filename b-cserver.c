@@ -0,0 +1,1604 @@
+/*
+ * Benchmarks for the computation server.
+ *
+ * Each benchmark runs the same workload against an in-process server
+ * and reports the throughput.  Add new benchmarks to the "Benchmark
+ * functions" block below.
+ */
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+
+#include "cserver.h"
+#include "cserver-internal.h"
+
+#define BENCH_SOCKET "/tmp/b-cserver.sock"
+
+/* Workload shape, settable from the command line. */
+static int bench_clients = 16;
+static int bench_requests = 20000;
+static int bench_depth = 1;
+
+/* Runs discarded before measuring, runs measured, the CPU to pin to
+   (-1 for none), and the baseline to compare with or write, with the
+   slowdown in percent reported as a regression. */
+static int bench_warmup = 0;
+static int bench_repeat = 1;
+static int bench_cpu = -1;
+static const char *bench_baseline, *bench_save_baseline;
+static double bench_threshold = 10;
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***************************** Workload driver. *****************************/
+
+typedef struct BenchCtxRec
+{
+  Mutex mutex;
+  Condition cv;
+  int running;
+  Boolean failed;
+  /* Speak the binary protocol instead of text. */
+  Boolean binary;
+  /* Connect over TCP to this loopback port instead of BENCH_SOCKET,
+     and connections per client for the connect benchmarks. */
+  int tcp_port, connects;
+} BenchCtxStruct, *BenchCtx;
+
+static int connect_local(const char *path)
+{
+  struct sockaddr_un saddr = { 0 };
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  saddr.sun_family = AF_UNIX;
+  strncpy(saddr.sun_path, path, sizeof(saddr.sun_path) - 1);
+  if (fd >= 0 && connect(fd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  return fd;
+}
+
+static int connect_tcp(int port)
+{
+  struct sockaddr_in saddr = { 0 };
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  saddr.sin_family = AF_INET;
+  saddr.sin_port = htons(port);
+  saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  return fd;
+}
+
+/* Size of a binary addition reply. */
+#define BENCH_BINARY_REPLY (BINARY_HEADER_SIZE + 8)
+
+/* One client: send `bench_requests' additions, keeping up to
+   `bench_depth' of them in flight, and read every reply. */
+static void *bench_client(void *context)
+{
+  static const char text_request[] = "1 + 2 3\n";
+  static const uint32_t operands[] = { 2, 3 };
+  BenchCtx bench_ctx = context;
+  char request[64];
+  const size_t request_len = bench_ctx->binary ?
+    binary_encode_request(request, BINARY_OP_ADD, 1, operands, 2) :
+    strlen(strcpy(request, text_request));
+  char *batch = xcalloc(bench_depth, request_len);
+  Boolean failed = FALSE;
+  int fd = connect_local(BENCH_SOCKET);
+  int sent = 0, received = 0;
+  size_t reply_bytes = 0;
+  char buf[4096];
+
+  for (int i = 0; i < bench_depth; ++i)
+    memcpy(&batch[i * request_len], request, request_len);
+
+  if (fd < 0)
+    failed = TRUE;
+  else if (bench_ctx->binary)
+    {
+      const char magic = (char) BINARY_MAGIC;
+      if (write(fd, &magic, 1) != 1)
+        failed = TRUE;
+    }
+  while (!failed && received < bench_requests)
+    {
+      int count = bench_depth - (sent - received);
+      if (count > bench_requests - sent)
+        count = bench_requests - sent;
+      if (count > 0)
+        {
+          if (write(fd, batch, count * request_len) != count * request_len)
+            failed = TRUE;
+          sent += count;
+        }
+
+      ssize_t ret = read(fd, buf, sizeof(buf));
+      if (ret <= 0)
+        failed = TRUE;
+      else if (bench_ctx->binary)
+        {
+          reply_bytes += ret;
+          received = reply_bytes / BENCH_BINARY_REPLY;
+        }
+      else
+        for (ssize_t i = 0; i < ret; ++i)
+          if (buf[i] == '\n')
+            ++received;
+    }
+
+  if (fd >= 0)
+    close(fd);
+  xfree(batch);
+
+  mutex_lock(bench_ctx->mutex);
+  bench_ctx->failed |= failed;
+  --bench_ctx->running;
+  condition_signal(bench_ctx->cv);
+  mutex_unlock(bench_ctx->mutex);
+  return NULL;
+}
+
+typedef struct ServeCtxRec
+{
+  Server server;
+  int listen_fd;
+  /* Served with server_serve_sharded() if set. */
+  const int *listen_fds;
+  size_t listen_count;
+  Mutex mutex;
+  Condition cv;
+  Boolean done;
+} ServeCtxStruct, *ServeCtx;
+
+static void *serve_thread(void *context)
+{
+  ServeCtx serve_ctx = context;
+  if (serve_ctx->listen_count)
+    server_serve_sharded(serve_ctx->server, serve_ctx->listen_fds,
+                         serve_ctx->listen_count);
+  else
+    server_serve(serve_ctx->server, serve_ctx->listen_fd);
+  mutex_lock(serve_ctx->mutex);
+  serve_ctx->done = TRUE;
+  condition_signal(serve_ctx->cv);
+  mutex_unlock(serve_ctx->mutex);
+  return NULL;
+}
+
+/* Start a server using `engine' on BENCH_SOCKET.  Returns FALSE if it
+   could not be started or fell back to another engine; we do not
+   report the fallback's numbers as ours. */
+static Boolean bench_server_start(ServeCtx serve_ctx, ServerEngine engine)
+{
+  ServerCreateParamsStruct params[1] = { { 0 } };
+
+  unlink(BENCH_SOCKET);
+  serve_ctx->listen_fd = create_local_listener(BENCH_SOCKET);
+  if (serve_ctx->listen_fd < 0)
+    return FALSE;
+  params->engine = engine;
+  serve_ctx->server = server_create_with_params(params);
+  if (!serve_ctx->server || server_engine(serve_ctx->server) != engine)
+    {
+      server_destroy(serve_ctx->server);
+      close(serve_ctx->listen_fd);
+      unlink(BENCH_SOCKET);
+      return FALSE;
+    }
+  serve_ctx->mutex = mutex_create();
+  serve_ctx->cv = condition_create();
+  if (!thread_create(serve_thread, serve_ctx))
+    fatal("Failed to start the server");
+  return TRUE;
+}
+
+static void bench_server_stop(ServeCtx serve_ctx)
+{
+  server_shutdown(serve_ctx->server);
+  /* Kick a blocking accept() loop so it sees the shutdown. */
+  close(connect_local(BENCH_SOCKET));
+  mutex_lock(serve_ctx->mutex);
+  while (!serve_ctx->done)
+    condition_wait(serve_ctx->cv, serve_ctx->mutex);
+  mutex_unlock(serve_ctx->mutex);
+  server_destroy(serve_ctx->server);
+  close(serve_ctx->listen_fd);
+  unlink(BENCH_SOCKET);
+  mutex_destroy(serve_ctx->mutex);
+  condition_destroy(serve_ctx->cv);
+}
+
+/* Run the workload against a server using `engine' and return the
+   requests per second, or a negative value on failure. */
+static double bench_engine_protocol(ServerEngine engine, Boolean binary)
+{
+  ServeCtxStruct serve_ctx[1] = { { 0 } };
+  BenchCtxStruct bench_ctx[1] = { { 0 } };
+  double start, elapsed;
+
+  if (!bench_server_start(serve_ctx, engine))
+    return -1;
+
+  bench_ctx->mutex = mutex_create();
+  bench_ctx->cv = condition_create();
+  bench_ctx->binary = binary;
+  start = now_seconds();
+  for (int i = 0; i < bench_clients; ++i)
+    {
+      mutex_lock(bench_ctx->mutex);
+      ++bench_ctx->running;
+      mutex_unlock(bench_ctx->mutex);
+      if (!thread_create(bench_client, bench_ctx))
+        fatal("Failed to start client thread");
+    }
+  mutex_lock(bench_ctx->mutex);
+  while (bench_ctx->running)
+    condition_wait(bench_ctx->cv, bench_ctx->mutex);
+  mutex_unlock(bench_ctx->mutex);
+  elapsed = now_seconds() - start;
+
+  bench_server_stop(serve_ctx);
+  mutex_destroy(bench_ctx->mutex);
+  condition_destroy(bench_ctx->cv);
+
+  if (bench_ctx->failed)
+    return -1;
+  return (double) bench_clients * bench_requests / elapsed;
+}
+
+static double bench_engine(ServerEngine engine)
+{
+  return bench_engine_protocol(engine, FALSE);
+}
+
+/* Connect, send one request and wait for the reply, `bench_requests'
+   times over; returns the mean time to the reply in microseconds.  This
+   is dominated by the connection handoff to a worker. */
+static double bench_accept(ServerEngine engine)
+{
+  static const char request[] = "1 + 2 3\n";
+  ServeCtxStruct serve_ctx[1] = { { 0 } };
+  Boolean failed = FALSE;
+  double total = 0;
+  char buf[64];
+
+  if (!bench_server_start(serve_ctx, engine))
+    return -1;
+
+  for (int i = 0; i < bench_requests && !failed; ++i)
+    {
+      const double start = now_seconds();
+      const int fd = connect_local(BENCH_SOCKET);
+      if (fd < 0 ||
+          write(fd, request, strlen(request)) != strlen(request) ||
+          read(fd, buf, sizeof(buf)) <= 0)
+        failed = TRUE;
+      total += now_seconds() - start;
+      if (fd >= 0)
+        close(fd);
+    }
+
+  bench_server_stop(serve_ctx);
+  return failed ? -1 : total / bench_requests * 1e6;
+}
+
+/* Connect and disconnect `bench_requests' times. */
+static void *bench_connect_client(void *context)
+{
+  BenchCtx bench_ctx = context;
+  Boolean failed = FALSE;
+
+  for (int i = 0; i < bench_ctx->connects && !failed; ++i)
+    {
+      const int fd = bench_ctx->tcp_port ? connect_tcp(bench_ctx->tcp_port) :
+        connect_local(BENCH_SOCKET);
+      if (fd < 0)
+        failed = TRUE;
+      else
+        close(fd);
+    }
+
+  mutex_lock(bench_ctx->mutex);
+  bench_ctx->failed |= failed;
+  --bench_ctx->running;
+  condition_signal(bench_ctx->cv);
+  mutex_unlock(bench_ctx->mutex);
+  return NULL;
+}
+
+/* Connect and disconnect until told to stop. */
+static void *bench_churn(void *context)
+{
+  BenchCtx bench_ctx = context;
+  Boolean stop = FALSE;
+
+  while (!stop)
+    {
+      const int fd = connect_local(BENCH_SOCKET);
+      if (fd >= 0)
+        close(fd);
+      mutex_lock(bench_ctx->mutex);
+      stop = bench_ctx->failed;
+      mutex_unlock(bench_ctx->mutex);
+    }
+
+  mutex_lock(bench_ctx->mutex);
+  --bench_ctx->running;
+  condition_signal(bench_ctx->cv);
+  mutex_unlock(bench_ctx->mutex);
+  return NULL;
+}
+
+/* Issue `bench_requests' LIST calls while `bench_clients' threads
+   connect and disconnect; returns LIST calls per second. */
+static double bench_list(ServerEngine engine)
+{
+  static const char request[] = "1 LIST 0 0\n";
+  ServeCtxStruct serve_ctx[1] = { { 0 } };
+  BenchCtxStruct bench_ctx[1] = { { 0 } };
+  Boolean failed = FALSE;
+  double start, elapsed;
+  char buf[65536];
+  int fd;
+
+  if (!bench_server_start(serve_ctx, engine))
+    return -1;
+  bench_ctx->mutex = mutex_create();
+  bench_ctx->cv = condition_create();
+  for (int i = 0; i < bench_clients; ++i)
+    {
+      mutex_lock(bench_ctx->mutex);
+      ++bench_ctx->running;
+      mutex_unlock(bench_ctx->mutex);
+      if (!thread_create(bench_churn, bench_ctx))
+        fatal("Failed to start client thread");
+    }
+
+  fd = connect_local(BENCH_SOCKET);
+  start = now_seconds();
+  for (int i = 0; i < bench_requests && !failed; ++i)
+    {
+      ssize_t ret = 0;
+      if (fd < 0 || write(fd, request, strlen(request)) != strlen(request))
+        failed = TRUE;
+      /* Read up to the end of the reply line. */
+      while (!failed && (ret == 0 || buf[ret - 1] != '\n'))
+        {
+          const ssize_t got = read(fd, &buf[ret], sizeof(buf) - ret);
+          if (got <= 0)
+            failed = TRUE;
+          else
+            ret += got;
+        }
+    }
+  elapsed = now_seconds() - start;
+  if (fd >= 0)
+    close(fd);
+
+  /* `failed' doubles as the stop flag of the churn threads. */
+  mutex_lock(bench_ctx->mutex);
+  bench_ctx->failed = TRUE;
+  while (bench_ctx->running)
+    condition_wait(bench_ctx->cv, bench_ctx->mutex);
+  mutex_unlock(bench_ctx->mutex);
+
+  bench_server_stop(serve_ctx);
+  mutex_destroy(bench_ctx->mutex);
+  condition_destroy(bench_ctx->cv);
+  return failed ? -1 : bench_requests / elapsed;
+}
+
+/* Connect and disconnect as fast as possible from `bench_clients'
+   threads, `bench_requests' times each; returns connections per
+   second. */
+/* Run `bench_clients' threads connecting and disconnecting `connects'
+   times each; returns the elapsed time, or -1 if a connection
+   failed. */
+static double bench_connects(BenchCtx bench_ctx)
+{
+  double start, elapsed;
+
+  bench_ctx->mutex = mutex_create();
+  bench_ctx->cv = condition_create();
+
+  start = now_seconds();
+  for (int i = 0; i < bench_clients; ++i)
+    {
+      mutex_lock(bench_ctx->mutex);
+      ++bench_ctx->running;
+      mutex_unlock(bench_ctx->mutex);
+      if (!thread_create(bench_connect_client, bench_ctx))
+        fatal("Failed to start client thread");
+    }
+  mutex_lock(bench_ctx->mutex);
+  while (bench_ctx->running)
+    condition_wait(bench_ctx->cv, bench_ctx->mutex);
+  mutex_unlock(bench_ctx->mutex);
+  elapsed = now_seconds() - start;
+
+  mutex_destroy(bench_ctx->mutex);
+  condition_destroy(bench_ctx->cv);
+  return bench_ctx->failed ? -1 : elapsed;
+}
+
+static double bench_connect_storm(ServerEngine engine)
+{
+  ServeCtxStruct serve_ctx[1] = { { 0 } };
+  BenchCtxStruct bench_ctx[1] = { { 0 } };
+
+  if (!bench_server_start(serve_ctx, engine))
+    return -1;
+  bench_ctx->connects = bench_requests;
+  const double elapsed = bench_connects(bench_ctx);
+  bench_server_stop(serve_ctx);
+  if (elapsed < 0)
+    return -1;
+  return (double) bench_clients * bench_ctx->connects / elapsed;
+}
+
+/* The same over TCP, with `acceptors' SO_REUSEPORT listeners. */
+static double bench_connect_tcp(size_t acceptors)
+{
+  ServeCtxStruct serve_ctx[1] = { { 0 } };
+  BenchCtxStruct bench_ctx[1] = { { 0 } };
+  int listen_fds[acceptors];
+  double elapsed = -1;
+
+  for (size_t i = 0; i < acceptors; ++i)
+    {
+      listen_fds[i] = create_tcp_listener("127.0.0.1", bench_ctx->tcp_port,
+                                          1024, TRUE, TRUE);
+      if (listen_fds[i] < 0)
+        fatal("Failed to create TCP listener");
+      if (!i)
+        bench_ctx->tcp_port = socket_local_port(listen_fds[i]);
+    }
+  serve_ctx->listen_fds = listen_fds;
+  serve_ctx->listen_count = acceptors;
+  serve_ctx->server = server_create();
+  serve_ctx->mutex = mutex_create();
+  serve_ctx->cv = condition_create();
+  if (!thread_create(serve_thread, serve_ctx))
+    fatal("Failed to start the server");
+
+  /* Every closed connection holds a loopback port in TIME_WAIT for a
+     while, so stay well within the ephemeral range. */
+  bench_ctx->connects = bench_requests < 1000 ? bench_requests : 1000;
+  elapsed = bench_connects(bench_ctx);
+
+  /* The acceptors are woken by the shutdown itself. */
+  server_shutdown(serve_ctx->server);
+  mutex_lock(serve_ctx->mutex);
+  while (!serve_ctx->done)
+    condition_wait(serve_ctx->cv, serve_ctx->mutex);
+  mutex_unlock(serve_ctx->mutex);
+  server_destroy(serve_ctx->server);
+  for (size_t i = 0; i < acceptors; ++i)
+    close(listen_fds[i]);
+  mutex_destroy(serve_ctx->mutex);
+  condition_destroy(serve_ctx->cv);
+  if (elapsed < 0)
+    return -1;
+  return (double) bench_clients * bench_ctx->connects / elapsed;
+}
+
+/* Client objects are allocated on the accepting thread and released on
+   the one serving the connection.  This replays that pattern: one
+   thread allocates, another frees what it is handed.  Returns objects
+   per second through `pool', or through calloc()/free() if NULL. */
+/* Connection bursts: open BENCH_BURST connections back to back, wait
+   for the server to register them all, then close them. */
+#define BENCH_BURST 10000
+#define BENCH_BURSTS 3
+
+/* Wait up to ten seconds for the server to count `connections'. */
+static Boolean bench_wait_connections(Server server, size_t connections)
+{
+  const double deadline = now_seconds() + 10;
+  while (__atomic_load_n(&server->connections, __ATOMIC_RELAXED) !=
+         connections)
+    {
+      if (now_seconds() > deadline)
+        return FALSE;
+      sched_yield();
+    }
+  return TRUE;
+}
+
+static double bench_accept_burst(ServerEngine engine)
+{
+  ServeCtxStruct serve_ctx[1] = { { 0 } };
+  struct rlimit limit;
+  int burst = BENCH_BURST, *fds;
+  double elapsed = 0;
+  Boolean failed = FALSE;
+
+  /* Both ends of every connection live in this process. */
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < 2 * BENCH_BURST + 256)
+    burst = (limit.rlim_cur - 256) / 2;
+
+  if (!bench_server_start(serve_ctx, engine))
+    return -1;
+  fds = xcalloc(burst, sizeof(int));
+  for (int round = 0; round < BENCH_BURSTS && !failed; ++round)
+    {
+      const double start = now_seconds();
+      for (int i = 0; i < burst; ++i)
+        if ((fds[i] = connect_local(BENCH_SOCKET)) < 0)
+          failed = TRUE;
+      failed |= !bench_wait_connections(serve_ctx->server, burst);
+      elapsed += now_seconds() - start;
+
+      for (int i = 0; i < burst; ++i)
+        if (fds[i] >= 0)
+          close(fds[i]);
+      failed |= !bench_wait_connections(serve_ctx->server, 0);
+    }
+  bench_server_stop(serve_ctx);
+  xfree(fds);
+  return failed ? -1 : (double) burst * BENCH_BURSTS / elapsed;
+}
+
+#define BENCH_ALLOC_OBJECTS 1000000
+#define BENCH_ALLOC_QUEUE 1024
+
+typedef struct AllocCtxRec
+{
+  ObjectPool pool;
+  WorkQueue queue;
+  Mutex mutex;
+  Condition cv;
+  Boolean done;
+} AllocCtxStruct, *AllocCtx;
+
+static void *bench_alloc_release(void *context)
+{
+  AllocCtx alloc_ctx = context;
+  for (int freed = 0; freed < BENCH_ALLOC_OBJECTS; )
+    {
+      void *object = work_queue_pop(alloc_ctx->queue);
+      if (!object)
+        {
+          sched_yield();
+          continue;
+        }
+      if (alloc_ctx->pool)
+        object_pool_free(alloc_ctx->pool, object);
+      else
+        xfree(object);
+      ++freed;
+    }
+  mutex_lock(alloc_ctx->mutex);
+  alloc_ctx->done = TRUE;
+  condition_signal(alloc_ctx->cv);
+  mutex_unlock(alloc_ctx->mutex);
+  return NULL;
+}
+
+static double bench_alloc(ObjectPool pool)
+{
+  AllocCtxStruct alloc_ctx[1] = { { 0 } };
+  double start, elapsed;
+
+  alloc_ctx->pool = pool;
+  alloc_ctx->queue = work_queue_create(BENCH_ALLOC_QUEUE);
+  alloc_ctx->mutex = mutex_create();
+  alloc_ctx->cv = condition_create();
+
+  start = now_seconds();
+  if (!thread_create(bench_alloc_release, alloc_ctx))
+    fatal("Failed to start thread");
+  for (int i = 0; i < BENCH_ALLOC_OBJECTS; ++i)
+    {
+      void *object = pool ? object_pool_alloc(pool) :
+        xcalloc(1, sizeof(ClientStruct));
+      while (!work_queue_push(alloc_ctx->queue, object))
+        sched_yield();
+    }
+  mutex_lock(alloc_ctx->mutex);
+  while (!alloc_ctx->done)
+    condition_wait(alloc_ctx->cv, alloc_ctx->mutex);
+  mutex_unlock(alloc_ctx->mutex);
+  elapsed = now_seconds() - start;
+
+  work_queue_destroy(alloc_ctx->queue);
+  mutex_destroy(alloc_ctx->mutex);
+  condition_destroy(alloc_ctx->cv);
+  return BENCH_ALLOC_OBJECTS / elapsed;
+}
+
+/**************************** Benchmark functions. ***************************/
+
+/* Batch arithmetic, on one core: the kernels alone, then whole
+   requests through communicate() from memory, one `+' line per pair
+   against VADD batches. */
+#define BENCH_ADD_PAIRS 1000000
+#define BENCH_ADD_VECTOR 1024
+#define BENCH_VADD_BATCH 1000
+
+static double bench_add_kernel(VectorKernel kernel)
+{
+  int32_t *a, *b, *sum;
+  double start, elapsed;
+  const int rounds = BENCH_ADD_PAIRS / BENCH_ADD_VECTOR * 10;
+
+  /* Unsupported kernels report nothing rather than fail the run. */
+  if (!vector_kernel_supported(kernel))
+    return 0;
+  a = xcalloc(3 * BENCH_ADD_VECTOR, sizeof(int32_t));
+  b = a + BENCH_ADD_VECTOR;
+  sum = b + BENCH_ADD_VECTOR;
+  for (int i = 0; i < BENCH_ADD_VECTOR; ++i)
+    {
+      a[i] = i * 7919;
+      b[i] = -i * 104729;
+    }
+
+  start = now_seconds();
+  for (int i = 0; i < rounds; ++i)
+    if (!vector_add_i32_with(kernel, a, b, sum, BENCH_ADD_VECTOR))
+      fatal("Unexpected overflow");
+  elapsed = now_seconds() - start;
+  xfree(a);
+  return (double) rounds * BENCH_ADD_VECTOR / elapsed;
+}
+
+typedef struct BenchPipeRec
+{
+  const char *input;
+  size_t length, offset;
+} BenchPipeStruct, *BenchPipe;
+
+static int bench_pipe_read(Client client, char *buf, size_t bytes,
+                           void *context)
+{
+  const BenchPipe source = context;
+  if (bytes > source->length - source->offset)
+    bytes = source->length - source->offset;
+  memcpy(buf, source->input + source->offset, bytes);
+  source->offset += bytes;
+  return bytes;
+}
+
+static ssize_t bench_pipe_writev(Client client, const struct iovec *iov,
+                                 int iovcnt, void *context)
+{
+  ssize_t written = 0;
+  for (int i = 0; i < iovcnt; ++i)
+    written += iov[i].iov_len;
+  return written;
+}
+
+static double bench_add_requests(Boolean vadd)
+{
+  BenchPipeStruct source[1] = { { 0 } };
+  ClientCreateParamsStruct params[1] = { { 0 } };
+  const size_t size = BENCH_ADD_PAIRS * 32;
+  char * const input = xcalloc(1, size);
+  Server server = server_create();
+  Client client;
+  double start, elapsed;
+  Boolean success;
+
+  for (int i = 0; i < BENCH_ADD_PAIRS; ++i)
+    {
+      const int num1 = (int) ((unsigned) i * 7919 % 2000000) - 1000000;
+      const int num2 = i % 1000;
+      if (!vadd)
+        source->length += snprintf(input + source->length, size - source->length,
+                                 "%d + %d %d\n", i, num1, num2);
+      else
+        {
+          if (i % BENCH_VADD_BATCH == 0)
+            source->length += snprintf(input + source->length,
+                                     size - source->length, "%d VADD %d 0\n",
+                                     i, BENCH_VADD_BATCH);
+          source->length += snprintf(input + source->length, size - source->length,
+                                   "%d %d\n", num1, num2);
+        }
+    }
+  source->input = input;
+  params->client_read = bench_pipe_read;
+  params->client_read_context = source;
+  params->client_writev = bench_pipe_writev;
+  client = client_create(-1, params);
+
+  start = now_seconds();
+  success = communicate(server, client);
+  elapsed = now_seconds() - start;
+
+  client_destroy(client);
+  server_destroy(server);
+  xfree(input);
+  return success ? BENCH_ADD_PAIRS / elapsed : -1;
+}
+
+#define BENCH_RET static double
+
+BENCH_RET bench_engine_threads(void)
+{
+  return bench_engine(SERVER_ENGINE_THREADS);
+}
+
+BENCH_RET bench_engine_epoll(void)
+{
+  return bench_engine(SERVER_ENGINE_EPOLL);
+}
+
+BENCH_RET bench_engine_uring(void)
+{
+  /* Reported as failed where io_uring is unavailable. */
+  return bench_engine(SERVER_ENGINE_URING);
+}
+
+BENCH_RET bench_binary_threads(void)
+{
+  return bench_engine_protocol(SERVER_ENGINE_THREADS, TRUE);
+}
+
+BENCH_RET bench_binary_epoll(void)
+{
+  return bench_engine_protocol(SERVER_ENGINE_EPOLL, TRUE);
+}
+
+BENCH_RET bench_binary_uring(void)
+{
+  return bench_engine_protocol(SERVER_ENGINE_URING, TRUE);
+}
+
+BENCH_RET bench_accept_threads(void)
+{
+  return bench_accept(SERVER_ENGINE_THREADS);
+}
+
+BENCH_RET bench_list_churn(void)
+{
+  return bench_list(SERVER_ENGINE_EPOLL);
+}
+
+BENCH_RET bench_connect_threads(void)
+{
+  return bench_connect_storm(SERVER_ENGINE_THREADS);
+}
+
+BENCH_RET bench_accept_burst_epoll(void)
+{
+  return bench_accept_burst(SERVER_ENGINE_EPOLL);
+}
+
+BENCH_RET bench_accept_burst_uring(void)
+{
+  return bench_accept_burst(SERVER_ENGINE_URING);
+}
+
+BENCH_RET bench_connect_tcp_1(void)
+{
+  return bench_connect_tcp(1);
+}
+
+BENCH_RET bench_connect_tcp_4(void)
+{
+  return bench_connect_tcp(4);
+}
+
+BENCH_RET bench_client_alloc_calloc(void)
+{
+  return bench_alloc(NULL);
+}
+
+BENCH_RET bench_client_alloc_pool(void)
+{
+  ObjectPool pool = object_pool_create(sizeof(ClientStruct),
+                                       CLIENT_SLAB_OBJECTS,
+                                       CLIENT_POOL_BATCH);
+  const double result = bench_alloc(pool);
+  /* The releasing thread hands its cache back as it exits. */
+  usleep(10 * 1000);
+  object_pool_destroy(pool);
+  return result;
+}
+
+/* Connections whose timers the wheel benchmark keeps armed. */
+#define BENCH_TIMERS 100000
+
+/* Re-arm the timers of BENCH_TIMERS connections over and over, as
+   their deadlines move, while the wheel turns. */
+BENCH_RET bench_timer_wheel(void)
+{
+  TimerStruct * const timers = xcalloc(BENCH_TIMERS, sizeof(*timers));
+  const TimerWheel wheel = timer_wheel_create(0);
+  const int rounds = 20;
+  uint64_t now = 0;
+  double start, elapsed;
+
+  for (int i = 0; i < BENCH_TIMERS; ++i)
+    timer_wheel_add(wheel, &timers[i], 1 + i % 3000);
+
+  start = now_seconds();
+  for (int round = 0; round < rounds; ++round)
+    for (int i = 0; i < BENCH_TIMERS; ++i)
+      {
+        timer_wheel_cancel(wheel, &timers[i]);
+        timer_wheel_add(wheel, &timers[i], now + 1 + (i * 7919) % 3000);
+        if (i % 1000 == 0)
+          for (Timer timer = timer_wheel_advance(wheel, ++now), next; timer;
+               timer = next)
+            {
+              next = timer->next;
+              timer_wheel_add(wheel, timer, now + 3000);
+            }
+      }
+  elapsed = now_seconds() - start;
+  timer_wheel_destroy(wheel);
+  xfree(timers);
+  return (double) rounds * BENCH_TIMERS / elapsed;
+}
+
+/* What metrics add to a request: the process time taken around the
+   handler, the request counters and histogram, and the bytes in and
+   out, all in the calling thread's shard. */
+BENCH_RET bench_metrics_record(void)
+{
+  const Server server = server_create();
+  const Client client = client_create(-1, NULL);
+  const ServerOp op = server_find_op(server, "+", 1);
+  const int rounds = 10000000;
+  double start, elapsed;
+
+  start = now_seconds();
+  for (int i = 0; i < rounds; ++i)
+    {
+      const uint64_t begin = clock_monotonic_ns();
+      metrics_request(server, client, op, clock_monotonic_ns() - begin);
+      metrics_count(server, SERVER_COUNTER_BYTES_IN, 8);
+      metrics_count(server, SERVER_COUNTER_BYTES_OUT, 12);
+    }
+  elapsed = now_seconds() - start;
+  client_destroy(client);
+  server_destroy(server);
+  return elapsed * 1e9 / rounds;
+}
+
+/* Recording one trace event into the calling thread's ring, which
+   wraps many times over. */
+BENCH_RET bench_trace_record(void)
+{
+  const Server server = server_create();
+  const ServerOp op = server_find_op(server, "+", 1);
+  const int rounds = 10000000;
+  double start, elapsed;
+
+  server_set_tracing(server, TRUE);
+  start = now_seconds();
+  for (int i = 0; i < rounds; ++i)
+    trace_record(server, TRACE_PROCESS, 7, i, i + 100, op);
+  elapsed = now_seconds() - start;
+  server_destroy(server);
+  return elapsed * 1e9 / rounds;
+}
+
+/* A worker's cost of a warning during a storm of them, to /dev/null;
+   past the burst the rate limit turns them away before formatting. */
+BENCH_RET bench_log_warning(void)
+{
+  const int null_fd = open("/dev/null", O_WRONLY);
+  const int previous = log_set_fd(null_fd);
+  const int rounds = 1000000;
+  double start, elapsed;
+
+  start = now_seconds();
+  for (int i = 0; i < rounds; ++i)
+    warning("bad request line %d", i);
+  elapsed = now_seconds() - start;
+  log_set_fd(previous);
+  close(null_fd);
+  return elapsed * 1e9 / rounds;
+}
+
+BENCH_RET bench_add_kernel_scalar(void)
+{
+  return bench_add_kernel(VECTOR_KERNEL_SCALAR);
+}
+
+BENCH_RET bench_add_kernel_sse2(void)
+{
+  return bench_add_kernel(VECTOR_KERNEL_SSE2);
+}
+
+BENCH_RET bench_add_kernel_avx2(void)
+{
+  return bench_add_kernel(VECTOR_KERNEL_AVX2);
+}
+
+BENCH_RET bench_add_lines(void)
+{
+  return bench_add_requests(FALSE);
+}
+
+BENCH_RET bench_vadd_lines(void)
+{
+  return bench_add_requests(TRUE);
+}
+
+/* Microbenchmarks of the request path and the util primitives it
+   leans on, each a tight loop on one thread unless noted; run them
+   with --repeat and --cpu for stable figures. */
+#define BENCH_MICRO_ROUNDS 2000000
+
+/* One "+" request through process_line(), parse to reply. */
+BENCH_RET bench_process_line(void)
+{
+  const Server server = server_create();
+  const Client client = client_create(-1, NULL);
+  Boolean success = TRUE;
+  double start, elapsed;
+
+  start = now_seconds();
+  for (int i = 0; i < BENCH_MICRO_ROUNDS && success; ++i)
+    {
+      char *reply = NULL, *errors = NULL;
+      success = process_line(server, client, "1 + 2 3", &reply, &errors);
+      arena_reset(client_arena(client));
+    }
+  elapsed = now_seconds() - start;
+  client_destroy(client);
+  server_destroy(server);
+  return success ? elapsed * 1e9 / BENCH_MICRO_ROUNDS : -1;
+}
+
+/* Serves one request per read, the way an unpipelined client sends
+   them. */
+static int bench_one_request_read(Client client, char *buf, size_t bytes,
+                                  void *context)
+{
+  static const char request[] = "1 + 2 3\n";
+  int * const remaining = context;
+  if (!*remaining)
+    return 0;
+  --*remaining;
+  memcpy(buf, request, sizeof(request) - 1);
+  return sizeof(request) - 1;
+}
+
+/* communicate() with one request per read and one reply per write:
+   the fixed cost of a round trip without the system calls. */
+BENCH_RET bench_communicate(void)
+{
+  ClientCreateParamsStruct params[1] = { { 0 } };
+  const Server server = server_create();
+  int remaining = BENCH_MICRO_ROUNDS;
+  double start, elapsed;
+  Boolean success;
+
+  params->client_read = bench_one_request_read;
+  params->client_read_context = &remaining;
+  params->client_writev = bench_pipe_writev;
+  const Client client = client_create(-1, params);
+
+  start = now_seconds();
+  success = communicate(server, client);
+  elapsed = now_seconds() - start;
+  client_destroy(client);
+  server_destroy(server);
+  return success ? elapsed * 1e9 / BENCH_MICRO_ROUNDS : -1;
+}
+
+BENCH_RET bench_string_format(void)
+{
+  double start, elapsed;
+
+  start = now_seconds();
+  for (int i = 0; i < BENCH_MICRO_ROUNDS; ++i)
+    xfree(string_format("%d + %d %d = %d", i, i, i, i + i));
+  elapsed = now_seconds() - start;
+  return elapsed * 1e9 / BENCH_MICRO_ROUNDS;
+}
+
+/* Locks behind a table, so Mutex and the pthread wrappers it replaced
+   are timed alike. */
+typedef struct BenchLockOpsRec
+{
+  void *(*create)(void);
+  void (*lock)(void *lock);
+  void (*unlock)(void *lock);
+  void (*destroy)(void *lock);
+} BenchLockOpsStruct, *BenchLockOps;
+
+static void *bench_futex_mutex_create(void)
+{
+  return mutex_create();
+}
+
+static void bench_futex_mutex_lock(void *lock)
+{
+  mutex_lock(lock);
+}
+
+static void bench_futex_mutex_unlock(void *lock)
+{
+  mutex_unlock(lock);
+}
+
+static void bench_futex_mutex_destroy(void *lock)
+{
+  mutex_destroy(lock);
+}
+
+static const BenchLockOpsStruct bench_futex_mutex_ops =
+  {
+    bench_futex_mutex_create, bench_futex_mutex_lock,
+    bench_futex_mutex_unlock, bench_futex_mutex_destroy
+  };
+
+/* Mutex as it was before it was built on a futex: a pthread mutex and
+   a flag stored on every lock and unlock. */
+typedef struct BenchPthreadMutexRec
+{
+  pthread_mutex_t mutex;
+  Boolean locked;
+} BenchPthreadMutexStruct, *BenchPthreadMutex;
+
+static void *bench_pmutex_create(void)
+{
+  const BenchPthreadMutex mutex = xcalloc(1, sizeof(*mutex));
+  pthread_mutex_init(&mutex->mutex, NULL);
+  return mutex;
+}
+
+static void bench_pmutex_lock(void *lock)
+{
+  const BenchPthreadMutex mutex = lock;
+  pthread_mutex_lock(&mutex->mutex);
+  mutex->locked = TRUE;
+}
+
+static void bench_pmutex_unlock(void *lock)
+{
+  const BenchPthreadMutex mutex = lock;
+  mutex->locked = FALSE;
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+static void bench_pmutex_destroy(void *lock)
+{
+  const BenchPthreadMutex mutex = lock;
+  pthread_mutex_destroy(&mutex->mutex);
+  xfree(mutex);
+}
+
+static const BenchLockOpsStruct bench_pthread_mutex_ops =
+  {
+    bench_pmutex_create, bench_pmutex_lock,
+    bench_pmutex_unlock, bench_pmutex_destroy
+  };
+
+static void *bench_noop_thread(void *context)
+{
+  return context;
+}
+
+/* An uncontended lock and unlock. */
+static double bench_lock(const BenchLockOpsStruct * const ops)
+{
+  void * const lock = ops->create();
+  const int rounds = BENCH_MICRO_ROUNDS * 10;
+  double start, elapsed;
+  pthread_t thread;
+
+  /* glibc leaves out the locked instructions of pthread mutexes until
+     the process starts a second thread, which a server always has. */
+  if (pthread_create(&thread, NULL, bench_noop_thread, NULL) != 0)
+    return -1;
+  pthread_join(thread, NULL);
+
+  start = now_seconds();
+  for (int i = 0; i < rounds; ++i)
+    {
+      ops->lock(lock);
+      ops->unlock(lock);
+    }
+  elapsed = now_seconds() - start;
+  ops->destroy(lock);
+  return elapsed * 1e9 / rounds;
+}
+
+BENCH_RET bench_mutex_lock(void)
+{
+  return bench_lock(&bench_futex_mutex_ops);
+}
+
+BENCH_RET bench_pthread_mutex_lock(void)
+{
+  return bench_lock(&bench_pthread_mutex_ops);
+}
+
+#define BENCH_CONTENTION_THREADS 4
+
+typedef struct BenchContentionRec
+{
+  const BenchLockOpsStruct *ops;
+  void *lock;
+  int rounds;
+  /* Counted under the lock. */
+  uint64_t counter;
+} BenchContentionStruct, *BenchContention;
+
+static void *bench_contention_thread(void *context)
+{
+  const BenchContention contention = context;
+
+  for (int i = 0; i < contention->rounds; ++i)
+    {
+      contention->ops->lock(contention->lock);
+      ++contention->counter;
+      contention->ops->unlock(contention->lock);
+    }
+  return NULL;
+}
+
+/* BENCH_CONTENTION_THREADS threads taking the same lock around a tiny
+   critical section: the mean time per lock and unlock. */
+static double bench_contention(const BenchLockOpsStruct * const ops)
+{
+  BenchContentionStruct contention[1] =
+    { { ops, ops->create(), BENCH_MICRO_ROUNDS, 0 } };
+  pthread_t threads[BENCH_CONTENTION_THREADS];
+  double start, elapsed;
+  int started;
+
+  start = now_seconds();
+  for (started = 0; started < BENCH_CONTENTION_THREADS; ++started)
+    if (pthread_create(&threads[started], NULL, bench_contention_thread,
+                       contention) != 0)
+      break;
+  for (int i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+  elapsed = now_seconds() - start;
+  ops->destroy(contention->lock);
+  if (started < BENCH_CONTENTION_THREADS ||
+      contention->counter != (uint64_t) started * contention->rounds)
+    return -1;
+  return elapsed * 1e9 / (started * contention->rounds);
+}
+
+BENCH_RET bench_mutex_contention(void)
+{
+  return bench_contention(&bench_futex_mutex_ops);
+}
+
+BENCH_RET bench_pthread_mutex_contention(void)
+{
+  return bench_contention(&bench_pthread_mutex_ops);
+}
+
+/* Signaling a condition nobody waits for, as a worker does after each
+   job while the others are busy. */
+BENCH_RET bench_condition_signal(void)
+{
+  const Condition cv = condition_create();
+  const int rounds = BENCH_MICRO_ROUNDS * 10;
+  double start, elapsed;
+
+  start = now_seconds();
+  for (int i = 0; i < rounds; ++i)
+    condition_signal(cv);
+  elapsed = now_seconds() - start;
+  condition_destroy(cv);
+  return elapsed * 1e9 / rounds;
+}
+
+BENCH_RET bench_pthread_condition_signal(void)
+{
+  pthread_cond_t cond;
+  const int rounds = BENCH_MICRO_ROUNDS * 10;
+  double start, elapsed;
+
+  pthread_cond_init(&cond, NULL);
+  start = now_seconds();
+  for (int i = 0; i < rounds; ++i)
+    pthread_cond_signal(&cond);
+  elapsed = now_seconds() - start;
+  pthread_cond_destroy(&cond);
+  return elapsed * 1e9 / rounds;
+}
+
+typedef struct BenchHandoffRec
+{
+  Mutex mutex;
+  Condition cv;
+  /* Whose turn it is, 0 or 1, and handoffs left; -1 once the second
+     thread is done. */
+  int turn, remaining;
+} BenchHandoffStruct, *BenchHandoff;
+
+/* Wait for `turn', then hand over to the other side. */
+static void bench_handoff_play(const BenchHandoff handoff, const int turn)
+{
+  mutex_lock(handoff->mutex);
+  while (handoff->remaining > 0)
+    {
+      while (handoff->turn != turn && handoff->remaining > 0)
+        condition_wait(handoff->cv, handoff->mutex);
+      if (handoff->remaining > 0)
+        {
+          --handoff->remaining;
+          handoff->turn = !turn;
+          condition_signal(handoff->cv);
+        }
+    }
+  condition_signal(handoff->cv);
+  mutex_unlock(handoff->mutex);
+}
+
+static void *bench_handoff_thread(void *context)
+{
+  const BenchHandoff handoff = context;
+  bench_handoff_play(handoff, 1);
+  mutex_lock(handoff->mutex);
+  handoff->turn = -1;
+  condition_signal(handoff->cv);
+  mutex_unlock(handoff->mutex);
+  return NULL;
+}
+
+/* Two threads passing the turn back and forth with condition_signal():
+   a wakeup and a context switch per handoff. */
+BENCH_RET bench_condition_handoff(void)
+{
+  BenchHandoffStruct handoff[1] = { { 0 } };
+  const int rounds = BENCH_MICRO_ROUNDS / 20;
+  double start, elapsed;
+
+  handoff->mutex = mutex_create();
+  handoff->cv = condition_create();
+  handoff->remaining = rounds;
+
+  start = now_seconds();
+  if (!thread_create(bench_handoff_thread, handoff))
+    return -1;
+  bench_handoff_play(handoff, 0);
+  mutex_lock(handoff->mutex);
+  while (handoff->turn != -1)
+    condition_wait(handoff->cv, handoff->mutex);
+  mutex_unlock(handoff->mutex);
+  elapsed = now_seconds() - start;
+
+  condition_destroy(handoff->cv);
+  mutex_destroy(handoff->mutex);
+  return elapsed * 1e9 / rounds;
+}
+
+/**************************** Benchmark framework. ***************************/
+
+#define FUN(fun, unit)                          \
+  { #fun, fun, unit }
+
+struct {
+  char *name;
+  double (*func)(void);
+  char *unit;
+} bench_funcs[] =
+  {
+    FUN(bench_engine_threads, "requests/s"),
+    FUN(bench_engine_epoll, "requests/s"),
+    FUN(bench_engine_uring, "requests/s"),
+    FUN(bench_binary_threads, "requests/s"),
+    FUN(bench_binary_epoll, "requests/s"),
+    FUN(bench_binary_uring, "requests/s"),
+    FUN(bench_accept_threads, "us/connection"),
+    FUN(bench_list_churn, "LIST/s"),
+    FUN(bench_connect_threads, "connections/s"),
+    FUN(bench_connect_tcp_1, "connections/s"),
+    FUN(bench_connect_tcp_4, "connections/s"),
+    FUN(bench_accept_burst_epoll, "connections/s"),
+    FUN(bench_accept_burst_uring, "connections/s"),
+    FUN(bench_client_alloc_calloc, "clients/s"),
+    FUN(bench_client_alloc_pool, "clients/s"),
+    FUN(bench_add_kernel_scalar, "adds/s"),
+    FUN(bench_add_kernel_sse2, "adds/s"),
+    FUN(bench_add_kernel_avx2, "adds/s"),
+    FUN(bench_add_lines, "adds/s"),
+    FUN(bench_vadd_lines, "adds/s"),
+    FUN(bench_timer_wheel, "rearms/s"),
+    FUN(bench_metrics_record, "ns/request"),
+    FUN(bench_trace_record, "ns/event"),
+    FUN(bench_log_warning, "ns/message"),
+    FUN(bench_process_line, "ns/request"),
+    FUN(bench_communicate, "ns/request"),
+    FUN(bench_string_format, "ns/call"),
+    FUN(bench_mutex_lock, "ns/lock"),
+    FUN(bench_pthread_mutex_lock, "ns/lock"),
+    FUN(bench_mutex_contention, "ns/lock"),
+    FUN(bench_pthread_mutex_contention, "ns/lock"),
+    FUN(bench_condition_signal, "ns/signal"),
+    FUN(bench_pthread_condition_signal, "ns/signal"),
+    FUN(bench_condition_handoff, "ns/handoff"),
+
+    { NULL, NULL, NULL }
+  };
+
+struct option long_options[] =
+  {
+    { "clients",  TRUE, NULL, 'c' },
+    { "requests", TRUE, NULL, 'n' },
+    { "depth",    TRUE, NULL, 'p' },
+    { "warmup",   TRUE, NULL, 'w' },
+    { "repeat",   TRUE, NULL, 'r' },
+    { "cpu",      TRUE, NULL, 'C' },
+    { "baseline", TRUE, NULL, 'b' },
+    { "save-baseline", TRUE, NULL, 's' },
+    { "threshold", TRUE, NULL, 't' },
+    { "debug",   FALSE, NULL, 'd' },
+    {NULL, 0, 0, 0}
+  };
+
+/* A baseline is a JSON object of benchmark names and results, one per
+   line, as written by bench_baseline_write(). */
+typedef struct BenchBaselineRec
+{
+  char name[64];
+  double result;
+} BenchBaselineStruct, *BenchBaseline;
+
+/* Read the baseline at `path' into `entries', returning their number,
+   or -1 if the file cannot be read. */
+static int bench_baseline_read(const char *path, BenchBaseline entries,
+                               int max_entries)
+{
+  FILE * const in = fopen(path, "r");
+  char line[256];
+  int count = 0;
+
+  if (!in)
+    return -1;
+  while (count < max_entries && fgets(line, sizeof(line), in))
+    if (sscanf(line, " \"%63[^\"]\" : %lf", entries[count].name,
+               &entries[count].result) == 2)
+      ++count;
+  fclose(in);
+  return count;
+}
+
+static Boolean bench_baseline_write(const char *path, const double *results)
+{
+  FILE * const out = fopen(path, "w");
+  const char *separator = "";
+
+  if (!out)
+    return FALSE;
+  fputs("{", out);
+  for (int ii = 0; bench_funcs[ii].name; ii++)
+    if (results[ii] >= 0)
+      {
+        fprintf(out, "%s\n  \"%s\": %.6g", separator, bench_funcs[ii].name,
+                results[ii]);
+        separator = ",";
+      }
+  fputs("\n}\n", out);
+  return fclose(out) == 0;
+}
+
+static int bench_compare_doubles(const void *a, const void *b)
+{
+  const double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Run benchmark `ii' as configured.  Returns the median of the measured
+   runs, or -1 if any failed; `spread_ret' is set to the range of the
+   runs as a fraction of the median. */
+static double bench_run(const int ii, double *spread_ret)
+{
+  double * const results = xcalloc(bench_repeat, sizeof(double));
+  double median = -1;
+
+  *spread_ret = 0;
+  for (int run = 0; run < bench_warmup; run++)
+    if ((*bench_funcs[ii].func)() < 0)
+      goto done;
+  for (int run = 0; run < bench_repeat; run++)
+    if ((results[run] = (*bench_funcs[ii].func)()) < 0)
+      goto done;
+
+  qsort(results, bench_repeat, sizeof(double), bench_compare_doubles);
+  median = bench_repeat % 2 ? results[bench_repeat / 2] :
+    (results[bench_repeat / 2 - 1] + results[bench_repeat / 2]) / 2;
+  if (median > 0)
+    *spread_ret = (results[bench_repeat - 1] - results[0]) / median;
+ done:
+  xfree(results);
+  return median;
+}
+
+/* How much worse `result' is than `baseline', as a fraction; rates
+   ("/s") are better higher, costs better lower. */
+static double bench_slowdown(const int ii, const double result,
+                             const double baseline)
+{
+  const char * const unit = bench_funcs[ii].unit;
+  const size_t length = strlen(unit);
+  if (length >= 2 && !strcmp(unit + length - 2, "/s"))
+    return (baseline - result) / baseline;
+  return (result - baseline) / baseline;
+}
+
+int main(int argc, char **argv)
+{
+  int failed_benchmarks = 0, regressions = 0, baseline_count = 0;
+  BenchBaselineStruct baseline[128];
+  double results[sizeof(bench_funcs) / sizeof(bench_funcs[0])];
+  int ii, opt;
+
+  while ((opt = getopt_long(argc, argv, "c:n:p:w:r:C:b:s:t:d", long_options,
+                            NULL)) != -1)
+    {
+      switch (opt)
+        {
+        case 'c':
+          bench_clients = atoi(optarg);
+          break;
+
+        case 'n':
+          bench_requests = atoi(optarg);
+          break;
+
+        case 'p':
+          bench_depth = atoi(optarg);
+          break;
+
+        case 'w':
+          bench_warmup = atoi(optarg);
+          break;
+
+        case 'r':
+          bench_repeat = atoi(optarg);
+          break;
+
+        case 'C':
+          bench_cpu = atoi(optarg);
+          break;
+
+        case 'b':
+          bench_baseline = optarg;
+          break;
+
+        case 's':
+          bench_save_baseline = optarg;
+          break;
+
+        case 't':
+          bench_threshold = atof(optarg);
+          break;
+
+        case 'd':
+          set_output_mode(OM_DEBUG);
+          break;
+        }
+    }
+  if (bench_clients < 1 || bench_requests < 1 || bench_depth < 1 ||
+      bench_repeat < 1 || bench_warmup < 0)
+    {
+      fprintf(stderr, "clients, requests, depth and repeat must be "
+              "positive\n");
+      return 2;
+    }
+  if (bench_baseline &&
+      (baseline_count = bench_baseline_read(bench_baseline, baseline,
+                                             sizeof(baseline) /
+                                             sizeof(baseline[0]))) < 0)
+    {
+      fprintf(stderr, "cannot read baseline %s: %m\n", bench_baseline);
+      return 2;
+    }
+
+  /* Threads created from here on inherit the CPU. */
+  if (bench_cpu >= 0)
+    {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(bench_cpu, &cpus);
+      if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+        {
+          fprintf(stderr, "cannot pin to CPU %d: %m\n", bench_cpu);
+          return 2;
+        }
+    }
+
+  signal(SIGPIPE, SIG_IGN);
+  printf("%d clients, %d requests each, pipeline depth %d\n",
+         bench_clients, bench_requests, bench_depth);
+  if (bench_repeat > 1 || bench_warmup)
+    printf("median of %d runs after %d warmup runs\n", bench_repeat,
+           bench_warmup);
+  if (bench_cpu >= 0)
+    printf("pinned to CPU %d\n", bench_cpu);
+
+  /* Run benchmarks, optionally only those named on the command line. */
+  for (ii = 0; bench_funcs[ii].name; ii++)
+    {
+      results[ii] = -1;
+      Boolean selected = optind == argc;
+      for (int jj = optind; jj < argc; jj++)
+        if (!strcmp(argv[jj], bench_funcs[ii].name))
+          selected = TRUE;
+      if (!selected)
+        continue;
+
+      double spread;
+      const double result = results[ii] = bench_run(ii, &spread);
+      if (result < 0)
+        {
+          printf("%-24s failed\n", bench_funcs[ii].name);
+          failed_benchmarks++;
+          fflush(stdout);
+          continue;
+        }
+
+      printf("%-24s %12.*f %s", bench_funcs[ii].name, result < 100 ? 1 : 0,
+             result, bench_funcs[ii].unit);
+      if (bench_repeat > 1)
+        printf("  range %.1f%%", spread * 100);
+      for (int jj = 0; jj < baseline_count; jj++)
+        if (!strcmp(baseline[jj].name, bench_funcs[ii].name) &&
+            baseline[jj].result > 0)
+          {
+            const double slowdown = bench_slowdown(ii, result,
+                                                   baseline[jj].result);
+            printf("  %+.1f%% vs baseline", slowdown * 100);
+            if (slowdown * 100 > bench_threshold)
+              {
+                printf("  REGRESSION");
+                regressions++;
+              }
+          }
+      printf("\n");
+      fflush(stdout);
+    }
+
+  if (bench_save_baseline)
+    {
+      /* Keep the baseline of benchmarks without a result this time. */
+      for (ii = 0; bench_funcs[ii].name; ii++)
+        for (int jj = 0; results[ii] < 0 && jj < baseline_count; jj++)
+          if (!strcmp(baseline[jj].name, bench_funcs[ii].name))
+            results[ii] = baseline[jj].result;
+      if (!bench_baseline_write(bench_save_baseline, results))
+        {
+          fprintf(stderr, "cannot write baseline %s: %m\n",
+                  bench_save_baseline);
+          return 2;
+        }
+    }
+  if (regressions)
+    printf("%d regression%s over %.0f%%\n", regressions,
+           regressions == 1 ? "" : "s", bench_threshold);
+
+  return failed_benchmarks == 0 && regressions == 0 ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+/*
+ * The binary protocol: length-prefixed frames with little-endian
+ * integer operands.  Replies are encoded straight into the client's
+ * arena and queued without any formatting.
+ */
+#define _GNU_SOURCE
+#include "cserver-internal.h"
+#include <assert.h>
+#include <endian.h>
+#include <string.h>
+
+/* Payload limit implied by the input buffer. */
+#define BINARY_MAX_PAYLOAD (BINARY_MAX_FRAME - BINARY_HEADER_SIZE)
+
+static uint16_t binary_load16(const char * const p)
+{
+  uint16_t value;
+  memcpy(&value, p, sizeof(value));
+  return le16toh(value);
+}
+
+static uint32_t binary_load32(const char * const p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return le32toh(value);
+}
+
+static uint64_t binary_load64(const char * const p)
+{
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return le64toh(value);
+}
+
+static void binary_store16(char * const p, const uint16_t value)
+{
+  const uint16_t le = htole16(value);
+  memcpy(p, &le, sizeof(le));
+}
+
+static void binary_store32(char * const p, const uint32_t value)
+{
+  const uint32_t le = htole32(value);
+  memcpy(p, &le, sizeof(le));
+}
+
+static void binary_store64(char * const p, const uint64_t value)
+{
+  const uint64_t le = htole64(value);
+  memcpy(p, &le, sizeof(le));
+}
+
+static void binary_encode_header(char * const buf, const uint32_t length,
+                                 const uint16_t opcode, const uint16_t status,
+                                 const uint64_t request_id)
+{
+  binary_store32(buf, length);
+  binary_store16(buf + 4, opcode);
+  binary_store16(buf + 6, status);
+  binary_store64(buf + 8, request_id);
+}
+
+size_t binary_encode_request(char * const buf, const BinaryOp op,
+                             const uint64_t request_id,
+                             const uint32_t * const operands,
+                             const size_t count)
+{
+  binary_encode_header(buf, count * 4, op, BINARY_STATUS_OK, request_id);
+  for (size_t i = 0; i < count; ++i)
+    binary_store32(buf + BINARY_HEADER_SIZE + i * 4, operands[i]);
+  return BINARY_HEADER_SIZE + count * 4;
+}
+
+/* A request being served. */
+typedef struct BinaryRequestRec
+{
+  uint16_t opcode;
+  uint64_t request_id;
+  const char *payload;
+  uint32_t length;
+} BinaryRequestStruct, *BinaryRequest;
+
+/* Allocate a reply with `length' bytes of payload, queue it and return
+   the payload to fill in. */
+static char *binary_reply(const Client client, const BinaryRequest request,
+                          const uint16_t status, const uint32_t length)
+{
+  char * const frame = arena_calloc(client->arena, 1,
+                                    BINARY_HEADER_SIZE + length);
+  binary_encode_header(frame, length, request->opcode, status,
+                       request->request_id);
+  client_queue_output(client, frame, BINARY_HEADER_SIZE + length);
+  return frame + BINARY_HEADER_SIZE;
+}
+
+static void binary_reply_error(const Client client,
+                               const BinaryRequest request,
+                               const char * const message)
+{
+  const size_t length = strlen(message);
+  memcpy(binary_reply(client, request, BINARY_STATUS_ERROR, length), message,
+         length);
+  if (client->server)
+    metrics_count(client->server, SERVER_COUNTER_ERRORS, 1);
+}
+
+static void binary_op_add(const Server server, const Client client,
+                          const BinaryRequest request)
+{
+  if (request->length != 8)
+    {
+      binary_reply_error(client, request, "Failed to parse request");
+      return;
+    }
+  const int32_t num1 = binary_load32(request->payload);
+  const int32_t num2 = binary_load32(request->payload + 4);
+  binary_store64(binary_reply(client, request, BINARY_STATUS_OK, 8),
+                 (int64_t) num1 + num2);
+}
+
+static void binary_op_numclients(const Server server, const Client client,
+                                 const BinaryRequest request)
+{
+  binary_store64(binary_reply(client, request, BINARY_STATUS_OK, 8),
+                 __atomic_load_n(&server->connections, __ATOMIC_RELAXED));
+}
+
+static void binary_op_list(const Server server, const Client client,
+                           const BinaryRequest request)
+{
+  if (request->length != 8)
+    {
+      binary_reply_error(client, request, "Failed to parse request");
+      return;
+    }
+  const uint32_t offset = binary_load32(request->payload);
+  uint32_t count = binary_load32(request->payload + 4);
+
+  size_t epoch;
+  const RegistrySnapshot snapshot = registry_snapshot_acquire(server, &epoch);
+  const size_t total = snapshot ? snapshot->count : 0;
+  if (offset >= total)
+    count = 0;
+  else if (!count || count > total - offset)
+    count = total - offset;
+
+  char * const payload = binary_reply(client, request, BINARY_STATUS_OK,
+                                      8 + count * 4);
+  binary_store32(payload, total);
+  binary_store32(payload + 4, count);
+  for (uint32_t i = 0; i < count; ++i)
+    binary_store32(payload + 8 + i * 4, snapshot->fds[offset + i]);
+  registry_snapshot_release(server, epoch);
+}
+
+/* Copy `count' operands into an aligned vector. */
+static int32_t *binary_load_vector(const Arena arena, const char * const p,
+                                   const uint32_t count)
+{
+  int32_t * const vector = arena_calloc(arena, count, sizeof(int32_t));
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  memcpy(vector, p, count * sizeof(int32_t));
+#else
+  for (uint32_t i = 0; i < count; ++i)
+    vector[i] = binary_load32(p + i * 4);
+#endif
+  return vector;
+}
+
+static void binary_op_vadd(const Server server, const Client client,
+                           const BinaryRequest request)
+{
+  const uint32_t count = request->length >= 4 ?
+    binary_load32(request->payload) : 0;
+  if (request->length < 4 || request->length - 4 != (uint64_t) count * 8)
+    {
+      binary_reply_error(client, request, "Failed to parse request");
+      return;
+    }
+
+  const int32_t * const a = binary_load_vector(client->arena,
+                                               request->payload + 4, count);
+  const int32_t * const b = binary_load_vector(client->arena,
+                                               request->payload + 4 +
+                                               count * 4, count);
+  int32_t * const sum = arena_calloc(client->arena, count, sizeof(int32_t));
+  if (!vector_add_i32(a, b, sum, count))
+    {
+      binary_reply_error(client, request, "Integer overflow");
+      return;
+    }
+
+  char * const payload = binary_reply(client, request, BINARY_STATUS_OK,
+                                      4 + count * 4);
+  binary_store32(payload, count);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  memcpy(payload + 4, sum, count * sizeof(int32_t));
+#else
+  for (uint32_t i = 0; i < count; ++i)
+    binary_store32(payload + 4 + i * 4, sum[i]);
+#endif
+}
+
+typedef void (*BinaryHandler)(Server server, Client client,
+                              BinaryRequest request);
+
+static const BinaryHandler binary_handlers[] =
+  {
+    [BINARY_OP_ADD] = binary_op_add,
+    [BINARY_OP_NUMCLIENTS] = binary_op_numclients,
+    [BINARY_OP_LIST] = binary_op_list,
+    [BINARY_OP_VADD] = binary_op_vadd,
+  };
+
+Boolean client_process_binary(const Server server, const Client client)
+{
+  while (!client_output_full(client))
+    {
+      const size_t available = client->input_end - client->input_start;
+      const char * const frame = &client->input[client->input_start];
+      BinaryRequestStruct request[1];
+
+      if (available < BINARY_HEADER_SIZE)
+        break;
+      request->length = binary_load32(frame);
+      if (request->length > BINARY_MAX_PAYLOAD)
+        {
+          warning("Protocol error, too long frame");
+          return FALSE;
+        }
+      if (available < BINARY_HEADER_SIZE + request->length)
+        break;
+
+      request->opcode = binary_load16(frame + 4);
+      request->request_id = binary_load64(frame + 8);
+      request->payload = frame + BINARY_HEADER_SIZE;
+      client->input_start += BINARY_HEADER_SIZE + request->length;
+      client->input_scan = client->input_start;
+
+      if (request->opcode < sizeof(binary_handlers) /
+          sizeof(binary_handlers[0]) && binary_handlers[request->opcode])
+        {
+          const uint64_t start = clock_monotonic_ns();
+          binary_handlers[request->opcode](server, client, request);
+          const uint64_t end = clock_monotonic_ns();
+          metrics_request(server, client, NULL, end - start);
+          TRACE_SPAN(server, TRACE_PROCESS, client->conn_fd, start, end,
+                     NULL);
+        }
+      else
+        binary_reply_error(client, request, "unknown op");
+    }
+  return TRUE;
+}
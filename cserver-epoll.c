@@ -0,0 +1,302 @@
+/*
+ * The epoll connection engine: a few event loops multiplexing
+ * non-blocking connections, so idle clients cost no thread.
+ */
+#define _GNU_SOURCE
+#include "cserver-internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Events handled per epoll_wait() call. */
+#define EVENT_LOOP_BATCH 256
+
+struct EventLoopRec
+{
+  Server server;
+  int epoll_fd;
+  /* eventfd used to wake the loop for shutdown. */
+  int wake_fd;
+  /* Connections multiplexed; added to by the acceptors. */
+  size_t clients;
+};
+
+/* Stop multiplexing `client' and release it. */
+static void event_loop_close_client(const EventLoop loop, const Client client)
+{
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->conn_fd, NULL);
+  server_destroy_client(loop->server, client);
+  client_destroy(client);
+  __atomic_sub_fetch(&loop->clients, 1, __ATOMIC_RELAXED);
+}
+
+/* Wait for input while the output queue is empty, and for the socket to
+   drain otherwise.  Not reading while replies are stuck applies
+   backpressure to clients that do not read theirs. */
+static Boolean event_loop_update_interest(const EventLoop loop,
+                                          const Client client)
+{
+  struct epoll_event event = { 0 };
+  event.events = client_output_pending(client) ? EPOLLOUT : EPOLLIN;
+  event.data.ptr = client;
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, client->conn_fd,
+                   &event) == 0;
+}
+
+/* Process buffered lines and send their replies until the input runs
+   out of complete lines or the socket fills up.  Returns FALSE if the
+   connection should be closed. */
+static Boolean event_loop_serve(const EventLoop loop, const Client client)
+{
+  while (TRUE)
+    {
+      const Boolean success = client_process_input(loop->server, client);
+      const Boolean more = client_output_full(client);
+      if (!client_flush_output(client))
+        {
+          warning("Failed to send reply");
+          return FALSE;
+        }
+      if (!success)
+        return FALSE;
+      /* Either every buffered line is served, or the socket is full and
+         the rest waits for EPOLLOUT. */
+      if (!more || client_output_pending(client))
+        return TRUE;
+    }
+}
+
+static Boolean event_loop_readable(const EventLoop loop, const Client client)
+{
+  const int ret = client_fill_input(client);
+  DEBUG(("Client read returned %d", ret));
+  if (ret < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return TRUE;
+      warning("Comm channel in error: %m");
+      return FALSE;
+    }
+  else if (ret == 0)
+    {
+      DEBUG(("Client in EOF"));
+      if (client_input_pending(client))
+        warning("Protocol error, leftovers in read buffer");
+      return FALSE;
+    }
+  return event_loop_serve(loop, client);
+}
+
+/* Handle readiness of one connection.  Returns FALSE if it should be
+   closed. */
+static Boolean event_loop_ready(const EventLoop loop, const Client client,
+                                const uint32_t events)
+{
+  const Boolean was_pending = client_output_pending(client);
+
+  if (events & EPOLLOUT)
+    {
+      if (!client_flush_output(client))
+        {
+          warning("Failed to send reply");
+          return FALSE;
+        }
+      /* Lines left over while the output queue was full. */
+      if (!client_output_pending(client) && !event_loop_serve(loop, client))
+        return FALSE;
+    }
+  else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+      if (!event_loop_readable(loop, client))
+        return FALSE;
+    }
+
+  if (was_pending != client_output_pending(client) &&
+      !event_loop_update_interest(loop, client))
+    {
+      warning("Failed to update event interest: %m");
+      return FALSE;
+    }
+  client_timer_update(loop->server, client);
+  return TRUE;
+}
+
+/* Close every connection owned by `loop'.  They are taken off the
+   registry in one pass and chained through next_client, then closed
+   without the lock. */
+static void event_loop_close_all(const EventLoop loop)
+{
+  const Server server = loop->server;
+  Client closing = NULL, next;
+
+  mutex_lock(server->mutex);
+  for (Client client = server->head; client; client = next)
+    {
+      next = client->next_client;
+      if (client->loop != loop)
+        continue;
+      server_unlink_client(server, client);
+      client->next_client = closing;
+      closing = client;
+    }
+  mutex_unlock(server->mutex);
+
+  while (closing)
+    {
+      const Client client = closing;
+      closing = client->next_client;
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->conn_fd, NULL);
+      client_timer_stop(server, client);
+      metrics_count(server, SERVER_COUNTER_CLOSED, 1);
+      client_destroy(client);
+      __atomic_sub_fetch(&loop->clients, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *event_loop_thread(void * const context)
+{
+  const EventLoop loop = context;
+  const Server server = loop->server;
+  struct epoll_event events[EVENT_LOOP_BATCH];
+
+  /* After shutdown, the half-closed connections finish their requests
+     and leave, unless the drain runs out of time first. */
+  while (!server_shutdown_requested(server) ||
+         (__atomic_load_n(&loop->clients, __ATOMIC_RELAXED) &&
+          !server_drain_expired(server)))
+    {
+      const int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_BATCH,
+                                   -1);
+      if (count < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          warning("epoll_wait() failed: %m");
+          break;
+        }
+
+      for (int i = 0; i < count; ++i)
+        {
+          const Client client = events[i].data.ptr;
+          if (!client)
+            {
+              uint64_t value;
+              if (read(loop->wake_fd, &value, sizeof(value)) < 0)
+                DEBUG(("Wake read failed"));
+              continue;
+            }
+          if (!event_loop_ready(loop, client, events[i].events))
+            event_loop_close_client(loop, client);
+        }
+    }
+
+  event_loop_close_all(loop);
+  metrics_thread_exit(server);
+  trace_thread_exit(server);
+
+  mutex_lock(server->mutex);
+  assert(server->pool_size);
+  --server->pool_size;
+  condition_signal(server->condition);
+  mutex_unlock(server->mutex);
+  return NULL;
+}
+
+Boolean event_loops_start(const Server server, const size_t loop_count)
+{
+  server->loops = xcalloc(loop_count, sizeof(*server->loops));
+  for (size_t i = 0; i < loop_count; ++i)
+    {
+      const EventLoop loop = xcalloc(1, sizeof(*loop));
+      struct epoll_event event = { 0 };
+
+      loop->server = server;
+      loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      server->loops[server->loop_count++] = loop;
+      if (loop->epoll_fd < 0 || loop->wake_fd < 0)
+        {
+          warning("Failed to create event loop: %m");
+          return FALSE;
+        }
+
+      event.events = EPOLLIN;
+      event.data.ptr = NULL;
+      if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event))
+        {
+          warning("Failed to watch wakeup descriptor: %m");
+          return FALSE;
+        }
+
+      mutex_lock(server->mutex);
+      ++server->pool_size;
+      mutex_unlock(server->mutex);
+      if (!thread_create(event_loop_thread, loop))
+        {
+          mutex_lock(server->mutex);
+          --server->pool_size;
+          mutex_unlock(server->mutex);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+void event_loops_wake(const Server server)
+{
+  const uint64_t one = 1;
+
+  for (size_t i = 0; i < server->loop_count; ++i)
+    if (server->loops[i]->wake_fd >= 0 &&
+        write(server->loops[i]->wake_fd, &one, sizeof(one)) < 0)
+      warning("Failed to wake event loop: %m");
+}
+
+void event_loops_destroy(const Server server)
+{
+  for (size_t i = 0; i < server->loop_count; ++i)
+    {
+      const EventLoop loop = server->loops[i];
+      if (loop->epoll_fd >= 0)
+        close(loop->epoll_fd);
+      if (loop->wake_fd >= 0)
+        close(loop->wake_fd);
+      xfree(loop);
+    }
+  xfree(server->loops);
+  server->loops = NULL;
+  server->loop_count = 0;
+}
+
+Boolean event_loop_add_client(const Server server, const Client client,
+                              const AcceptShard shard)
+{
+  struct epoll_event event = { 0 };
+  const int flags = fcntl(client->conn_fd, F_GETFL);
+
+  /* Connections from the accept loop are non-blocking already. */
+  if (flags < 0 || (!(flags & O_NONBLOCK) &&
+                    fcntl(client->conn_fd, F_SETFL, flags | O_NONBLOCK) < 0))
+    return FALSE;
+
+  if (shard)
+    client->loop = server->loops[accept_shard_next(shard,
+                                                   server->loop_count)];
+  else
+    {
+      mutex_lock(server->mutex);
+      client->loop = server->loops[server->next_loop++ % server->loop_count];
+      mutex_unlock(server->mutex);
+    }
+
+  event.events = EPOLLIN;
+  event.data.ptr = client;
+  if (epoll_ctl(client->loop->epoll_fd, EPOLL_CTL_ADD, client->conn_fd,
+                &event))
+    return FALSE;
+  __atomic_add_fetch(&client->loop->clients, 1, __ATOMIC_RELAXED);
+  return TRUE;
+}
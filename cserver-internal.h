@@ -0,0 +1,477 @@
+/*
+ * Internals of the computation server shared by the connection engines.
+ * Not part of the API.
+ */
+
+#ifndef _CSERVER_INTERNAL_H_
+#define _CSERVER_INTERNAL_H_
+
+#include "cserver.h"
+#include <sys/socket.h>
+#include <pthread.h>
+
+typedef struct EventLoopRec *EventLoop;
+typedef struct UringRec *Uring;
+typedef struct WorkerRec *Worker;
+typedef struct RegistrySnapshotRec *RegistrySnapshot;
+typedef struct ServerOpRec *ServerOp;
+typedef struct MetricsShardRec *MetricsShard;
+typedef struct TraceRingRec *TraceRing;
+
+/* The share of the workers, event loops or rings one acceptor hands
+   its connections to: members `shard', `shard + shards', ... in turn.
+   Owned by the acceptor thread, so the cursor needs no lock. */
+typedef struct AcceptShardRec
+{
+  size_t shard, shards, next;
+} AcceptShardStruct, *AcceptShard;
+
+/* Ops beyond this many are served but not counted by name. */
+#define SERVER_METRICS_OPS 32
+
+struct ServerOpRec
+{
+  char name[REQUEST_FIELD_MAX + 1];
+  int length;
+  /* Registration order, which counts the op in the metrics. */
+  size_t index;
+  ServerOpHandler handler;
+};
+
+/* The timeout a connection is subject to, by what it is doing. */
+typedef enum
+{
+  CLIENT_TIMEOUT_IDLE,
+  CLIENT_TIMEOUT_READ,
+  CLIENT_TIMEOUT_WRITE,
+  CLIENT_TIMEOUT_COUNT
+} ClientTimeout;
+
+struct ServerRec
+{
+  /* Set once by server_shutdown(), and `drain_expired' once
+     server_destroy() has given up waiting for the connections to
+     finish; both are read without the mutex. */
+  Boolean shutdown_requested, drain_expired;
+  long drain_timeout_ms;
+  ServerEngine engine;
+
+  Mutex mutex;
+  Condition condition;
+  Client head, tail;
+  /* Number of running engine threads; server_destroy() waits for this
+     to drop to zero.  `connections' is only changed under the mutex
+     but may be read atomically without it. */
+  size_t pool_size, connections;
+
+  /* Immutable copy of the registry, so LIST walks no list under the
+     mutex.  A change only marks it stale, and the first reader to see
+     that republishes it.  Readers announce themselves in
+     snapshot_readers[epoch & 1]; a replaced copy waits in
+     snapshot_retired[] until the readers of its epoch are gone. */
+  Boolean snapshot_stale;
+  RegistrySnapshot snapshot;
+  size_t snapshot_epoch, snapshot_readers[2];
+  RegistrySnapshot snapshot_retired[2];
+
+  /* Op handlers, hashed by name into a collision-free table of
+     op_mask + 1 slots, so a lookup is one hash and one compare. */
+  ServerOp ops;
+  size_t op_mask, op_count;
+
+  /* SERVER_ENGINE_THREADS: pool bounds, workers serving a connection
+     and connections waiting in the run queues.  `workers' has room for
+     max_threads; the first worker_slots are allocated and the first
+     pool_size of those are running.  `retiring' counts workers that
+     gave up their slot and have not exited yet. */
+  size_t min_threads, max_threads, busy, queued;
+  long idle_timeout_ms;
+  Worker *workers;
+  size_t worker_slots, next_worker, retiring;
+
+  /* SERVER_ENGINE_THREADS admission control, see ServerCreateParams.
+     Acceptors blocked for room are counted in `admission_waiters'.
+     `overloaded' is set once the queueing delay has stayed above the
+     target since `overload_deadline_ns'. */
+  size_t max_queued, admission_waiters;
+  ServerAdmission admission;
+  uint64_t queue_target_ns, queue_interval_ns, overload_deadline_ns;
+  Boolean overloaded;
+  size_t rejected, dropped, shed;
+  uint64_t queue_delay_total_ns, queue_delay_count, queue_delay_max_ns;
+
+  /* SERVER_ENGINE_EPOLL: event loops and the round-robin cursor used to
+     spread new connections over them. */
+  EventLoop *loops;
+  size_t loop_count, next_loop;
+
+  /* SERVER_ENGINE_URING: rings and their round-robin cursor. */
+  Uring *rings;
+  size_t ring_count, next_ring;
+
+  /* Listeners of server_serve_sharded(), shut down to wake the
+     acceptors blocked on them, and the acceptor threads still
+     running. */
+  const int *listen_fds;
+  size_t listen_count, acceptors;
+
+  /* Connections taken by the accept loops, and connections closed
+     unserved for lack of descriptors. */
+  size_t accept_count, accept_shed;
+
+  /* Connection timeouts by ClientTimeout, zero if disabled, and the
+     shortest enabled one.  The timer thread, if any, keeps the wheel of
+     connection timers under timer_mutex and counts the connections it
+     closes in `timeouts_expired'. */
+  long timeouts_ms[CLIENT_TIMEOUT_COUNT], min_timeout_ms;
+  TimerWheel timer_wheel;
+  Mutex timer_mutex;
+  Condition timer_condition;
+  Boolean timer_running;
+  size_t timeouts_expired[CLIENT_TIMEOUT_COUNT];
+
+  /* Metrics, see cserver-metrics.c: the calling thread's shard under
+     `metrics_key', every live shard, and the counts of threads gone,
+     the list and the latter under metrics_mutex. */
+  pthread_key_t metrics_key;
+  Mutex metrics_mutex;
+  MetricsShard metrics_shards, metrics_retired;
+
+  /* Tracing, see cserver-trace.c: whether the trace points record, read
+     without a lock, the calling thread's ring under `trace_key', and
+     every ring, owned or free, under trace_mutex. */
+  Boolean trace_enabled;
+  pthread_key_t trace_key;
+  Mutex trace_mutex;
+  TraceRing trace_rings;
+  size_t trace_ring_count;
+};
+
+typedef struct ClientRec ClientStruct;
+
+/* Longest accepted request line, including the terminating newline. */
+#define CLIENT_MAX_LINE 256
+
+/* Size of the per-client input buffer.  One read() pulls at most this
+   many bytes from the connection, so pipelined requests are consumed in
+   a single system call. */
+#define CLIENT_INPUT_BUFFER_SIZE 4096
+
+/* Number of vectors in the per-client output queue.  Replies to all
+   pipelined requests buffered at once are flushed with one writev(). */
+#define CLIENT_OUTPUT_QUEUE_SIZE 64
+
+/* Size of the blocks of the per-client arena; enough for the replies
+   to a full output queue of ordinary requests. */
+#define CLIENT_ARENA_BLOCK_SIZE 4096
+
+/* Client objects per slab of the client pool, and objects moved
+   between a thread cache and the shared depot at a time. */
+#define CLIENT_SLAB_OBJECTS 32
+#define CLIENT_POOL_BATCH 16
+
+/* Descriptors per LISTSTREAM line unless the request asks otherwise. */
+#define LIST_STREAM_CHUNK 1024
+
+/* Most operand pairs a single VADD request may carry. */
+#define CLIENT_VADD_MAX 65536
+
+struct ClientRec
+{
+  int conn_fd;
+
+  /* Input buffer.  Bytes in [input_start, input_end) have been read but
+     not yet consumed as lines.  input_scan is where the newline search
+     resumes, so every byte is scanned only once. */
+  size_t input_start, input_scan, input_end;
+  char input[CLIENT_INPUT_BUFFER_SIZE];
+
+  /* Output queue of replies not yet sent.  Each reply takes two
+     vectors, the reply itself and a shared newline.  Vectors in
+     [output_head, output_count) are unsent. */
+  int output_head, output_count;
+  struct iovec output[CLIENT_OUTPUT_QUEUE_SIZE];
+
+  /* Replies, errors and other request scratch memory.  Reset whenever
+     the output queue has been sent in full. */
+  Arena arena;
+
+  /* Set once the first byte told which protocol the connection
+     speaks. */
+  Boolean protocol_detected, binary;
+
+  /* A LISTSTREAM reply in progress: the registry position of the next
+     chunk and the descriptors per chunk. */
+  Boolean list_stream;
+  size_t list_stream_offset, list_stream_chunk;
+
+  /* A VADD request collecting its operand lines: the pairs expected and
+     received so far, the reply prefix echoing the request, and the
+     operand and sum vectors, `vadd_capacity' elements each, kept across
+     requests. */
+  size_t vadd_count, vadd_filled, vadd_capacity;
+  char vadd_prefix[4 * (REQUEST_FIELD_MAX + 1) + 2];
+  int32_t *vadd_a, *vadd_b, *vadd_sum;
+
+  /* SERVER_ENGINE_THREADS: when the connection entered a run queue. */
+  uint64_t queued_ns;
+
+  /* The server the connection is registered with, if any, when input
+     was last read, and the requests answered since the output queue
+     was last empty. */
+  Server server;
+  uint64_t metrics_read_ns;
+  size_t metrics_requests;
+
+  /* SERVER_ENGINE_URING: when the send in flight was submitted, if it
+     is traced. */
+  uint64_t trace_send_ns;
+
+  /* Timeout state, see cserver-timers.c.  The deadline in milliseconds
+     and the ClientTimeout it enforces are packed into `timer_deadline'
+     by CLIENT_DEADLINE(); `timer_line_start' is where the request
+     under a read deadline starts. */
+  TimerStruct timer;
+  uint64_t timer_deadline;
+  size_t timer_line_start;
+
+  /* Linked list.  If no next element, this will be NULL.*/
+  Client prev_client, next_client;
+
+  /* SERVER_ENGINE_EPOLL: the loop multiplexing this connection. */
+  EventLoop loop;
+
+  /* SERVER_ENGINE_URING: the owning ring, the operations in flight and
+     the message header of the reply being sent. */
+  Uring ring;
+  Boolean uring_recv_armed, uring_send_armed, uring_closing;
+  Client uring_next;
+  struct msghdr uring_msg;
+
+  /* Allow overriding IO calls for easier mocking. */
+  int (*read)(Client client, char *buf, size_t bytes, void *context);
+  void *read_context;
+
+  Boolean (*write)(Client client, char *buf, size_t bytes, void *context);
+  void *write_context;
+
+  ssize_t (*writev)(Client client, const struct iovec *iov, int iovcnt,
+                    void *context);
+  void *writev_context;
+};
+
+/* Client registry. */
+
+/* Descriptors of the registered clients, in registration order. */
+struct RegistrySnapshotRec
+{
+  RegistrySnapshot retired_next;
+  size_t count;
+  int fds[];
+};
+
+/* Enter a read-side section and return the current snapshot, which
+   stays valid until registry_snapshot_release().  Takes the mutex only
+   to republish a stale snapshot. */
+RegistrySnapshot registry_snapshot_acquire(Server server, size_t *epoch_ret);
+void registry_snapshot_release(Server server, size_t epoch);
+
+/* Append `client' to the list of connected clients. */
+void server_register_client(Server server, Client client);
+
+/* When communicate() is done, the client context should be removed from
+   the list with this call. */
+void server_destroy_client(Server server, Client client);
+
+/* Take `client' off the list of connected clients, with the server
+   mutex held.  The caller stops its timer and counts it closed. */
+void server_unlink_client(Server server, Client client);
+
+/* Connection timeouts. */
+
+#define CLIENT_DEADLINE(ms, timeout) ((uint64_t) (ms) << 2 | (timeout))
+/* Deadline of a disabled timeout. */
+#define CLIENT_NO_DEADLINE (UINT64_MAX >> 2)
+
+/* Start the timer thread if any timeout is enabled. */
+Boolean timers_start(Server server);
+void timers_wake(Server server);
+void timers_destroy(Server server);
+
+/* Arm the timer of a new connection, and disarm it before the
+   connection is destroyed. */
+void client_timer_start(Server server, Client client);
+void client_timer_stop(Server server, Client client);
+
+/* Move the deadline of `client' after progress: its replies are
+   waiting to go out, a request is arriving, or it is idle.  Called by
+   the thread serving the connection; it takes no lock. */
+void client_timer_update(Server server, Client client);
+
+/* Metrics.  Counting takes no lock and no locked instruction. */
+
+void metrics_start(Server server);
+void metrics_destroy(Server server);
+/* Hand the calling thread's counts over before it exits. */
+void metrics_thread_exit(Server server);
+/* Shards of threads still running. */
+size_t metrics_shard_count(Server server);
+
+void metrics_count(Server server, ServerCounter counter, uint64_t n);
+void metrics_record(Server server, ServerLatency latency, uint64_t ns,
+                    uint64_t count);
+/* Account for one request on `client' that took `process_ns' to
+   process; `op' is the op that served it, or NULL. */
+void metrics_request(Server server, Client client, ServerOp op,
+                     uint64_t process_ns);
+
+/* Tracing.  Building with CSERVER_NO_TRACE defined compiles the trace
+   points out. */
+
+typedef enum
+{
+  /* SERVER_ENGINE_THREADS: waiting in a run queue. */
+  TRACE_QUEUE,
+  /* Reading a connection, including waiting for it with blocking
+     IO. */
+  TRACE_READ,
+  /* Processing a request. */
+  TRACE_PROCESS,
+  /* Writing replies, or the send in flight with io_uring. */
+  TRACE_WRITE,
+  TRACE_STAGE_COUNT
+} TraceStage;
+
+void trace_start(Server server, Boolean enabled);
+void trace_destroy(Server server);
+/* Hand the calling thread's ring over before it exits. */
+void trace_thread_exit(Server server);
+/* Rings allocated, owned or free. */
+size_t trace_ring_total(Server server);
+
+/* Record a span of `stage' on connection `fd' from `start_ns' to
+   `end_ns'; `op' is the op served, or NULL. */
+void trace_record(Server server, TraceStage stage, int fd,
+                  uint64_t start_ns, uint64_t end_ns, ServerOp op);
+
+#ifdef CSERVER_NO_TRACE
+#define TRACE_ON(server) FALSE
+#define TRACE_BEGIN(server) ((uint64_t) 0)
+#define TRACE_END(server, stage, fd, start, op) ((void) (start))
+#define TRACE_SPAN(server, stage, fd, start, end, op) ((void) 0)
+#else
+/* TRUE if `server', which may be NULL, is tracing. */
+#define TRACE_ON(server) \
+  ((server) && __atomic_load_n(&(server)->trace_enabled, __ATOMIC_RELAXED))
+/* The start of a span, or zero if it is not traced. */
+#define TRACE_BEGIN(server) (TRACE_ON(server) ? clock_monotonic_ns() : 0)
+/* End the span begun at `start' unless it is not traced. */
+#define TRACE_END(server, stage, fd, start, op)                         \
+  do                                                                    \
+    {                                                                   \
+      if (start)                                                        \
+        trace_record(server, stage, fd, start, clock_monotonic_ns(), op); \
+    }                                                                   \
+  while (0)
+/* Record a span timed already, if tracing. */
+#define TRACE_SPAN(server, stage, fd, start, end, op)   \
+  do                                                    \
+    {                                                   \
+      if (TRACE_ON(server))                             \
+        trace_record(server, stage, fd, start, end, op); \
+    }                                                   \
+  while (0)
+#endif
+
+/* The op registered as the `length' bytes at `name', or NULL. */
+ServerOp server_find_op(Server server, const char *name, int length);
+
+/* Returns TRUE once the connections left after shutdown are to be
+   closed without further ado. */
+Boolean server_drain_expired(Server server);
+
+/* The member of `shard' out of `members' to take the next
+   connection. */
+size_t accept_shard_next(AcceptShard shard, size_t members);
+
+/* Connection IO shared by the engines. */
+
+/* Pull as many bytes as the connection has ready into the input
+   buffer.  Returns the value of client_read(). */
+int client_fill_input(Client client);
+
+/* For engines that read on their own: make room in the input buffer and
+   return the free space at `*space_ret', then account for `bytes'
+   placed there. */
+size_t client_input_space(Client client, char **space_ret);
+void client_input_commit(Client client, size_t bytes);
+
+/* Serve the request `line', without its newline, by its op.  The reply
+   or error message is allocated from the client arena. */
+Boolean process_line(Server server, Client client, const char *line,
+                     char **reply_ret, char **errors_ret);
+
+/* Process buffered request lines, queueing their replies, until no
+   complete line is left or the output queue is full.  Returns FALSE on
+   a protocol or processing error; replies queued before the error
+   should still be flushed. */
+Boolean client_process_input(Server server, Client client);
+
+/* Returns TRUE if the output queue cannot take another reply. */
+Boolean client_output_full(Client client);
+
+/* Returns TRUE if queued replies are waiting to be sent. */
+Boolean client_output_pending(Client client);
+
+/* Send queued replies, resuming after partial writes.  On a
+   non-blocking connection this stops when the socket is full, leaving
+   the rest queued.  Returns FALSE if the connection failed. */
+Boolean client_flush_output(Client client);
+
+/* Account for `written' bytes of the output queue having been sent by
+   other means; the queue is reset once everything is out. */
+void client_output_advance(Client client, size_t written);
+
+/* Returns TRUE if bytes of an incomplete line are buffered. */
+Boolean client_input_pending(Client client);
+
+/* Queue `bytes' of raw output at `data', which must stay valid until
+   the queue is flushed.  Output adjacent to the previous entry extends
+   it, so consecutive replies built in the arena go out as one
+   vector. */
+void client_queue_output(Client client, const char *data, size_t bytes);
+
+/* Binary protocol: serve the complete frames buffered, queueing their
+   replies, until none is left or the output queue is full.  Returns
+   FALSE on a framing error. */
+Boolean client_process_binary(Server server, Client client);
+
+/* Engines. */
+
+/* SERVER_ENGINE_THREADS. */
+Boolean workers_start(Server server);
+void workers_wake_all(Server server);
+void workers_destroy(Server server);
+/* Queue `client' on a worker's run queue, one of `shard' if given,
+   subject to admission control.  Returns FALSE with `errors_ret' set if
+   the connection is refused; SERVER_BUSY_REPLY has been sent then. */
+Boolean workers_dispatch(Server server, Client client, AcceptShard shard,
+                         char **errors_ret);
+
+/* SERVER_ENGINE_EPOLL. */
+Boolean event_loops_start(Server server, size_t loop_count);
+void event_loops_wake(Server server);
+void event_loops_destroy(Server server);
+Boolean event_loop_add_client(Server server, Client client,
+                              AcceptShard shard);
+
+/* SERVER_ENGINE_URING. */
+Boolean uring_supported(void);
+Boolean urings_start(Server server, size_t ring_count);
+void urings_wake(Server server);
+void urings_destroy(Server server);
+Boolean uring_add_client(Server server, Client client, AcceptShard shard);
+/* Start accepting in every ring, ring i on listen_fds[i % count]. */
+void urings_listen(Server server, const int *listen_fds, size_t count);
+
+#endif  /* _CSERVER_INTERNAL_H_ */
@@ -0,0 +1,287 @@
+/*
+ * Metrics.  Every thread counts into a shard of its own, cache-line
+ * aligned and allocated on its first count, so recording is a few plain
+ * stores: no lock, no locked instruction and no line shared with
+ * another thread.  Readers merge the shards under the metrics mutex.
+ * Engine threads fold their shard into `metrics_retired' on the way
+ * out; shards of other threads live as long as the server.
+ */
+#define _GNU_SOURCE
+#include "cserver-internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define METRICS_ALIGN 64
+
+/* Prometheus histogram buckets: every power of two of nanoseconds from
+   2^METRICS_LE_FIRST to 2^METRICS_LE_LAST, about 256 ns to 34 s. */
+#define METRICS_LE_FIRST 8
+#define METRICS_LE_LAST 35
+
+struct MetricsShardRec
+{
+  MetricsShard prev, next;
+  uint64_t counters[SERVER_COUNTER_COUNT];
+  uint64_t op_requests[SERVER_METRICS_OPS];
+  HistogramStruct latencies[SERVER_LATENCY_COUNT];
+};
+
+static const char * const metrics_counter_names[SERVER_COUNTER_COUNT][2] =
+  {
+    { "cserver_connections_accepted_total", "Connections registered." },
+    { "cserver_connections_closed_total", "Connections closed." },
+    { "cserver_requests_total", "Requests served, text and binary." },
+    { "cserver_received_bytes_total", "Bytes read from connections." },
+    { "cserver_sent_bytes_total", "Bytes written to connections." },
+    { "cserver_errors_total", "Failed requests and protocol errors." },
+  };
+
+static const char * const metrics_latency_names[SERVER_LATENCY_COUNT][2] =
+  {
+    { "cserver_queue_wait_seconds", "Time connections waited for a worker." },
+    { "cserver_process_seconds", "Time processing a request." },
+    { "cserver_request_seconds",
+      "Time from reading a request to writing its reply." },
+  };
+
+static MetricsShard metrics_shard_create(void)
+{
+  const MetricsShard shard = xmemalign(METRICS_ALIGN, sizeof(*shard));
+
+  memset(shard, 0, sizeof(*shard));
+  return shard;
+}
+
+/* Add the counts of `from' to `into', which only the caller writes. */
+static void metrics_shard_merge(const MetricsShard into,
+                                const MetricsShard from)
+{
+  for (int i = 0; i < SERVER_COUNTER_COUNT; ++i)
+    into->counters[i] += __atomic_load_n(&from->counters[i],
+                                         __ATOMIC_RELAXED);
+  for (int i = 0; i < SERVER_METRICS_OPS; ++i)
+    into->op_requests[i] += __atomic_load_n(&from->op_requests[i],
+                                            __ATOMIC_RELAXED);
+  for (int i = 0; i < SERVER_LATENCY_COUNT; ++i)
+    histogram_merge(&into->latencies[i], &from->latencies[i]);
+}
+
+void metrics_start(const Server server)
+{
+  const int ret = pthread_key_create(&server->metrics_key, NULL);
+  if (ret != 0)
+    fatal("Failed to create metrics key: code %d", ret);
+  server->metrics_mutex = mutex_create();
+  server->metrics_retired = metrics_shard_create();
+}
+
+void metrics_destroy(const Server server)
+{
+  if (!server->metrics_retired)
+    return;
+  pthread_key_delete(server->metrics_key);
+  while (server->metrics_shards)
+    {
+      const MetricsShard shard = server->metrics_shards;
+      server->metrics_shards = shard->next;
+      free(shard);
+    }
+  free(server->metrics_retired);
+  server->metrics_retired = NULL;
+  mutex_destroy(server->metrics_mutex);
+}
+
+static MetricsShard metrics_shard(const Server server)
+{
+  MetricsShard shard = pthread_getspecific(server->metrics_key);
+  if (shard)
+    return shard;
+
+  shard = metrics_shard_create();
+  mutex_lock(server->metrics_mutex);
+  shard->next = server->metrics_shards;
+  if (server->metrics_shards)
+    server->metrics_shards->prev = shard;
+  server->metrics_shards = shard;
+  mutex_unlock(server->metrics_mutex);
+  if (pthread_setspecific(server->metrics_key, shard) != 0)
+    fatal("Failed to set the metrics shard");
+  return shard;
+}
+
+void metrics_thread_exit(const Server server)
+{
+  const MetricsShard shard = pthread_getspecific(server->metrics_key);
+  if (!shard)
+    return;
+
+  mutex_lock(server->metrics_mutex);
+  metrics_shard_merge(server->metrics_retired, shard);
+  if (shard->prev)
+    shard->prev->next = shard->next;
+  else
+    server->metrics_shards = shard->next;
+  if (shard->next)
+    shard->next->prev = shard->prev;
+  mutex_unlock(server->metrics_mutex);
+  pthread_setspecific(server->metrics_key, NULL);
+  free(shard);
+}
+
+size_t metrics_shard_count(const Server server)
+{
+  size_t count = 0;
+  mutex_lock(server->metrics_mutex);
+  for (MetricsShard shard = server->metrics_shards; shard; shard = shard->next)
+    ++count;
+  mutex_unlock(server->metrics_mutex);
+  return count;
+}
+
+/* Only the owning thread writes a shard, so a plain increment is
+   enough; the store is atomic for the readers' sake. */
+#define METRICS_ADD(field, n) \
+  __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void metrics_count(const Server server, const ServerCounter counter,
+                   const uint64_t n)
+{
+  const MetricsShard shard = metrics_shard(server);
+  METRICS_ADD(shard->counters[counter], n);
+}
+
+void metrics_record(const Server server, const ServerLatency latency,
+                    const uint64_t ns, const uint64_t count)
+{
+  histogram_record(&metrics_shard(server)->latencies[latency], ns, count);
+}
+
+void metrics_request(const Server server, const Client client,
+                     const ServerOp op, const uint64_t process_ns)
+{
+  const MetricsShard shard = metrics_shard(server);
+
+  METRICS_ADD(shard->counters[SERVER_COUNTER_REQUESTS], 1);
+  if (op && op->index < SERVER_METRICS_OPS)
+    METRICS_ADD(shard->op_requests[op->index], 1);
+  histogram_record(&shard->latencies[SERVER_LATENCY_PROCESS], process_ns, 1);
+  ++client->metrics_requests;
+}
+
+/* Merge every shard into `total'. */
+static void metrics_collect(const Server server, const MetricsShard total)
+{
+  memset(total, 0, sizeof(*total));
+  mutex_lock(server->metrics_mutex);
+  metrics_shard_merge(total, server->metrics_retired);
+  for (MetricsShard shard = server->metrics_shards; shard;
+       shard = shard->next)
+    metrics_shard_merge(total, shard);
+  mutex_unlock(server->metrics_mutex);
+}
+
+void server_get_metrics(const Server server, const ServerMetrics metrics_ret)
+{
+  const MetricsShard total = metrics_shard_create();
+
+  metrics_collect(server, total);
+  memcpy(metrics_ret->counters, total->counters, sizeof(total->counters));
+  memcpy(metrics_ret->latencies, total->latencies,
+         sizeof(total->latencies));
+  free(total);
+}
+
+uint64_t server_get_op_requests(const Server server, const char * const name)
+{
+  const ServerOp op = server_find_op(server, name, strlen(name));
+  if (!op || op->index >= SERVER_METRICS_OPS)
+    return 0;
+
+  uint64_t count = 0;
+  mutex_lock(server->metrics_mutex);
+  count += server->metrics_retired->op_requests[op->index];
+  for (MetricsShard shard = server->metrics_shards; shard;
+       shard = shard->next)
+    count += __atomic_load_n(&shard->op_requests[op->index],
+                             __ATOMIC_RELAXED);
+  mutex_unlock(server->metrics_mutex);
+  return count;
+}
+
+static void metrics_format_histogram(FILE * const out,
+                                     const char * const name,
+                                     const Histogram histogram)
+{
+  uint64_t count = 0;
+  size_t bucket = 0;
+
+  /* Buckets are cumulative; a power of two starts a log-linear
+     bucket, so each bound counts whole buckets. */
+  for (int le = METRICS_LE_FIRST; le <= METRICS_LE_LAST; ++le)
+    {
+      const size_t end = histogram_bucket((uint64_t) 1 << le);
+      for (; bucket < end; ++bucket)
+        count += histogram->buckets[bucket];
+      fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", name,
+              (double) ((uint64_t) 1 << le) / 1e9,
+              (unsigned long long) count);
+    }
+  for (; bucket < HISTOGRAM_BUCKETS; ++bucket)
+    count += histogram->buckets[bucket];
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+          (unsigned long long) count);
+  fprintf(out, "%s_sum %.9f\n", name, histogram->sum / 1e9);
+  fprintf(out, "%s_count %llu\n", name, (unsigned long long) count);
+}
+
+char *server_format_metrics(const Server server)
+{
+  const MetricsShard total = metrics_shard_create();
+  char *text = NULL;
+  size_t size = 0;
+  FILE * const out = open_memstream(&text, &size);
+  if (!out)
+    fatal("memory allocation failed.");
+
+  metrics_collect(server, total);
+  fprintf(out, "# HELP cserver_connections Connections open.\n"
+          "# TYPE cserver_connections gauge\n"
+          "cserver_connections %zu\n",
+          __atomic_load_n(&server->connections, __ATOMIC_RELAXED));
+  for (int i = 0; i < SERVER_COUNTER_COUNT; ++i)
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            metrics_counter_names[i][0], metrics_counter_names[i][1],
+            metrics_counter_names[i][0], metrics_counter_names[i][0],
+            (unsigned long long) total->counters[i]);
+
+  fprintf(out, "# HELP cserver_op_requests_total Requests served by op.\n"
+          "# TYPE cserver_op_requests_total counter\n");
+  for (size_t i = 0; server->ops && i <= server->op_mask; ++i)
+    {
+      const ServerOp op = &server->ops[i];
+      if (!op->handler || op->index >= SERVER_METRICS_OPS)
+        continue;
+      fputs("cserver_op_requests_total{op=\"", out);
+      for (int j = 0; j < op->length; ++j)
+        {
+          if (op->name[j] == '"' || op->name[j] == '\\')
+            fputc('\\', out);
+          fputc(op->name[j], out);
+        }
+      fprintf(out, "\"} %llu\n",
+              (unsigned long long) total->op_requests[op->index]);
+    }
+
+  for (int i = 0; i < SERVER_LATENCY_COUNT; ++i)
+    {
+      fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n",
+              metrics_latency_names[i][0], metrics_latency_names[i][1],
+              metrics_latency_names[i][0]);
+      metrics_format_histogram(out, metrics_latency_names[i][0],
+                               &total->latencies[i]);
+    }
+
+  fclose(out);
+  free(total);
+  return text;
+}
@@ -0,0 +1,442 @@
+/*
+ * The thread pool connection engine.  Each worker owns a run queue of
+ * accepted connections; the acceptor spreads new connections over the
+ * queues round-robin and wakes a parked worker, and workers with an
+ * empty queue steal from their peers.  No global lock is taken on the
+ * handoff.  The pool grows while every worker is busy and shrinks back
+ * to its minimum after an idle timeout.
+ *
+ * Admission control bounds the connections waiting in the queues and
+ * sheds new ones while the queueing delay stays above its target, in
+ * the manner of CoDel: a delay above the target is tolerated for one
+ * interval, as a burst, before it counts as overload.
+ */
+#define _GNU_SOURCE
+#include "cserver-internal.h"
+#include <assert.h>
+#include <string.h>
+
+/* Connections each run queue can hold. */
+#define WORKER_QUEUE_SIZE 1024
+
+struct WorkerRec
+{
+  Server server;
+  size_t index;
+  WorkQueue queue;
+
+  /* A worker with nothing to do sets `parked' and sleeps on its own
+     condition until `wakeup' is set.  Producers claim a parked worker by
+     clearing the flag, so each wakeup goes to a different worker. */
+  Boolean parked;
+  Boolean wakeup;
+  Mutex mutex;
+  Condition condition;
+};
+
+/* Take a connection from the worker's own queue, or steal one from a
+   peer. */
+static Client worker_find_work(const Worker worker)
+{
+  const Server server = worker->server;
+  Client client = work_queue_pop(worker->queue);
+  if (client)
+    return client;
+
+  const size_t slots = __atomic_load_n(&server->worker_slots,
+                                       __ATOMIC_ACQUIRE);
+  for (size_t i = 1; i < slots; ++i)
+    {
+      const Worker peer = server->workers[(worker->index + i) % slots];
+      if ((client = work_queue_pop(peer->queue)))
+        return client;
+    }
+  return NULL;
+}
+
+static void worker_signal(const Worker worker)
+{
+  mutex_lock(worker->mutex);
+  worker->wakeup = TRUE;
+  condition_signal(worker->condition);
+  mutex_unlock(worker->mutex);
+}
+
+/* Wake `worker' if it is parked.  Returns TRUE if it was. */
+static Boolean worker_wake(const Worker worker)
+{
+  Boolean parked = TRUE;
+  if (!__atomic_compare_exchange_n(&worker->parked, &parked, FALSE, FALSE,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return FALSE;
+  worker_signal(worker);
+  return TRUE;
+}
+
+/* Account for the time `client' spent queued, and track whether the
+   delay has stayed above the target for a whole interval. */
+static void worker_note_queue_delay(const Server server, const Client client)
+{
+  const uint64_t now = clock_monotonic_ns();
+  const uint64_t delay = now - client->queued_ns;
+  uint64_t max = __atomic_load_n(&server->queue_delay_max_ns,
+                                 __ATOMIC_RELAXED);
+
+  metrics_record(server, SERVER_LATENCY_QUEUE_WAIT, delay, 1);
+  TRACE_SPAN(server, TRACE_QUEUE, client->conn_fd, client->queued_ns, now,
+             NULL);
+  __atomic_add_fetch(&server->queue_delay_total_ns, delay, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&server->queue_delay_count, 1, __ATOMIC_RELAXED);
+  while (delay > max &&
+         !__atomic_compare_exchange_n(&server->queue_delay_max_ns, &max,
+                                      delay, TRUE, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+    ;
+
+  if (!server->queue_target_ns)
+    return;
+  uint64_t deadline = __atomic_load_n(&server->overload_deadline_ns,
+                                      __ATOMIC_RELAXED);
+  if (delay < server->queue_target_ns)
+    {
+      if (deadline)
+        {
+          __atomic_store_n(&server->overload_deadline_ns, 0,
+                           __ATOMIC_RELAXED);
+          __atomic_store_n(&server->overloaded, FALSE, __ATOMIC_RELAXED);
+        }
+    }
+  else if (!deadline)
+    __atomic_compare_exchange_n(&server->overload_deadline_ns, &deadline,
+                                now + server->queue_interval_ns, FALSE,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  else if (now >= deadline &&
+           !__atomic_load_n(&server->overloaded, __ATOMIC_RELAXED))
+    __atomic_store_n(&server->overloaded, TRUE, __ATOMIC_RELAXED);
+}
+
+/* An idle worker means nothing is waiting: the overload is over. */
+static void worker_clear_overload(const Server server)
+{
+  if (__atomic_load_n(&server->overload_deadline_ns, __ATOMIC_RELAXED))
+    {
+      __atomic_store_n(&server->overload_deadline_ns, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&server->overloaded, FALSE, __ATOMIC_RELAXED);
+    }
+}
+
+/* Give up the slot if this is the highest running worker and the pool
+   is above its minimum.  Slots stay contiguous, so the acceptor can
+   pick among [0, pool_size) without a lock.  The worker counts in
+   `retiring' until it exits. */
+static Boolean worker_retire(const Worker worker)
+{
+  const Server server = worker->server;
+  Boolean retired = FALSE;
+
+  mutex_lock(server->mutex);
+  if (!server_shutdown_requested(server) &&
+      worker->index + 1 == server->pool_size &&
+      server->pool_size > server->min_threads)
+    {
+      __atomic_store_n(&server->pool_size, worker->index, __ATOMIC_SEQ_CST);
+      ++server->retiring;
+      retired = TRUE;
+    }
+  mutex_unlock(server->mutex);
+  if (!retired)
+    return FALSE;
+
+  /* Connections pushed while retiring go to the first worker, which
+     always runs. */
+  Client client;
+  while ((client = work_queue_pop(worker->queue)))
+    while (!work_queue_push(server->workers[0]->queue, client))
+      worker_signal(server->workers[0]);
+  worker_signal(server->workers[0]);
+  return TRUE;
+}
+
+/* Sleep until woken, shut down or idle for the timeout.  Returns FALSE
+   on timeout. */
+static Boolean worker_park(const Worker worker)
+{
+  const Server server = worker->server;
+  Boolean woken = TRUE;
+
+  mutex_lock(worker->mutex);
+  while (!worker->wakeup && !server_shutdown_requested(server) && woken)
+    woken = condition_timedwait(worker->condition, worker->mutex,
+                                server->idle_timeout_ms);
+  worker->wakeup = FALSE;
+  mutex_unlock(worker->mutex);
+  __atomic_store_n(&worker->parked, FALSE, __ATOMIC_SEQ_CST);
+  return woken;
+}
+
+static void *worker_thread(void * const context)
+{
+  const Worker worker = context;
+  const Server server = worker->server;
+  Boolean retired = FALSE;
+
+  while (TRUE)
+    {
+      Client client = worker_find_work(worker);
+      if (!client)
+        {
+          /* Announce parking, then look again: a producer either sees
+             the flag or its connection is found here. */
+          __atomic_store_n(&worker->parked, TRUE, __ATOMIC_SEQ_CST);
+          client = worker_find_work(worker);
+          if (!client)
+            {
+              worker_clear_overload(server);
+              if (server_shutdown_requested(server))
+                {
+                  __atomic_store_n(&worker->parked, FALSE, __ATOMIC_SEQ_CST);
+                  break;
+                }
+              /* The slot may be running a new worker once retired. */
+              if (!worker_park(worker) && (retired = worker_retire(worker)))
+                break;
+              continue;
+            }
+          __atomic_store_n(&worker->parked, FALSE, __ATOMIC_SEQ_CST);
+        }
+
+      worker_note_queue_delay(server, client);
+      __atomic_sub_fetch(&server->queued, 1, __ATOMIC_SEQ_CST);
+      /* Either a blocked acceptor sees the room, or its count is seen
+         here. */
+      if (__atomic_load_n(&server->admission_waiters, __ATOMIC_SEQ_CST))
+        {
+          mutex_lock(server->mutex);
+          condition_broadcast(server->condition);
+          mutex_unlock(server->mutex);
+        }
+      __atomic_add_fetch(&server->busy, 1, __ATOMIC_RELAXED);
+
+      DEBUG(("Communicating"));
+      const Boolean success = communicate(server, client);
+      DEBUG(("Communication %s", success ? "succesful" : "failed"));
+      if (!success)
+        warning("Failed to accept connection");
+
+      server_destroy_client(server, client);
+      client_destroy(client);
+
+      __atomic_sub_fetch(&server->busy, 1, __ATOMIC_RELAXED);
+    }
+
+  metrics_thread_exit(server);
+  trace_thread_exit(server);
+  mutex_lock(server->mutex);
+  if (retired)
+    --server->retiring;
+  else
+    {
+      assert(server->pool_size);
+      __atomic_sub_fetch(&server->pool_size, 1, __ATOMIC_SEQ_CST);
+    }
+  /* server_destroy() waits on the server condition. */
+  condition_broadcast(server->condition);
+  mutex_unlock(server->mutex);
+  return NULL;
+}
+
+/* Start a worker in the next free slot.  Called with the server mutex
+   held. */
+static Boolean workers_spawn(const Server server)
+{
+  const size_t index = server->pool_size;
+
+  assert(index < server->max_threads);
+  if (index == server->worker_slots)
+    {
+      const Worker worker = xcalloc(1, sizeof(*worker));
+      worker->server = server;
+      worker->index = index;
+      worker->queue = work_queue_create(WORKER_QUEUE_SIZE);
+      worker->mutex = mutex_create();
+      worker->condition = condition_create();
+      server->workers[index] = worker;
+      __atomic_store_n(&server->worker_slots, index + 1, __ATOMIC_RELEASE);
+    }
+
+  __atomic_store_n(&server->pool_size, index + 1, __ATOMIC_SEQ_CST);
+  if (thread_create(worker_thread, server->workers[index]))
+    return TRUE;
+  __atomic_store_n(&server->pool_size, index, __ATOMIC_SEQ_CST);
+  return FALSE;
+}
+
+Boolean workers_start(const Server server)
+{
+  server->workers = xcalloc(server->max_threads, sizeof(*server->workers));
+
+  mutex_lock(server->mutex);
+  for (size_t i = 0; i < server->min_threads; ++i)
+    if (!workers_spawn(server))
+      break;
+  mutex_unlock(server->mutex);
+  return server->pool_size > 0;
+}
+
+void workers_wake_all(const Server server)
+{
+  const size_t slots = __atomic_load_n(&server->worker_slots,
+                                       __ATOMIC_ACQUIRE);
+  for (size_t i = 0; i < slots; ++i)
+    worker_signal(server->workers[i]);
+}
+
+void workers_destroy(const Server server)
+{
+  for (size_t i = 0; i < server->worker_slots; ++i)
+    {
+      const Worker worker = server->workers[i];
+      Client client;
+      /* Connections queued while the workers were exiting. */
+      while ((client = work_queue_pop(worker->queue)))
+        {
+          server_destroy_client(server, client);
+          client_destroy(client);
+        }
+      work_queue_destroy(worker->queue);
+      mutex_destroy(worker->mutex);
+      condition_destroy(worker->condition);
+      xfree(worker);
+    }
+  xfree(server->workers);
+  server->workers = NULL;
+  server->worker_slots = 0;
+}
+
+/* Tell a refused client, as far as its socket buffer allows, and
+   count it. */
+static void workers_refuse(const Client client, size_t * const counter)
+{
+  send(client->conn_fd, SERVER_BUSY_REPLY, strlen(SERVER_BUSY_REPLY),
+       MSG_DONTWAIT | MSG_NOSIGNAL);
+  __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Refuse the head of the first non-empty queue from `first' on, the
+   connection that has waited longest there. */
+static void workers_drop_oldest(const Server server, const size_t first,
+                                const size_t pool_size)
+{
+  for (size_t i = 0; i < pool_size; ++i)
+    {
+      const Client client =
+        work_queue_pop(server->workers[(first + i) % pool_size]->queue);
+      if (client)
+        {
+          __atomic_sub_fetch(&server->queued, 1, __ATOMIC_SEQ_CST);
+          workers_refuse(client, &server->dropped);
+          server_destroy_client(server, client);
+          client_destroy(client);
+          return;
+        }
+    }
+}
+
+/* Wait for room in the queues.  Returns FALSE on shutdown. */
+static Boolean workers_wait_for_room(const Server server)
+{
+  Boolean shutdown;
+
+  mutex_lock(server->mutex);
+  __atomic_add_fetch(&server->admission_waiters, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&server->queued, __ATOMIC_SEQ_CST) >=
+         server->max_queued && !server_shutdown_requested(server))
+    condition_wait(server->condition, server->mutex);
+  __atomic_sub_fetch(&server->admission_waiters, 1, __ATOMIC_SEQ_CST);
+  shutdown = server_shutdown_requested(server);
+  mutex_unlock(server->mutex);
+  return !shutdown;
+}
+
+Boolean workers_dispatch(const Server server, const Client client,
+                         const AcceptShard shard, char ** const errors_ret)
+{
+  const size_t pool_size = __atomic_load_n(&server->pool_size,
+                                           __ATOMIC_SEQ_CST);
+  Worker target = NULL;
+
+  /* Shed while the delay is over target, unless the queues have
+     drained meanwhile. */
+  if (__atomic_load_n(&server->overloaded, __ATOMIC_RELAXED) &&
+      __atomic_load_n(&server->queued, __ATOMIC_RELAXED))
+    {
+      workers_refuse(client, &server->shed);
+      *errors_ret = xstrdup("Server is overloaded");
+      return FALSE;
+    }
+
+  /* Start at the next worker of the shard, or of the whole pool, and
+     move on to its neighbours if that queue is full. */
+  const size_t first = !pool_size ? 0 : shard ?
+    accept_shard_next(shard, pool_size) :
+    __atomic_fetch_add(&server->next_worker, 1, __ATOMIC_RELAXED);
+
+  if (__atomic_load_n(&server->queued, __ATOMIC_SEQ_CST) >=
+      server->max_queued)
+    switch (server->admission)
+      {
+      case SERVER_ADMISSION_REJECT:
+        workers_refuse(client, &server->rejected);
+        *errors_ret = xstrdup("Too many queued connections");
+        return FALSE;
+
+      case SERVER_ADMISSION_DROP_OLDEST:
+        workers_drop_oldest(server, first, pool_size);
+        break;
+
+      case SERVER_ADMISSION_BLOCK:
+        if (!workers_wait_for_room(server))
+          {
+            *errors_ret = xstrdup("Server is shutting down");
+            return FALSE;
+          }
+        break;
+      }
+
+  /* Count the connection before a worker can take it. */
+  client->queued_ns = clock_monotonic_ns();
+  const size_t queued = __atomic_add_fetch(&server->queued, 1,
+                                           __ATOMIC_SEQ_CST);
+  for (size_t i = 0; i < pool_size && !target; ++i)
+    {
+      const Worker worker = server->workers[(first + i) % pool_size];
+      if (work_queue_push(worker->queue, client))
+        target = worker;
+    }
+  if (!target)
+    {
+      __atomic_sub_fetch(&server->queued, 1, __ATOMIC_SEQ_CST);
+      workers_refuse(client, &server->rejected);
+      *errors_ret = xstrdup("Run queues are full");
+      return FALSE;
+    }
+
+  /* Wake the owner if it sleeps, otherwise any sleeping peer to steal
+     the connection. */
+  Boolean woken = worker_wake(target);
+  for (size_t i = 1; i < pool_size && !woken; ++i)
+    woken = worker_wake(server->workers[(target->index + i) % pool_size]);
+
+  /* Grow when there are more queued connections than idle workers. */
+  if (!woken &&
+      queued > pool_size - __atomic_load_n(&server->busy, __ATOMIC_RELAXED))
+    {
+      mutex_lock(server->mutex);
+      if (!server_shutdown_requested(server) &&
+          server->pool_size < server->max_threads &&
+          !workers_spawn(server))
+        DEBUG(("Pool did not grow, connection stays queued"));
+      mutex_unlock(server->mutex);
+    }
+  return TRUE;
+}
@@ -0,0 +1,196 @@
+/*
+ * Connection timeouts.  Every connection has a timer on one wheel,
+ * served by a timer thread that shuts down the sockets of connections
+ * past their deadline; the engine serving the connection then sees EOF
+ * or an error and closes it the usual way.
+ *
+ * The engines never touch the wheel on the request path: they store
+ * the new deadline with an atomic write.  A timer is armed no later
+ * than the shortest enabled timeout from its last check, which no
+ * deadline set since can precede.  When it fires on a deadline that
+ * has moved on, it is simply armed again.
+ */
+#define _GNU_SOURCE
+#include "cserver-internal.h"
+#include <stddef.h>
+
+/* Resolution of the deadlines. */
+#define TIMER_TICK_MS 10
+
+/* The first tick at or after `ms'. */
+static uint64_t timers_tick(const uint64_t ms)
+{
+  return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+static Client timer_client(const Timer timer)
+{
+  return (Client) ((char *) timer - offsetof(ClientStruct, timer));
+}
+
+/* Arm the timer of `client' for its next check.  Called with the timer
+   mutex held. */
+static void timers_arm(const Server server, const Client client,
+                       const uint64_t now_ms, const uint64_t deadline_ms)
+{
+  const uint64_t check_ms = now_ms + server->min_timeout_ms;
+  const Boolean was_empty = !timer_wheel_count(server->timer_wheel);
+
+  timer_wheel_add(server->timer_wheel, &client->timer,
+                  timers_tick(deadline_ms < check_ms ?
+                              deadline_ms : check_ms));
+  if (was_empty)
+    condition_signal(server->timer_condition);
+}
+
+/* Called with the timer mutex held, which keeps `client' alive. */
+static void timers_check(const Server server, const Client client,
+                         const uint64_t now_ms)
+{
+  const uint64_t deadline = __atomic_load_n(&client->timer_deadline,
+                                            __ATOMIC_RELAXED);
+  const uint64_t deadline_ms = deadline >> 2;
+  const ClientTimeout timeout = deadline & 3;
+
+  if (deadline_ms > now_ms)
+    {
+      timers_arm(server, client, now_ms, deadline_ms);
+      return;
+    }
+  DEBUG(("Connection %d timed out", client->conn_fd));
+  __atomic_add_fetch(&server->timeouts_expired[timeout], 1, __ATOMIC_RELAXED);
+  shutdown(client->conn_fd, SHUT_RDWR);
+}
+
+static void *timers_thread(void * const context)
+{
+  const Server server = context;
+
+  mutex_lock(server->timer_mutex);
+  while (!server_shutdown_requested(server))
+    {
+      if (timer_wheel_count(server->timer_wheel))
+        condition_timedwait(server->timer_condition, server->timer_mutex,
+                            TIMER_TICK_MS);
+      else
+        condition_wait(server->timer_condition, server->timer_mutex);
+
+      const uint64_t now_ms = clock_monotonic_coarse_ms();
+      Timer timer = timer_wheel_advance(server->timer_wheel,
+                                        now_ms / TIMER_TICK_MS);
+      while (timer)
+        {
+          const Timer next = timer->next;
+          timers_check(server, timer_client(timer), now_ms);
+          timer = next;
+        }
+    }
+  mutex_unlock(server->timer_mutex);
+
+  mutex_lock(server->mutex);
+  server->timer_running = FALSE;
+  condition_broadcast(server->condition);
+  mutex_unlock(server->mutex);
+  return NULL;
+}
+
+Boolean timers_start(const Server server)
+{
+  server->min_timeout_ms = 0;
+  for (int i = 0; i < CLIENT_TIMEOUT_COUNT; ++i)
+    if (server->timeouts_ms[i] > 0 &&
+        (!server->min_timeout_ms ||
+         server->timeouts_ms[i] < server->min_timeout_ms))
+      server->min_timeout_ms = server->timeouts_ms[i];
+  if (!server->min_timeout_ms)
+    return TRUE;
+
+  server->timer_mutex = mutex_create();
+  server->timer_condition = condition_create();
+  server->timer_wheel =
+    timer_wheel_create(clock_monotonic_coarse_ms() / TIMER_TICK_MS);
+  server->timer_running = TRUE;
+  if (thread_create(timers_thread, server))
+    return TRUE;
+  server->timer_running = FALSE;
+  return FALSE;
+}
+
+void timers_wake(const Server server)
+{
+  if (!server->timer_wheel)
+    return;
+  mutex_lock(server->timer_mutex);
+  condition_signal(server->timer_condition);
+  mutex_unlock(server->timer_mutex);
+}
+
+void timers_destroy(const Server server)
+{
+  if (!server->timer_wheel)
+    return;
+  timer_wheel_destroy(server->timer_wheel);
+  condition_destroy(server->timer_condition);
+  mutex_destroy(server->timer_mutex);
+  server->timer_wheel = NULL;
+}
+
+void client_timer_start(const Server server, const Client client)
+{
+  if (!server->timer_wheel)
+    return;
+  const uint64_t now_ms = clock_monotonic_coarse_ms();
+  const long timeout = server->timeouts_ms[CLIENT_TIMEOUT_IDLE];
+
+  client->timer_deadline =
+    CLIENT_DEADLINE(timeout ? now_ms + timeout : CLIENT_NO_DEADLINE,
+                    CLIENT_TIMEOUT_IDLE);
+  mutex_lock(server->timer_mutex);
+  timers_arm(server, client, now_ms, CLIENT_NO_DEADLINE);
+  mutex_unlock(server->timer_mutex);
+}
+
+void client_timer_stop(const Server server, const Client client)
+{
+  if (!server->timer_wheel)
+    return;
+  mutex_lock(server->timer_mutex);
+  timer_wheel_cancel(server->timer_wheel, &client->timer);
+  mutex_unlock(server->timer_mutex);
+}
+
+void client_timer_update(const Server server, const Client client)
+{
+  if (!server->timer_wheel)
+    return;
+  const ClientTimeout timeout =
+    client_output_pending(client) ? CLIENT_TIMEOUT_WRITE :
+    client_input_pending(client) ? CLIENT_TIMEOUT_READ : CLIENT_TIMEOUT_IDLE;
+  const uint64_t current = __atomic_load_n(&client->timer_deadline,
+                                           __ATOMIC_RELAXED);
+
+  /* A request keeps the deadline of its first byte, however slowly the
+     rest trickles in. */
+  if (timeout == CLIENT_TIMEOUT_READ && (current & 3) == CLIENT_TIMEOUT_READ &&
+      client->timer_line_start == client->input_start)
+    return;
+  client->timer_line_start = client->input_start;
+
+  const long timeout_ms = server->timeouts_ms[timeout];
+  __atomic_store_n(&client->timer_deadline,
+                   CLIENT_DEADLINE(timeout_ms ? clock_monotonic_coarse_ms() +
+                                   timeout_ms : CLIENT_NO_DEADLINE, timeout),
+                   __ATOMIC_RELAXED);
+}
+
+void server_get_timeout_stats(const Server server,
+                              const ServerTimeoutStats stats_ret)
+{
+  stats_ret->idle = __atomic_load_n(&server->timeouts_expired
+                                    [CLIENT_TIMEOUT_IDLE], __ATOMIC_RELAXED);
+  stats_ret->read = __atomic_load_n(&server->timeouts_expired
+                                    [CLIENT_TIMEOUT_READ], __ATOMIC_RELAXED);
+  stats_ret->write = __atomic_load_n(&server->timeouts_expired
+                                     [CLIENT_TIMEOUT_WRITE],
+                                     __ATOMIC_RELAXED);
+}
@@ -0,0 +1,242 @@
+/*
+ * Request tracing.  Trace points record spans of the request stages,
+ * queueing, reading, processing and writing, into a ring of the calling
+ * thread's own, so recording takes no lock and no locked instruction;
+ * the oldest events are overwritten.  server_format_trace() copies the
+ * rings out and formats them as Chrome trace JSON, which chrome://tracing
+ * and Perfetto load.  Rings of exited threads are handed to new ones and
+ * live as long as the server.
+ */
+#define _GNU_SOURCE
+#include "cserver-internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Events per ring, a power of two. */
+#define TRACE_RING_EVENTS 4096
+
+#define TRACE_ALIGN 64
+
+/* An event's op field when no op is known. */
+#define TRACE_NO_OP 0xff
+
+static const char * const trace_stage_names[TRACE_STAGE_COUNT] =
+  { "queue", "read", "process", "write" };
+
+/* An event is three words: the start, the duration, and the
+   descriptor, stage and op packed by TRACE_EVENT_INFO().  They are
+   stored one by one, so readers check `claimed' for events overwritten
+   while they copied, like a sequence lock: the words are stored with
+   release after `claimed', and read with acquire before it, so a reader
+   that sees any new word also sees the claim. */
+#define TRACE_EVENT_WORDS 3
+#define TRACE_EVENT_INFO(fd, stage, op) \
+  ((uint64_t) (uint32_t) (fd) << 32 | (uint64_t) (stage) << 8 | (op))
+
+struct TraceRingRec
+{
+  TraceRing next;
+  /* Numbers the ring in the trace, where it shows as a thread. */
+  size_t id;
+  /* Whether a thread records into the ring; under trace_mutex. */
+  Boolean owned;
+  /* Events published, and events the owner has started writing. */
+  uint64_t head, claimed;
+  uint64_t events[TRACE_RING_EVENTS][TRACE_EVENT_WORDS];
+};
+
+void trace_start(const Server server, const Boolean enabled)
+{
+  const int ret = pthread_key_create(&server->trace_key, NULL);
+  if (ret != 0)
+    fatal("Failed to create trace key: code %d", ret);
+  server->trace_mutex = mutex_create();
+  server->trace_enabled = enabled;
+}
+
+void trace_destroy(const Server server)
+{
+  if (!server->trace_mutex)
+    return;
+  pthread_key_delete(server->trace_key);
+  while (server->trace_rings)
+    {
+      const TraceRing ring = server->trace_rings;
+      server->trace_rings = ring->next;
+      free(ring);
+    }
+  mutex_destroy(server->trace_mutex);
+  server->trace_mutex = NULL;
+}
+
+/* The calling thread's ring: a free one of a thread gone, or a new
+   one. */
+static TraceRing trace_ring(const Server server)
+{
+  TraceRing ring = pthread_getspecific(server->trace_key);
+  if (ring)
+    return ring;
+
+  mutex_lock(server->trace_mutex);
+  for (ring = server->trace_rings; ring && ring->owned; ring = ring->next)
+    ;
+  if (!ring)
+    {
+      ring = xmemalign(TRACE_ALIGN, sizeof(*ring));
+      memset(ring, 0, sizeof(*ring));
+      ring->id = ++server->trace_ring_count;
+      ring->next = server->trace_rings;
+      server->trace_rings = ring;
+    }
+  ring->owned = TRUE;
+  mutex_unlock(server->trace_mutex);
+  if (pthread_setspecific(server->trace_key, ring) != 0)
+    fatal("Failed to set the trace ring");
+  return ring;
+}
+
+void trace_thread_exit(const Server server)
+{
+  const TraceRing ring = pthread_getspecific(server->trace_key);
+  if (!ring)
+    return;
+
+  mutex_lock(server->trace_mutex);
+  ring->owned = FALSE;
+  mutex_unlock(server->trace_mutex);
+  pthread_setspecific(server->trace_key, NULL);
+}
+
+size_t trace_ring_total(const Server server)
+{
+  mutex_lock(server->trace_mutex);
+  const size_t count = server->trace_ring_count;
+  mutex_unlock(server->trace_mutex);
+  return count;
+}
+
+void trace_record(const Server server, const TraceStage stage, const int fd,
+                  const uint64_t start_ns, const uint64_t end_ns,
+                  const ServerOp op)
+{
+  const TraceRing ring = trace_ring(server);
+  const uint64_t head = ring->head;
+  uint64_t * const event = ring->events[head & (TRACE_RING_EVENTS - 1)];
+  const unsigned op_index = op && op->index < TRACE_NO_OP ?
+    op->index : TRACE_NO_OP;
+
+  /* Claim the slot before overwriting it. */
+  __atomic_store_n(&ring->claimed, head + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&event[0], start_ns, __ATOMIC_RELEASE);
+  __atomic_store_n(&event[1], end_ns - start_ns, __ATOMIC_RELEASE);
+  __atomic_store_n(&event[2], TRACE_EVENT_INFO(fd, stage, op_index),
+                   __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void server_set_tracing(const Server server, const Boolean enabled)
+{
+  __atomic_store_n(&server->trace_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+Boolean server_tracing(const Server server)
+{
+  return __atomic_load_n(&server->trace_enabled, __ATOMIC_RELAXED);
+}
+
+/* Copy the events of `ring' still intact to `events', oldest first,
+   and return their number. */
+static size_t trace_ring_copy(const TraceRing ring,
+                              uint64_t events[][TRACE_EVENT_WORDS])
+{
+  const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+  for (uint64_t i = first; i < head; ++i)
+    for (int j = 0; j < TRACE_EVENT_WORDS; ++j)
+      events[i - first][j] =
+        __atomic_load_n(&ring->events[i & (TRACE_RING_EVENTS - 1)][j],
+                        __ATOMIC_ACQUIRE);
+
+  /* Drop the events whose slots the owner claimed meanwhile. */
+  const uint64_t claimed = __atomic_load_n(&ring->claimed,
+                                           __ATOMIC_ACQUIRE);
+  const uint64_t intact = claimed > TRACE_RING_EVENTS ?
+    claimed - TRACE_RING_EVENTS : 0;
+  if (intact <= first)
+    return head - first;
+  if (intact >= head)
+    return 0;
+  memmove(events, events[intact - first],
+          (head - intact) * sizeof(events[0]));
+  return head - intact;
+}
+
+/* Write `length' bytes at `s' as the contents of a JSON string. */
+static void trace_format_string(FILE * const out, const char * const s,
+                                const int length)
+{
+  for (int i = 0; i < length; ++i)
+    {
+      const unsigned char c = s[i];
+      if (c == '"' || c == '\\')
+        fprintf(out, "\\%c", c);
+      else if (c < 0x20)
+        fprintf(out, "\\u%04x", c);
+      else
+        fputc(c, out);
+    }
+}
+
+char *server_format_trace(const Server server)
+{
+  uint64_t (*events)[TRACE_EVENT_WORDS] =
+    xcalloc(TRACE_RING_EVENTS, sizeof(*events));
+  ServerOp ops[TRACE_NO_OP] = { NULL };
+  const pid_t pid = getpid();
+  const char *separator = "";
+  char *text = NULL;
+  size_t size = 0;
+  FILE * const out = open_memstream(&text, &size);
+  if (!out)
+    fatal("memory allocation failed.");
+
+  for (size_t i = 0; server->ops && i <= server->op_mask; ++i)
+    if (server->ops[i].handler && server->ops[i].index < TRACE_NO_OP)
+      ops[server->ops[i].index] = &server->ops[i];
+
+  /* One line, so the TRACE op can reply with it. */
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+  mutex_lock(server->trace_mutex);
+  for (TraceRing ring = server->trace_rings; ring; ring = ring->next)
+    {
+      const size_t count = trace_ring_copy(ring, events);
+      for (size_t i = 0; i < count; ++i)
+        {
+          const uint64_t info = events[i][2];
+          const unsigned stage = (info >> 8) & 0xff, op = info & 0xff;
+          if (stage >= TRACE_STAGE_COUNT)
+            continue;
+          fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"cserver\",\"ph\":\"X\","
+                  "\"pid\":%d,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,"
+                  "\"args\":{\"fd\":%d", separator, trace_stage_names[stage],
+                  (int) pid, ring->id, events[i][0] / 1e3,
+                  events[i][1] / 1e3, (int) (int32_t) (info >> 32));
+          if (op != TRACE_NO_OP && ops[op])
+            {
+              fputs(",\"op\":\"", out);
+              trace_format_string(out, ops[op]->name, ops[op]->length);
+              fputc('"', out);
+            }
+          fputs("}}", out);
+          separator = ",";
+        }
+    }
+  mutex_unlock(server->trace_mutex);
+  fputs("]}", out);
+
+  fclose(out);
+  xfree(events);
+  return text;
+}
@@ -0,0 +1,734 @@
+/*
+ * The io_uring connection engine.  Every ring thread keeps a multishot
+ * accept armed on the listener, receives into buffers picked by the
+ * kernel from a provided buffer ring, and sends each batch of replies
+ * with the next receive linked behind it.  A request/reply round trip
+ * costs no system call of its own beyond the io_uring_enter() shared by
+ * the whole batch.
+ *
+ * liburing is not required; the rings are driven through the raw
+ * system calls.
+ */
+#define _GNU_SOURCE
+#include "cserver-internal.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Submission queue entries per ring. */
+#define URING_ENTRIES 1024
+
+/* Provided receive buffers per ring, and their size.  Idle connections
+   hold no receive buffer; the kernel picks one only when data arrives. */
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+/* Operation kinds, kept in the low bits of the user data next to the
+   Client pointer. */
+typedef enum
+{
+  URING_OP_WAKE,
+  URING_OP_ACCEPT,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_CANCEL
+} UringOp;
+
+#define URING_OP_MASK 7UL
+
+struct UringRec
+{
+  Server server;
+  int ring_fd, wake_fd;
+
+  /* Listener handed over by urings_listen(), or -1.  Set while the
+     ring thread runs, so accessed atomically. */
+  int listen_fd;
+  Boolean accept_armed, stopping;
+  size_t clients;
+
+  /* Submission queue. */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries, sq_local_tail;
+  struct io_uring_sqe *sqes;
+
+  /* Completion queue. */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+
+  /* Provided buffers. */
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *buffers;
+  unsigned short buf_tail;
+
+  /* Target of the wakeup eventfd read. */
+  uint64_t wake_value;
+
+  /* Connections handed over by server_accept_connection(). */
+  Mutex mutex;
+  Client pending;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                 flags, NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, void *arg,
+                          unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(const Uring ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map && ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map)
+    munmap(ring->sq_map, ring->sq_map_size);
+  if (ring->buf_ring)
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  xfree(ring->buffers);
+}
+
+/* Give buffer `bid' back to the kernel. */
+static void uring_recycle_buffer(const Uring ring, const unsigned bid)
+{
+  struct io_uring_buf * const buf =
+    &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (uintptr_t) &ring->buffers[bid * URING_BUFFER_SIZE];
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = bid;
+  __atomic_store_n(&ring->buf_ring->tail, ++ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Create the ring, map its queues and register the provided buffers.
+   Returns FALSE if the kernel lacks any of it. */
+static Boolean uring_init(const Uring ring)
+{
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CLAMP;
+  ring->ring_fd = uring_setup(URING_ENTRIES, &params);
+  if (ring->ring_fd < 0)
+    return FALSE;
+
+  ring->sq_map_size = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP &&
+      ring->cq_map_size > ring->sq_map_size)
+    ring->sq_map_size = ring->cq_map_size;
+
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                      IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED)
+    {
+      ring->sq_map = NULL;
+      return FALSE;
+    }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_map = ring->sq_map;
+  else
+    {
+      ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                          IORING_OFF_CQ_RING);
+      if (ring->cq_map == MAP_FAILED)
+        {
+          ring->cq_map = NULL;
+          return FALSE;
+        }
+    }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                    IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      ring->sqes = NULL;
+      return FALSE;
+    }
+
+  ring->sq_head = (unsigned *) ((char *) ring->sq_map + params.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_map + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_map +
+                                params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_map + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+
+  ring->cq_head = (unsigned *) ((char *) ring->cq_map + params.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_map + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_map +
+                                params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_map +
+                                        params.cq_off.cqes);
+
+  /* Provided buffer ring; registering it fails on kernels older than
+     5.19, which also lack multishot accept. */
+  ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED)
+    {
+      ring->buf_ring = NULL;
+      return FALSE;
+    }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) ring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return FALSE;
+
+  ring->buffers = xcalloc(URING_BUFFERS, URING_BUFFER_SIZE);
+  for (unsigned bid = 0; bid < URING_BUFFERS; ++bid)
+    uring_recycle_buffer(ring, bid);
+  return TRUE;
+}
+
+Boolean uring_supported(void)
+{
+  struct UringRec ring;
+  Boolean supported;
+
+  memset(&ring, 0, sizeof(ring));
+  supported = uring_init(&ring);
+  uring_unmap(&ring);
+  if (ring.ring_fd >= 0)
+    close(ring.ring_fd);
+  return supported;
+}
+
+/* Number of entries the kernel has not consumed yet. */
+static unsigned uring_unsubmitted(const Uring ring)
+{
+  return ring->sq_local_tail -
+    __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Publish queued entries to the kernel and optionally wait for at least
+   one completion. */
+static void uring_submit(const Uring ring, const Boolean wait)
+{
+  const unsigned to_submit = uring_unsubmitted(ring);
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  if (!to_submit && !wait)
+    return;
+  while (uring_enter(ring->ring_fd, to_submit, wait ? 1 : 0,
+                     wait ? IORING_ENTER_GETEVENTS : 0) < 0)
+    {
+      if (errno == EINTR)
+        {
+          if (wait)
+            break;
+          continue;
+        }
+      if (errno != EAGAIN && errno != EBUSY)
+        fatal("io_uring_enter() failed: %m");
+      /* Completion queue is full; reap before submitting more. */
+      break;
+    }
+}
+
+/* Return a cleared submission entry, submitting the queue first if it
+   is full. */
+static struct io_uring_sqe *uring_get_sqe(const Uring ring)
+{
+  while (ring->sq_local_tail -
+         __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    uring_submit(ring, FALSE);
+
+  const unsigned index = ring->sq_local_tail & *ring->sq_mask;
+  struct io_uring_sqe * const sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ++ring->sq_local_tail;
+  return sqe;
+}
+
+static __u64 uring_user_data(const Client client, const UringOp op)
+{
+  return (uintptr_t) client | op;
+}
+
+static void uring_arm_wake(const Uring ring)
+{
+  struct io_uring_sqe * const sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = ring->wake_fd;
+  sqe->addr = (uintptr_t) &ring->wake_value;
+  sqe->len = sizeof(ring->wake_value);
+  sqe->user_data = uring_user_data(NULL, URING_OP_WAKE);
+}
+
+static void uring_arm_accept(const Uring ring)
+{
+  struct io_uring_sqe * const sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = __atomic_load_n(&ring->listen_fd, __ATOMIC_ACQUIRE);
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = uring_user_data(NULL, URING_OP_ACCEPT);
+  ring->accept_armed = TRUE;
+}
+
+static void uring_cancel_accept(const Uring ring)
+{
+  struct io_uring_sqe * const sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = uring_user_data(NULL, URING_OP_ACCEPT);
+  sqe->user_data = uring_user_data(NULL, URING_OP_CANCEL);
+}
+
+/* Queue a receive into a provided buffer, at most as large as the free
+   space of the input buffer. */
+static void uring_arm_recv(const Uring ring, const Client client,
+                           const size_t space)
+{
+  struct io_uring_sqe * const sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->conn_fd;
+  sqe->len = space < URING_BUFFER_SIZE ? space : URING_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = uring_user_data(client, URING_OP_RECV);
+  client->uring_recv_armed = TRUE;
+}
+
+/* Queue a send of the output queue.  If `link_recv', the next receive
+   is linked behind it so it starts once the replies are out. */
+static void uring_arm_send(const Uring ring, const Client client,
+                           const Boolean link_recv)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+  memset(&client->uring_msg, 0, sizeof(client->uring_msg));
+  client->uring_msg.msg_iov = &client->output[client->output_head];
+  client->uring_msg.msg_iovlen = client->output_count - client->output_head;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = client->conn_fd;
+  sqe->addr = (uintptr_t) &client->uring_msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = uring_user_data(client, URING_OP_SEND);
+  client->uring_send_armed = TRUE;
+  client->trace_send_ns = TRACE_BEGIN(client->server);
+
+  if (link_recv)
+    {
+      char *space;
+      const size_t bytes = client_input_space(client, &space);
+      if (bytes)
+        {
+          sqe->flags |= IOSQE_IO_LINK;
+          uring_arm_recv(ring, client, bytes);
+        }
+    }
+}
+
+/* Release `client' once it is closing and nothing is in flight for
+   it. */
+static void uring_maybe_destroy(const Uring ring, const Client client)
+{
+  if (!client->uring_closing || client->uring_recv_armed ||
+      client->uring_send_armed)
+    return;
+  server_destroy_client(ring->server, client);
+  client_destroy(client);
+  assert(ring->clients);
+  --ring->clients;
+}
+
+/* Close `client'; operations in flight complete with EOF or errors and
+   the client is released after the last one. */
+static void uring_close_client(const Uring ring, const Client client)
+{
+  client->uring_closing = TRUE;
+  shutdown(client->conn_fd, SHUT_RDWR);
+  uring_maybe_destroy(ring, client);
+}
+
+/* Advance the connection: process buffered lines, send their replies
+   and keep a receive armed. */
+static void uring_kick(const Uring ring, const Client client)
+{
+  if (!client->uring_send_armed)
+    {
+      const Boolean success = client_process_input(ring->server, client);
+      if (!success)
+        {
+          /* Replies preceding the error still go out, but nothing more
+             is read. */
+          client->uring_closing = TRUE;
+          shutdown(client->conn_fd, SHUT_RD);
+          if (client_output_pending(client))
+            uring_arm_send(ring, client, FALSE);
+          uring_maybe_destroy(ring, client);
+          return;
+        }
+      if (client_output_pending(client))
+        {
+          uring_arm_send(ring, client, !client->uring_recv_armed);
+          client_timer_update(ring->server, client);
+          return;
+        }
+    }
+
+  if (!client->uring_recv_armed && !client->uring_send_armed)
+    {
+      char *space;
+      const size_t bytes = client_input_space(client, &space);
+      if (bytes)
+        uring_arm_recv(ring, client, bytes);
+    }
+  client_timer_update(ring->server, client);
+}
+
+static void uring_start_client(const Uring ring, const Client client)
+{
+  client->ring = ring;
+  ++ring->clients;
+  if (ring->stopping)
+    uring_close_client(ring, client);
+  else
+    uring_kick(ring, client);
+}
+
+static void uring_handle_recv(const Uring ring, const Client client,
+                              const struct io_uring_cqe * const cqe)
+{
+  client->uring_recv_armed = FALSE;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+      const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (cqe->res > 0 && !client->uring_closing)
+        {
+          char *space;
+          const size_t bytes = client_input_space(client, &space);
+          assert(cqe->res <= bytes);
+          memcpy(space, &ring->buffers[bid * URING_BUFFER_SIZE], cqe->res);
+          client_input_commit(client, cqe->res);
+        }
+      uring_recycle_buffer(ring, bid);
+    }
+
+  if (client->uring_closing)
+    uring_maybe_destroy(ring, client);
+  else if (cqe->res == -ECANCELED || cqe->res == -ENOBUFS)
+    {
+      /* The linked send was short, or the buffers ran out; retry. */
+      uring_kick(ring, client);
+    }
+  else if (cqe->res < 0)
+    {
+      warning("Comm channel in error: %s", strerror(-cqe->res));
+      uring_close_client(ring, client);
+    }
+  else if (cqe->res == 0)
+    {
+      DEBUG(("Client in EOF"));
+      if (client_input_pending(client))
+        warning("Protocol error, leftovers in read buffer");
+      /* A receive linked behind a short send may see EOF before the
+         replies are out, as a drain's half-close makes it; send them
+         first. */
+      client->uring_closing = TRUE;
+      if (client_output_pending(client) && !client->uring_send_armed)
+        uring_arm_send(ring, client, FALSE);
+      uring_maybe_destroy(ring, client);
+    }
+  else
+    {
+      uring_kick(ring, client);
+    }
+}
+
+static void uring_handle_send(const Uring ring, const Client client,
+                              const struct io_uring_cqe * const cqe)
+{
+  client->uring_send_armed = FALSE;
+  TRACE_END(client->server, TRACE_WRITE, client->conn_fd,
+            client->trace_send_ns, NULL);
+  /* A send of nothing would be resubmitted forever. */
+  if (cqe->res <= 0)
+    {
+      if (!client->uring_closing)
+        warning("Failed to send reply: %s",
+                cqe->res ? strerror(-cqe->res) : "nothing sent");
+      uring_close_client(ring, client);
+      return;
+    }
+
+  client_output_advance(client, cqe->res);
+  if (client->uring_closing)
+    {
+      /* Finish the replies preceding a processing error. */
+      if (cqe->res > 0 && client_output_pending(client))
+        uring_arm_send(ring, client, FALSE);
+      else
+        uring_close_client(ring, client);
+      return;
+    }
+  uring_kick(ring, client);
+}
+
+static void uring_handle_accept(const Uring ring,
+                                const struct io_uring_cqe * const cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    ring->accept_armed = FALSE;
+
+  if (cqe->res >= 0)
+    {
+      const Client client = client_create(cqe->res, NULL);
+      DEBUG(("Got connection"));
+      mutex_lock(ring->server->mutex);
+      server_register_client(ring->server, client);
+      mutex_unlock(ring->server->mutex);
+      uring_start_client(ring, client);
+    }
+  else if (cqe->res != -ECANCELED)
+    warning("Failed to low-level accept(): %s", strerror(-cqe->res));
+
+  if (!ring->accept_armed && !ring->stopping)
+    uring_arm_accept(ring);
+}
+
+/* Close every connection owned by `ring'. */
+static void uring_close_all(const Uring ring)
+{
+  const Server server = ring->server;
+  Client * const clients = xcalloc(ring->clients + 1, sizeof(*clients));
+  size_t count = 0;
+
+  mutex_lock(server->mutex);
+  for (Client client = server->head; client; client = client->next_client)
+    if (client->ring == ring)
+      clients[count++] = client;
+  mutex_unlock(server->mutex);
+
+  for (size_t i = 0; i < count; ++i)
+    uring_close_client(ring, clients[i]);
+  xfree(clients);
+}
+
+static void uring_handle_wake(const Uring ring)
+{
+  Client pending;
+
+  mutex_lock(ring->mutex);
+  pending = ring->pending;
+  ring->pending = NULL;
+  mutex_unlock(ring->mutex);
+
+  while (pending)
+    {
+      const Client client = pending;
+      pending = client->uring_next;
+      client->uring_next = NULL;
+      uring_start_client(ring, client);
+    }
+
+  if (server_shutdown_requested(ring->server))
+    {
+      /* The half-closed connections finish their requests and leave,
+         unless the drain runs out of time first. */
+      if (!ring->stopping)
+        {
+          ring->stopping = TRUE;
+          if (ring->accept_armed)
+            uring_cancel_accept(ring);
+        }
+      if (server_drain_expired(ring->server))
+        {
+          uring_close_all(ring);
+          return;
+        }
+    }
+  else if (__atomic_load_n(&ring->listen_fd, __ATOMIC_ACQUIRE) >= 0 &&
+           !ring->accept_armed)
+    uring_arm_accept(ring);
+  uring_arm_wake(ring);
+}
+
+static void uring_handle_cqe(const Uring ring,
+                             const struct io_uring_cqe * const cqe)
+{
+  const Client client = (Client) (uintptr_t) (cqe->user_data &
+                                              ~URING_OP_MASK);
+
+  switch ((UringOp) (cqe->user_data & URING_OP_MASK))
+    {
+    case URING_OP_WAKE:
+      uring_handle_wake(ring);
+      break;
+
+    case URING_OP_ACCEPT:
+      uring_handle_accept(ring, cqe);
+      break;
+
+    case URING_OP_RECV:
+      uring_handle_recv(ring, client, cqe);
+      break;
+
+    case URING_OP_SEND:
+      uring_handle_send(ring, client, cqe);
+      break;
+
+    case URING_OP_CANCEL:
+      break;
+    }
+}
+
+static void *uring_thread(void * const context)
+{
+  const Uring ring = context;
+  const Server server = ring->server;
+
+  uring_arm_wake(ring);
+  while (!ring->stopping || ring->clients || ring->accept_armed)
+    {
+      uring_submit(ring, TRUE);
+
+      unsigned head = *ring->cq_head;
+      const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head)
+        {
+          /* Copy the entry; handlers may submit and the slot is only
+             ours until the head moves. */
+          const struct io_uring_cqe cqe =
+            ring->cqes[head & *ring->cq_mask];
+          __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+          uring_handle_cqe(ring, &cqe);
+        }
+    }
+  metrics_thread_exit(server);
+  trace_thread_exit(server);
+
+  mutex_lock(server->mutex);
+  assert(server->pool_size);
+  --server->pool_size;
+  condition_signal(server->condition);
+  mutex_unlock(server->mutex);
+  return NULL;
+}
+
+Boolean urings_start(const Server server, const size_t ring_count)
+{
+  server->rings = xcalloc(ring_count, sizeof(*server->rings));
+  for (size_t i = 0; i < ring_count; ++i)
+    {
+      const Uring ring = xcalloc(1, sizeof(*ring));
+
+      ring->server = server;
+      ring->listen_fd = -1;
+      ring->mutex = mutex_create();
+      ring->wake_fd = eventfd(0, EFD_CLOEXEC);
+      server->rings[server->ring_count++] = ring;
+      if (!uring_init(ring) || ring->wake_fd < 0)
+        {
+          warning("Failed to create io_uring: %m");
+          return FALSE;
+        }
+
+      mutex_lock(server->mutex);
+      ++server->pool_size;
+      mutex_unlock(server->mutex);
+      if (!thread_create(uring_thread, ring))
+        {
+          mutex_lock(server->mutex);
+          --server->pool_size;
+          mutex_unlock(server->mutex);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+void urings_wake(const Server server)
+{
+  const uint64_t one = 1;
+
+  for (size_t i = 0; i < server->ring_count; ++i)
+    if (server->rings[i]->wake_fd >= 0 &&
+        write(server->rings[i]->wake_fd, &one, sizeof(one)) < 0)
+      warning("Failed to wake io_uring: %m");
+}
+
+void urings_destroy(const Server server)
+{
+  for (size_t i = 0; i < server->ring_count; ++i)
+    {
+      const Uring ring = server->rings[i];
+      uring_unmap(ring);
+      if (ring->ring_fd >= 0)
+        close(ring->ring_fd);
+      if (ring->wake_fd >= 0)
+        close(ring->wake_fd);
+      mutex_destroy(ring->mutex);
+      xfree(ring);
+    }
+  xfree(server->rings);
+  server->rings = NULL;
+  server->ring_count = 0;
+}
+
+Boolean uring_add_client(const Server server, const Client client,
+                         const AcceptShard shard)
+{
+  Uring ring;
+  if (shard)
+    ring = server->rings[accept_shard_next(shard, server->ring_count)];
+  else
+    {
+      mutex_lock(server->mutex);
+      ring = server->rings[server->next_ring++ % server->ring_count];
+      mutex_unlock(server->mutex);
+    }
+
+  mutex_lock(ring->mutex);
+  client->uring_next = ring->pending;
+  ring->pending = client;
+  mutex_unlock(ring->mutex);
+
+  const uint64_t one = 1;
+  return write(ring->wake_fd, &one, sizeof(one)) == sizeof(one);
+}
+
+void urings_listen(const Server server, const int * const listen_fds,
+                   const size_t count)
+{
+  for (size_t i = 0; i < server->ring_count; ++i)
+    __atomic_store_n(&server->rings[i]->listen_fd, listen_fds[i % count],
+                     __ATOMIC_RELEASE);
+  urings_wake(server);
+}
@@ -2,47 +2,153 @@
  * Partially implemented API for the project.
  */
 #define _GNU_SOURCE
-#include "cserver.h"
+#include "cserver-internal.h"
 #include <assert.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
 
-struct ServerRec
+#define SERVER_ASSERT_REGISTRY(server)                                  \
+  assert(!(server)->connections == !(server)->head &&                   \
+    !(server)->connections == !(server)->tail)
+
+void registry_snapshot_release(const Server server, const size_t epoch)
+{
+  __atomic_sub_fetch(&server->snapshot_readers[epoch & 1], 1,
+                     __ATOMIC_RELEASE);
+}
+
+/* Format up to `count' descriptors of `snapshot' from `offset' on,
+   separated by spaces and preceded by the snapshot size if
+   `with_total'.  Sized up front, so this is one pass and one
+   allocation from `arena'. */
+static char *registry_snapshot_format(const Arena arena,
+                                      const RegistrySnapshot snapshot,
+                                      const Boolean with_total,
+                                      const size_t offset, size_t count)
 {
-  Boolean shutdown_requested;
+  /* Room for a space and a full-width int per field. */
+#define LIST_FIELD_WIDTH 12
+  if (offset >= snapshot->count)
+    count = 0;
+  else if (count > snapshot->count - offset)
+    count = snapshot->count - offset;
 
-  Mutex mutex;
-  Condition condition;
-  Client head, tail, next;
-  size_t pool_size, connections;
-};
+  const size_t size = (count + 2) * LIST_FIELD_WIDTH;
+  char * const reply = arena_calloc(arena, 1, size);
+  char *end = reply;
 
-typedef struct ClientRec ClientStruct;
+  if (with_total)
+    end += snprintf(end, size, "%zu", snapshot->count);
+  for (size_t i = offset; i < offset + count; ++i)
+    end += snprintf(end, size - (end - reply), end == reply ? "%d" : " %d",
+                    snapshot->fds[i]);
+  return reply;
+}
 
-struct ClientRec
+static void registry_snapshot_free_list(RegistrySnapshot snapshot)
 {
-  int conn_fd;
+  while (snapshot)
+    {
+      const RegistrySnapshot next = snapshot->retired_next;
+      xfree(snapshot);
+      snapshot = next;
+    }
+}
 
-  /* Linked list.  If no next element, this will be NULL.*/
-  Client prev_client, next_client;
+/* Publish a fresh copy of the registry and retire the old one.  Copies
+   retired two epochs ago are freed once their readers are gone; the
+   writer never waits for readers.  Called with the mutex held, by the
+   first reader after a change. */
+static void registry_snapshot_publish(const Server server)
+{
+  const RegistrySnapshot snapshot =
+    xcalloc(1, sizeof(*snapshot) + server->connections * sizeof(int));
+  for (Client current = server->head; current; current = current->next_client)
+    snapshot->fds[snapshot->count++] = current->conn_fd;
 
-  /* Allow overriding IO calls for easier mocking. */
-  int (*read)(Client client, char *buf, size_t bytes, void *context);
-  void *read_context;
+  const RegistrySnapshot old = __atomic_exchange_n(&server->snapshot, snapshot,
+                                                   __ATOMIC_SEQ_CST);
+  const size_t epoch = server->snapshot_epoch;
+  if (old)
+    {
+      old->retired_next = server->snapshot_retired[epoch & 1];
+      server->snapshot_retired[epoch & 1] = old;
+    }
 
-  Boolean (*write)(Client client, char *buf, size_t bytes, void *context);
-  void *write_context;
-};
+  /* The other parity holds readers of the previous epoch.  Once they are
+     gone, nothing can still see what was retired then. */
+  if (!__atomic_load_n(&server->snapshot_readers[(epoch + 1) & 1],
+                       __ATOMIC_SEQ_CST))
+    {
+      registry_snapshot_free_list(server->snapshot_retired[(epoch + 1) & 1]);
+      server->snapshot_retired[(epoch + 1) & 1] = NULL;
+      __atomic_store_n(&server->snapshot_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    }
+}
 
-/* When communicate() is done, the client context should be removed from
-   the list with this call. */
-static void server_destroy_client(const Server server, const Client client)
+RegistrySnapshot registry_snapshot_acquire(const Server server,
+                                           size_t * const epoch_ret)
 {
-  mutex_lock(server->mutex);
-  assert(server->connections && server->head && server->tail &&
-    (server->connections <= server->pool_size || server->next)
-  );
+  if (__atomic_load_n(&server->snapshot_stale, __ATOMIC_ACQUIRE))
+    {
+      mutex_lock(server->mutex);
+      if (server->snapshot_stale)
+        {
+          registry_snapshot_publish(server);
+          __atomic_store_n(&server->snapshot_stale, FALSE, __ATOMIC_RELAXED);
+        }
+      mutex_unlock(server->mutex);
+    }
+
+  while (TRUE)
+    {
+      const size_t epoch = __atomic_load_n(&server->snapshot_epoch,
+                                           __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&server->snapshot_readers[epoch & 1], 1,
+                         __ATOMIC_SEQ_CST);
+      /* A reader counted under a stale epoch could miss a reclamation;
+         step back and retry. */
+      if (__atomic_load_n(&server->snapshot_epoch, __ATOMIC_SEQ_CST) == epoch)
+        {
+          *epoch_ret = epoch;
+          return __atomic_load_n(&server->snapshot, __ATOMIC_SEQ_CST);
+        }
+      __atomic_sub_fetch(&server->snapshot_readers[epoch & 1], 1,
+                         __ATOMIC_SEQ_CST);
+    }
+}
+
+void server_register_client(const Server server, const Client client)
+{
+  SERVER_ASSERT_REGISTRY(server);
+  client->prev_client = server->tail;
+  client->next_client = NULL;
+  if (server->connections)
+    server->tail = server->tail->next_client = client;
+  else
+    server->head = server->tail = client;
+  __atomic_add_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&server->snapshot_stale, TRUE, __ATOMIC_RELEASE);
+  client->server = server;
+  metrics_count(server, SERVER_COUNTER_ACCEPTED, 1);
+  client_timer_start(server, client);
+  /* Missed the sweep of server_shutdown(). */
+  if (server_shutdown_requested(server))
+    shutdown(client->conn_fd, SHUT_RD);
+}
+
+void server_unlink_client(const Server server, const Client client)
+{
+  assert(server->connections);
+  SERVER_ASSERT_REGISTRY(server);
   if (client->prev_client)
     client->prev_client->next_client = client->next_client;
   else
@@ -51,65 +157,182 @@ static void server_destroy_client(const Server server, const Client client)
     client->next_client->prev_client = client->prev_client;
   else
     server->tail = client->prev_client;
-  --server->connections;
-  mutex_unlock(server->mutex);
+  __atomic_sub_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&server->snapshot_stale, TRUE, __ATOMIC_RELEASE);
 }
 
-static void *server_thread(void * const context) {
-  const Server server = (Server) context;
-  while (TRUE) {
-    mutex_lock(server->mutex);
-    assert(!server->connections == !server->head &&
-      !server->connections == !server->tail &&
-      (server->connections <= server->pool_size || server->next)
-    );
-    while (!server_shutdown_requested(server) && !server->next)
-      condition_wait(server->condition, server->mutex);
-    if (server_shutdown_requested(server) && !server->next) {
-      mutex_unlock(server->mutex);
-      break;
-    }
-    const Client client = server->next;
-    server->next = server->next->next_client;
-    mutex_unlock(server->mutex);
-
-    DEBUG(("Communicating"));
-    const Boolean success = communicate(server, client);
-    DEBUG(("Communication %s", success ? "succesful" : "failed"));
-    if (!success)
-      warning("Failed to accept connection");
-
-    server_destroy_client(server, client);
-    client_destroy(client);
-  }
+void server_destroy_client(const Server server, const Client client)
+{
+  client_timer_stop(server, client);
   mutex_lock(server->mutex);
-  assert(server->pool_size);
-  --server->pool_size;
-  condition_signal(server->condition);
+  server_unlink_client(server, client);
   mutex_unlock(server->mutex);
-  return NULL;
+  metrics_count(server, SERVER_COUNTER_CLOSED, 1);
 }
 
+/* Number of event loops or rings to run. */
+static size_t server_thread_count(const ServerCreateParams params)
+{
+  long cpus;
+
+  if (params->event_loops)
+    return params->event_loops;
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? cpus : 1;
+}
+
+static void server_register_builtin_ops(Server server,
+                                        ServerCreateParams params);
+
 Server server_create(void)
+{
+  return server_create_with_params(NULL);
+}
+
+Server server_create_with_params(const ServerCreateParams params)
 {
   const Server server = xcalloc(1, sizeof(*server));
   server->mutex = mutex_create();
   server->condition = condition_create();
-  server->pool_size = 64U;
-  for (size_t i = 0; i < server->pool_size; ++i)
-    thread_create(server_thread, server);
+  metrics_start(server);
+  trace_start(server, params && params->trace);
+  server->engine = params ? params->engine : SERVER_ENGINE_THREADS;
+  server_register_builtin_ops(server, params);
+
+  server->drain_timeout_ms = params && params->drain_timeout_ms ?
+    params->drain_timeout_ms : SERVER_DEFAULT_DRAIN_TIMEOUT_MS;
+  if (params)
+    {
+      server->timeouts_ms[CLIENT_TIMEOUT_IDLE] = params->conn_idle_timeout_ms;
+      server->timeouts_ms[CLIENT_TIMEOUT_READ] = params->read_timeout_ms;
+      server->timeouts_ms[CLIENT_TIMEOUT_WRITE] = params->write_timeout_ms;
+    }
+  if (!timers_start(server))
+    {
+      warning("Failed to start the timer thread");
+      server_destroy(server);
+      return NULL;
+    }
+
+  switch (server->engine)
+    {
+    case SERVER_ENGINE_THREADS:
+      server->min_threads = params && params->min_threads ?
+        params->min_threads : SERVER_DEFAULT_MIN_THREADS;
+      server->max_threads = params && params->max_threads ?
+        params->max_threads : SERVER_DEFAULT_MAX_THREADS;
+      if (server->max_threads < server->min_threads)
+        server->max_threads = server->min_threads;
+      server->idle_timeout_ms = params && params->idle_timeout_ms ?
+        params->idle_timeout_ms : SERVER_DEFAULT_IDLE_TIMEOUT_MS;
+      server->max_queued = params && params->max_queued ?
+        params->max_queued : SERVER_DEFAULT_MAX_QUEUED;
+      server->admission = params ? params->admission :
+        SERVER_ADMISSION_REJECT;
+      server->queue_target_ns = params ?
+        (uint64_t) params->queue_target_ms * 1000000 : 0;
+      server->queue_interval_ns = (uint64_t) 1000000 *
+        (params && params->queue_interval_ms ?
+         params->queue_interval_ms : SERVER_DEFAULT_QUEUE_INTERVAL_MS);
+
+      /* Only the minimum is started up front; the rest come on demand. */
+      if (!workers_start(server))
+        {
+          warning("Failed to start worker threads");
+          server_destroy(server);
+          return NULL;
+        }
+      break;
+
+    case SERVER_ENGINE_URING:
+      if (uring_supported())
+        {
+          if (!urings_start(server, server_thread_count(params)))
+            {
+              warning("Failed to start io_uring threads");
+              server_destroy(server);
+              return NULL;
+            }
+          break;
+        }
+      warning("io_uring is not available, using epoll");
+      server->engine = SERVER_ENGINE_EPOLL;
+      /* Fall through. */
+
+    case SERVER_ENGINE_EPOLL:
+      if (!event_loops_start(server, server_thread_count(params)))
+        {
+          warning("Failed to start event loops");
+          server_destroy(server);
+          return NULL;
+        }
+      break;
+    }
   return server;
 }
 
+/* Wait for the engine threads to finish the connections left, and
+   force the connections closed once the drain deadline passes.
+   Returns FALSE if the threads have still not finished one more drain
+   timeout later; the server must then be left allocated. */
+static Boolean server_drain(const Server server)
+{
+  const uint64_t timeout = (uint64_t) server->drain_timeout_ms * 1000000;
+  uint64_t deadline = clock_monotonic_ns() + timeout;
+  Boolean drained = TRUE;
+
+  mutex_lock(server->mutex);
+  while (server->pool_size || server->retiring || server->timer_running)
+    {
+      const uint64_t now = clock_monotonic_ns();
+      if (now < deadline)
+        condition_timedwait(server->condition, server->mutex,
+                            (deadline - now + 999999) / 1000000);
+      else if (server_drain_expired(server))
+        {
+          warning("Drain stuck, %zu threads still running",
+                  server->pool_size + server->retiring +
+                  server->timer_running);
+          drained = FALSE;
+          break;
+        }
+      else
+        {
+          if (server->connections)
+            warning("Drain deadline passed, closing %zu connections",
+                    server->connections);
+          __atomic_store_n(&server->drain_expired, TRUE, __ATOMIC_RELEASE);
+          for (Client client = server->head; client;
+               client = client->next_client)
+            shutdown(client->conn_fd, SHUT_RDWR);
+          event_loops_wake(server);
+          urings_wake(server);
+          deadline = now + timeout;
+        }
+    }
+  mutex_unlock(server->mutex);
+  return drained;
+}
+
 void server_destroy(const Server server)
 {
   if (!server)
     return;
 
-  mutex_lock(server->mutex);
-  while (server->pool_size)
-    condition_wait(server->condition, server->mutex);
-  mutex_unlock(server->mutex);
+  server_shutdown(server);
+  /* Threads still running may touch anything below. */
+  if (!server_drain(server))
+    return;
+  workers_destroy(server);
+  event_loops_destroy(server);
+  urings_destroy(server);
+  registry_snapshot_free_list(server->snapshot);
+  registry_snapshot_free_list(server->snapshot_retired[0]);
+  registry_snapshot_free_list(server->snapshot_retired[1]);
+  timers_destroy(server);
+  metrics_destroy(server);
+  trace_destroy(server);
+  xfree(server->ops);
   condition_destroy(server->condition);
   mutex_destroy(server->mutex);
   xfree(server);
@@ -117,12 +340,88 @@ void server_destroy(const Server server)
 
 void server_shutdown(const Server server)
 {
-  server->shutdown_requested = TRUE;
+  mutex_lock(server->mutex);
+  if (!server_shutdown_requested(server))
+    {
+      __atomic_store_n(&server->shutdown_requested, TRUE, __ATOMIC_RELEASE);
+      /* Acceptors blocked in accept() get EINVAL. */
+      for (size_t i = 0; i < server->listen_count; ++i)
+        shutdown(server->listen_fds[i], SHUT_RD);
+      /* Requests received already are still served; then the
+         connections read EOF and close. */
+      for (Client client = server->head; client; client = client->next_client)
+        shutdown(client->conn_fd, SHUT_RD);
+    }
+  condition_broadcast(server->condition);
+  mutex_unlock(server->mutex);
+  workers_wake_all(server);
+  event_loops_wake(server);
+  urings_wake(server);
+  timers_wake(server);
 }
 
 Boolean server_shutdown_requested(const Server server)
 {
-  return server->shutdown_requested;
+  return __atomic_load_n(&server->shutdown_requested, __ATOMIC_ACQUIRE);
+}
+
+Boolean server_drain_expired(const Server server)
+{
+  return __atomic_load_n(&server->drain_expired, __ATOMIC_ACQUIRE);
+}
+
+size_t accept_shard_next(const AcceptShard shard, const size_t members)
+{
+  /* With fewer members than shards, shards share them. */
+  if (members <= shard->shards)
+    return shard->shard % members;
+  const size_t slots =
+    (members - shard->shard + shard->shards - 1) / shard->shards;
+  return shard->shard + shard->shards * (shard->next++ % slots);
+}
+
+static Boolean server_accept_sharded(const Server server, const int conn_fd,
+                                     const AcceptShard shard,
+                                     char ** const errors_ret)
+{
+  DEBUG(("Got connection"));
+  if (server_shutdown_requested(server))
+    {
+      *errors_ret = xstrdup("Server is shutting down");
+      return FALSE;
+    }
+  const Client client = client_create(conn_fd, NULL);
+
+  if (server->engine != SERVER_ENGINE_THREADS)
+    {
+      mutex_lock(server->mutex);
+      server_register_client(server, client);
+      mutex_unlock(server->mutex);
+      if (!(server->engine == SERVER_ENGINE_EPOLL ?
+            event_loop_add_client(server, client, shard) :
+            uring_add_client(server, client, shard)))
+        {
+          *errors_ret = string_format("Failed to hand over connection: %m");
+          server_destroy_client(server, client);
+          /* The caller closes the descriptor. */
+          client->conn_fd = -1;
+          client_destroy(client);
+          return FALSE;
+        }
+      return TRUE;
+    }
+
+  mutex_lock(server->mutex);
+  server_register_client(server, client);
+  mutex_unlock(server->mutex);
+  if (!workers_dispatch(server, client, shard, errors_ret))
+    {
+      server_destroy_client(server, client);
+      client->conn_fd = -1;
+      client_destroy(client);
+      return FALSE;
+    }
+  return TRUE;
 }
 
 /* Create a Client object, append it to the list of running jobs, start
@@ -132,24 +431,210 @@ Boolean server_accept_connection(
     const int conn_fd,
     char ** const errors_ret
 ) {
-  /* STUB IMPLEMENTATION, DOES NOT SATISFY REQUIREMENTS. */
-  DEBUG(("Got connection"));
-  const Client client = client_create(conn_fd, NULL);
+  return server_accept_sharded(server, conn_fd, NULL, errors_ret);
+}
+
+void server_get_pool_stats(const Server server, const ServerPoolStats stats_ret)
+{
+  /* The counters move without the lock; this is a best-effort view. */
+  stats_ret->pool_size = __atomic_load_n(&server->pool_size, __ATOMIC_RELAXED);
+  stats_ret->busy = __atomic_load_n(&server->busy, __ATOMIC_RELAXED);
+  stats_ret->queued = __atomic_load_n(&server->queued, __ATOMIC_RELAXED);
+  stats_ret->rejected = __atomic_load_n(&server->rejected, __ATOMIC_RELAXED);
+  stats_ret->dropped = __atomic_load_n(&server->dropped, __ATOMIC_RELAXED);
+  stats_ret->shed = __atomic_load_n(&server->shed, __ATOMIC_RELAXED);
+  stats_ret->overloaded = __atomic_load_n(&server->overloaded,
+                                          __ATOMIC_RELAXED);
+  const uint64_t count = __atomic_load_n(&server->queue_delay_count,
+                                         __ATOMIC_RELAXED);
+  stats_ret->queue_delay_mean_us = count ?
+    __atomic_load_n(&server->queue_delay_total_ns, __ATOMIC_RELAXED) /
+    count / 1000 : 0;
+  stats_ret->queue_delay_max_us =
+    __atomic_load_n(&server->queue_delay_max_ns, __ATOMIC_RELAXED) / 1000;
+}
+
+void server_get_accept_stats(const Server server,
+                             const ServerAcceptStats stats_ret)
+{
+  stats_ret->accepted = __atomic_load_n(&server->accept_count,
+                                        __ATOMIC_RELAXED);
+  stats_ret->shed = __atomic_load_n(&server->accept_shed, __ATOMIC_RELAXED);
+}
+
+ServerEngine server_engine(const Server server)
+{
+  return server->engine;
+}
+
+/* Connections an acceptor takes per wakeup before it checks for
+   shutdown again. */
+#define ACCEPT_BATCH 64
+
+/* Pause bounds while the process is out of descriptors or memory. */
+#define ACCEPT_BACKOFF_MIN_MS 1
+#define ACCEPT_BACKOFF_MAX_MS 100
+
+/* Out of descriptors: accept the oldest pending connection on the
+   reserve descriptor and close it at once, so its client hears about
+   it instead of waiting in the backlog. */
+static void server_accept_shed(const Server server, const int listen_fd,
+                               int * const reserve_fd)
+{
+  if (*reserve_fd >= 0)
+    close(*reserve_fd);
+  const int conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (conn_fd >= 0)
+    {
+      __atomic_add_fetch(&server->accept_shed, 1, __ATOMIC_RELAXED);
+      close(conn_fd);
+    }
+  /* Another thread may take the slot first; retry on the next
+     shortage. */
+  *reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* Drain `listen_fd' a batch at a time.  Only the threads engine reads
+   with blocking calls; the others get non-blocking connections
+   straight from accept4(). */
+static void server_accept_loop(const Server server, const int listen_fd,
+                               const AcceptShard shard)
+{
+  const int accept_flags = SOCK_CLOEXEC |
+    (server->engine == SERVER_ENGINE_THREADS ? 0 : SOCK_NONBLOCK);
+  struct pollfd pollfd = { .fd = listen_fd, .events = POLLIN };
+  const int flags = fcntl(listen_fd, F_GETFL);
+  int reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  int backoff_ms = 0;
+
+  if (flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    warning("Failed to make the listener non-blocking: %m");
+
+  while (!server_shutdown_requested(server))
+    {
+      if (backoff_ms)
+        poll(NULL, 0, backoff_ms);
+      else if (poll(&pollfd, 1, -1) < 0 && errno != EINTR)
+        {
+          warning("Failed to poll the listener: %m");
+          break;
+        }
+
+      for (int i = 0; i < ACCEPT_BATCH; ++i)
+        {
+          char *errors = NULL;
+          const int conn_fd = accept4(listen_fd, NULL, NULL, accept_flags);
+
+          if (server_shutdown_requested(server))
+            {
+              if (conn_fd >= 0)
+                close(conn_fd);
+              break;
+            }
+          if (conn_fd < 0)
+            {
+              const int error = errno;
+              if (error == EINTR || error == ECONNABORTED)
+                continue;
+              if (error == EAGAIN || error == EWOULDBLOCK)
+                {
+                  backoff_ms = 0;
+                  break;
+                }
+              /* Warn once per shortage, not once per attempt. */
+              if (!backoff_ms)
+                warning("Failed to low-level accept(): %s", strerror(error));
+              if (error == EMFILE || error == ENFILE)
+                server_accept_shed(server, listen_fd, &reserve_fd);
+              backoff_ms = backoff_ms ? backoff_ms * 2 : ACCEPT_BACKOFF_MIN_MS;
+              if (backoff_ms > ACCEPT_BACKOFF_MAX_MS)
+                backoff_ms = ACCEPT_BACKOFF_MAX_MS;
+              break;
+            }
+
+          backoff_ms = 0;
+          __atomic_add_fetch(&server->accept_count, 1, __ATOMIC_RELAXED);
+          if (!server_accept_sharded(server, conn_fd, shard, &errors))
+            {
+              warning("Failed to accept connection: %s", errors);
+              close(conn_fd);
+            }
+          xfree(errors);
+        }
+    }
+
+  if (reserve_fd >= 0)
+    close(reserve_fd);
+}
+
+typedef struct AcceptorRec
+{
+  Server server;
+  int listen_fd;
+  AcceptShardStruct shard[1];
+} AcceptorStruct, *Acceptor;
+
+static void *acceptor_thread(void *context)
+{
+  const Acceptor acceptor = context;
+  const Server server = acceptor->server;
+
+  server_accept_loop(server, acceptor->listen_fd, acceptor->shard);
   mutex_lock(server->mutex);
-  assert(!server->connections == !server->head &&
-    !server->connections == !server->tail &&
-    (server->connections <= server->pool_size || server->next)
-  );
-  if (server->connections)
-    server->tail = server->tail->next_client = client;
-  else
-    server->head = server->tail = client;
-  if (!server->next)
-    server->next = client;
-  ++server->connections;
-  condition_signal(server->condition);
+  --server->acceptors;
+  condition_broadcast(server->condition);
   mutex_unlock(server->mutex);
-  return TRUE;
+  return NULL;
+}
+
+void server_serve_sharded(const Server server, const int * const listen_fds,
+                          const size_t count)
+{
+  if (server->engine == SERVER_ENGINE_URING && count <= server->ring_count)
+    {
+      /* The rings accept on their own, each on its listener. */
+      urings_listen(server, listen_fds, count);
+      mutex_lock(server->mutex);
+      while (!server_shutdown_requested(server))
+        condition_wait(server->condition, server->mutex);
+      mutex_unlock(server->mutex);
+      return;
+    }
+
+  const Acceptor acceptors = xcalloc(count, sizeof(AcceptorStruct));
+  mutex_lock(server->mutex);
+  server->listen_fds = listen_fds;
+  server->listen_count = count;
+  for (size_t i = 0; i < count && !server_shutdown_requested(server); ++i)
+    {
+      acceptors[i].server = server;
+      acceptors[i].listen_fd = listen_fds[i];
+      acceptors[i].shard->shard = i;
+      acceptors[i].shard->shards = count;
+      /* The calling thread serves the first listener. */
+      if (!i)
+        continue;
+      if (thread_create(acceptor_thread, &acceptors[i]))
+        ++server->acceptors;
+      else
+        warning("Failed to start acceptor for listener %zu", i);
+    }
+  mutex_unlock(server->mutex);
+
+  server_accept_loop(server, listen_fds[0], acceptors[0].shard);
+
+  mutex_lock(server->mutex);
+  while (server->acceptors)
+    condition_wait(server->condition, server->mutex);
+  server->listen_fds = NULL;
+  server->listen_count = 0;
+  mutex_unlock(server->mutex);
+  xfree(acceptors);
+}
+
+void server_serve(const Server server, const int listen_fd)
+{
+  server_serve_sharded(server, &listen_fd, 1);
 }
 
 /* Functions used to communicate by default. */
@@ -161,17 +646,85 @@ int client_default_read(Client client, char *buf, size_t bytes, void *context)
 Boolean client_default_write(Client client, char *buf, size_t bytes,
                              void *context)
 {
-  int written_bytes = write(client->conn_fd, buf, bytes);
-  fsync(client->conn_fd);
-  return bytes == written_bytes;
+  while (bytes)
+    {
+      const ssize_t written_bytes = write(client->conn_fd, buf, bytes);
+      if (written_bytes < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      buf += written_bytes;
+      bytes -= written_bytes;
+    }
+  return TRUE;
+}
+
+ssize_t client_default_writev(Client client, const struct iovec *iov,
+                              int iovcnt, void *context)
+{
+  const ssize_t ret = writev(client->conn_fd, iov, iovcnt);
+  return ret < 0 ? -errno : ret;
+}
+
+/* Vectored write on top of a plain client_write hook: gather the vectors
+   into one buffer so the hook sees a single call. */
+static ssize_t client_gather_writev(Client client, const struct iovec *iov,
+                                    int iovcnt, void *context)
+{
+  size_t bytes = 0, offset = 0;
+  for (int i = 0; i < iovcnt; ++i)
+    bytes += iov[i].iov_len;
+
+  /* Released with the replies once they are all sent. */
+  char * const buf = arena_calloc(client->arena, 1, bytes + 1);
+  for (int i = 0; i < iovcnt; ++i)
+    {
+      memcpy(&buf[offset], iov[i].iov_base, iov[i].iov_len);
+      offset += iov[i].iov_len;
+    }
+  const Boolean success = client->write(client, buf, bytes,
+                                        client->write_context);
+  return success ? (ssize_t) bytes : -EIO;
+}
+
+/* Client objects come from a process-wide slab pool; connection storms
+   then recycle them through thread caches instead of malloc(). */
+static ObjectPool client_pool_instance;
+static pthread_once_t client_pool_once = PTHREAD_ONCE_INIT;
+
+static void client_pool_init(void)
+{
+  client_pool_instance = object_pool_create(sizeof(ClientStruct),
+                                            CLIENT_SLAB_OBJECTS,
+                                            CLIENT_POOL_BATCH);
+}
+
+static ObjectPool client_pool(void)
+{
+  pthread_once(&client_pool_once, client_pool_init);
+  return client_pool_instance;
+}
+
+void client_get_allocation_stats(const ObjectPoolStats stats_ret)
+{
+  object_pool_get_stats(client_pool(), stats_ret);
+}
+
+Arena client_arena(const Client client)
+{
+  return client->arena;
 }
 
 Client client_create(int conn_fd, ClientCreateParams params)
 {
-  Client client = xcalloc(1, sizeof(*client));
+  Client client = object_pool_alloc(client_pool());
   client->conn_fd = conn_fd;
+  client->arena = arena_create(CLIENT_ARENA_BLOCK_SIZE);
   client->read = client_default_read;
   client->write = client_default_write;
+  client->writev = client_default_writev;
 
   if (params)
     {
@@ -185,6 +738,13 @@ Client client_create(int conn_fd, ClientCreateParams params)
         {
           client->write = params->client_write;
           client->write_context = params->client_write_context;
+          client->writev = client_gather_writev;
+        }
+
+      if (params->client_writev)
+        {
+          client->writev = params->client_writev;
+          client->writev_context = params->client_writev_context;
         }
     }
   return client;
@@ -197,7 +757,9 @@ void client_destroy(Client client)
 
   if (client->conn_fd >= 0)
     close(client->conn_fd);
-  xfree(client);
+  arena_destroy(client->arena);
+  xfree(client->vadd_a);
+  object_pool_free(client_pool(), client);
 }
 
 /* Convenience wrappers. */
@@ -211,79 +773,788 @@ int client_write(Client client, char *buf, size_t bytes)
   return client->write(client, buf, bytes, client->write_context);
 }
 
+ssize_t client_writev(Client client, const struct iovec *iov, int iovcnt)
+{
+  return client->writev(client, iov, iovcnt, client->writev_context);
+}
+
+/* Op table. */
+
+/* The op table doubles until every op lands in its own slot; this
+   bounds the search. */
+#define SERVER_OP_TABLE_MIN 16
+#define SERVER_OP_TABLE_MAX 4096
+
+/* FNV-1a. */
+static uint32_t server_op_hash(const char * const name, const int length)
+{
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; ++i)
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  return hash;
+}
+
+ServerOp server_find_op(const Server server, const char * const name,
+                        const int length)
+{
+  if (!server->ops)
+    return NULL;
+  const ServerOp op = &server->ops[server_op_hash(name, length) &
+                                   server->op_mask];
+  if (op->handler && op->length == length && !memcmp(op->name, name, length))
+    return op;
+  return NULL;
+}
+
+Boolean server_register_op(const Server server, const char * const name,
+                           const ServerOpHandler handler)
+{
+  const size_t length = strlen(name);
+  if (!length || length > REQUEST_FIELD_MAX || !handler)
+    return FALSE;
+
+  const ServerOp existing = server_find_op(server, name, length);
+  if (existing)
+    {
+      existing->handler = handler;
+      return TRUE;
+    }
+
+  /* Rebuild the table with the new op, at the smallest size without
+     collisions. */
+  const size_t old_size = server->ops ? server->op_mask + 1 : 0;
+  for (size_t size = old_size ? old_size : SERVER_OP_TABLE_MIN;
+       size <= SERVER_OP_TABLE_MAX; size *= 2)
+    {
+      const ServerOp ops = xcalloc(size, sizeof(*ops));
+      Boolean collision = FALSE;
+      struct ServerOpRec added = { { 0 } };
+
+      memcpy(added.name, name, length);
+      added.length = length;
+      added.index = server->op_count;
+      added.handler = handler;
+      for (size_t i = 0; i <= old_size && !collision; ++i)
+        {
+          const ServerOp op = i < old_size ? &server->ops[i] : &added;
+          if (!op->handler)
+            continue;
+          const ServerOp slot =
+            &ops[server_op_hash(op->name, op->length) & (size - 1)];
+          if (slot->handler)
+            collision = TRUE;
+          else
+            *slot = *op;
+        }
+      if (!collision)
+        {
+          xfree(server->ops);
+          server->ops = ops;
+          server->op_mask = size - 1;
+          ++server->op_count;
+          return TRUE;
+        }
+      xfree(ops);
+    }
+  return FALSE;
+}
+
+/* Request parsing. */
+
+/* Scan the field starting at the first non-space at or after `p'.
+   Returns the end of the field. */
+static const char *request_field_scan(const char *p, const RequestField field)
+{
+  while (isspace((unsigned char) *p))
+    ++p;
+  field->start = p;
+  while (*p && !isspace((unsigned char) *p) &&
+         p - field->start < REQUEST_FIELD_MAX)
+    ++p;
+  field->length = p - field->start;
+  return p;
+}
+
+/* Split `line' into its four fields in one pass, without copying.
+   Returns FALSE if fewer than four are present. */
+static Boolean request_parse(const char *line, const Request request)
+{
+  line = request_field_scan(line, &request->param);
+  line = request_field_scan(line, &request->op);
+  line = request_field_scan(line, &request->arg1);
+  request_field_scan(line, &request->arg2);
+  return request->arg2.length > 0;
+}
+
+Boolean request_field_int(const RequestField field, int * const value_ret)
+{
+  const char *p = field->start, * const end = p + field->length;
+  const Boolean negative = p < end && *p == '-';
+  long long value = 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    ++p;
+  /* Like atoi(), parsing stops at the first non-digit. */
+  for (; p < end && *p >= '0' && *p <= '9'; ++p)
+    {
+      value = value * 10 + (*p - '0');
+      if (value > (long long) INT_MAX + 1)
+        return FALSE;
+    }
+  if (negative)
+    value = -value;
+  if (value > INT_MAX)
+    return FALSE;
+  *value_ret = value;
+  return TRUE;
+}
+
+/* Built-in ops. */
+
+static Boolean server_op_add(Server server, Client client, Request request,
+                             char **reply_ret, char **errors_ret)
+{
+  int num1, num2;
+  if (!request_field_int(&request->arg1, &num1) ||
+      !request_field_int(&request->arg2, &num2))
+    {
+      *errors_ret = arena_strdup(client->arena, "Failed to parse line");
+      return FALSE;
+    }
+  *reply_ret = arena_string_format(
+                 client->arena, "%.*s %.*s %.*s %.*s = %lld",
+                 request->param.length, request->param.start,
+                 request->op.length, request->op.start,
+                 request->arg1.length, request->arg1.start,
+                 request->arg2.length, request->arg2.start,
+                 (long long) num1 + num2);
+  return TRUE;
+}
+
+/* LIST <offset> <count>: the registry size followed by up to `count'
+   descriptors from `offset' on, all of them for 0. */
+static Boolean server_op_list(Server server, Client client, Request request,
+                              char **reply_ret, char **errors_ret)
+{
+  int offset, count;
+  if (!request_field_int(&request->arg1, &offset) ||
+      !request_field_int(&request->arg2, &count) ||
+      offset < 0 || count < 0)
+    {
+      *errors_ret = arena_strdup(client->arena, "Invalid LIST range");
+      return FALSE;
+    }
+
+  size_t epoch;
+  const RegistrySnapshot snapshot = registry_snapshot_acquire(server, &epoch);
+  if (snapshot && snapshot->count)
+    *reply_ret = registry_snapshot_format(client->arena, snapshot, TRUE,
+                                          offset,
+                                          count ? count : snapshot->count);
+  registry_snapshot_release(server, epoch);
+  return TRUE;
+}
+
+/* LISTSTREAM <chunk> <ignored>: the registry size, then lines of up to
+   `chunk' descriptors, then an empty line.  Chunks are cut as the
+   output queue drains, so the whole listing is never held in
+   memory. */
+static Boolean server_op_liststream(Server server, Client client,
+                                    Request request, char **reply_ret,
+                                    char **errors_ret)
+{
+  int chunk;
+  if (!request_field_int(&request->arg1, &chunk) || chunk < 0)
+    {
+      *errors_ret = arena_strdup(client->arena,
+                                 "Invalid LISTSTREAM chunk size");
+      return FALSE;
+    }
+  *reply_ret = arena_string_format(client->arena, "%zu",
+                                   __atomic_load_n(&server->connections,
+                                                   __ATOMIC_RELAXED));
+  client->list_stream = TRUE;
+  client->list_stream_offset = 0;
+  client->list_stream_chunk = chunk ? chunk : LIST_STREAM_CHUNK;
+  return TRUE;
+}
+
+/* VADD <count> <ignored>: each of the next `count' lines carries one
+   operand pair, and a single reply lists all the sums once the last
+   pair is in.  The pairs are parsed into vectors and added in one
+   pass. */
+static Boolean server_op_vadd(Server server, Client client, Request request,
+                              char **reply_ret, char **errors_ret)
+{
+  int count;
+  if (!request_field_int(&request->arg1, &count) || count <= 0 ||
+      count > CLIENT_VADD_MAX)
+    {
+      *errors_ret = arena_strdup(client->arena, "Invalid VADD count");
+      return FALSE;
+    }
+
+  if (count > client->vadd_capacity)
+    {
+      size_t capacity = client->vadd_capacity ? client->vadd_capacity : 64;
+      while (capacity < count)
+        capacity *= 2;
+      xfree(client->vadd_a);
+      client->vadd_a = xcalloc(3 * capacity, sizeof(int32_t));
+      client->vadd_b = client->vadd_a + capacity;
+      client->vadd_sum = client->vadd_b + capacity;
+      client->vadd_capacity = capacity;
+    }
+  snprintf(client->vadd_prefix, sizeof(client->vadd_prefix),
+           "%.*s %.*s %.*s %.*s =",
+           request->param.length, request->param.start,
+           request->op.length, request->op.start,
+           request->arg1.length, request->arg1.start,
+           request->arg2.length, request->arg2.start);
+  client->vadd_count = count;
+  client->vadd_filled = 0;
+  return TRUE;
+}
+
+static Boolean server_op_shutdown(Server server, Client client,
+                                  Request request, char **reply_ret,
+                                  char **errors_ret)
+{
+  *reply_ret = arena_string_format(client->arena, "%.*s %.*s = %zu",
+                                   request->param.length,
+                                   request->param.start,
+                                   request->op.length, request->op.start,
+                                   __atomic_load_n(&server->connections,
+                                                   __ATOMIC_RELAXED));
+  server_shutdown(server);
+  return TRUE;
+}
+
+/* STATS <format> <ignored>: with format 0, the counters and latency
+   percentiles in one line of name=value pairs, latencies in
+   nanoseconds; with 1, server_format_metrics() followed by an empty
+   line. */
+static Boolean server_op_stats(Server server, Client client, Request request,
+                               char **reply_ret, char **errors_ret)
+{
+  int format;
+  if (!request_field_int(&request->arg1, &format) || format < 0 ||
+      format > 1)
+    {
+      *errors_ret = arena_strdup(client->arena, "Invalid STATS format");
+      return FALSE;
+    }
+  if (format)
+    {
+      char * const text = server_format_metrics(server);
+      *reply_ret = arena_strdup(client->arena, text);
+      xfree(text);
+      return TRUE;
+    }
+
+  static const char * const latencies[SERVER_LATENCY_COUNT] =
+    { "queue_wait", "process", "request" };
+  /* Room for every name and full-width value after the echoed
+     request. */
+#define STATS_REPLY_WIDTH 1024
+  const ServerMetrics metrics = arena_calloc(client->arena, 1,
+                                             sizeof(*metrics));
+  server_get_metrics(server, metrics);
+
+  const size_t size = request->param.length + request->op.length +
+    STATS_REPLY_WIDTH;
+  char * const reply = arena_calloc(client->arena, 1, size);
+  char *end = reply;
+
+  end += snprintf(
+    end, size, "%.*s %.*s = connections=%zu accepted=%llu closed=%llu "
+    "requests=%llu errors=%llu bytes_in=%llu bytes_out=%llu",
+    request->param.length, request->param.start,
+    request->op.length, request->op.start,
+    __atomic_load_n(&server->connections, __ATOMIC_RELAXED),
+    (unsigned long long) metrics->counters[SERVER_COUNTER_ACCEPTED],
+    (unsigned long long) metrics->counters[SERVER_COUNTER_CLOSED],
+    (unsigned long long) metrics->counters[SERVER_COUNTER_REQUESTS],
+    (unsigned long long) metrics->counters[SERVER_COUNTER_ERRORS],
+    (unsigned long long) metrics->counters[SERVER_COUNTER_BYTES_IN],
+    (unsigned long long) metrics->counters[SERVER_COUNTER_BYTES_OUT]);
+  for (int i = 0; i < SERVER_LATENCY_COUNT; ++i)
+    {
+      const Histogram histogram = &metrics->latencies[i];
+      end += snprintf(
+        end, size - (end - reply),
+        " %s_p50_ns=%llu %s_p99_ns=%llu %s_max_ns=%llu", latencies[i],
+        (unsigned long long) histogram_percentile(histogram, 0.5),
+        latencies[i],
+        (unsigned long long) histogram_percentile(histogram, 0.99),
+        latencies[i], (unsigned long long) histogram->max);
+    }
+  *reply_ret = reply;
+  return TRUE;
+}
+
+/* TRACE <mode> <ignored>: mode 0 turns tracing off and 1 on, replying
+   with the new state; 2 replies with server_format_trace(). */
+static Boolean server_op_trace(Server server, Client client, Request request,
+                               char **reply_ret, char **errors_ret)
+{
+  int mode;
+  if (!request_field_int(&request->arg1, &mode) || mode < 0 || mode > 2)
+    {
+      *errors_ret = arena_strdup(client->arena, "Invalid TRACE mode");
+      return FALSE;
+    }
+  if (mode == 2)
+    {
+      char * const text = server_format_trace(server);
+      *reply_ret = arena_strdup(client->arena, text);
+      xfree(text);
+      return TRUE;
+    }
+  server_set_tracing(server, mode);
+  *reply_ret = arena_string_format(client->arena, "%d", mode);
+  return TRUE;
+}
+
+/* LOCKS <ignored> <ignored>: lock_profile_format() followed by an empty
+   line, where lock profiling is compiled in. */
+static Boolean server_op_locks(Server server, Client client, Request request,
+                               char **reply_ret, char **errors_ret)
+{
+#ifdef CSERVER_LOCK_PROFILE
+  char * const text = lock_profile_format();
+  *reply_ret = arena_strdup(client->arena, text);
+  xfree(text);
+  return TRUE;
+#else
+  *errors_ret = arena_strdup(client->arena, "Lock profiling is compiled "
+                             "out, build with LOCK_PROFILE=1");
+  return FALSE;
+#endif
+}
+
+static Boolean server_op_numclients(Server server, Client client,
+                                    Request request, char **reply_ret,
+                                    char **errors_ret)
+{
+  *reply_ret = arena_string_format(client->arena, "%zu",
+                                   __atomic_load_n(&server->connections,
+                                                   __ATOMIC_RELAXED));
+  return TRUE;
+}
+
+static void server_register_builtin_ops(const Server server,
+                                        const ServerCreateParams params)
+{
+  if (!server_register_op(server, "+", server_op_add) ||
+      !server_register_op(server, "LIST", server_op_list) ||
+      !server_register_op(server, "LISTSTREAM", server_op_liststream) ||
+      !server_register_op(server, "NUMCLIENTS", server_op_numclients) ||
+      !server_register_op(server, "VADD", server_op_vadd) ||
+      !server_register_op(server, "STATS", server_op_stats) ||
+      !server_register_op(server, "TRACE", server_op_trace) ||
+      !server_register_op(server, "LOCKS", server_op_locks) ||
+      (params && params->shutdown_op &&
+       !server_register_op(server, "SHUTDOWN", server_op_shutdown)))
+    fatal("Failed to register the built-in ops");
+}
+
 /* This will process the request.  The process function may be replaced
    with a function with similar semantics, but which will delay, wait
    for certain conditions, allocate huge amounts of memory, etc. */
 Boolean process_line(Server server, Client client,
                      const char *line, char **reply_ret, char **errors_ret)
 {
-#define FIELD_WIDTH 20
-  char param[FIELD_WIDTH], op[FIELD_WIDTH], arg1[FIELD_WIDTH],
-    arg2[FIELD_WIDTH];
+  RequestStruct request[1];
   DEBUG(("Processing line: %s", line));
 
-  int ret = sscanf(line, "%19s %19s %19s %19s",
-                   param,
-                   op,
-                   arg1,
-                   arg2);
-  if (ret != 4)
+  if (!request_parse(line, request))
     {
-      *errors_ret = xstrdup("Failed to parse line");
+      *errors_ret = arena_strdup(client->arena, "Failed to parse line");
       return FALSE;
     }
 
-  if (!strcmp(op, "+"))
+  const ServerOp op = server_find_op(server, request->op.start,
+                                     request->op.length);
+  if (!op)
     {
-      int num1 = atoi(arg1);
-      int num2 = atoi(arg2);
-      *reply_ret = string_format(
-                     "%s %s %s %s = %d", param, op, arg1, arg2,
-                     num1 + num2);
+      *errors_ret = arena_strdup(client->arena, "unknown op");
+      return FALSE;
     }
-  else if (!strcmp(op, "LIST"))
+  const uint64_t start = clock_monotonic_ns();
+  const Boolean success = op->handler(server, client, request, reply_ret,
+                                      errors_ret);
+  const uint64_t end = clock_monotonic_ns();
+  metrics_request(server, client, op, end - start);
+  TRACE_SPAN(server, TRACE_PROCESS, client->conn_fd, start, end, op);
+  return success;
+}
+
+size_t client_input_space(const Client client, char ** const space_ret)
+{
+  if (client->input_start == client->input_end)
+    client->input_start = client->input_scan = client->input_end = 0;
+  else if (client->input_end == sizeof(client->input))
     {
-      mutex_lock(server->mutex);
-      if (server->connections) {
-        *reply_ret = string_format("%d", server->connections);
-        for (Client current = server->head;
-          current; current = current->next_client
-        ) {
-          char * const new_string =
-            string_format("%s %d", *reply_ret, current->conn_fd);
-          xfree(*reply_ret);
-          *reply_ret = new_string;
+      /* Move the partial line to the front to make room. */
+      const size_t pending = client->input_end - client->input_start;
+      memmove(client->input, &client->input[client->input_start], pending);
+      client->input_scan -= client->input_start;
+      client->input_start = 0;
+      client->input_end = pending;
+    }
+
+  *space_ret = &client->input[client->input_end];
+  return sizeof(client->input) - client->input_end;
+}
+
+void client_input_commit(const Client client, const size_t bytes)
+{
+  assert(client->input_end + bytes <= sizeof(client->input));
+  client->input_end += bytes;
+  if (client->server)
+    {
+      client->metrics_read_ns = clock_monotonic_ns();
+      metrics_count(client->server, SERVER_COUNTER_BYTES_IN, bytes);
+    }
+}
+
+int client_fill_input(const Client client)
+{
+  char *space;
+  const size_t bytes = client_input_space(client, &space);
+  const uint64_t trace_start = TRACE_BEGIN(client->server);
+  const int ret = client_read(client, space, bytes);
+  TRACE_END(client->server, TRACE_READ, client->conn_fd, trace_start, NULL);
+  if (ret > 0)
+    client_input_commit(client, ret);
+  return ret;
+}
+
+/* Return the next complete line from the input buffer with the newline
+   replaced by a NUL, or NULL if no complete line is buffered.  The line
+   stays valid until the next client_fill_input().  `too_long_ret' is set
+   if the pending data cannot form a line of at most CLIENT_MAX_LINE
+   bytes. */
+static char *client_next_line(const Client client, Boolean * const too_long_ret)
+{
+  char * const start = &client->input[client->input_start];
+  char * const newline = memchr(&client->input[client->input_scan], '\n',
+                                client->input_end - client->input_scan);
+  if (!newline)
+    {
+      client->input_scan = client->input_end;
+      *too_long_ret =
+        client->input_end - client->input_start >= CLIENT_MAX_LINE - 1;
+      return NULL;
+    }
+  if (newline - start >= CLIENT_MAX_LINE - 1)
+    {
+      *too_long_ret = TRUE;
+      return NULL;
+    }
+
+  *newline = '\0';
+  client->input_start = client->input_scan = newline - client->input + 1;
+  return start;
+}
+
+/* Append `reply' to the output queue.  It must stay valid until the
+   queue is flushed, as arena memory does. */
+static void client_queue_reply(const Client client, const char * const reply)
+{
+  static char newline[] = "\n";
+
+  assert(client->output_count + 2 <= CLIENT_OUTPUT_QUEUE_SIZE);
+  client->output[client->output_count].iov_base = (char *) reply;
+  client->output[client->output_count++].iov_len = strlen(reply);
+  client->output[client->output_count].iov_base = newline;
+  client->output[client->output_count++].iov_len = 1;
+}
+
+void client_queue_output(const Client client, const char * const data,
+                         const size_t bytes)
+{
+  if (client->output_count > client->output_head)
+    {
+      struct iovec * const last = &client->output[client->output_count - 1];
+      if ((const char *) last->iov_base + last->iov_len == data)
+        {
+          last->iov_len += bytes;
+          return;
         }
-      }
-      mutex_unlock(server->mutex);
     }
-  else if (!strcmp(op, "NUMCLIENTS"))
+  assert(client->output_count < CLIENT_OUTPUT_QUEUE_SIZE);
+  client->output[client->output_count].iov_base = (char *) data;
+  client->output[client->output_count++].iov_len = bytes;
+}
+
+/* Drop the output queue and the request memory behind it. */
+static void client_clear_output(const Client client)
+{
+  client->output_head = client->output_count = 0;
+  arena_reset(client->arena);
+}
+
+Boolean client_output_full(const Client client)
+{
+  return client->output_count + 2 > CLIENT_OUTPUT_QUEUE_SIZE;
+}
+
+Boolean client_output_pending(const Client client)
+{
+  return client->output_head < client->output_count;
+}
+
+Boolean client_input_pending(const Client client)
+{
+  return client->input_start != client->input_end;
+}
+
+void client_output_advance(const Client client, size_t written)
+{
+  if (client->server && written)
+    metrics_count(client->server, SERVER_COUNTER_BYTES_OUT, written);
+
+  /* Skip fully written vectors and trim a partially written one. */
+  while (client->output_head < client->output_count &&
+         written >= client->output[client->output_head].iov_len)
+    written -= client->output[client->output_head++].iov_len;
+  if (written)
     {
-      mutex_lock(server->mutex);
-      *reply_ret = string_format("%d", server->connections);
-      mutex_unlock(server->mutex);
+      struct iovec * const iov = &client->output[client->output_head];
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+
+  if (client->output_head == client->output_count)
+    {
+      /* Time the requests answered since the queue was last empty
+         from the last read, which completed the latest of them. */
+      if (client->server && client->metrics_requests)
+        metrics_record(client->server, SERVER_LATENCY_REQUEST,
+                       clock_monotonic_ns() - client->metrics_read_ns,
+                       client->metrics_requests);
+      client->metrics_requests = 0;
+      client_clear_output(client);
+    }
+}
+
+Boolean client_flush_output(const Client client)
+{
+  const uint64_t trace_start = client_output_pending(client) ?
+    TRACE_BEGIN(client->server) : 0;
+  Boolean success = TRUE;
+
+  while (client->output_head < client->output_count)
+    {
+      const ssize_t ret =
+        client_writev(client, &client->output[client->output_head],
+                      client->output_count - client->output_head);
+      if (ret == -EINTR)
+        continue;
+      /* Writing nothing would never make progress. */
+      if (ret <= 0)
+        {
+          if (ret != -EAGAIN && ret != -EWOULDBLOCK)
+            success = FALSE;
+          break;
+        }
+
+      client_output_advance(client, ret);
+    }
+  TRACE_END(client->server, TRACE_WRITE, client->conn_fd, trace_start,
+            NULL);
+  return success;
+}
+
+/* Process one request line and queue the reply. */
+static Boolean communicate_line(const Server server, const Client client,
+                                const char * const line)
+{
+  Boolean success;
+  char *errors = NULL, *reply = NULL;
+
+  success = process_line(server, client, line, &reply, &errors);
+  DEBUG(("Processing done: status: %d, reply: %s, errors: %s",
+         success, reply, errors));
+  if (!success)
+    {
+      warning("processing failed: %s", errors);
+      return FALSE;
+    }
+  /* A VADD replies once its operand lines are in. */
+  if (!client->vadd_count)
+    client_queue_reply(client, reply ? reply : "");
+  DEBUG(("Client request processed"));
+  return TRUE;
+}
+
+/* Queue the next chunk of a LISTSTREAM reply, or the empty line ending
+   it.  Each chunk is cut from the current registry snapshot. */
+static void client_list_stream_next(const Server server, const Client client)
+{
+  size_t epoch;
+  const RegistrySnapshot snapshot = registry_snapshot_acquire(server, &epoch);
+
+  if (!snapshot || client->list_stream_offset >= snapshot->count)
+    {
+      client_queue_reply(client, "");
+      client->list_stream = FALSE;
     }
   else
     {
-      *errors_ret = xstrdup("unknown op");
+      client_queue_reply(client,
+                         registry_snapshot_format(client->arena, snapshot,
+                                                  FALSE,
+                                                  client->list_stream_offset,
+                                                  client->list_stream_chunk));
+      client->list_stream_offset += client->list_stream_chunk;
+    }
+  registry_snapshot_release(server, epoch);
+}
+
+/* Parse one whitespace-delimited VADD operand at `*p'. */
+static Boolean client_vadd_operand(const char **p, const char * const end,
+                                   int32_t * const value_ret)
+{
+  const char *q = *p;
+
+  while (q < end && isspace((unsigned char) *q))
+    ++q;
+  q = decimal_parse_i32(q, end, value_ret);
+  if (!q || (q < end && !isspace((unsigned char) *q)))
+    return FALSE;
+  *p = q;
+  return TRUE;
+}
+
+/* Take one VADD operand line, and queue the reply after the last. */
+static Boolean client_vadd_line(const Client client, const char * const line)
+{
+  const char *p = line, * const end = line + strlen(line);
+  const size_t i = client->vadd_filled;
+
+  if (!client_vadd_operand(&p, end, &client->vadd_a[i]) ||
+      !client_vadd_operand(&p, end, &client->vadd_b[i]))
+    {
+      warning("processing failed: %s", "Failed to parse line");
+      return FALSE;
+    }
+  while (p < end && isspace((unsigned char) *p))
+    ++p;
+  if (p != end)
+    {
+      warning("processing failed: %s", "Failed to parse line");
+      return FALSE;
+    }
+  if (++client->vadd_filled < client->vadd_count)
+    return TRUE;
+
+  client->vadd_count = 0;
+  if (!vector_add_i32(client->vadd_a, client->vadd_b, client->vadd_sum,
+                      client->vadd_filled))
+    {
+      warning("processing failed: %s", "Integer overflow");
       return FALSE;
     }
+
+  const size_t prefix = strlen(client->vadd_prefix);
+  char * const reply =
+    arena_calloc(client->arena, 1,
+                 prefix + client->vadd_filled * (DECIMAL_I32_SIZE + 1) + 1);
+  char *q = reply + prefix;
+  memcpy(reply, client->vadd_prefix, prefix);
+  for (size_t j = 0; j < client->vadd_filled; ++j)
+    {
+      *q++ = ' ';
+      q += decimal_format_i32(q, client->vadd_sum[j]);
+    }
+  client_queue_reply(client, reply);
   return TRUE;
 }
 
+static Boolean client_process_requests(const Server server,
+                                       const Client client)
+{
+  Boolean too_long = FALSE;
+  char *line = NULL;
+
+  /* The first byte of a connection selects the protocol. */
+  if (!client->protocol_detected)
+    {
+      if (!client_input_pending(client))
+        return TRUE;
+      client->protocol_detected = TRUE;
+      if ((unsigned char) client->input[client->input_start] == BINARY_MAGIC)
+        {
+          client->binary = TRUE;
+          client->input_scan = ++client->input_start;
+        }
+    }
+  if (client->binary)
+    return client_process_binary(server, client);
+
+  /* Serve every complete line already buffered before reading again;
+     pipelining clients send many per segment, and their replies go out
+     together.  A stream in progress finishes before the next line. */
+  while (!client_output_full(client))
+    {
+      if (client->list_stream)
+        client_list_stream_next(server, client);
+      else if (!(line = client_next_line(client, &too_long)))
+        break;
+      else if (client->vadd_count)
+        {
+          if (!client_vadd_line(client, line))
+            return FALSE;
+        }
+      else if (!communicate_line(server, client, line))
+        return FALSE;
+    }
+
+  if (too_long)
+    {
+      warning("Protocol error, too long line");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+Boolean client_process_input(const Server server, const Client client)
+{
+  if (client_process_requests(server, client))
+    return TRUE;
+  metrics_count(server, SERVER_COUNTER_ERRORS, 1);
+  return FALSE;
+}
+
 Boolean communicate(Server server, Client client)
 {
-  char buf[256];
-  int read_bytes = 0;
+  client->input_start = client->input_scan = client->input_end = 0;
+  client->list_stream = FALSE;
+  client->vadd_count = 0;
+  client->protocol_detected = client->binary = FALSE;
+  client_clear_output(client);
 
   while (TRUE)
     {
-      if (read_bytes >= sizeof(buf) - 1)
+      const Boolean success = client_process_input(server, client);
+      const Boolean more = client_output_full(client);
+      if (client_output_pending(client))
+        client_timer_update(server, client);
+      if (!client_flush_output(client))
         {
-          warning("Protocol error, too long line");
+          warning("Failed to send reply");
           return FALSE;
         }
-      int ret = client_read(client, &buf[read_bytes], 1);
+      if (!success)
+        return FALSE;
+      if (more)
+        continue;
+
+      client_timer_update(server, client);
+      int ret = client_fill_input(client);
       DEBUG(("Client read returned %d", ret));
       if (ret < 0)
         {
@@ -293,7 +1564,7 @@ Boolean communicate(Server server, Client client)
       else if (ret == 0)
         {
           DEBUG(("Client in EOF"));
-          if (read_bytes == 0)
+          if (!client_input_pending(client))
             {
               return TRUE;
             }
@@ -303,43 +1574,5 @@ Boolean communicate(Server server, Client client)
               return FALSE;
             }
         }
-      else
-        {
-          char last_char = buf[read_bytes];
-
-          if (last_char == '\n')
-            {
-              Boolean success;
-              char *errors = NULL, *reply = NULL;
-              buf[read_bytes] = '\0';
-              success = process_line(server, client, buf, &reply, &errors);
-              DEBUG(("Processing done: status: %d, reply: %s, errors: %s",
-                     success, reply, errors));
-              read_bytes = 0;
-              if (!success)
-                {
-                  warning("processing failed: %s", errors);
-                  xfree(errors);
-                  xfree(reply);
-                  return FALSE;
-                }
-              xfree(errors);
-              {
-                char *response = string_format("%s\n", reply);
-                success = client_write(client, response, strlen(response));
-                xfree(response);
-              }
-              if (!success)
-                {
-                  warning("Failed to send reply");
-                  return FALSE;
-                }
-              DEBUG(("Client request processed"));
-            }
-          else
-            {
-              read_bytes++;
-            }
-        }
     }
 }
@@ -6,17 +6,111 @@
 #define _CSERVER_H_
 
 #include "util.h"
+#include <sys/uio.h>
+#include <stdint.h>
 
 /***************************** API definition. ******************************/
 
 typedef struct ServerRec * Server;
 
+/* How connections are served. */
+typedef enum
+{
+  /* A pool of threads, each serving one connection at a time with
+     blocking IO.  The default. */
+  SERVER_ENGINE_THREADS,
+  /* Event loops multiplexing non-blocking connections with epoll. */
+  SERVER_ENGINE_EPOLL,
+  /* Threads driving io_uring rings that accept, read and write on their
+     own.  Falls back to SERVER_ENGINE_EPOLL if the kernel lacks the
+     needed io_uring features. */
+  SERVER_ENGINE_URING
+} ServerEngine;
+
+/* What SERVER_ENGINE_THREADS does with a connection arriving while
+   the run queues hold `max_queued' connections already. */
+typedef enum
+{
+  /* Refuse it: server_accept_connection() fails, after sending
+     SERVER_BUSY_REPLY.  The default. */
+  SERVER_ADMISSION_REJECT,
+  /* Refuse the connection that has waited longest instead, which gets
+     SERVER_BUSY_REPLY, and queue the new one. */
+  SERVER_ADMISSION_DROP_OLDEST,
+  /* Wait in server_accept_connection() until there is room. */
+  SERVER_ADMISSION_BLOCK
+} ServerAdmission;
+
+/* Sent to connections refused by admission control. */
+#define SERVER_BUSY_REPLY "Server is busy\n"
+
+typedef struct ServerCreateParamsRec
+{
+  ServerEngine engine;
+
+  /* Number of event loops for SERVER_ENGINE_EPOLL, or rings for
+     SERVER_ENGINE_URING.  Zero means one per online CPU. */
+  size_t event_loops;
+
+  /* SERVER_ENGINE_THREADS: the pool starts with `min_threads' workers
+     and spawns more, up to `max_threads', while connections are queued
+     and every worker is busy.  Workers beyond the minimum exit after
+     `idle_timeout_ms' without work.  Zero selects the defaults below. */
+  size_t min_threads, max_threads;
+  long idle_timeout_ms;
+
+  /* SERVER_ENGINE_THREADS admission control.  At most `max_queued'
+     connections wait for a worker; `admission' says what happens to
+     more.  With a non-zero `queue_target_ms', once the queueing delay
+     of connections stays above it for `queue_interval_ms', new
+     connections are refused until the delay drops below the target or
+     the queues drain.  Zero selects the defaults below; a zero target
+     disables delay-based shedding. */
+  size_t max_queued;
+  ServerAdmission admission;
+  long queue_target_ms, queue_interval_ms;
+
+  /* Connection timeouts, for every engine; zero disables one.  A
+     connection is closed after `conn_idle_timeout_ms' without a request,
+     when a request has not arrived in full `read_timeout_ms' after its
+     first byte, or when a reply makes no progress for
+     `write_timeout_ms'.  Deadlines are kept to 10 ms. */
+  long conn_idle_timeout_ms, read_timeout_ms, write_timeout_ms;
+
+  /* How long server_destroy() lets connections finish after shutdown
+     before closing them; zero selects the default.  With `shutdown_op',
+     any client may request shutdown with "<id> SHUTDOWN 0 0", which
+     replies with the number of connections being drained. */
+  long drain_timeout_ms;
+  Boolean shutdown_op;
+
+  /* Start with tracing on, see server_set_tracing(). */
+  Boolean trace;
+
+} ServerCreateParamsStruct, *ServerCreateParams;
+
+#define SERVER_DEFAULT_MIN_THREADS 4
+#define SERVER_DEFAULT_MAX_THREADS 256
+#define SERVER_DEFAULT_IDLE_TIMEOUT_MS 10000
+#define SERVER_DEFAULT_MAX_QUEUED 4096
+#define SERVER_DEFAULT_QUEUE_INTERVAL_MS 100
+#define SERVER_DEFAULT_DRAIN_TIMEOUT_MS 5000
+
 /* Create the server object. */
 Server server_create(void);
-/* Calling this is only legal if there are no ongoing requests for the
-   server. */
+/* Create the server object.  `params' may be NULL for the defaults. */
+Server server_create_with_params(ServerCreateParams params);
+/* Shut down if that has not been requested yet, and wait for the
+   connections to drain.  Connections still open when the drain timeout
+   passes are closed.  If the engine threads have still not finished a
+   drain timeout after that, a warning is logged and the server is left
+   allocated, so this returns in bounded time. */
 void server_destroy(Server server);
 
+/* Stop accepting and half-close every connection: requests received
+   already are served and answered, then the connection is closed.
+   Returns at once; safe to call from any thread, including an op
+   handler, and more than once. */
 void server_shutdown(Server server);
 
 /* Returns TRUE if shutdown has been called for the server, FALSE otherwise. */
@@ -24,6 +118,116 @@ Boolean server_shutdown_requested(Server server);
 
 Boolean server_accept_connection(Server server, int conn_fd, char **errors_ret);
 
+/* A snapshot of the worker pool of SERVER_ENGINE_THREADS. */
+typedef struct ServerPoolStatsRec
+{
+  /* Running workers, workers serving a connection, and connections
+     waiting for a worker. */
+  size_t pool_size, busy, queued;
+  /* Connections refused because the queues were full, refused as the
+     oldest queued under SERVER_ADMISSION_DROP_OLDEST, and refused
+     because of the queueing delay. */
+  size_t rejected, dropped, shed;
+  /* Whether new connections are being shed for queueing delay, and
+     the mean and worst queueing delay so far, in microseconds. */
+  Boolean overloaded;
+  uint64_t queue_delay_mean_us, queue_delay_max_us;
+} ServerPoolStatsStruct, *ServerPoolStats;
+
+void server_get_pool_stats(Server server, ServerPoolStats stats_ret);
+
+/* Counters of the accept loops of server_serve(). */
+typedef struct ServerAcceptStatsRec
+{
+  /* Connections accepted, and connections closed unserved because the
+     process ran out of descriptors. */
+  size_t accepted, shed;
+} ServerAcceptStatsStruct, *ServerAcceptStats;
+
+void server_get_accept_stats(Server server, ServerAcceptStats stats_ret);
+
+/* Connections closed by each of the timeouts. */
+typedef struct ServerTimeoutStatsRec
+{
+  size_t idle, read, write;
+} ServerTimeoutStatsStruct, *ServerTimeoutStats;
+
+void server_get_timeout_stats(Server server, ServerTimeoutStats stats_ret);
+
+/* Metrics, kept for every engine. */
+typedef enum
+{
+  /* Connections registered and closed. */
+  SERVER_COUNTER_ACCEPTED,
+  SERVER_COUNTER_CLOSED,
+  /* Requests served, text and binary. */
+  SERVER_COUNTER_REQUESTS,
+  /* Bytes read from and written to connections. */
+  SERVER_COUNTER_BYTES_IN,
+  SERVER_COUNTER_BYTES_OUT,
+  /* Failed requests and protocol errors. */
+  SERVER_COUNTER_ERRORS,
+  SERVER_COUNTER_COUNT
+} ServerCounter;
+
+typedef enum
+{
+  /* SERVER_ENGINE_THREADS: from entering a run queue to being taken by
+     a worker. */
+  SERVER_LATENCY_QUEUE_WAIT,
+  /* Processing a request: process_line() or a binary op. */
+  SERVER_LATENCY_PROCESS,
+  /* From reading a request to having written its reply. */
+  SERVER_LATENCY_REQUEST,
+  SERVER_LATENCY_COUNT
+} ServerLatency;
+
+typedef struct ServerMetricsRec
+{
+  uint64_t counters[SERVER_COUNTER_COUNT];
+  /* In nanoseconds. */
+  HistogramStruct latencies[SERVER_LATENCY_COUNT];
+} ServerMetricsStruct, *ServerMetrics;
+
+/* Threads count into shards of their own; these merge them. */
+void server_get_metrics(Server server, ServerMetrics metrics_ret);
+/* Requests served by the op `name'. */
+uint64_t server_get_op_requests(Server server, const char *name);
+/* The metrics in the Prometheus text exposition format.  xfree() the
+   result. */
+char *server_format_metrics(Server server);
+
+/* Tracing: while on, every thread records the stages of the requests it
+   serves, queueing, reading, processing and writing, into a ring of the
+   latest few thousand events.  Off by default; costs next to nothing
+   while off, and nothing at all built with CSERVER_NO_TRACE. */
+void server_set_tracing(Server server, Boolean enabled);
+Boolean server_tracing(Server server);
+/* The events in the rings as Chrome trace JSON, on one line.  xfree()
+   the result. */
+char *server_format_trace(Server server);
+
+/* Returns the engine actually serving connections, which differs from
+   the requested one after a fallback. */
+ServerEngine server_engine(Server server);
+
+/* Serve connections arriving on the listening socket `listen_fd' until
+   shutdown is requested.  The io_uring engine accepts on its own; the
+   others make the listener non-blocking and drain it in batches,
+   feeding server_accept_connection().  When descriptors run out,
+   pending connections are accepted and closed at once, and accepting
+   backs off until descriptors are available again. */
+void server_serve(Server server, int listen_fd);
+
+/* Serve `count' listening sockets, typically bound to one address with
+   SO_REUSEPORT, with an acceptor thread each; the calling thread takes
+   the first.  Acceptor i hands its connections to its own shard of the
+   workers, event loops or rings, so acceptors share no cursor.  Returns
+   once shutdown has been requested and every acceptor has stopped;
+   server_shutdown() shuts the listeners down to wake them. */
+void server_serve_sharded(Server server, const int *listen_fds,
+                          size_t count);
+
 typedef struct ClientRec *Client;
 
 typedef struct ClientCreateParamsRec
@@ -37,11 +241,104 @@ typedef struct ClientCreateParamsRec
                           void *context);
   void *client_write_context;
 
+  /* Vectored write.  Return the number of bytes written, which may be
+     less than requested but not 0, or a negated errno value: -EAGAIN
+     if the connection cannot take more yet, -EINTR to be called again,
+     anything else on error.  errno is not consulted.  If only
+     client_write is given, the vectors are gathered into one buffer
+     and passed to it. */
+  ssize_t (*client_writev)(Client client, const struct iovec *iov,
+                           int iovcnt, void *context);
+  void *client_writev_context;
+
 } ClientCreateParamsStruct, *ClientCreateParams;
 
 Client client_create(int sock_fd, ClientCreateParams params);
 void client_destroy(Client client);
 
+/* Statistics of the slab pool Client objects are allocated from. */
+void client_get_allocation_stats(ObjectPoolStats stats_ret);
+
+/* Scratch memory for requests on `client'.  Replies and errors are
+   allocated here; the arena is reset once they have been sent. */
+Arena client_arena(Client client);
+
+/* Request dispatch. */
+
+/* Longest field of a request line; longer runs are split into several
+   fields, as scanf("%19s") does. */
+#define REQUEST_FIELD_MAX 19
+
+/* One field of a request line.  It points into the line and is not NUL
+   terminated; print it with "%.*s". */
+typedef struct RequestFieldRec
+{
+  const char *start;
+  int length;
+} RequestFieldStruct, *RequestField;
+
+/* A parsed request line "<id> <op> <arg1> <arg2>". */
+typedef struct RequestRec
+{
+  RequestFieldStruct param, op, arg1, arg2;
+} RequestStruct, *Request;
+
+/* Handles one request.  Same contract as process_line(): on success
+   `*reply_ret' may be set to a reply, on failure `*errors_ret' to a
+   message, both allocated from client_arena(). */
+typedef Boolean (*ServerOpHandler)(Server server, Client client,
+                                   Request request, char **reply_ret,
+                                   char **errors_ret);
+
+/* Route requests whose op field is `name' to `handler', replacing any
+   earlier handler.  The table is not locked, so register before serving
+   connections.  Returns FALSE if `name' is empty or too long, or the
+   table cannot place it. */
+Boolean server_register_op(Server server, const char *name,
+                           ServerOpHandler handler);
+
+/* Parse `field' as a decimal int the way atoi() does, but fail instead
+   of overflowing. */
+Boolean request_field_int(RequestField field, int *value_ret);
+
+/* Binary protocol.  A connection whose first byte is BINARY_MAGIC
+   speaks it from then on; any other first byte selects the text
+   protocol.  Requests and replies are frames of a BINARY_HEADER_SIZE
+   byte header followed by `length' bytes of payload.  All integers are
+   little-endian.  The header is
+
+     u32 length, u16 opcode, u16 status, u64 request id
+
+   where status is 0 in requests, and replies echo the opcode and the
+   request id.  A frame must fit in BINARY_MAX_FRAME bytes. */
+#define BINARY_MAGIC 0xb1
+#define BINARY_HEADER_SIZE 16
+#define BINARY_MAX_FRAME 4096
+
+typedef enum
+{
+  /* i32 a, i32 b -> i64 a + b. */
+  BINARY_OP_ADD = 1,
+  /* -> u64 connected clients. */
+  BINARY_OP_NUMCLIENTS = 2,
+  /* u32 offset, u32 count (0 for all) -> u32 connected clients, u32 n,
+     n * i32 descriptors. */
+  BINARY_OP_LIST = 3,
+  /* u32 n, n * i32 a, n * i32 b -> u32 n, n * i32 a + b; an error if
+     any sum overflows. */
+  BINARY_OP_VADD = 4
+} BinaryOp;
+
+/* Reply status; an error reply carries a message as its payload. */
+#define BINARY_STATUS_OK 0
+#define BINARY_STATUS_ERROR 1
+
+/* Encode a request with `count' 32-bit operands into `buf', which must
+   have room for BINARY_HEADER_SIZE + 4 * count bytes.  Returns the
+   frame size. */
+size_t binary_encode_request(char *buf, BinaryOp op, uint64_t request_id,
+                             const uint32_t *operands, size_t count);
+
 /* Performs the actual protocol between the client and the server. */
 Boolean communicate(Server server, Client client);
 
@@ -0,0 +1,541 @@
+/*
+ * Load generator for the computation server.
+ *
+ * Connections are spread over threads, each multiplexing its share with
+ * ppoll().  In the closed loop every connection keeps `depth' requests
+ * in flight and sends the next one as soon as a reply arrives.  In the
+ * open loop requests fall due at a constant total rate whether or not
+ * the replies keep up, and at most `depth' are in flight per
+ * connection.  Latency is measured from when a request fell due rather
+ * than from when it could be sent, so a server that stalls is charged
+ * for the requests held back meanwhile as well (the correction for
+ * coordinated omission).  The results are printed as one line of JSON.
+ */
+#define _GNU_SOURCE
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Longest request generated, including the newline. */
+#define LOAD_REQUEST_MAX 48
+
+/* How long to keep retrying the first connection while the server
+   starts. */
+#define LOAD_CONNECT_RETRY_MS 3000
+
+struct option long_options[] =
+  {
+    { "connect",     TRUE,  NULL, 'C' },
+    { "connections", TRUE,  NULL, 'c' },
+    { "threads",     TRUE,  NULL, 't' },
+    { "depth",       TRUE,  NULL, 'p' },
+    { "duration",    TRUE,  NULL, 'T' },
+    { "rate",        TRUE,  NULL, 'r' },
+    { "mix",         TRUE,  NULL, 'm' },
+    { "debug",       FALSE, NULL, 'd' },
+    {NULL, 0, 0, 0}
+  };
+
+/* Ops of the mix. */
+typedef enum
+{
+  LOAD_OP_ADD,
+  LOAD_OP_LIST,
+  LOAD_OP_NUMCLIENTS,
+  LOAD_OP_COUNT
+} LoadOp;
+
+static const char * const load_op_names[LOAD_OP_COUNT] =
+  { "+", "LIST", "NUMCLIENTS" };
+
+/* Workload shape, settable from the command line. */
+static const char *load_address = "/tmp/cserver.sock";
+static int load_connections = 16;
+static int load_threads = 0;
+static int load_depth = 1;
+static double load_duration = 5;
+static double load_rate = 0;
+static const char *load_mix = "+:100";
+
+/* Weight of each op in the mix, their sum, and the mix spelled out for
+   the report. */
+static unsigned load_weights[LOAD_OP_COUNT];
+static unsigned load_weight_total;
+static char load_mix_text[64];
+
+/* The measured interval, on the monotonic clock. */
+static uint64_t load_start_ns, load_end_ns;
+
+typedef struct LoadConnRec
+{
+  int fd;
+  Boolean failed;
+  /* When each request in flight fell due, oldest at `head'; a ring of
+     load_depth entries. */
+  uint64_t *due_ns;
+  size_t head, in_flight;
+  /* Open loop: when the next request falls due, and the time between
+     requests on this connection. */
+  uint64_t next_due_ns, interval_ns;
+  uint64_t next_id;
+  /* Requests generated but not yet written. */
+  char *output;
+  size_t output_start, output_end;
+} LoadConnStruct, *LoadConn;
+
+typedef struct LoadThreadRec
+{
+  pthread_t thread;
+  LoadConn *conns;
+  size_t conn_count;
+  uint64_t random;
+  /* Replies received and their latencies, and requests lost with
+     failed connections. */
+  uint64_t requests, errors;
+  HistogramStruct latency;
+} LoadThreadStruct, *LoadThread;
+
+/* Parse "op:weight,..." into load_weights. */
+static Boolean load_parse_mix(const char * const mix)
+{
+  char * const copy = xstrdup(mix);
+  char *saveptr = NULL;
+  Boolean ret_val = TRUE;
+
+  memset(load_weights, 0, sizeof(load_weights));
+  load_weight_total = 0;
+  for (char *item = strtok_r(copy, ",", &saveptr); item && ret_val;
+       item = strtok_r(NULL, ",", &saveptr))
+    {
+      char * const colon = strrchr(item, ':');
+      const int weight = colon ? atoi(colon + 1) : 1;
+      int op;
+
+      if (colon)
+        *colon = '\0';
+      for (op = 0; op < LOAD_OP_COUNT; ++op)
+        if (!strcmp(item, load_op_names[op]))
+          break;
+      if (op == LOAD_OP_COUNT || weight < 0)
+        ret_val = FALSE;
+      else
+        {
+          load_weights[op] += weight;
+          load_weight_total += weight;
+        }
+    }
+  xfree(copy);
+
+  char *p = load_mix_text;
+  for (int op = 0; op < LOAD_OP_COUNT; ++op)
+    if (load_weights[op])
+      p += snprintf(p, load_mix_text + sizeof(load_mix_text) - p, "%s%s:%u",
+                    p == load_mix_text ? "" : ",", load_op_names[op],
+                    load_weights[op]);
+  return ret_val && load_weight_total > 0;
+}
+
+/* xorshift64*, one state per thread. */
+static uint64_t load_random(const LoadThread thread)
+{
+  thread->random ^= thread->random >> 12;
+  thread->random ^= thread->random << 25;
+  thread->random ^= thread->random >> 27;
+  return thread->random * 0x2545f4914f6cdd1dULL;
+}
+
+/* Connect to load_address, a socket path or "host:port".  Returns -1
+   on failure. */
+static int load_connect(void)
+{
+  int fd = -1;
+
+  if (strchr(load_address, '/'))
+    {
+      struct sockaddr_un saddr = { 0 };
+      saddr.sun_family = AF_UNIX;
+      strncpy(saddr.sun_path, load_address, sizeof(saddr.sun_path) - 1);
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 &&
+          connect(fd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+        {
+          close(fd);
+          fd = -1;
+        }
+      return fd;
+    }
+
+  char * const host = xstrdup(load_address);
+  char * const colon = strrchr(host, ':');
+  struct addrinfo hints = { 0 }, *addrs = NULL;
+  hints.ai_socktype = SOCK_STREAM;
+  if (colon)
+    {
+      *colon = '\0';
+      if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &addrs) != 0)
+        addrs = NULL;
+    }
+  for (struct addrinfo *addr = addrs; addr && fd < 0; addr = addr->ai_next)
+    {
+      const int one = 1;
+      fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+      if (fd < 0)
+        continue;
+      if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0)
+        {
+          close(fd);
+          fd = -1;
+          continue;
+        }
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+  if (addrs)
+    freeaddrinfo(addrs);
+  xfree(host);
+  return fd;
+}
+
+/* Append the next request of the mix to the output of `conn', due at
+   `due_ns'. */
+static void load_queue_request(const LoadThread thread, const LoadConn conn,
+                               const uint64_t due_ns)
+{
+  const uint64_t pick = load_random(thread);
+  unsigned weight = pick % load_weight_total;
+  int op = 0;
+  while (weight >= load_weights[op])
+    weight -= load_weights[op++];
+
+  char * const request = &conn->output[conn->output_end];
+  const unsigned long long id = ++conn->next_id;
+  int length;
+  switch (op)
+    {
+    case LOAD_OP_ADD:
+      length = snprintf(request, LOAD_REQUEST_MAX, "%llu + %u %u\n", id,
+                        (unsigned) (pick >> 32) % 1000,
+                        (unsigned) (pick >> 48) % 1000);
+      break;
+    case LOAD_OP_LIST:
+      length = snprintf(request, LOAD_REQUEST_MAX, "%llu LIST 0 16\n", id);
+      break;
+    default:
+      length = snprintf(request, LOAD_REQUEST_MAX, "%llu NUMCLIENTS 0 0\n",
+                        id);
+      break;
+    }
+  conn->output_end += length;
+  conn->due_ns[(conn->head + conn->in_flight++) % load_depth] = due_ns;
+}
+
+/* Queue the requests due on `conn' by `now' that fit in flight. */
+static void load_conn_fill(const LoadThread thread, const LoadConn conn,
+                           const uint64_t now)
+{
+  /* Keep only the unsent requests, which are in flight, so the
+     buffer never outgrows load_depth requests. */
+  memmove(conn->output, &conn->output[conn->output_start],
+          conn->output_end - conn->output_start);
+  conn->output_end -= conn->output_start;
+  conn->output_start = 0;
+  while (conn->in_flight < load_depth)
+    {
+      if (!conn->interval_ns)
+        load_queue_request(thread, conn, now);
+      else if (conn->next_due_ns <= now)
+        {
+          load_queue_request(thread, conn, conn->next_due_ns);
+          conn->next_due_ns += conn->interval_ns;
+        }
+      else
+        break;
+    }
+}
+
+/* The requests in flight on a failed connection are lost. */
+static void load_conn_fail(const LoadThread thread, const LoadConn conn)
+{
+  conn->failed = TRUE;
+  thread->errors += conn->in_flight;
+  conn->in_flight = 0;
+}
+
+static void load_conn_flush(const LoadThread thread, const LoadConn conn)
+{
+  while (conn->output_start < conn->output_end)
+    {
+      const ssize_t ret = write(conn->fd, &conn->output[conn->output_start],
+                                conn->output_end - conn->output_start);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            load_conn_fail(thread, conn);
+          return;
+        }
+      conn->output_start += ret;
+    }
+}
+
+/* Read the replies ready on `conn'; each line answers the oldest
+   request in flight. */
+static void load_conn_receive(const LoadThread thread, const LoadConn conn,
+                              char * const buf, const size_t size)
+{
+  const ssize_t ret = read(conn->fd, buf, size);
+  if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (ret <= 0)
+    {
+      load_conn_fail(thread, conn);
+      return;
+    }
+
+  const uint64_t now = clock_monotonic_ns();
+  for (const char *p = buf; (p = memchr(p, '\n', buf + ret - p)); ++p)
+    {
+      if (!conn->in_flight)
+        {
+          warning("Unexpected reply");
+          load_conn_fail(thread, conn);
+          return;
+        }
+      const uint64_t due = conn->due_ns[conn->head];
+      conn->head = (conn->head + 1) % load_depth;
+      --conn->in_flight;
+      if (now < load_end_ns)
+        {
+          ++thread->requests;
+          histogram_record(&thread->latency, now > due ? now - due : 0, 1);
+        }
+    }
+}
+
+static void *load_thread(void *context)
+{
+  const LoadThread thread = context;
+  struct pollfd * const pfds = xcalloc(thread->conn_count, sizeof(*pfds));
+  char * const buf = xcalloc(1, 65536);
+
+  while (TRUE)
+    {
+      const uint64_t now = clock_monotonic_ns();
+      uint64_t wake = load_end_ns;
+      if (now >= load_end_ns)
+        break;
+
+      for (size_t i = 0; i < thread->conn_count; ++i)
+        {
+          const LoadConn conn = thread->conns[i];
+          pfds[i].fd = -1;
+          if (conn->failed)
+            continue;
+          load_conn_fill(thread, conn, now);
+          load_conn_flush(thread, conn);
+          if (conn->failed)
+            continue;
+          if (conn->interval_ns && conn->in_flight < load_depth &&
+              conn->next_due_ns < wake)
+            wake = conn->next_due_ns;
+          pfds[i].fd = conn->fd;
+          pfds[i].events = POLLIN;
+          if (conn->output_start < conn->output_end)
+            pfds[i].events |= POLLOUT;
+        }
+
+      const uint64_t timeout = wake > now ? wake - now : 0;
+      const struct timespec ts =
+        { timeout / 1000000000, timeout % 1000000000 };
+      if (ppoll(pfds, thread->conn_count, &ts, NULL) < 0 && errno != EINTR)
+        fatal("poll failed: %m");
+
+      for (size_t i = 0; i < thread->conn_count; ++i)
+        if (pfds[i].fd >= 0 && pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+          load_conn_receive(thread, thread->conns[i], buf, 65536);
+    }
+
+  /* Requests still in flight at the end are neither served nor lost. */
+  xfree(buf);
+  xfree(pfds);
+  return NULL;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: l-cserver [options]\n"
+          "  --connect ADDR      socket path or host:port (%s)\n"
+          "  --connections N     connections (%d)\n"
+          "  --threads N         threads, 0 for one per CPU up to N (%d)\n"
+          "  --depth N           requests in flight per connection (%d)\n"
+          "  --duration SECONDS  how long to run (%g)\n"
+          "  --rate N            open loop at N requests/s in total, 0 for\n"
+          "                      the closed loop (%g)\n"
+          "  --mix OP:W,...      weights of +, LIST and NUMCLIENTS (%s)\n",
+          load_address, load_connections, load_threads, load_depth,
+          load_duration, load_rate, load_mix);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "C:c:t:p:T:r:m:d", long_options,
+                            NULL)) != -1)
+    {
+      switch (opt)
+        {
+        case 'C':
+          load_address = optarg;
+          break;
+
+        case 'c':
+          load_connections = atoi(optarg);
+          break;
+
+        case 't':
+          load_threads = atoi(optarg);
+          break;
+
+        case 'p':
+          load_depth = atoi(optarg);
+          break;
+
+        case 'T':
+          load_duration = atof(optarg);
+          break;
+
+        case 'r':
+          load_rate = atof(optarg);
+          break;
+
+        case 'm':
+          load_mix = optarg;
+          break;
+
+        case 'd':
+          set_output_mode(OM_DEBUG);
+          break;
+
+        default:
+          usage();
+          return 2;
+        }
+    }
+  if (load_connections < 1 || load_threads < 0 || load_depth < 1 ||
+      load_duration <= 0 || load_rate < 0 || !load_parse_mix(load_mix))
+    {
+      usage();
+      return 2;
+    }
+  if (!load_threads)
+    {
+      const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      load_threads = cpus > 0 ? cpus : 1;
+    }
+  if (load_threads > load_connections)
+    load_threads = load_connections;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Connect everything first, giving a starting server a moment. */
+  const LoadConn conns = xcalloc(load_connections, sizeof(*conns));
+  const uint64_t give_up = clock_monotonic_ns() +
+    (uint64_t) LOAD_CONNECT_RETRY_MS * 1000000;
+  for (int i = 0; i < load_connections; ++i)
+    {
+      const LoadConn conn = &conns[i];
+      while ((conn->fd = load_connect()) < 0 && i == 0 &&
+             clock_monotonic_ns() < give_up)
+        usleep(50 * 1000);
+      if (conn->fd < 0)
+        {
+          warning("Failed to connect to %s: %m", load_address);
+          return 1;
+        }
+      fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+      conn->due_ns = xcalloc(load_depth, sizeof(*conn->due_ns));
+      conn->output = xcalloc(load_depth, LOAD_REQUEST_MAX);
+    }
+
+  /* Open loop: every connection sends at an equal share of the rate,
+     staggered so the requests are evenly spaced in total. */
+  load_start_ns = clock_monotonic_ns();
+  load_end_ns = load_start_ns + (uint64_t) (load_duration * 1e9);
+  for (int i = 0; load_rate > 0 && i < load_connections; ++i)
+    {
+      conns[i].interval_ns = load_connections * 1e9 / load_rate;
+      if (!conns[i].interval_ns)
+        conns[i].interval_ns = 1;
+      conns[i].next_due_ns = load_start_ns +
+        conns[i].interval_ns * i / load_connections;
+    }
+
+  /* Thread i takes connections i, i + load_threads, ... */
+  const LoadThread threads = xcalloc(load_threads, sizeof(*threads));
+  for (int i = 0; i < load_threads; ++i)
+    {
+      const LoadThread thread = &threads[i];
+      thread->conns = xcalloc(load_connections / load_threads + 1,
+                              sizeof(*thread->conns));
+      for (int j = i; j < load_connections; j += load_threads)
+        thread->conns[thread->conn_count++] = &conns[j];
+      thread->random = 0x9e3779b97f4a7c15ULL * (i + 1);
+      if (pthread_create(&thread->thread, NULL, load_thread, thread) != 0)
+        fatal("Failed to create thread");
+    }
+
+  HistogramStruct * const latency = xcalloc(1, sizeof(*latency));
+  uint64_t requests = 0, errors = 0;
+  for (int i = 0; i < load_threads; ++i)
+    {
+      pthread_join(threads[i].thread, NULL);
+      requests += threads[i].requests;
+      errors += threads[i].errors;
+      histogram_merge(latency, &threads[i].latency);
+    }
+  const double elapsed = (clock_monotonic_ns() - load_start_ns) / 1e9;
+
+  printf("{\"mode\":\"%s\",\"connections\":%d,\"threads\":%d,"
+         "\"depth\":%d,\"rate\":%.0f,\"mix\":\"%s\",\"duration_s\":%.3f,"
+         "\"requests\":%llu,\"errors\":%llu,\"throughput_rps\":%.0f,"
+         "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,"
+         "\"max\":%.1f}}\n",
+         load_rate > 0 ? "open" : "closed", load_connections, load_threads,
+         load_depth, load_rate, load_mix_text, elapsed,
+         (unsigned long long) requests, (unsigned long long) errors,
+         requests / elapsed,
+         histogram_percentile(latency, 0.5) / 1e3,
+         histogram_percentile(latency, 0.99) / 1e3,
+         histogram_percentile(latency, 0.999) / 1e3,
+         latency->max / 1e3);
+
+  for (int i = 0; i < load_threads; ++i)
+    xfree(threads[i].conns);
+  for (int i = 0; i < load_connections; ++i)
+    {
+      close(conns[i].fd);
+      xfree(conns[i].due_ns);
+      xfree(conns[i].output);
+    }
+  xfree(threads);
+  xfree(conns);
+  xfree(latency);
+  return errors || !requests ? 1 : 0;
+}
@@ -10,8 +10,17 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <errno.h>
+#include <endian.h>
 
 #include "cserver.h"
+#include "cserver-internal.h"
 
 /***************************** Test functions. ******************************/
 
@@ -126,6 +135,443 @@ TEST_RET test_null_mutex_destroy(char **errors_ret)
   return TRUE;
 }
 
+TEST_RET test_condition_timedwait(char **errors_ret)
+{
+  Mutex mutex = mutex_create();
+  Condition cv = condition_create();
+  Boolean ret_val = FALSE, signaled;
+
+  mutex_lock(mutex);
+  signaled = condition_timedwait(cv, mutex, 10);
+  mutex_unlock(mutex);
+  if (signaled)
+    {
+      *errors_ret = xstrdup("unsignaled wait should time out");
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  mutex_destroy(mutex);
+  condition_destroy(cv);
+  return ret_val;
+}
+
+TEST_RET test_work_queue(char **errors_ret)
+{
+  WorkQueue queue = work_queue_create(3);
+  int items[4];
+  Boolean ret_val = FALSE;
+
+  if (work_queue_pop(queue))
+    {
+      *errors_ret = xstrdup("new queue should be empty");
+      goto error;
+    }
+  /* The capacity is rounded up to four. */
+  for (int i = 0; i < 4; ++i)
+    if (!work_queue_push(queue, &items[i]))
+      {
+        *errors_ret = string_format("push %d should have succeeded", i);
+        goto error;
+      }
+  if (work_queue_push(queue, &items[0]))
+    {
+      *errors_ret = xstrdup("push to a full queue should fail");
+      goto error;
+    }
+  for (int i = 0; i < 4; ++i)
+    if (work_queue_pop(queue) != &items[i])
+      {
+        *errors_ret = string_format("pop %d returned the wrong item", i);
+        goto error;
+      }
+  if (work_queue_pop(queue))
+    {
+      *errors_ret = xstrdup("drained queue should be empty");
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  work_queue_destroy(queue);
+  return ret_val;
+}
+
+TEST_RET test_histogram(char **errors_ret)
+{
+  HistogramStruct histogram[1] = { { 0 } }, merged[1] = { { 0 } };
+  Boolean ret_val = FALSE;
+
+  /* Buckets tile the values in order, each within 1/16 of its own. */
+  for (uint64_t value = 1; value < ((uint64_t) 1 << HISTOGRAM_MAX_BITS);
+       value += 1 + value / 37)
+    {
+      const size_t bucket = histogram_bucket(value);
+      const uint64_t limit = histogram_bucket_limit(bucket);
+      if (bucket >= HISTOGRAM_BUCKETS || limit < value ||
+          histogram_bucket_limit(bucket - 1) >= value ||
+          (limit - value) * 16 > value)
+        {
+          *errors_ret = string_format("value %llu in bucket %zu up to %llu",
+                                      (unsigned long long) value, bucket,
+                                      (unsigned long long) limit);
+          goto error;
+        }
+    }
+  if (histogram_bucket(UINT64_MAX) != HISTOGRAM_BUCKETS - 1)
+    {
+      *errors_ret = xstrdup("huge values should land in the last bucket");
+      goto error;
+    }
+
+  if (histogram_percentile(histogram, 0.5))
+    {
+      *errors_ret = xstrdup("an empty histogram should have no percentile");
+      goto error;
+    }
+  for (uint64_t value = 1; value <= 1000; ++value)
+    histogram_record(histogram, value, 1);
+  histogram_record(histogram, 100000, 10);
+  histogram_merge(merged, histogram);
+  histogram_merge(merged, histogram);
+  const uint64_t p50 = histogram_percentile(merged, 0.5);
+  const uint64_t p995 = histogram_percentile(merged, 0.995);
+  if (merged->count != 2020 || merged->sum != 2 * (500500 + 1000000) ||
+      merged->max != 100000 || p50 < 505 || p50 > 505 * 17 / 16 ||
+      p995 != 100000 || histogram_percentile(merged, 0) != 1)
+    {
+      *errors_ret = string_format("count %llu sum %llu max %llu p50 %llu "
+                                  "p995 %llu",
+                                  (unsigned long long) merged->count,
+                                  (unsigned long long) merged->sum,
+                                  (unsigned long long) merged->max,
+                                  (unsigned long long) p50,
+                                  (unsigned long long) p995);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  return ret_val;
+}
+
+TEST_RET test_timer_wheel(char **errors_ret)
+{
+  const uint64_t start = 1000003, horizon = (uint64_t) 1 << 24;
+  const int count = 2000;
+  TimerWheel wheel = timer_wheel_create(start);
+  TimerStruct *timers = xcalloc(count, sizeof(*timers));
+  Boolean *fired = xcalloc(count, sizeof(*fired));
+  Boolean ret_val = FALSE;
+  uint64_t now = start;
+  int armed = 0;
+
+  /* Spread over every level, with some due at once and some past the
+     horizon; every seventh is cancelled. */
+  srand(1);
+  for (int i = 0; i < count; ++i)
+    {
+      const uint64_t expires = i % 100 == 0 ? start :
+        i % 100 == 1 ? start + 2 * horizon :
+        start + (((uint64_t) rand() << 16 ^ rand()) % horizon);
+      timer_wheel_add(wheel, &timers[i], expires);
+      if (expires < start + horizon && expires > start &&
+          timers[i].expires != expires)
+        {
+          *errors_ret = string_format("timer %d was moved", i);
+          goto error;
+        }
+    }
+  for (int i = 0; i < count; i += 7)
+    timer_wheel_cancel(wheel, &timers[i]);
+  for (int i = 0; i < count; ++i)
+    armed += timer_armed(&timers[i]);
+  if (timer_wheel_count(wheel) != armed)
+    {
+      *errors_ret = xstrdup("wrong count of armed timers");
+      goto error;
+    }
+
+  /* Each timer comes out of the first advance that reaches it. */
+  while (timer_wheel_count(wheel) && now < start + 2 * horizon)
+    {
+      const uint64_t previous = now;
+      now += 1 + rand() % 5000;
+      for (Timer timer = timer_wheel_advance(wheel, now); timer;
+           timer = timer->next)
+        {
+          const int i = timer - timers;
+          if (fired[i] || i % 7 == 0 || timer->expires <= previous ||
+              timer->expires > now)
+            {
+              *errors_ret = string_format("timer %d due at %llu fired "
+                                          "between %llu and %llu", i,
+                                          (unsigned long long) timer->expires,
+                                          (unsigned long long) previous,
+                                          (unsigned long long) now);
+              goto error;
+            }
+          fired[i] = TRUE;
+          --armed;
+        }
+    }
+  if (armed)
+    {
+      *errors_ret = string_format("%d timers never fired", armed);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  timer_wheel_destroy(wheel);
+  xfree(timers);
+  xfree(fired);
+  return ret_val;
+}
+
+TEST_RET test_arena(char **errors_ret)
+{
+  Arena arena = arena_create(64);
+  Boolean ret_val = FALSE;
+  char *first, *string, *large;
+
+  first = arena_calloc(arena, 1, 3);
+  if ((size_t) first % 16 || (size_t) arena_calloc(arena, 1, 1) % 16)
+    {
+      *errors_ret = xstrdup("arena allocations should be aligned");
+      goto error;
+    }
+  /* Formatting past the end of a block moves on to a new one. */
+  string = arena_string_format(arena, "%s-%d", "a string longer than the rest"
+                               " of the block", 42);
+  if (strcmp(string, "a string longer than the rest of the block-42") != 0)
+    {
+      *errors_ret = string_format("garbled arena string: %s", string);
+      goto error;
+    }
+  large = arena_calloc(arena, 1, 1000);
+  large[999] = 'x';
+  if (strcmp(arena_strdup(arena, "dup"), "dup") != 0)
+    {
+      *errors_ret = xstrdup("arena_strdup() failed");
+      goto error;
+    }
+
+  /* Reset reuses the blocks from the start. */
+  arena_reset(arena);
+  if (arena_calloc(arena, 1, 3) != first)
+    {
+      *errors_ret = xstrdup("reset should reuse the first block");
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  arena_destroy(arena);
+  return ret_val;
+}
+
+typedef struct PoolTestCtxRec
+{
+  ObjectPool pool;
+  void **objects;
+  int count;
+  Mutex mutex;
+  Condition cv;
+  Boolean done;
+} PoolTestCtxStruct, *PoolTestCtx;
+
+/* Free objects allocated by another thread, then exit. */
+static void *pool_free_thread(void *context)
+{
+  PoolTestCtx test_ctx = context;
+  for (int i = 0; i < test_ctx->count; ++i)
+    object_pool_free(test_ctx->pool, test_ctx->objects[i]);
+  mutex_lock(test_ctx->mutex);
+  test_ctx->done = TRUE;
+  condition_signal(test_ctx->cv);
+  mutex_unlock(test_ctx->mutex);
+  return NULL;
+}
+
+TEST_RET test_object_pool(char **errors_ret)
+{
+  PoolTestCtxStruct test_ctx[1] = { { 0 } };
+  ObjectPoolStatsStruct stats[1];
+  void *objects[10];
+  Boolean ret_val = FALSE;
+
+  test_ctx->pool = object_pool_create(100, 4, 2);
+  test_ctx->mutex = mutex_create();
+  test_ctx->cv = condition_create();
+  for (int i = 0; i < 10; ++i)
+    {
+      char *object = objects[i] = object_pool_alloc(test_ctx->pool);
+      if ((size_t) object % 64 || object[0] || object[99])
+        {
+          *errors_ret = xstrdup("objects should be aligned and zeroed");
+          goto error;
+        }
+      memset(object, 0xff, 100);
+    }
+
+  object_pool_get_stats(test_ctx->pool, stats);
+  if (stats->live != 10 || stats->slabs != 3 || stats->free != 2)
+    {
+      *errors_ret = string_format("unexpected stats: %zu live, %zu free, "
+                                  "%zu slabs", stats->live, stats->free,
+                                  stats->slabs);
+      goto error;
+    }
+
+  /* Objects freed on another thread come back through the depot. */
+  test_ctx->objects = objects;
+  test_ctx->count = 10;
+  if (!thread_create(pool_free_thread, test_ctx))
+    {
+      *errors_ret = xstrdup("failed to start thread");
+      goto error;
+    }
+  mutex_lock(test_ctx->mutex);
+  while (!test_ctx->done)
+    condition_wait(test_ctx->cv, test_ctx->mutex);
+  mutex_unlock(test_ctx->mutex);
+
+  object_pool_get_stats(test_ctx->pool, stats);
+  if (stats->live != 0 || stats->free != 12)
+    {
+      *errors_ret = xstrdup("freed objects should be accounted as free");
+      goto error;
+    }
+  /* The thread hands its cache to the depot as it exits. */
+  usleep(50 * 1000);
+  for (int i = 0; i < 10; ++i)
+    objects[i] = object_pool_alloc(test_ctx->pool);
+  object_pool_get_stats(test_ctx->pool, stats);
+  for (int i = 0; i < 10; ++i)
+    object_pool_free(test_ctx->pool, objects[i]);
+  if (stats->slabs != 3)
+    {
+      *errors_ret = xstrdup("freed objects should be reused");
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  object_pool_destroy(test_ctx->pool);
+  mutex_destroy(test_ctx->mutex);
+  condition_destroy(test_ctx->cv);
+  return ret_val;
+}
+
+TEST_RET test_vector_add(char **errors_ret)
+{
+  int32_t a[67], b[67], sum[67];
+
+  /* Every length exercises the vector loops and the scalar tail. */
+  for (size_t count = 0; count <= 67; ++count)
+    for (VectorKernel kernel = 0; kernel < VECTOR_KERNEL_COUNT; ++kernel)
+      {
+        if (!vector_kernel_supported(kernel))
+          continue;
+        for (size_t i = 0; i < count; ++i)
+          {
+            a[i] = (int32_t) (i * 2654435761u) >> 2;
+            b[i] = (int32_t) (i * 40503u) - 1000000;
+          }
+        if (!vector_add_i32_with(kernel, a, b, sum, count))
+          {
+            *errors_ret = string_format("%s: spurious overflow",
+                                        vector_kernel_name(kernel));
+            return FALSE;
+          }
+        for (size_t i = 0; i < count; ++i)
+          if (sum[i] != (int64_t) a[i] + b[i])
+            {
+              *errors_ret = string_format("%s: wrong sum %zu of %zu",
+                                          vector_kernel_name(kernel), i,
+                                          count);
+              return FALSE;
+            }
+
+        /* Overflow in either direction, anywhere, is caught. */
+        for (size_t i = 0; i < count; ++i)
+          {
+            a[i] = i % 2 ? INT32_MIN : INT32_MAX;
+            b[i] = i % 2 ? -1 : 1;
+            if (vector_add_i32_with(kernel, a, b, sum, count))
+              {
+                *errors_ret = string_format("%s: missed overflow %zu of %zu",
+                                            vector_kernel_name(kernel), i,
+                                            count);
+                return FALSE;
+              }
+            a[i] = b[i] = 0;
+          }
+      }
+  return TRUE;
+}
+
+TEST_RET test_decimal(char **errors_ret)
+{
+  static const struct
+  {
+    const char *text;
+    int32_t value;
+    size_t length;
+  } valid[] =
+    {
+      { "0", 0, 1 },
+      { "-0", 0, 2 },
+      { "+7", 7, 2 },
+      { "12345678", 12345678, 8 },
+      { "123456789 1", 123456789, 9 },
+      { "2147483647", INT32_MAX, 10 },
+      { "-2147483648", INT32_MIN, 11 },
+      { "000000000002147483647", INT32_MAX, 21 },
+      { "-99x", -99, 3 },
+    };
+  static const char *invalid[] =
+    { "", "-", "+x", "2147483648", "-2147483649", "12345678901" };
+  char buf[DECIMAL_I32_SIZE + 1];
+  int32_t value;
+
+  for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); ++i)
+    {
+      const char * const text = valid[i].text;
+      const char * const end = decimal_parse_i32(text, text + strlen(text),
+                                                 &value);
+      if (end != text + valid[i].length || value != valid[i].value)
+        {
+          *errors_ret = string_format("failed to parse %s", text);
+          return FALSE;
+        }
+    }
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+    if (decimal_parse_i32(invalid[i], invalid[i] + strlen(invalid[i]),
+                          &value))
+      {
+        *errors_ret = string_format("%s should not parse", invalid[i]);
+        return FALSE;
+      }
+
+  const int32_t values[] = { 0, 7, -7, 10, 99, -100, 12345678, INT32_MAX,
+                             INT32_MIN };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+      char expected[DECIMAL_I32_SIZE + 1];
+      snprintf(expected, sizeof(expected), "%d", values[i]);
+      buf[decimal_format_i32(buf, values[i])] = '\0';
+      if (strcmp(buf, expected) != 0)
+        {
+          *errors_ret = string_format("%d formatted as %s", values[i], buf);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
 TEST_RET test_condition(char **errors_ret)
 {
   Condition cv = condition_create();
@@ -219,10 +665,83 @@ TEST_RET test_thread(char **errors_ret)
   return ret_val;
 }
 
+#define CONTENTION_THREADS 4
+#define CONTENTION_ROUNDS 100000
+
+typedef struct ContentionTestCtxRec
+{
+  Mutex mutex;
+  Condition cv;
+  /* Both under the mutex. */
+  long counter;
+  int running;
+} ContentionTestCtxStruct, *ContentionTestCtx;
+
+void *contention_handler(void *context)
+{
+  ContentionTestCtx test_ctx = context;
+
+  for (int i = 0; i < CONTENTION_ROUNDS; ++i)
+    {
+      mutex_lock(test_ctx->mutex);
+      ++test_ctx->counter;
+      mutex_unlock(test_ctx->mutex);
+    }
+  mutex_lock(test_ctx->mutex);
+  if (!--test_ctx->running)
+    condition_signal(test_ctx->cv);
+  mutex_unlock(test_ctx->mutex);
+  return NULL;
+}
+
+/* Threads hammering one mutex lose no increments, and the last one
+   out wakes the waiter. */
+TEST_RET test_mutex_contention(char **errors_ret)
+{
+  ContentionTestCtxStruct test_ctx[1] = { { 0 } };
+  Boolean ret_val = FALSE;
+
+  test_ctx->mutex = mutex_create();
+  test_ctx->cv = condition_create();
+
+  mutex_lock(test_ctx->mutex);
+  for (int i = 0; i < CONTENTION_THREADS; ++i)
+    if (thread_create(contention_handler, test_ctx))
+      ++test_ctx->running;
+  if (test_ctx->running != CONTENTION_THREADS)
+    {
+      *errors_ret = xstrdup("Failed to create threads");
+      while (test_ctx->running)
+        condition_wait(test_ctx->cv, test_ctx->mutex);
+      mutex_unlock(test_ctx->mutex);
+      goto error;
+    }
+  while (test_ctx->running)
+    condition_wait(test_ctx->cv, test_ctx->mutex);
+  mutex_unlock(test_ctx->mutex);
+
+  if (test_ctx->counter != (long) CONTENTION_THREADS * CONTENTION_ROUNDS)
+    {
+      *errors_ret = string_format("counted %ld, expected %ld",
+                                  test_ctx->counter,
+                                  (long) CONTENTION_THREADS *
+                                  CONTENTION_ROUNDS);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  mutex_destroy(test_ctx->mutex);
+  condition_destroy(test_ctx->cv);
+  return ret_val;
+}
+
 typedef struct CommunicationReadTestCtxRec
 {
   int ret_val;
   char *ret_buffer;
+  /* If non-zero, hand out at most this many bytes per read. */
+  size_t chunk_size;
 } CommunicationReadTestCtxStruct, *CommunicationReadTestCtx;
 
 static int mock_read(Client client, char *buf, size_t bytes, void *context)
@@ -238,6 +757,8 @@ static int mock_read(Client client, char *buf, size_t bytes, void *context)
       char *ret_buffer = test_ctx->ret_buffer;
       int bytes_left;
       bytes_left = strlen(ret_buffer);
+      if (test_ctx->chunk_size && test_ctx->chunk_size < bytes)
+        bytes = test_ctx->chunk_size;
       if (bytes_left < bytes)
         bytes = bytes_left;
 
@@ -262,6 +783,8 @@ typedef struct CommunicationWriteTestCtxRec
 {
   Boolean ret_val;
   char ret_buffer[256];
+  /* Replies are appended; this is the number of bytes written so far. */
+  size_t written;
 } CommunicationWriteTestCtxStruct, *CommunicationWriteTestCtx;
 
 
@@ -274,11 +797,44 @@ static Boolean mock_write(Client client, char *buf, size_t bytes, void *context)
     }
   else
     {
-      strncpy(test_ctx->ret_buffer, buf, bytes);
+      if (bytes > sizeof(test_ctx->ret_buffer) - 1 - test_ctx->written)
+        bytes = sizeof(test_ctx->ret_buffer) - 1 - test_ctx->written;
+      strncpy(&test_ctx->ret_buffer[test_ctx->written], buf, bytes);
+      test_ctx->written += bytes;
       return TRUE;
     }
 }
 
+typedef struct CommunicationWritevTestCtxRec
+{
+  /* Accept at most this many bytes per call to force partial writes. */
+  size_t max_bytes;
+  int calls;
+  char ret_buffer[256];
+  size_t written;
+} CommunicationWritevTestCtxStruct, *CommunicationWritevTestCtx;
+
+static ssize_t mock_writev(Client client, const struct iovec *iov, int iovcnt,
+                           void *context)
+{
+  CommunicationWritevTestCtx test_ctx = context;
+  size_t bytes = 0;
+
+  test_ctx->calls++;
+  for (int i = 0; i < iovcnt && bytes < test_ctx->max_bytes; ++i)
+    {
+      size_t len = iov[i].iov_len;
+      if (len > test_ctx->max_bytes - bytes)
+        len = test_ctx->max_bytes - bytes;
+      if (len > sizeof(test_ctx->ret_buffer) - 1 - test_ctx->written)
+        return -ENOSPC;
+      memcpy(&test_ctx->ret_buffer[test_ctx->written], iov[i].iov_base, len);
+      test_ctx->written += len;
+      bytes += len;
+    }
+  return bytes;
+}
+
 #define LONG_BUFFER "ggggggggggggggggggggggggggggggggggggggggggggggggggggggggg"\
   "ggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggg"\
   "ggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggggg"\
@@ -293,6 +849,8 @@ TEST_RET test_communicate(char **errors_ret)
   Client client;
   CommunicationReadTestCtxStruct read_test_ctx[1] = { { 0 } };
   CommunicationWriteTestCtxStruct write_test_ctx[1] = { { 0 } };
+  /* mock_read() lets go of its buffer once it has handed it all out. */
+  char *input = NULL;
 
   params->client_read = mock_read;
   params->client_read_context = read_test_ctx;
@@ -319,14 +877,14 @@ TEST_RET test_communicate(char **errors_ret)
        goto error;
     }
 
-  read_test_ctx->ret_buffer = xstrdup("foo"); /* No newline. */
+  read_test_ctx->ret_buffer = input = xstrdup("foo"); /* No newline. */
   if (communicate(server, client) != FALSE)
     {
        *errors_ret = xstrdup("communication should fail because of crud");
        goto error;
     }
-  xfree(read_test_ctx->ret_buffer);
-  read_test_ctx->ret_buffer = xstrdup(LONG_BUFFER);
+  xfree(input);
+  read_test_ctx->ret_buffer = input = xstrdup(LONG_BUFFER);
   if (communicate(server, client) != FALSE)
     {
        *errors_ret = xstrdup("communication should fail because of "
@@ -334,8 +892,8 @@ TEST_RET test_communicate(char **errors_ret)
        goto error;
     }
 
-  xfree(read_test_ctx->ret_buffer);
-  read_test_ctx->ret_buffer = xstrdup("100 + 5 5\n");
+  xfree(input);
+  read_test_ctx->ret_buffer = input = xstrdup("100 + 5 5\n");
   if (communicate(server, client) != TRUE)
     {
        *errors_ret = xstrdup("communication should succeed");
@@ -348,16 +906,16 @@ TEST_RET test_communicate(char **errors_ret)
        goto error;
     }
 
-  xfree(read_test_ctx->ret_buffer);
-  read_test_ctx->ret_buffer = xstrdup("100 ' 5 5\n");
+  xfree(input);
+  read_test_ctx->ret_buffer = input = xstrdup("100 ' 5 5\n");
   if (communicate(server, client) != FALSE)
     {
        *errors_ret = xstrdup("communication should fail with invalid op");
        goto error;
     }
 
-  xfree(read_test_ctx->ret_buffer);
-  read_test_ctx->ret_buffer = xstrdup("100 + 5\n");
+  xfree(input);
+  read_test_ctx->ret_buffer = input = xstrdup("100 + 5\n");
   if (communicate(server, client) != FALSE)
     {
        *errors_ret = xstrdup("communication should fail with invalid args");
@@ -369,34 +927,1947 @@ TEST_RET test_communicate(char **errors_ret)
 
   ret_val = TRUE;
  error:
-  xfree(read_test_ctx->ret_buffer);
+  xfree(input);
   return ret_val;
 }
 
-/* Add your tests here. */
+TEST_RET test_communicate_pipelined(char **errors_ret)
+{
+  Server server = server_create();
+  Boolean ret_val = FALSE;
+  ClientCreateParamsStruct params[1] = { { 0 } };
+  Client client;
+  CommunicationReadTestCtxStruct read_test_ctx[1] = { { 0 } };
+  CommunicationWriteTestCtxStruct write_test_ctx[1] = { { 0 } };
+  char *input = NULL;
 
-/***************************** Test framework. ******************************/
+  params->client_read = mock_read;
+  params->client_read_context = read_test_ctx;
 
-#define FUN(fun)                                \
-  { #fun, fun }
+  params->client_write = mock_write;
+  params->client_write_context = write_test_ctx;
 
-struct {
-  char *name;
-  Boolean (*func)(char **);
-  int serial_number;
-} test_funcs[] =
-  {
-    FUN(test_create_listener),
-    FUN(test_server_shutdown),
+  write_test_ctx->ret_val = TRUE;
 
-    FUN(test_mutex),
-    FUN(test_null_mutex_destroy),
-    FUN(test_condition),
-    FUN(test_null_condition_destroy),
-    FUN(test_thread_noop),
-    FUN(test_thread),
+  client = client_create(-1, params);
 
-    FUN(test_communicate),
+  /* Several requests arriving in one segment. */
+  read_test_ctx->ret_buffer = input = xstrdup("1 + 1 2\n2 + 2 3\n3 + 3 4\n");
+  if (communicate(server, client) != TRUE)
+    {
+       *errors_ret = xstrdup("pipelined communication should succeed");
+       goto error;
+    }
+
+  if (strcmp(write_test_ctx->ret_buffer,
+             "1 + 1 2 = 3\n2 + 2 3 = 5\n3 + 3 4 = 7\n") != 0)
+    {
+       *errors_ret = xstrdup("did not receive all pipelined replies");
+       goto error;
+    }
+
+  /* Lines split across reads at every possible position. */
+  xfree(input);
+  read_test_ctx->ret_buffer = input = xstrdup("10 + 20 30\n11 + -1 1\n");
+  read_test_ctx->chunk_size = 3;
+  write_test_ctx->written = 0;
+  memset(write_test_ctx->ret_buffer, 0, sizeof(write_test_ctx->ret_buffer));
+  if (communicate(server, client) != TRUE)
+    {
+       *errors_ret = xstrdup("split communication should succeed");
+       goto error;
+    }
+
+  if (strcmp(write_test_ctx->ret_buffer,
+             "10 + 20 30 = 50\n11 + -1 1 = 0\n") != 0)
+    {
+       *errors_ret = xstrdup("did not receive replies to split lines");
+       goto error;
+    }
+
+  client_destroy(client);
+  server_destroy(server);
+
+  ret_val = TRUE;
+ error:
+  xfree(input);
+  return ret_val;
+}
+
+TEST_RET test_communicate_writev(char **errors_ret)
+{
+  Server server = server_create();
+  Boolean ret_val = FALSE;
+  ClientCreateParamsStruct params[1] = { { 0 } };
+  Client client;
+  CommunicationReadTestCtxStruct read_test_ctx[1] = { { 0 } };
+  CommunicationWritevTestCtxStruct writev_test_ctx[1] = { { 0 } };
+  char *input = NULL;
+
+  params->client_read = mock_read;
+  params->client_read_context = read_test_ctx;
+
+  params->client_writev = mock_writev;
+  params->client_writev_context = writev_test_ctx;
+
+  client = client_create(-1, params);
+
+  /* All pipelined replies go out in one call. */
+  writev_test_ctx->max_bytes = 1024;
+  read_test_ctx->ret_buffer = input = xstrdup("1 + 1 2\n2 + 2 3\n");
+  if (communicate(server, client) != TRUE)
+    {
+       *errors_ret = xstrdup("communication should succeed");
+       goto error;
+    }
+
+  if (writev_test_ctx->calls != 1 ||
+      strcmp(writev_test_ctx->ret_buffer, "1 + 1 2 = 3\n2 + 2 3 = 5\n") != 0)
+    {
+       *errors_ret = xstrdup("replies should be coalesced into one write");
+       goto error;
+    }
+
+  /* Short writes are resumed, not treated as failures. */
+  xfree(input);
+  read_test_ctx->ret_buffer = input = xstrdup("1 + 1 2\n2 + 2 3\n");
+  memset(writev_test_ctx, 0, sizeof(*writev_test_ctx));
+  writev_test_ctx->max_bytes = 5;
+  if (communicate(server, client) != TRUE)
+    {
+       *errors_ret = xstrdup("communication with short writes should succeed");
+       goto error;
+    }
+
+  if (strcmp(writev_test_ctx->ret_buffer, "1 + 1 2 = 3\n2 + 2 3 = 5\n") != 0)
+    {
+       *errors_ret = xstrdup("short writes garbled the replies");
+       goto error;
+    }
+
+  /* A write of nothing fails the connection instead of spinning. */
+  xfree(input);
+  read_test_ctx->ret_buffer = input = xstrdup("1 + 1 2\n");
+  memset(writev_test_ctx, 0, sizeof(*writev_test_ctx));
+  if (communicate(server, client) != FALSE || writev_test_ctx->calls != 1)
+    {
+       *errors_ret = xstrdup("a zero-byte write should fail the connection");
+       goto error;
+    }
+
+  client_destroy(client);
+  server_destroy(server);
+
+  ret_val = TRUE;
+ error:
+  xfree(input);
+  return ret_val;
+}
+
+/* Feed `input' through communicate() and compare the replies with
+   `expected'. */
+static Boolean check_exchange(Server server, const char *input,
+                              Boolean expected_ret, const char *expected,
+                              char **errors_ret)
+{
+  ClientCreateParamsStruct params[1] = { { 0 } };
+  CommunicationReadTestCtxStruct read_test_ctx[1] = { { 0 } };
+  CommunicationWriteTestCtxStruct write_test_ctx[1] = { { 0 } };
+  Boolean ret_val = FALSE;
+  Client client;
+  char *buffer = NULL;
+
+  params->client_read = mock_read;
+  params->client_read_context = read_test_ctx;
+  params->client_write = mock_write;
+  params->client_write_context = write_test_ctx;
+  write_test_ctx->ret_val = TRUE;
+  read_test_ctx->ret_buffer = buffer = xstrdup(input);
+  client = client_create(-1, params);
+
+  if (communicate(server, client) != expected_ret)
+    *errors_ret = string_format("unexpected result for: %s", input);
+  else if (strcmp(write_test_ctx->ret_buffer, expected) != 0)
+    *errors_ret = string_format("unexpected replies for %s: %s", input,
+                                write_test_ctx->ret_buffer);
+  else
+    ret_val = TRUE;
+
+  client_destroy(client);
+  xfree(buffer);
+  return ret_val;
+}
+
+static Boolean op_echo(Server server, Client client, Request request,
+                       char **reply_ret, char **errors_ret)
+{
+  *reply_ret = arena_string_format(client_arena(client), "%.*s echo %.*s",
+                                   request->param.length,
+                                   request->param.start,
+                                   request->arg1.length, request->arg1.start);
+  return TRUE;
+}
+
+TEST_RET test_process_line(char **errors_ret)
+{
+  Server server = server_create();
+  Boolean ret_val = FALSE;
+
+  /* Fields are separated by any whitespace; extra fields are ignored. */
+  if (!check_exchange(server, "1\t+  -5 7 extra\n", TRUE, "1 + -5 7 = 2\n",
+                      errors_ret) ||
+      !check_exchange(server, "2 + 2147483647 1\n", TRUE,
+                      "2 + 2147483647 1 = 2147483648\n", errors_ret) ||
+      /* Numbers parse like atoi(). */
+      !check_exchange(server, "3 + 12abc x\n", TRUE, "3 + 12abc x = 12\n",
+                      errors_ret) ||
+      /* Fields longer than REQUEST_FIELD_MAX are split. */
+      !check_exchange(server, "4 + 1 abcdefghijklmnopqrstu\n", TRUE,
+                      "4 + 1 abcdefghijklmnopqrs = 1\n", errors_ret))
+    goto error;
+
+  if (!check_exchange(server, "1 + 1\n", FALSE, "", errors_ret) ||
+      !check_exchange(server, "1 + 2147483648 1\n", FALSE, "", errors_ret) ||
+      !check_exchange(server, "1 - 1 2\n", FALSE, "", errors_ret) ||
+      !check_exchange(server, "1 LIST -1 0\n", FALSE, "", errors_ret))
+    goto error;
+
+  /* Ops can be added and replaced. */
+  if (server_register_op(server, "", op_echo) ||
+      server_register_op(server, "01234567890123456789", op_echo) ||
+      !server_register_op(server, "ECHO", op_echo) ||
+      !check_exchange(server, "5 ECHO hi 0\n", TRUE, "5 echo hi\n",
+                      errors_ret) ||
+      !server_register_op(server, "+", op_echo) ||
+      !check_exchange(server, "6 + 1 2\n", TRUE, "6 echo 1\n", errors_ret))
+    {
+      if (!*errors_ret)
+        *errors_ret = xstrdup("op registration failed");
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  server_destroy(server);
+  return ret_val;
+}
+
+TEST_RET test_lock_profile(char **errors_ret)
+{
+  Server server = server_create();
+  Boolean ret_val = FALSE;
+#ifdef CSERVER_LOCK_PROFILE
+  static const char expected[] = "test_lock_profile locks=1 "
+    "acquired=1002 contended=0 waits=1 wait_ns=0 wait_max_ns=0 hold_ns=";
+  Mutex mutex = mutex_create_at("test_lock_profile");
+  Condition cv = condition_create();
+  char *text = NULL;
+
+  for (int i = 0; i < 1000; ++i)
+    {
+      mutex_lock(mutex);
+      mutex_unlock(mutex);
+    }
+  /* The wait counts as a release and another acquisition. */
+  mutex_lock(mutex);
+  condition_timedwait(cv, mutex, 1);
+  mutex_unlock(mutex);
+  text = lock_profile_format();
+  if (!strstr(text, expected))
+    {
+      *errors_ret = string_format("expected \"%s\" in:\n%s", expected, text);
+      goto error;
+    }
+  /* The server's mutexes are listed by their call sites. */
+  if (strncmp(text, "cserver.c:", 10) && !strstr(text, "\ncserver.c:"))
+    {
+      *errors_ret = string_format("no server mutexes in:\n%s", text);
+      goto error;
+    }
+#else
+  if (!check_exchange(server, "1 LOCKS 0 0\n", FALSE, "", errors_ret))
+    goto error;
+#endif
+
+  ret_val = TRUE;
+ error:
+#ifdef CSERVER_LOCK_PROFILE
+  xfree(text);
+  condition_destroy(cv);
+  mutex_destroy(mutex);
+#endif
+  server_destroy(server);
+  return ret_val;
+}
+
+TEST_RET test_vadd(char **errors_ret)
+{
+  Server server = server_create();
+  Boolean ret_val = FALSE;
+
+  /* The sums come back in one reply, and ordinary requests go on. */
+  if (!check_exchange(server, "1 VADD 3 x\n1 2\n -5\t7 \n2147483647 "
+                      "-2147483648\n2 + 1 1\n", TRUE,
+                      "1 VADD 3 x = 3 2 -1\n2 + 1 1 = 2\n", errors_ret) ||
+      !check_exchange(server, "1 VADD 1 0\n0 0\n1 VADD 2 0\n1 1\n2 2\n",
+                      TRUE, "1 VADD 1 0 = 0\n1 VADD 2 0 = 2 4\n",
+                      errors_ret))
+    goto error;
+
+  if (!check_exchange(server, "1 VADD 0 0\n", FALSE, "", errors_ret) ||
+      !check_exchange(server, "1 VADD 65537 0\n", FALSE, "", errors_ret) ||
+      !check_exchange(server, "1 VADD 1 0\n1\n", FALSE, "", errors_ret) ||
+      !check_exchange(server, "1 VADD 1 0\n1-2\n", FALSE, "",
+                      errors_ret) ||
+      !check_exchange(server, "1 VADD 1 0\n1 2 3\n", FALSE, "",
+                      errors_ret) ||
+      !check_exchange(server, "1 VADD 1 0\n2147483647 1\n", FALSE, "",
+                      errors_ret))
+    goto error;
+
+  ret_val = TRUE;
+ error:
+  server_destroy(server);
+  return ret_val;
+}
+
+/* Once the per-client arena is warmed up, serving requests makes no
+   heap allocation. */
+TEST_RET test_request_no_malloc(char **errors_ret)
+{
+  static const char requests[] =
+    "1 + 1 2\n2 NUMCLIENTS 0 0\n3 LIST 0 0\n4 + -7 3\n5 LISTSTREAM 0 0\n";
+  static const char expected[] =
+    "1 + 1 2 = 3\n0\n\n4 + -7 3 = -4\n0\n\n";
+  Server server = server_create();
+  Boolean ret_val = FALSE;
+  ClientCreateParamsStruct params[1] = { { 0 } };
+  CommunicationReadTestCtxStruct read_test_ctx[1] = { { 0 } };
+  CommunicationWritevTestCtxStruct writev_test_ctx[1] = { { 0 } };
+  Client client;
+  char *input = NULL;
+  size_t before;
+
+  params->client_read = mock_read;
+  params->client_read_context = read_test_ctx;
+  params->client_writev = mock_writev;
+  params->client_writev_context = writev_test_ctx;
+  client = client_create(-1, params);
+
+  for (int round = 0; round < 2; ++round)
+    {
+      xfree(input);
+      read_test_ctx->ret_buffer = input = xstrdup(requests);
+      memset(writev_test_ctx, 0, sizeof(*writev_test_ctx));
+      writev_test_ctx->max_bytes = 1024;
+
+      before = allocation_count();
+      if (communicate(server, client) != TRUE ||
+          strcmp(writev_test_ctx->ret_buffer, expected) != 0)
+        {
+          *errors_ret = string_format("unexpected replies: %s",
+                                      writev_test_ctx->ret_buffer);
+          goto error;
+        }
+      /* The first round fills the arena. */
+      if (round > 0 && allocation_count() != before)
+        {
+          *errors_ret = string_format("%zu allocations serving requests",
+                                      allocation_count() - before);
+          goto error;
+        }
+    }
+
+  ret_val = TRUE;
+ error:
+  xfree(input);
+  client_destroy(client);
+  server_destroy(server);
+  return ret_val;
+}
+
+/* Read from `fd' until `expected' bytes have arrived or the peer closes. */
+static ssize_t read_reply(int fd, char *buf, size_t bufsize, size_t expected)
+{
+  size_t got = 0;
+  while (got < expected && got < bufsize - 1)
+    {
+      ssize_t ret = read(fd, &buf[got], bufsize - 1 - got);
+      if (ret <= 0)
+        break;
+      got += ret;
+    }
+  buf[got] = '\0';
+  return got;
+}
+
+/* Run a pipelined exchange over a real socket with the given engine. */
+static Boolean check_engine_roundtrip(ServerEngine engine, char **errors_ret)
+{
+  static const char request[] = "1 + 1 2\n2 NUMCLIENTS 0 0\n3 + 40 2\n";
+  static const char expected[] = "1 + 1 2 = 3\n1\n3 + 40 2 = 42\n";
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  Server server;
+  Boolean ret_val = FALSE;
+  char *errors = NULL;
+  char buf[256];
+  int fds[2] = { -1, -1 };
+
+  params->engine = engine;
+  params->event_loops = 2;
+  server = server_create_with_params(params);
+  if (!server)
+    {
+      *errors_ret = xstrdup("server creation failed");
+      return FALSE;
+    }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      *errors_ret = xstrdup("socketpair failed");
+      goto error;
+    }
+
+  if (!server_accept_connection(server, fds[0], &errors))
+    {
+      *errors_ret = string_format("accept failed: %s", errors);
+      xfree(errors);
+      close(fds[0]);
+      goto error;
+    }
+
+  if (write(fds[1], request, strlen(request)) != strlen(request))
+    {
+      *errors_ret = xstrdup("failed to send requests");
+      goto error;
+    }
+
+  read_reply(fds[1], buf, sizeof(buf), strlen(expected));
+  if (strcmp(buf, expected) != 0)
+    {
+      *errors_ret = string_format("unexpected replies: %s", buf);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  if (fds[1] >= 0)
+    close(fds[1]);
+  server_shutdown(server);
+  server_destroy(server);
+  return ret_val;
+}
+
+TEST_RET test_engine_threads(char **errors_ret)
+{
+  return check_engine_roundtrip(SERVER_ENGINE_THREADS, errors_ret);
+}
+
+TEST_RET test_engine_epoll(char **errors_ret)
+{
+  return check_engine_roundtrip(SERVER_ENGINE_EPOLL, errors_ret);
+}
+
+TEST_RET test_engine_uring(char **errors_ret)
+{
+  /* Falls back to epoll where io_uring is unavailable. */
+  return check_engine_roundtrip(SERVER_ENGINE_URING, errors_ret);
+}
+
+/* Send `request' on `fd' until the reply matches `expected' or a
+   second passes; disconnects are torn down asynchronously. */
+static Boolean wait_list_reply(int fd, const char *request,
+                               const char *expected, char *buf,
+                               size_t bufsize)
+{
+  for (int i = 0; i < 100; ++i)
+    {
+      if (write(fd, request, strlen(request)) != strlen(request))
+        return FALSE;
+      read_reply(fd, buf, bufsize, strlen(expected));
+      if (!strcmp(buf, expected))
+        return TRUE;
+      usleep(10 * 1000);
+    }
+  return FALSE;
+}
+
+/* LIST reports the registered descriptors, following connects and
+   disconnects. */
+TEST_RET test_list_registry(char **errors_ret)
+{
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  Server server;
+  Boolean ret_val = FALSE;
+  char *errors = NULL, *expected = NULL;
+  char buf[256];
+  int fds[3][2];
+  int ii, accepted = 0;
+
+  params->engine = SERVER_ENGINE_EPOLL;
+  params->event_loops = 1;
+  server = server_create_with_params(params);
+  for (ii = 0; ii < 3; ++ii)
+    {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[ii]) < 0)
+        {
+          *errors_ret = xstrdup("socketpair failed");
+          goto error;
+        }
+      if (!server_accept_connection(server, fds[ii][0], &errors))
+        {
+          *errors_ret = string_format("accept failed: %s", errors);
+          xfree(errors);
+          close(fds[ii][0]);
+          close(fds[ii][1]);
+          goto error;
+        }
+      ++accepted;
+    }
+
+  expected = string_format("3 %d %d %d\n", fds[0][0], fds[1][0], fds[2][0]);
+  if (!wait_list_reply(fds[0][1], "1 LIST 0 0\n", expected, buf,
+                       sizeof(buf)))
+    {
+      *errors_ret = string_format("unexpected LIST reply: %s", buf);
+      goto error;
+    }
+
+  /* A page of the listing. */
+  xfree(expected);
+  expected = string_format("3 %d %d\n", fds[1][0], fds[2][0]);
+  if (!wait_list_reply(fds[0][1], "1 LIST 1 5\n", expected, buf,
+                       sizeof(buf)))
+    {
+      *errors_ret = string_format("unexpected LIST page: %s", buf);
+      goto error;
+    }
+
+  /* The streamed form, two descriptors per line. */
+  xfree(expected);
+  expected = string_format("3\n%d %d\n%d\n\n", fds[0][0], fds[1][0],
+                           fds[2][0]);
+  if (!wait_list_reply(fds[0][1], "1 LISTSTREAM 2 0\n", expected, buf,
+                       sizeof(buf)))
+    {
+      *errors_ret = string_format("unexpected LISTSTREAM reply: %s", buf);
+      goto error;
+    }
+
+  close(fds[1][1]);
+  fds[1][1] = -1;
+  xfree(expected);
+  expected = string_format("2 %d %d\n", fds[0][0], fds[2][0]);
+  if (!wait_list_reply(fds[0][1], "1 LIST 0 0\n", expected, buf,
+                       sizeof(buf)))
+    {
+      *errors_ret = string_format("LIST after disconnect: %s", buf);
+      goto error;
+    }
+
+  /* Connects and disconnects only mark the snapshot stale; the next
+     LIST copies the registry once. */
+  const RegistrySnapshot snapshot = __atomic_load_n(&server->snapshot,
+                                                    __ATOMIC_SEQ_CST);
+  for (ii = 0; ii < 32; ++ii)
+    {
+      int churn[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, churn) < 0 ||
+          !server_accept_connection(server, churn[0], &errors))
+        {
+          *errors_ret = xstrdup("failed to add churn connection");
+          xfree(errors);
+          goto error;
+        }
+      close(churn[1]);
+    }
+  if (__atomic_load_n(&server->snapshot, __ATOMIC_SEQ_CST) != snapshot)
+    {
+      *errors_ret = xstrdup("registry changes republished the snapshot");
+      goto error;
+    }
+  if (!wait_list_reply(fds[0][1], "1 LIST 0 0\n", expected, buf,
+                       sizeof(buf)))
+    {
+      *errors_ret = string_format("LIST after churn: %s", buf);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  xfree(expected);
+  for (ii = 0; ii < accepted; ++ii)
+    if (fds[ii][1] >= 0)
+      close(fds[ii][1]);
+  server_destroy(server);
+  return ret_val;
+}
+
+/* Read exactly `bytes' from `fd'. */
+static Boolean read_exact(int fd, char *buf, size_t bytes)
+{
+  while (bytes)
+    {
+      ssize_t ret = read(fd, buf, bytes);
+      if (ret <= 0)
+        return FALSE;
+      buf += ret;
+      bytes -= ret;
+    }
+  return TRUE;
+}
+
+/* Read one binary reply frame from `fd' into `buf'.  Returns the
+   payload length, or -1 on a short read. */
+static ssize_t read_binary_reply(int fd, char *buf, size_t bufsize,
+                                 uint16_t *opcode_ret, uint16_t *status_ret,
+                                 uint64_t *request_id_ret)
+{
+  uint32_t length;
+
+  if (!read_exact(fd, buf, BINARY_HEADER_SIZE))
+    return -1;
+  memcpy(&length, buf, 4);
+  memcpy(opcode_ret, buf + 4, 2);
+  memcpy(status_ret, buf + 6, 2);
+  memcpy(request_id_ret, buf + 8, 8);
+  length = le32toh(length);
+  *opcode_ret = le16toh(*opcode_ret);
+  *status_ret = le16toh(*status_ret);
+  *request_id_ret = le64toh(*request_id_ret);
+  if (length > bufsize || !read_exact(fd, buf, length))
+    return -1;
+  return length;
+}
+
+/* Run binary requests over a real socket with the given engine. */
+static Boolean check_engine_binary(ServerEngine engine, char **errors_ret)
+{
+  static const struct
+  {
+    BinaryOp op;
+    uint32_t operands[5];
+    size_t count;
+    uint16_t status;
+    size_t reply_length;
+  } cases[] =
+    {
+      { BINARY_OP_ADD, { 2, 40 }, 2, BINARY_STATUS_OK, 8 },
+      { BINARY_OP_ADD, { 0x7fffffff, 0x7fffffff }, 2, BINARY_STATUS_OK, 8 },
+      { BINARY_OP_NUMCLIENTS, { 0 }, 0, BINARY_STATUS_OK, 8 },
+      { BINARY_OP_LIST, { 0, 0 }, 2, BINARY_STATUS_OK, 12 },
+      { BINARY_OP_ADD, { 1 }, 1, BINARY_STATUS_ERROR, 23 },
+      { 99, { 0 }, 0, BINARY_STATUS_ERROR, 10 },
+      { BINARY_OP_VADD, { 2, 1, -5, 2, 7 }, 5, BINARY_STATUS_OK, 12 },
+      { BINARY_OP_VADD, { 1, 0x7fffffff, 1 }, 3, BINARY_STATUS_ERROR, 16 },
+      { BINARY_OP_VADD, { 2, 1, 1 }, 3, BINARY_STATUS_ERROR, 23 },
+    };
+  const int64_t sums[] = { 42, 0xfffffffeLL };
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  Server server;
+  Boolean ret_val = FALSE;
+  char *errors = NULL;
+  char request[512], buf[256];
+  size_t request_len = 1;
+  int fds[2] = { -1, -1 };
+
+  request[0] = (char) BINARY_MAGIC;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    request_len += binary_encode_request(&request[request_len], cases[i].op,
+                                         100 + i, cases[i].operands,
+                                         cases[i].count);
+
+  params->engine = engine;
+  params->event_loops = 1;
+  server = server_create_with_params(params);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      *errors_ret = xstrdup("socketpair failed");
+      goto error;
+    }
+  if (!server_accept_connection(server, fds[0], &errors))
+    {
+      *errors_ret = string_format("accept failed: %s", errors);
+      xfree(errors);
+      close(fds[0]);
+      goto error;
+    }
+  if (write(fds[1], request, request_len) != request_len)
+    {
+      *errors_ret = xstrdup("failed to send requests");
+      goto error;
+    }
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+      uint16_t opcode = 0, status = 0;
+      uint64_t request_id = 0;
+      int64_t value;
+      uint32_t total, count;
+      const ssize_t length = read_binary_reply(fds[1], buf, sizeof(buf),
+                                               &opcode, &status, &request_id);
+      if (length != cases[i].reply_length || opcode != cases[i].op ||
+          status != cases[i].status || request_id != 100 + i)
+        {
+          *errors_ret = string_format("unexpected reply %zu: length %zd, "
+                                      "op %u, status %u", i, length, opcode,
+                                      status);
+          goto error;
+        }
+
+      memcpy(&value, buf, 8);
+      memcpy(&total, buf, 4);
+      memcpy(&count, buf + 4, 4);
+      if ((i < 2 && (int64_t) le64toh(value) != sums[i]) ||
+          (i == 2 && le64toh(value) != 1) ||
+          (i == 3 && (le32toh(total) != 1 || le32toh(count) != 1)) ||
+          (i == 6 && (le32toh(total) != 2 || le32toh(count) != 3 ||
+                      memcmp(buf + 8, "\x02\x00\x00\x00", 4) != 0)))
+        {
+          *errors_ret = string_format("unexpected payload in reply %zu", i);
+          goto error;
+        }
+    }
+
+  ret_val = TRUE;
+ error:
+  if (fds[1] >= 0)
+    close(fds[1]);
+  server_destroy(server);
+  return ret_val;
+}
+
+TEST_RET test_binary_protocol(char **errors_ret)
+{
+  return check_engine_binary(SERVER_ENGINE_THREADS, errors_ret) &&
+    check_engine_binary(SERVER_ENGINE_EPOLL, errors_ret) &&
+    check_engine_binary(SERVER_ENGINE_URING, errors_ret);
+}
+
+/* Poll the pool statistics until they match or a second passes. */
+static Boolean wait_pool_stats(Server server, size_t pool_size, size_t busy,
+                               ServerPoolStats stats_ret)
+{
+  for (int i = 0; i < 100; ++i)
+    {
+      server_get_pool_stats(server, stats_ret);
+      if (stats_ret->pool_size == pool_size && stats_ret->busy == busy &&
+          stats_ret->queued == 0)
+        return TRUE;
+      usleep(10 * 1000);
+    }
+  return FALSE;
+}
+
+TEST_RET test_pool_elastic(char **errors_ret)
+{
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  ServerPoolStatsStruct stats[1];
+  Server server;
+  Boolean ret_val = FALSE;
+  int fds[3][2];
+  int ii;
+
+  params->min_threads = 1;
+  params->max_threads = 3;
+  params->idle_timeout_ms = 50;
+  params->trace = TRUE;
+  server = server_create_with_params(params);
+
+  if (!wait_pool_stats(server, 1, 0, stats))
+    {
+      *errors_ret = xstrdup("pool should start at the minimum");
+      goto error;
+    }
+
+  for (int round = 0; round < 3; ++round)
+    {
+      /* Idle connections pin a worker each, so the pool grows to the
+         maximum. */
+      for (ii = 0; ii < 3; ii++)
+        {
+          char *errors = NULL;
+          if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[ii]) < 0 ||
+              !server_accept_connection(server, fds[ii][0], &errors))
+            {
+              *errors_ret = xstrdup("failed to add connection");
+              xfree(errors);
+              goto error;
+            }
+        }
+
+      if (!wait_pool_stats(server, 3, 3, stats))
+        {
+          *errors_ret = string_format("pool should have grown to 3 busy, "
+                                      "got %zu/%zu/%zu", stats->pool_size,
+                                      stats->busy, stats->queued);
+          goto error;
+        }
+
+      /* Once the clients leave, the extra workers retire. */
+      for (ii = 0; ii < 3; ii++)
+        close(fds[ii][1]);
+
+      if (!wait_pool_stats(server, 1, 0, stats))
+        {
+          *errors_ret = string_format("idle workers should have retired, "
+                                      "got %zu/%zu/%zu", stats->pool_size,
+                                      stats->busy, stats->queued);
+          goto error;
+        }
+
+      /* Retired workers hand their shards and rings back; this thread
+         keeps one of each for the connections it added. */
+      if (metrics_shard_count(server) > params->max_threads + 1 ||
+          trace_ring_total(server) > params->max_threads + 1)
+        {
+          *errors_ret = string_format("%zu metrics shards and %zu trace "
+                                      "rings after round %d",
+                                      metrics_shard_count(server),
+                                      trace_ring_total(server), round);
+          goto error;
+        }
+    }
+
+  ret_val = TRUE;
+ error:
+  server_destroy(server);
+  return ret_val;
+}
+
+/* Hand the server one end of a new socketpair and return the other,
+   or -1.  A non-zero `sndbuf' shrinks the send buffer of the server
+   end. */
+static int timeout_connect(const Server server, const int sndbuf)
+{
+  char *errors = NULL;
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return -1;
+  if ((sndbuf && setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                            sizeof(sndbuf)) < 0) ||
+      !server_accept_connection(server, fds[0], &errors))
+    {
+      xfree(errors);
+      close(fds[0]);
+      close(fds[1]);
+      return -1;
+    }
+  return fds[1];
+}
+
+/* Read `fd' until the server hangs up, for at most two seconds.  A
+   server closing with requests unread resets the connection. */
+static Boolean wait_hangup(const int fd)
+{
+  const struct timeval timeout = { 2, 0 };
+  char buf[4096];
+  ssize_t ret;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  while ((ret = read(fd, buf, sizeof(buf))) > 0 ||
+         (ret < 0 && errno == EINTR))
+    ;
+  return ret == 0 || errno == ECONNRESET;
+}
+
+/* Poll the timeout counters until they match or two seconds pass. */
+static Boolean wait_timeout_stats(const Server server, const size_t idle,
+                                  const size_t read, const size_t write,
+                                  const ServerTimeoutStats stats_ret)
+{
+  for (int i = 0; i < 200; ++i)
+    {
+      server_get_timeout_stats(server, stats_ret);
+      if (stats_ret->idle == idle && stats_ret->read == read &&
+          stats_ret->write == write)
+        return TRUE;
+      usleep(10 * 1000);
+    }
+  return FALSE;
+}
+
+static Boolean check_engine_timeouts(ServerEngine engine, char **errors_ret)
+{
+  static const char request[] = "1 + 1 1\n";
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  ServerTimeoutStatsStruct stats[1] = { { 0 } };
+  Boolean ret_val = FALSE;
+  char buf[64];
+  int fd = -1;
+
+  params->engine = engine;
+  params->event_loops = 1;
+  params->min_threads = 3;
+  params->conn_idle_timeout_ms = 100;
+  params->read_timeout_ms = 150;
+  params->write_timeout_ms = 150;
+  const Server server = server_create_with_params(params);
+
+  /* Idle after a request. */
+  fd = timeout_connect(server, 0);
+  if (fd < 0 || write(fd, request, strlen(request)) != strlen(request) ||
+      read(fd, buf, sizeof(buf)) <= 0)
+    {
+      *errors_ret = xstrdup("failed to serve a request");
+      goto error;
+    }
+  if (!wait_hangup(fd) || !wait_timeout_stats(server, 1, 0, 0, stats))
+    {
+      *errors_ret = string_format("an idle connection should time out, "
+                                  "got %zu/%zu/%zu", stats->idle,
+                                  stats->read, stats->write);
+      goto error;
+    }
+  close(fd);
+
+  /* A request trickling in a byte at a time, each well within the idle
+     timeout. */
+  fd = timeout_connect(server, 0);
+  for (int i = 0; fd >= 0 && i < 100; ++i)
+    {
+      server_get_timeout_stats(server, stats);
+      if (stats->read ||
+          send(fd, "1", 1, MSG_NOSIGNAL | MSG_DONTWAIT) != 1)
+        break;
+      usleep(20 * 1000);
+    }
+  if (fd < 0 || !wait_hangup(fd) ||
+      !wait_timeout_stats(server, 1, 1, 0, stats))
+    {
+      *errors_ret = string_format("a slow request should time out, "
+                                  "got %zu/%zu/%zu", stats->idle,
+                                  stats->read, stats->write);
+      goto error;
+    }
+  close(fd);
+
+  /* Pipelined requests whose replies are never read. */
+  fd = timeout_connect(server, 4096);
+  for (int i = 0; fd >= 0 && i < 20000; ++i)
+    if (send(fd, request, strlen(request), MSG_NOSIGNAL | MSG_DONTWAIT) !=
+        strlen(request))
+      break;
+  if (fd < 0 || !wait_timeout_stats(server, 1, 1, 1, stats) ||
+      !wait_hangup(fd))
+    {
+      *errors_ret = string_format("a stuck reply should time out, "
+                                  "got %zu/%zu/%zu", stats->idle,
+                                  stats->read, stats->write);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  if (fd >= 0)
+    close(fd);
+  server_destroy(server);
+  return ret_val;
+}
+
+TEST_RET test_client_timeouts(char **errors_ret)
+{
+  return check_engine_timeouts(SERVER_ENGINE_THREADS, errors_ret) &&
+    check_engine_timeouts(SERVER_ENGINE_EPOLL, errors_ret) &&
+    check_engine_timeouts(SERVER_ENGINE_URING, errors_ret);
+}
+
+/* Shut a server down over SHUTDOWN with an idle connection, one with
+   a request in flight and one stuck on replies nobody reads. */
+static Boolean check_engine_drain(ServerEngine engine, char **errors_ret)
+{
+  static const char request[] = "1 + 1 1\n2 SHUTDOWN 0 0\n";
+  static const char expected[] = "1 + 1 1 = 2\n2 SHUTDOWN = 3\n";
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  Boolean ret_val = FALSE;
+  char buf[256], flood[8 * 1024];
+  int idle_fd = -1, busy_fd = -1, stuck_fd = -1;
+
+  params->engine = engine;
+  params->event_loops = 1;
+  params->min_threads = 3;
+  params->drain_timeout_ms = 300;
+  params->shutdown_op = TRUE;
+  Server server = server_create_with_params(params);
+
+  idle_fd = timeout_connect(server, 0);
+  busy_fd = timeout_connect(server, 0);
+  stuck_fd = timeout_connect(server, 4096);
+  /* Requests in large writes, so far more are queued than the replies
+     fit in the socket buffers. */
+  for (size_t i = 0; i < sizeof(flood); i += 8)
+    memcpy(&flood[i], "3 + 1 1\n", 8);
+  for (int i = 0; stuck_fd >= 0 && i < 64; ++i)
+    if (send(stuck_fd, flood, sizeof(flood), MSG_NOSIGNAL | MSG_DONTWAIT) !=
+        sizeof(flood))
+      break;
+  if (idle_fd < 0 || busy_fd < 0 || stuck_fd < 0 ||
+      write(busy_fd, request, strlen(request)) != strlen(request))
+    {
+      *errors_ret = xstrdup("failed to set up connections");
+      goto error;
+    }
+  read_reply(busy_fd, buf, sizeof(buf), strlen(expected));
+  if (strcmp(buf, expected) != 0 || !server_shutdown_requested(server))
+    {
+      *errors_ret = string_format("SHUTDOWN should reply and shut down, "
+                                  "got: %s", buf);
+      goto error;
+    }
+
+  /* Only the stuck connection holds the drain up to its deadline. */
+  const uint64_t start = clock_monotonic_ns();
+  server_destroy(server);
+  server = NULL;
+  const uint64_t elapsed_ms = (clock_monotonic_ns() - start) / 1000000;
+  if (elapsed_ms < 250 || elapsed_ms > 2000)
+    {
+      *errors_ret = string_format("drain took %llu ms, expected about 300",
+                                  (unsigned long long) elapsed_ms);
+      goto error;
+    }
+  if (read(idle_fd, buf, sizeof(buf)) != 0 ||
+      read(busy_fd, buf, sizeof(buf)) != 0 || !wait_hangup(stuck_fd))
+    {
+      *errors_ret = xstrdup("every connection should be closed");
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  if (idle_fd >= 0)
+    close(idle_fd);
+  if (busy_fd >= 0)
+    close(busy_fd);
+  if (stuck_fd >= 0)
+    close(stuck_fd);
+  if (server)
+    server_destroy(server);
+  return ret_val;
+}
+
+TEST_RET test_shutdown_drain(char **errors_ret)
+{
+  return check_engine_drain(SERVER_ENGINE_THREADS, errors_ret) &&
+    check_engine_drain(SERVER_ENGINE_EPOLL, errors_ret) &&
+    check_engine_drain(SERVER_ENGINE_URING, errors_ret);
+}
+
+/* Read from `fd' until what was read ends with `end'.  Returns the
+   bytes read, or -1 if the connection closed first. */
+static ssize_t read_until(const int fd, char * const buf, const size_t size,
+                          const char * const end)
+{
+  const size_t end_length = strlen(end);
+  size_t got = 0;
+
+  while (got < end_length || memcmp(&buf[got - end_length], end, end_length))
+    {
+      const ssize_t ret = read(fd, &buf[got], size - 1 - got);
+      if (ret <= 0)
+        return -1;
+      got += ret;
+      buf[got] = '\0';
+    }
+  return got;
+}
+
+static Boolean check_engine_metrics(ServerEngine engine, char **errors_ret)
+{
+  static const char requests[] = "1 + 1 2\n2 + 3 4\n3 NUMCLIENTS 0 0\n";
+  static const char replies[] = "1 + 1 2 = 3\n2 + 3 4 = 7\n1\n";
+  static const char stats[] = "4 STATS 0 0\n";
+  static const char stats_reply[] = "4 STATS = connections=1 accepted=1 "
+    "closed=0 requests=3 errors=0 bytes_in=";
+  static const char prometheus[] = "5 STATS 1 0\n";
+  static const char bogus[] = "6 BOGUS 0 0\n";
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  ServerMetrics metrics = xcalloc(1, sizeof(*metrics));
+  Boolean ret_val = FALSE;
+  size_t bytes_out = 0;
+  char buf[16384];
+  ssize_t ret;
+
+  params->engine = engine;
+  params->event_loops = 1;
+  params->min_threads = 1;
+  const Server server = server_create_with_params(params);
+  const int fd = timeout_connect(server, 0);
+
+  if (fd < 0 || write(fd, requests, strlen(requests)) != strlen(requests) ||
+      read_reply(fd, buf, sizeof(buf), strlen(replies)) != strlen(replies))
+    {
+      *errors_ret = xstrdup("failed to serve requests");
+      goto error;
+    }
+  bytes_out += strlen(replies);
+
+  if (write(fd, stats, strlen(stats)) != strlen(stats) ||
+      (ret = read_until(fd, buf, sizeof(buf), "\n")) < 0 ||
+      strncmp(buf, stats_reply, strlen(stats_reply)) ||
+      !strstr(buf, " request_p50_ns="))
+    {
+      *errors_ret = string_format("unexpected STATS reply: %s", buf);
+      goto error;
+    }
+  bytes_out += ret;
+
+  if (write(fd, prometheus, strlen(prometheus)) != strlen(prometheus) ||
+      (ret = read_until(fd, buf, sizeof(buf), "\n\n")) < 0 ||
+      !strstr(buf, "\ncserver_requests_total 4\n") ||
+      !strstr(buf, "\ncserver_op_requests_total{op=\"+\"} 2\n") ||
+      !strstr(buf, "\ncserver_process_seconds_count 4\n") ||
+      !strstr(buf, "\ncserver_request_seconds_bucket{le=\"+Inf\"} 4\n"))
+    {
+      *errors_ret = string_format("unexpected Prometheus text: %s", buf);
+      goto error;
+    }
+  bytes_out += ret;
+
+  if (write(fd, bogus, strlen(bogus)) != strlen(bogus) || !wait_hangup(fd))
+    {
+      *errors_ret = xstrdup("an unknown op should close the connection");
+      goto error;
+    }
+
+  /* The connection is counted closed once the server is done with it. */
+  for (int i = 0; i < 200; ++i)
+    {
+      server_get_metrics(server, metrics);
+      if (metrics->counters[SERVER_COUNTER_CLOSED])
+        break;
+      usleep(10 * 1000);
+    }
+  const uint64_t * const counters = metrics->counters;
+  const size_t bytes_in = strlen(requests) + strlen(stats) +
+    strlen(prometheus) + strlen(bogus);
+  if (counters[SERVER_COUNTER_ACCEPTED] != 1 ||
+      counters[SERVER_COUNTER_CLOSED] != 1 ||
+      counters[SERVER_COUNTER_REQUESTS] != 5 ||
+      counters[SERVER_COUNTER_ERRORS] != 1 ||
+      counters[SERVER_COUNTER_BYTES_IN] != bytes_in ||
+      counters[SERVER_COUNTER_BYTES_OUT] != bytes_out)
+    {
+      *errors_ret = string_format("counters %llu %llu %llu %llu %llu %llu",
+                                  (unsigned long long) counters[0],
+                                  (unsigned long long) counters[1],
+                                  (unsigned long long) counters[2],
+                                  (unsigned long long) counters[3],
+                                  (unsigned long long) counters[4],
+                                  (unsigned long long) counters[5]);
+      goto error;
+    }
+  if (metrics->latencies[SERVER_LATENCY_QUEUE_WAIT].count !=
+      (engine == SERVER_ENGINE_THREADS) ||
+      metrics->latencies[SERVER_LATENCY_PROCESS].count != 5 ||
+      metrics->latencies[SERVER_LATENCY_REQUEST].count != 5 ||
+      server_get_op_requests(server, "+") != 2 ||
+      server_get_op_requests(server, "STATS") != 2 ||
+      server_get_op_requests(server, "BOGUS") != 0)
+    {
+      *errors_ret = xstrdup("wrong latency or op counts");
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  if (fd >= 0)
+    close(fd);
+  server_destroy(server);
+  xfree(metrics);
+  return ret_val;
+}
+
+TEST_RET test_metrics(char **errors_ret)
+{
+  return check_engine_metrics(SERVER_ENGINE_THREADS, errors_ret) &&
+    check_engine_metrics(SERVER_ENGINE_EPOLL, errors_ret) &&
+    check_engine_metrics(SERVER_ENGINE_URING, errors_ret);
+}
+
+/* Occurrences of `needle' in `haystack'. */
+static size_t count_substrings(const char *haystack, const char * const needle)
+{
+  size_t count = 0;
+  while ((haystack = strstr(haystack, needle)))
+    {
+      ++count;
+      haystack += strlen(needle);
+    }
+  return count;
+}
+
+static Boolean check_engine_trace(ServerEngine engine, char **errors_ret)
+{
+  static const char traced[] = "1 + 1 2\n";
+  static const char traced_reply[] = "1 + 1 2 = 3\n";
+  static const char off[] = "2 TRACE 0 0\n";
+  static const char untraced[] = "3 + 2 2\n";
+  static const char untraced_reply[] = "3 + 2 2 = 4\n";
+  static const char dump[] = "4 TRACE 2 0\n";
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  Boolean ret_val = FALSE;
+  char buf[16384];
+
+  params->engine = engine;
+  params->event_loops = 1;
+  params->min_threads = 1;
+  params->trace = TRUE;
+  const Server server = server_create_with_params(params);
+  const int fd = timeout_connect(server, 0);
+
+  /* Requests are traced until "TRACE 0 0" turns tracing off. */
+  if (fd < 0 || write(fd, traced, strlen(traced)) != strlen(traced) ||
+      read_reply(fd, buf, sizeof(buf), strlen(traced_reply)) !=
+      strlen(traced_reply) || strcmp(buf, traced_reply) ||
+      write(fd, off, strlen(off)) != strlen(off) ||
+      read_reply(fd, buf, sizeof(buf), 2) != 2 || strcmp(buf, "0\n") ||
+      server_tracing(server) ||
+      write(fd, untraced, strlen(untraced)) != strlen(untraced) ||
+      read_reply(fd, buf, sizeof(buf), strlen(untraced_reply)) !=
+      strlen(untraced_reply) ||
+      write(fd, dump, strlen(dump)) != strlen(dump) ||
+      read_until(fd, buf, sizeof(buf), "]}\n") < 0)
+    {
+      *errors_ret = xstrdup("failed to serve requests");
+      goto error;
+    }
+
+#ifdef CSERVER_NO_TRACE
+  if (strcmp(buf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}\n"))
+    {
+      *errors_ret = string_format("trace points compiled in: %s", buf);
+      goto error;
+    }
+#else
+  const Boolean reads = engine != SERVER_ENGINE_URING;
+  if (strncmp(buf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[{", 40) ||
+      count_substrings(buf, "\"name\":\"queue\"") !=
+      (engine == SERVER_ENGINE_THREADS) ||
+      (count_substrings(buf, "\"name\":\"read\"") > 0) != reads ||
+      count_substrings(buf, "\"name\":\"process\"") != 1 ||
+      count_substrings(buf, "\"op\":\"+\"}}") != 1 ||
+      count_substrings(buf, "\"name\":\"write\"") != 1 ||
+      count_substrings(buf, "\"ph\":\"X\"") !=
+      count_substrings(buf, "\"dur\":"))
+    {
+      *errors_ret = string_format("unexpected trace: %s", buf);
+      goto error;
+    }
+#endif
+
+  ret_val = TRUE;
+ error:
+  if (fd >= 0)
+    close(fd);
+  server_destroy(server);
+  return ret_val;
+}
+
+TEST_RET test_trace(char **errors_ret)
+{
+  return check_engine_trace(SERVER_ENGINE_THREADS, errors_ret) &&
+    check_engine_trace(SERVER_ENGINE_EPOLL, errors_ret) &&
+    check_engine_trace(SERVER_ENGINE_URING, errors_ret);
+}
+
+TEST_RET test_log(char **errors_ret)
+{
+  static const char storm[] = "WARNING: log storm 7\n";
+  LogStatsStruct before[1], after[1];
+  FILE * const out = tmpfile();
+  char buf[16384];
+  size_t length;
+  Boolean ret_val = FALSE;
+
+  if (!out)
+    {
+      *errors_ret = xstrdup("Failed to create a temporary file");
+      return FALSE;
+    }
+  log_get_stats(before);
+  const int previous = log_set_fd(fileno(out));
+  for (int i = 0; i < 1000; ++i)
+    warning("log storm %d", 7);
+  /* Other warnings have limits of their own, and debug messages none;
+     flushing keeps the ring from filling up. */
+  log_flush();
+  warning("log storm over");
+  for (int i = 0; i < 3 * LOG_BURST; ++i)
+    {
+      debug("log debug %d", i);
+      if (i % 32 == 31)
+        log_flush();
+    }
+  log_flush();
+  log_get_stats(after);
+  log_set_fd(previous);
+
+  rewind(out);
+  length = fread(buf, 1, sizeof(buf) - 1, out);
+  buf[length] = '\0';
+  /* The burst goes through, folded into one line, and the rest is
+     counted. */
+  if (count_substrings(buf, storm) != 1 ||
+      !strstr(buf, "WARNING: last message repeated ") ||
+      count_substrings(buf, "WARNING: log storm over\n") != 1 ||
+      count_substrings(buf, "\nlog debug ") != 3 * LOG_BURST ||
+      !strstr(buf, " log messages suppressed ") ||
+      after->repeated - before->repeated == 0 ||
+      after->suppressed - before->suppressed < 1000 - 2 * LOG_BURST)
+    {
+      *errors_ret = string_format("unexpected log, %llu suppressed: %s",
+                                  (unsigned long long)
+                                  (after->suppressed - before->suppressed),
+                                  buf);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  fclose(out);
+  return ret_val;
+}
+
+/* Hang up the client ends so the worker lets go, then destroy the
+   server. */
+static void admission_server_destroy(const Server server, int fds[][2],
+                                     const size_t count)
+{
+  for (size_t ii = 0; ii < count; ii++)
+    if (fds[ii][1] >= 0)
+      {
+        close(fds[ii][1]);
+        fds[ii][1] = -1;
+      }
+  server_destroy(server);
+}
+
+/* A server with a single worker, pinned by an idle connection, and
+   `queued' more connections waiting for it.  fds[ii][1] are the client
+   ends. */
+static Server admission_server(const ServerAdmission admission,
+                               const size_t max_queued,
+                               const long queue_target_ms,
+                               int fds[][2], const size_t queued)
+{
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  ServerPoolStatsStruct stats[1];
+
+  params->min_threads = params->max_threads = 1;
+  params->max_queued = max_queued;
+  params->admission = admission;
+  params->queue_target_ms = queue_target_ms;
+  params->queue_interval_ms = queue_target_ms;
+  const Server server = server_create_with_params(params);
+
+  for (size_t ii = 0; ii <= queued; ii++)
+    {
+      char *errors = NULL;
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[ii]) < 0)
+        fds[ii][1] = -1;
+      if (fds[ii][1] < 0 ||
+          !server_accept_connection(server, fds[ii][0], &errors) ||
+          (!ii && !wait_pool_stats(server, 1, 1, stats)))
+        {
+          xfree(errors);
+          admission_server_destroy(server, fds, ii + 1);
+          return NULL;
+        }
+    }
+  return server;
+}
+
+/* Whether the client end `fd' got SERVER_BUSY_REPLY. */
+static Boolean read_busy_reply(const int fd)
+{
+  char buf[64];
+  const ssize_t n = read(fd, buf, sizeof(buf));
+  return n == strlen(SERVER_BUSY_REPLY) &&
+    !memcmp(buf, SERVER_BUSY_REPLY, n);
+}
+
+typedef struct AdmissionTestCtxRec
+{
+  Server server;
+  int fd;
+  Boolean accepted, done;
+} AdmissionTestCtxStruct, *AdmissionTestCtx;
+
+static void *admission_accept_thread(void *context)
+{
+  const AdmissionTestCtx ctx = context;
+  char *errors = NULL;
+
+  ctx->accepted = server_accept_connection(ctx->server, ctx->fd, &errors);
+  xfree(errors);
+  __atomic_store_n(&ctx->done, TRUE, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+TEST_RET test_admission(char **errors_ret)
+{
+  ServerPoolStatsStruct stats[1];
+  Server server = NULL;
+  Boolean ret_val = FALSE;
+  char *errors = NULL;
+  int fds[5][2];
+  AdmissionTestCtxStruct ctx[1] = { { NULL, -1, FALSE, FALSE } };
+  Boolean started = FALSE;
+
+  for (int ii = 0; ii < 5; ii++)
+    fds[ii][1] = -1;
+
+  /* Refused outright once two connections are waiting. */
+  server = admission_server(SERVER_ADMISSION_REJECT, 2, 0, fds, 2);
+  if (!server || socketpair(AF_UNIX, SOCK_STREAM, 0, fds[3]) < 0)
+    {
+      *errors_ret = xstrdup("failed to set up connections");
+      goto error;
+    }
+  if (server_accept_connection(server, fds[3][0], &errors) || !errors ||
+      !read_busy_reply(fds[3][1]))
+    {
+      *errors_ret = xstrdup("a third queued connection should be rejected");
+      goto error;
+    }
+  xfree(errors);
+  errors = NULL;
+  server_get_pool_stats(server, stats);
+  if (stats->rejected != 1 || stats->queued != 2)
+    {
+      *errors_ret = string_format("expected 1 rejected and 2 queued, "
+                                  "got %zu/%zu", stats->rejected,
+                                  stats->queued);
+      goto error;
+    }
+  admission_server_destroy(server, fds, 5);
+
+  /* The longest waiting connection makes room for the new one. */
+  server = admission_server(SERVER_ADMISSION_DROP_OLDEST, 2, 0, fds, 2);
+  if (!server || socketpair(AF_UNIX, SOCK_STREAM, 0, fds[3]) < 0)
+    {
+      *errors_ret = xstrdup("failed to set up connections");
+      goto error;
+    }
+  if (!server_accept_connection(server, fds[3][0], &errors) ||
+      !read_busy_reply(fds[1][1]))
+    {
+      *errors_ret = xstrdup("the oldest queued connection should be dropped");
+      goto error;
+    }
+  server_get_pool_stats(server, stats);
+  if (stats->dropped != 1 || stats->queued != 2)
+    {
+      *errors_ret = string_format("expected 1 dropped and 2 queued, "
+                                  "got %zu/%zu", stats->dropped,
+                                  stats->queued);
+      goto error;
+    }
+  admission_server_destroy(server, fds, 5);
+
+  /* The acceptor waits until the worker takes a queued connection. */
+  server = admission_server(SERVER_ADMISSION_BLOCK, 2, 0, fds, 2);
+  if (!server || socketpair(AF_UNIX, SOCK_STREAM, 0, fds[3]) < 0)
+    {
+      *errors_ret = xstrdup("failed to set up connections");
+      goto error;
+    }
+  ctx->server = server;
+  ctx->fd = fds[3][0];
+  started = thread_create(admission_accept_thread, ctx);
+  if (!started)
+    {
+      *errors_ret = xstrdup("failed to start the acceptor");
+      goto error;
+    }
+  usleep(50 * 1000);
+  if (__atomic_load_n(&ctx->done, __ATOMIC_SEQ_CST))
+    {
+      *errors_ret = xstrdup("the acceptor should block on full queues");
+      goto error;
+    }
+  close(fds[0][1]);
+  fds[0][1] = -1;
+  for (int i = 0; i < 100 && !__atomic_load_n(&ctx->done, __ATOMIC_SEQ_CST);
+       ++i)
+    usleep(10 * 1000);
+  if (!__atomic_load_n(&ctx->done, __ATOMIC_SEQ_CST) || !ctx->accepted)
+    {
+      *errors_ret = xstrdup("the acceptor should resume once there is room");
+      goto error;
+    }
+  started = FALSE;
+  admission_server_destroy(server, fds, 5);
+
+  /* Three connections wait 20ms each, over the 5ms target for longer
+     than the interval, so new ones are shed while any is waiting. */
+  server = admission_server(SERVER_ADMISSION_REJECT, 0, 5, fds, 3);
+  if (!server || socketpair(AF_UNIX, SOCK_STREAM, 0, fds[4]) < 0)
+    {
+      *errors_ret = xstrdup("failed to set up connections");
+      goto error;
+    }
+  usleep(20 * 1000);
+  close(fds[0][1]);
+  fds[0][1] = -1;
+  usleep(20 * 1000);
+  close(fds[1][1]);
+  fds[1][1] = -1;
+  for (int i = 0; i < 100; ++i)
+    {
+      server_get_pool_stats(server, stats);
+      if (stats->overloaded)
+        break;
+      usleep(10 * 1000);
+    }
+  if (!stats->overloaded || stats->queue_delay_max_us < 20 * 1000)
+    {
+      *errors_ret = string_format("a 20ms queueing delay should overload, "
+                                  "got a %llu us maximum",
+                                  (unsigned long long)
+                                  stats->queue_delay_max_us);
+      goto error;
+    }
+  if (server_accept_connection(server, fds[4][0], &errors) || !errors ||
+      !read_busy_reply(fds[4][1]))
+    {
+      *errors_ret = xstrdup("an overloaded server should shed connections");
+      goto error;
+    }
+  server_get_pool_stats(server, stats);
+  if (stats->shed != 1)
+    {
+      *errors_ret = string_format("expected 1 shed, got %zu", stats->shed);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  xfree(errors);
+  if (server)
+    {
+      /* Shutting down releases a blocked acceptor. */
+      server_shutdown(server);
+      while (started && !__atomic_load_n(&ctx->done, __ATOMIC_SEQ_CST))
+        usleep(1000);
+      admission_server_destroy(server, fds, 5);
+    }
+  return ret_val;
+}
+
+typedef struct ServeTestCtxRec
+{
+  Server server;
+  int listen_fd;
+  /* Served with server_serve_sharded() if set. */
+  const int *listen_fds;
+  size_t listen_count;
+  Mutex mutex;
+  Condition cv;
+  Boolean started, done;
+} ServeTestCtxStruct, *ServeTestCtx;
+
+static void *serve_thread(void *context)
+{
+  ServeTestCtx test_ctx = context;
+  if (test_ctx->listen_count)
+    server_serve_sharded(test_ctx->server, test_ctx->listen_fds,
+                         test_ctx->listen_count);
+  else
+    server_serve(test_ctx->server, test_ctx->listen_fd);
+  mutex_lock(test_ctx->mutex);
+  test_ctx->done = TRUE;
+  condition_signal(test_ctx->cv);
+  mutex_unlock(test_ctx->mutex);
+  return NULL;
+}
+
+/* Connect to the local listener at `path'. */
+static int connect_local(const char *path)
+{
+  struct sockaddr_un saddr = { 0 };
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  saddr.sun_family = AF_UNIX;
+  strncpy(saddr.sun_path, path, sizeof(saddr.sun_path) - 1);
+  if (fd >= 0 && connect(fd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  return fd;
+}
+
+/* Connect to `port' on the loopback interface. */
+static int connect_tcp(int port)
+{
+  struct sockaddr_in saddr = { 0 };
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  saddr.sin_family = AF_INET;
+  saddr.sin_port = htons(port);
+  saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  return fd;
+}
+
+/* server_serve() accepts and serves connections until shutdown. */
+static Boolean check_engine_serve(ServerEngine engine, char **errors_ret)
+{
+  static const char request[] = "1 + 2 3\n2 NUMCLIENTS 0 0\n";
+  static const char expected[] = "1 + 2 3 = 5\n1\n";
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  ServeTestCtxStruct test_ctx[1] = { { 0 } };
+  Boolean ret_val = FALSE;
+  char buf[256];
+  int fd = -1;
+
+  unlink("serve.sock");
+  test_ctx->listen_fd = create_local_listener("serve.sock");
+  test_ctx->mutex = mutex_create();
+  test_ctx->cv = condition_create();
+  params->engine = engine;
+  params->event_loops = 1;
+  test_ctx->server = server_create_with_params(params);
+  if (test_ctx->listen_fd >= 0 && test_ctx->server)
+    test_ctx->started = thread_create(serve_thread, test_ctx);
+  if (!test_ctx->started)
+    {
+      *errors_ret = xstrdup("failed to start serving");
+      goto error;
+    }
+
+  fd = connect_local("serve.sock");
+  if (fd < 0 || write(fd, request, strlen(request)) != strlen(request))
+    {
+      *errors_ret = xstrdup("failed to send requests");
+      goto error;
+    }
+
+  read_reply(fd, buf, sizeof(buf), strlen(expected));
+  if (strcmp(buf, expected) != 0)
+    {
+      *errors_ret = string_format("unexpected replies: %s", buf);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  if (fd >= 0)
+    close(fd);
+  if (test_ctx->server)
+    {
+      server_shutdown(test_ctx->server);
+      /* Kick a blocking accept() loop so it sees the shutdown. */
+      fd = connect_local("serve.sock");
+      if (fd >= 0)
+        close(fd);
+      mutex_lock(test_ctx->mutex);
+      while (test_ctx->started && !test_ctx->done)
+        condition_wait(test_ctx->cv, test_ctx->mutex);
+      mutex_unlock(test_ctx->mutex);
+      server_destroy(test_ctx->server);
+    }
+  if (test_ctx->listen_fd >= 0)
+    close(test_ctx->listen_fd);
+  unlink("serve.sock");
+  mutex_destroy(test_ctx->mutex);
+  condition_destroy(test_ctx->cv);
+  return ret_val;
+}
+
+#define SHARDED_LISTENERS 4
+#define SHARDED_CLIENTS 16
+
+/* Listeners sharing a port through SO_REUSEPORT are served by one
+   acceptor each. */
+static Boolean check_engine_sharded(ServerEngine engine, char **errors_ret)
+{
+  ServerCreateParamsStruct params[1] = { { 0 } };
+  ServeTestCtxStruct test_ctx[1] = { { 0 } };
+  int listen_fds[SHARDED_LISTENERS], fds[SHARDED_CLIENTS];
+  Boolean ret_val = FALSE;
+  int port = 0;
+  char buf[256];
+
+  for (int i = 0; i < SHARDED_CLIENTS; ++i)
+    fds[i] = -1;
+  for (int i = 0; i < SHARDED_LISTENERS; ++i)
+    {
+      listen_fds[i] = create_tcp_listener("127.0.0.1", port, 16, TRUE, TRUE);
+      if (!i && listen_fds[i] >= 0)
+        port = socket_local_port(listen_fds[i]);
+    }
+  test_ctx->listen_fds = listen_fds;
+  test_ctx->listen_count = SHARDED_LISTENERS;
+  test_ctx->mutex = mutex_create();
+  test_ctx->cv = condition_create();
+  params->engine = engine;
+  /* One ring per listener, so the io_uring engine accepts in the
+     rings. */
+  params->event_loops = SHARDED_LISTENERS;
+  test_ctx->server = server_create_with_params(params);
+  if (port > 0 && listen_fds[SHARDED_LISTENERS - 1] >= 0 && test_ctx->server)
+    test_ctx->started = thread_create(serve_thread, test_ctx);
+  if (!test_ctx->started)
+    {
+      *errors_ret = xstrdup("failed to start serving");
+      goto error;
+    }
+
+  for (int i = 0; i < SHARDED_CLIENTS; ++i)
+    {
+      char request[64], expected[64];
+      snprintf(request, sizeof(request), "%d + %d 1\n", i, i);
+      snprintf(expected, sizeof(expected), "%d + %d 1 = %d\n", i, i, i + 1);
+      fds[i] = connect_tcp(port);
+      if (fds[i] < 0 ||
+          write(fds[i], request, strlen(request)) != strlen(request))
+        {
+          *errors_ret = xstrdup("failed to send request");
+          goto error;
+        }
+      read_reply(fds[i], buf, sizeof(buf), strlen(expected));
+      if (strcmp(buf, expected) != 0)
+        {
+          *errors_ret = string_format("unexpected reply: %s", buf);
+          goto error;
+        }
+    }
+
+  ret_val = TRUE;
+ error:
+  for (int i = 0; i < SHARDED_CLIENTS; ++i)
+    if (fds[i] >= 0)
+      close(fds[i]);
+  if (test_ctx->server)
+    {
+      /* Blocked acceptors are woken without a connection. */
+      server_shutdown(test_ctx->server);
+      mutex_lock(test_ctx->mutex);
+      while (test_ctx->started && !test_ctx->done)
+        condition_wait(test_ctx->cv, test_ctx->mutex);
+      mutex_unlock(test_ctx->mutex);
+      server_destroy(test_ctx->server);
+    }
+  for (int i = 0; i < SHARDED_LISTENERS; ++i)
+    if (listen_fds[i] >= 0)
+      close(listen_fds[i]);
+  mutex_destroy(test_ctx->mutex);
+  condition_destroy(test_ctx->cv);
+  return ret_val;
+}
+
+TEST_RET test_serve_sharded(char **errors_ret)
+{
+  return check_engine_sharded(SERVER_ENGINE_THREADS, errors_ret) &&
+    check_engine_sharded(SERVER_ENGINE_EPOLL, errors_ret) &&
+    check_engine_sharded(SERVER_ENGINE_URING, errors_ret);
+}
+
+#define SHED_CLIENTS 4
+
+/* Out of descriptors, the acceptor closes pending connections instead
+   of spinning on EMFILE, and resumes once descriptors are back. */
+TEST_RET test_accept_emfile(char **errors_ret)
+{
+  static const char request[] = "1 + 2 3\n";
+  static const char expected[] = "1 + 2 3 = 5\n";
+  ServeTestCtxStruct test_ctx[1] = { { 0 } };
+  ServerAcceptStatsStruct stats[1];
+  struct sockaddr_un saddr = { 0 };
+  struct rlimit limit, saved_limit;
+  int fds[SHED_CLIENTS], first_fd = -1, fd = -1, probe;
+  Boolean ret_val = FALSE, limited = FALSE;
+  char buf[256];
+
+  for (int i = 0; i < SHED_CLIENTS; ++i)
+    fds[i] = -1;
+  unlink("shed.sock");
+  test_ctx->listen_fd = create_local_listener("shed.sock");
+  test_ctx->mutex = mutex_create();
+  test_ctx->cv = condition_create();
+  test_ctx->server = server_create();
+  if (test_ctx->listen_fd >= 0 && test_ctx->server)
+    test_ctx->started = thread_create(serve_thread, test_ctx);
+  if (!test_ctx->started)
+    {
+      *errors_ret = xstrdup("failed to start serving");
+      goto error;
+    }
+
+  /* A served request shows the acceptor is up with its reserve. */
+  first_fd = connect_local("shed.sock");
+  if (first_fd < 0 ||
+      write(first_fd, request, strlen(request)) != strlen(request))
+    {
+      *errors_ret = xstrdup("failed to send request");
+      goto error;
+    }
+  read_reply(first_fd, buf, sizeof(buf), strlen(expected));
+  if (strcmp(buf, expected) != 0)
+    {
+      *errors_ret = string_format("unexpected reply: %s", buf);
+      goto error;
+    }
+
+  /* Sockets made up front connect without a new descriptor, then no
+     descriptor is left for the acceptor. */
+  for (int i = 0; i < SHED_CLIENTS; ++i)
+    if ((fds[i] = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      {
+        *errors_ret = xstrdup("socket failed");
+        goto error;
+      }
+  probe = dup(0);
+  close(probe);
+  getrlimit(RLIMIT_NOFILE, &saved_limit);
+  limit = saved_limit;
+  limit.rlim_cur = probe;
+  if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+      *errors_ret = xstrdup("setrlimit failed");
+      goto error;
+    }
+  limited = TRUE;
+
+  saddr.sun_family = AF_UNIX;
+  strncpy(saddr.sun_path, "shed.sock", sizeof(saddr.sun_path) - 1);
+  for (int i = 0; i < SHED_CLIENTS; ++i)
+    if (connect(fds[i], (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+      {
+        *errors_ret = xstrdup("connect failed");
+        goto error;
+      }
+  for (int i = 0; i < SHED_CLIENTS; ++i)
+    if (read(fds[i], buf, sizeof(buf)) > 0)
+      {
+        *errors_ret = xstrdup("a shed connection should be closed");
+        goto error;
+      }
+  server_get_accept_stats(test_ctx->server, stats);
+  if (stats->shed != SHED_CLIENTS || stats->accepted != 1)
+    {
+      *errors_ret = string_format("unexpected stats: %zu accepted, %zu shed",
+                                  stats->accepted, stats->shed);
+      goto error;
+    }
+
+  setrlimit(RLIMIT_NOFILE, &saved_limit);
+  limited = FALSE;
+  fd = connect_local("shed.sock");
+  if (fd < 0 || write(fd, request, strlen(request)) != strlen(request))
+    {
+      *errors_ret = xstrdup("failed to send request");
+      goto error;
+    }
+  read_reply(fd, buf, sizeof(buf), strlen(expected));
+  if (strcmp(buf, expected) != 0)
+    {
+      *errors_ret = string_format("no recovery, reply: %s", buf);
+      goto error;
+    }
+
+  ret_val = TRUE;
+ error:
+  if (limited)
+    setrlimit(RLIMIT_NOFILE, &saved_limit);
+  for (int i = 0; i < SHED_CLIENTS; ++i)
+    if (fds[i] >= 0)
+      close(fds[i]);
+  if (first_fd >= 0)
+    close(first_fd);
+  if (fd >= 0)
+    close(fd);
+  if (test_ctx->server)
+    {
+      server_shutdown(test_ctx->server);
+      mutex_lock(test_ctx->mutex);
+      while (test_ctx->started && !test_ctx->done)
+        condition_wait(test_ctx->cv, test_ctx->mutex);
+      mutex_unlock(test_ctx->mutex);
+      server_destroy(test_ctx->server);
+    }
+  if (test_ctx->listen_fd >= 0)
+    close(test_ctx->listen_fd);
+  unlink("shed.sock");
+  mutex_destroy(test_ctx->mutex);
+  condition_destroy(test_ctx->cv);
+  return ret_val;
+}
+
+TEST_RET test_serve_epoll(char **errors_ret)
+{
+  return check_engine_serve(SERVER_ENGINE_EPOLL, errors_ret);
+}
+
+TEST_RET test_serve_uring(char **errors_ret)
+{
+  return check_engine_serve(SERVER_ENGINE_URING, errors_ret);
+}
+
+/* Add your tests here. */
+
+/***************************** Test framework. ******************************/
+
+#define FUN(fun)                                \
+  { #fun, fun }
+
+struct {
+  char *name;
+  Boolean (*func)(char **);
+  int serial_number;
+} test_funcs[] =
+  {
+    FUN(test_create_listener),
+    FUN(test_server_shutdown),
+
+    FUN(test_mutex),
+    FUN(test_null_mutex_destroy),
+    FUN(test_condition),
+    FUN(test_condition_timedwait),
+    FUN(test_null_condition_destroy),
+    FUN(test_thread_noop),
+    FUN(test_thread),
+    FUN(test_mutex_contention),
+    FUN(test_work_queue),
+    FUN(test_timer_wheel),
+    FUN(test_histogram),
+    FUN(test_arena),
+    FUN(test_object_pool),
+    FUN(test_vector_add),
+    FUN(test_decimal),
+    FUN(test_log),
+
+    FUN(test_communicate),
+    FUN(test_communicate_pipelined),
+    FUN(test_communicate_writev),
+    FUN(test_process_line),
+    FUN(test_lock_profile),
+    FUN(test_request_no_malloc),
+    FUN(test_vadd),
+
+    FUN(test_engine_threads),
+    FUN(test_engine_epoll),
+    FUN(test_engine_uring),
+    FUN(test_serve_epoll),
+    FUN(test_serve_uring),
+    FUN(test_serve_sharded),
+    FUN(test_accept_emfile),
+    FUN(test_binary_protocol),
+    FUN(test_pool_elastic),
+    FUN(test_admission),
+    FUN(test_client_timeouts),
+    FUN(test_shutdown_drain),
+    FUN(test_metrics),
+    FUN(test_trace),
+    FUN(test_list_registry),
 
     { NULL, NULL }
   };
@@ -433,6 +2904,10 @@ int main(int argc, char **argv)
         }
     }
 
+  /* Connections the server gives up on fail the writes of its
+     workers. */
+  signal(SIGPIPE, SIG_IGN);
+
   /* Run tests. */
   for (ii = 0; test_funcs[ii].name; ii++)
     {
@@ -463,6 +2938,8 @@ int main(int argc, char **argv)
 
   {
     Boolean success = failed_tests == 0 ? TRUE : FALSE;
+    /* The tests' warnings come first. */
+    log_flush();
     fprintf(stderr,
             "\n%s: Ran %d test%s, with %d failure%s.\n.",
             success ? "OK" : "FAIL",
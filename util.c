@@ -4,25 +4,44 @@
 #define _GNU_SOURCE
 #include "util.h"
 
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <stdarg.h>
 #include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <signal.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-static OutputMode output_mode = OM_NORMAL;
+OutputMode current_output_mode = OM_NORMAL;
 
 OutputMode get_output_mode()
 {
-  return output_mode;
+  return current_output_mode;
 }
 
 void set_output_mode(OutputMode given_output_mode)
 {
-  output_mode = given_output_mode;
+  current_output_mode = given_output_mode;
+}
+
+static __thread size_t allocations;
+
+size_t allocation_count(void)
+{
+  return allocations;
 }
 
 char *string_format(const char *format, ...)
@@ -31,6 +50,7 @@ char *string_format(const char *format, ...)
   va_list ap;
   int ret;
 
+  ++allocations;
   va_start(ap, format);
   ret = vasprintf(&message, format, ap);
   va_end(ap);
@@ -39,34 +59,352 @@ char *string_format(const char *format, ...)
   return message;
 }
 
+/* Logging.  Every thread that logs owns a ring of LOG_RING_RECORDS
+   messages, the first bytes of each a NUL-terminated line.  The owner
+   is the only producer; the writer thread, or log_flush(), is the
+   only consumer, under log_mutex, which also guards the list of rings
+   and the writer state.  Producers take no lock; they wake the writer
+   when their ring was empty, and it drains every LOG_WRITER_PERIOD_MS
+   regardless.  This sits below Mutex and thread_create(), which log
+   their own failures, so it uses pthreads directly. */
+#define LOG_RING_RECORDS 64
+#define LOG_WRITER_PERIOD_MS 100
+/* How often repeats and suppressed messages are reported while they
+   keep coming. */
+#define LOG_REPORT_PERIOD_MS 1000
+
+/* Rate limits a thread keeps, one per format of warning(), the
+   formats sharing them by the hash of their address. */
+#define LOG_LIMITS 16
+
+/* The rate limit of a format: the second it counts for, and the
+   messages left in it. */
+typedef struct LogLimitRec
+{
+  const char *format;
+  uint64_t window;
+  unsigned budget;
+} LogLimitStruct, *LogLimit;
+
+typedef struct LogRingRec *LogRing;
+
+struct LogRingRec
+{
+  LogRing next;
+  /* Messages consumed and produced. */
+  uint64_t head, tail;
+  /* The owner's rate limits. */
+  LogLimitStruct limits[LOG_LIMITS];
+  /* Counted by the owner, and the counts the writer has collected. */
+  uint64_t suppressed, dropped;
+  uint64_t suppressed_seen, dropped_seen;
+  /* Set once the owner has exited; the ring is freed once drained. */
+  Boolean orphaned;
+  char records[LOG_RING_RECORDS][LOG_MESSAGE_MAX];
+};
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static Boolean log_writer_running;
+static LogRing log_rings;
+static int log_fd = STDERR_FILENO;
+
+/* Writer state: the last line written and its repeats since, the
+   suppressed and dropped messages not yet reported, and when to report
+   them next. */
+static char log_last[LOG_MESSAGE_MAX];
+static uint64_t log_repeats, log_suppressed, log_dropped, log_report_ms;
+static LogStatsStruct log_stats;
+static char log_buffer[16384];
+static size_t log_buffer_used;
+
+static void log_output_flush(void)
+{
+  for (size_t done = 0; done < log_buffer_used; )
+    {
+      const ssize_t ret = write(log_fd, log_buffer + done,
+                                log_buffer_used - done);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        break;
+      done += ret;
+    }
+  log_buffer_used = 0;
+}
+
+static void log_output(const char * const line)
+{
+  const size_t length = strlen(line);
+  if (log_buffer_used + length + 1 > sizeof(log_buffer))
+    log_output_flush();
+  memcpy(log_buffer + log_buffer_used, line, length);
+  log_buffer_used += length;
+  log_buffer[log_buffer_used++] = '\n';
+  ++log_stats.written;
+}
+
+/* Report the repeats of the last line and the messages lost. */
+static void log_report(void)
+{
+  char line[128];
+
+  if (log_repeats)
+    {
+      snprintf(line, sizeof(line), "WARNING: last message repeated %llu "
+               "times",
+               (unsigned long long) log_repeats);
+      log_output(line);
+      log_repeats = 0;
+    }
+  if (log_suppressed || log_dropped)
+    {
+      snprintf(line, sizeof(line), "WARNING: %llu log messages suppressed "
+               "by the rate limit, %llu dropped",
+               (unsigned long long) log_suppressed,
+               (unsigned long long) log_dropped);
+      log_output(line);
+      log_suppressed = log_dropped = 0;
+    }
+}
+
+static void log_emit(const char * const line)
+{
+  if (!strcmp(line, log_last))
+    {
+      ++log_repeats;
+      ++log_stats.repeated;
+      return;
+    }
+  if (log_repeats)
+    log_report();
+  strcpy(log_last, line);
+  log_output(line);
+}
+
+/* Write out what the rings hold; with `report', also the pending
+   repeat and loss counts, which are otherwise held back until
+   LOG_REPORT_PERIOD_MS has passed.  Called under log_mutex. */
+static void log_drain(const Boolean report)
+{
+  const uint64_t now = clock_monotonic_coarse_ms();
+  LogRing *link = &log_rings;
+
+  while (*link)
+    {
+      const LogRing ring = *link;
+      const uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+      for (uint64_t i = ring->head; i < tail; ++i)
+        log_emit(ring->records[i % LOG_RING_RECORDS]);
+      __atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+
+      const uint64_t suppressed = __atomic_load_n(&ring->suppressed,
+                                                  __ATOMIC_RELAXED);
+      const uint64_t dropped = __atomic_load_n(&ring->dropped,
+                                               __ATOMIC_RELAXED);
+      log_suppressed += suppressed - ring->suppressed_seen;
+      log_stats.suppressed += suppressed - ring->suppressed_seen;
+      log_dropped += dropped - ring->dropped_seen;
+      log_stats.dropped += dropped - ring->dropped_seen;
+      ring->suppressed_seen = suppressed;
+      ring->dropped_seen = dropped;
+
+      if (ring->orphaned &&
+          __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == tail)
+        {
+          *link = ring->next;
+          free(ring);
+        }
+      else
+        link = &ring->next;
+    }
+
+  if (report || now >= log_report_ms)
+    {
+      log_report();
+      log_report_ms = now + LOG_REPORT_PERIOD_MS;
+    }
+  log_output_flush();
+}
+
+/* Once nothing has been logged for LOG_WRITER_PERIOD_MS, the writer
+   also reports the repeats and losses pending, so they do not wait for
+   the next message or for exit. */
+static void *log_writer(void *context)
+{
+  Boolean idle = FALSE;
+
+  pthread_mutex_lock(&log_mutex);
+  while (TRUE)
+    {
+      struct timespec deadline;
+
+      log_drain(idle);
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOG_WRITER_PERIOD_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      idle = pthread_cond_timedwait(&log_cond, &log_mutex,
+                                    &deadline) == ETIMEDOUT;
+    }
+  return NULL;
+}
+
+/* The owner of a ring has exited. */
+static void log_ring_release(void *context)
+{
+  const LogRing ring = context;
+
+  pthread_mutex_lock(&log_mutex);
+  ring->orphaned = TRUE;
+  pthread_mutex_unlock(&log_mutex);
+}
+
+static void log_init(void)
+{
+  pthread_attr_t attrs;
+  pthread_t thread;
+  sigset_t all, saved;
+
+  if (pthread_key_create(&log_key, log_ring_release) != 0)
+    abort();
+  atexit(log_flush);
+
+  /* The writer must not take signals meant for the threads that wait
+     for them. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  pthread_attr_init(&attrs);
+  pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attrs, 128 * 1024);
+  log_writer_running = pthread_create(&thread, &attrs, log_writer,
+                                      NULL) == 0;
+  pthread_attr_destroy(&attrs);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+static LogRing log_ring(void)
+{
+  LogRing ring = pthread_getspecific(log_key);
+  if (ring)
+    return ring;
+
+  ++allocations;
+  if (!(ring = calloc(1, sizeof(*ring))))
+    return NULL;
+  pthread_mutex_lock(&log_mutex);
+  ring->next = log_rings;
+  log_rings = ring;
+  pthread_mutex_unlock(&log_mutex);
+  pthread_setspecific(log_key, ring);
+  return ring;
+}
+
+/* Count a message of `format' against its rate limit in `ring', and
+   return FALSE if that is used up. */
+static Boolean log_limit(const LogRing ring, const char * const format)
+{
+  const uint64_t second = clock_monotonic_coarse_ms() / 1000;
+  const LogLimit limit = &ring->limits[((uintptr_t) format >> 3) %
+                                       LOG_LIMITS];
+
+  if (limit->format != format || limit->window != second)
+    {
+      limit->format = format;
+      limit->window = second;
+      limit->budget = LOG_BURST;
+    }
+  if (!limit->budget)
+    {
+      __atomic_store_n(&ring->suppressed, ring->suppressed + 1,
+                       __ATOMIC_RELAXED);
+      return FALSE;
+    }
+  --limit->budget;
+  return TRUE;
+}
+
+/* Queue `prefix' and the formatted message in the calling thread's
+   ring, unless a full ring or, if `limited', the rate limit of
+   `format' stops it. */
+static void log_message(const char * const prefix, const Boolean limited,
+                        const char * const format, va_list ap)
+{
+  const int saved_errno = errno;
+  LogRing ring;
+
+  pthread_once(&log_once, log_init);
+  if (!(ring = log_ring()) || (limited && !log_limit(ring, format)))
+    return;
+
+  const uint64_t tail = ring->tail;
+  const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (tail - head == LOG_RING_RECORDS)
+    {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+    }
+  char * const record = ring->records[tail % LOG_RING_RECORDS];
+  const size_t length = strlen(prefix);
+  memcpy(record, prefix, length);
+  /* For %m. */
+  errno = saved_errno;
+  vsnprintf(record + length, LOG_MESSAGE_MAX - length, format, ap);
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (!log_writer_running)
+    log_flush();
+  else if (tail == head)
+    pthread_cond_signal(&log_cond);
+  errno = saved_errno;
+}
+
+void log_flush(void)
+{
+  pthread_once(&log_once, log_init);
+  pthread_mutex_lock(&log_mutex);
+  log_drain(TRUE);
+  pthread_mutex_unlock(&log_mutex);
+}
+
+int log_set_fd(const int fd)
+{
+  int previous;
+
+  pthread_once(&log_once, log_init);
+  pthread_mutex_lock(&log_mutex);
+  log_drain(TRUE);
+  previous = log_fd;
+  log_fd = fd;
+  pthread_mutex_unlock(&log_mutex);
+  return previous;
+}
+
+void log_get_stats(const LogStats stats_ret)
+{
+  pthread_once(&log_once, log_init);
+  pthread_mutex_lock(&log_mutex);
+  log_drain(FALSE);
+  *stats_ret = log_stats;
+  pthread_mutex_unlock(&log_mutex);
+}
+
 void debug(const char *format, ...)
 {
   va_list ap;
-  int ret_val;
-  char *string = NULL;
   va_start(ap, format);
-  ret_val = vasprintf(&string, format, ap);
+  log_message("", FALSE, format, ap);
   va_end(ap);
-  if (ret_val >= 0)
-    {
-      fprintf(stderr, "%s\n", string);
-      xfree(string);
-    }
 }
 
 void warning(const char *format, ...)
 {
   va_list ap;
-  int ret_val;
-  char *string = NULL;
   va_start(ap, format);
-  ret_val = vasprintf(&string, format, ap);
+  log_message("WARNING: ", TRUE, format, ap);
   va_end(ap);
-  if (ret_val >= 0)
-    {
-      fprintf(stderr, "WARNING: %s\n", string);
-      xfree(string);
-    }
 }
 
 void default_fatal_handler(const char *msg, void *context)
@@ -99,6 +437,7 @@ void fatal(const char *fmt, ...)
   if (ret_val < 0)
     string = NULL;
 
+  log_flush();
   fatal_handler(string, fatal_context);
   xfree(string);
 }
@@ -113,24 +452,190 @@ void xfree(void *ptr)
 void *xcalloc(size_t num_items, size_t size)
 {
   void *ptr = calloc(num_items, size);
+  ++allocations;
   if (!ptr)
     fatal("memory allocation failed.");
   return ptr;
 }
 
+void *xmemalign(size_t alignment, size_t size)
+{
+  void *ptr = NULL;
+  ++allocations;
+  if (posix_memalign(&ptr, alignment, size) != 0)
+    {
+      fatal("memory allocation failed.");
+      return NULL;
+    }
+  return ptr;
+}
+
 char *xstrdup(const char *ptr)
 {
   char *newptr = NULL;
   if (!ptr)
     return NULL;
+  ++allocations;
   newptr = strdup(ptr);
-  if (!ptr)
+  if (!newptr)
       fatal("memory allocation failed.");
 
   return newptr;
 }
 
+/* Allocations are aligned for any type. */
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlockRec
+{
+  struct ArenaBlockRec *next;
+  size_t size, used;
+  char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+} ArenaBlockStruct, *ArenaBlock;
+
+typedef struct ArenaRec
+{
+  size_t block_size;
+  /* Blocks in use come first; `current' is the one being filled and
+     the blocks after it are empty. */
+  ArenaBlock first, current;
+} ArenaStruct;
+
+Arena arena_create(size_t block_size)
+{
+  Arena arena = xcalloc(1, sizeof(*arena));
+  /* Block sizes and offsets stay aligned, so the free space of a block
+     is too. */
+  arena->block_size = (block_size + ARENA_ALIGNMENT - 1) &
+    ~(size_t) (ARENA_ALIGNMENT - 1);
+  return arena;
+}
+
+void arena_destroy(Arena arena)
+{
+  if (!arena)
+    return;
+  while (arena->first)
+    {
+      ArenaBlock next = arena->first->next;
+      xfree(arena->first);
+      arena->first = next;
+    }
+  xfree(arena);
+}
+
+void arena_reset(Arena arena)
+{
+  ArenaBlock *link = &arena->first;
+  while (*link)
+    {
+      ArenaBlock block = *link;
+      if (block->size > arena->block_size)
+        {
+          *link = block->next;
+          xfree(block);
+          continue;
+        }
+      block->used = 0;
+      link = &block->next;
+    }
+  arena->current = arena->first;
+}
+
+/* Free space left in the current block. */
+static size_t arena_available(Arena arena, char **space_ret)
+{
+  ArenaBlock block = arena->current;
+  if (!block)
+    return 0;
+  *space_ret = &block->data[block->used];
+  return block->size - block->used;
+}
+
+static void *arena_alloc(Arena arena, size_t bytes)
+{
+  ArenaBlock block = arena->current;
+
+  bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+  if (!block || block->size - block->used < bytes)
+    {
+      /* Move on to the next empty block, or insert a new one. */
+      if (block && block->next && block->next->size >= bytes)
+        block = block->next;
+      else
+        {
+          const size_t size = bytes > arena->block_size ?
+            bytes : arena->block_size;
+          ArenaBlock new_block = xcalloc(1, sizeof(*new_block) + size);
+          new_block->size = size;
+          if (block)
+            {
+              new_block->next = block->next;
+              block->next = new_block;
+            }
+          else
+            {
+              new_block->next = arena->first;
+              arena->first = new_block;
+            }
+          block = new_block;
+        }
+      arena->current = block;
+    }
+
+  void *ptr = &block->data[block->used];
+  block->used += bytes;
+  return ptr;
+}
+
+void *arena_calloc(Arena arena, size_t num_objects, size_t size)
+{
+  if (size && num_objects > (size_t) -1 / size)
+    fatal("memory allocation failed.");
+  void *ptr = arena_alloc(arena, num_objects * size);
+  memset(ptr, 0, num_objects * size);
+  return ptr;
+}
+
+char *arena_strdup(Arena arena, const char *ptr)
+{
+  if (!ptr)
+    return NULL;
+  const size_t bytes = strlen(ptr) + 1;
+  return memcpy(arena_alloc(arena, bytes), ptr, bytes);
+}
+
+char *arena_string_format(Arena arena, const char *format, ...)
+{
+  char *space = NULL;
+  size_t available = arena_available(arena, &space);
+  va_list ap;
+  int ret;
+
+  /* Format straight into the current block; only if it does not fit,
+     allocate the exact size and format again. */
+  va_start(ap, format);
+  ret = vsnprintf(available ? space : NULL, available, format, ap);
+  va_end(ap);
+  if (ret < 0)
+    fatal("Failed string format");
+  if (ret < available)
+    return arena_alloc(arena, ret + 1);
+
+  space = arena_alloc(arena, ret + 1);
+  va_start(ap, format);
+  vsnprintf(space, ret + 1, format, ap);
+  va_end(ap);
+  return space;
+}
+
 int create_local_listener(const char *listener_path)
+{
+  return create_local_listener_with_backlog(listener_path, SOMAXCONN);
+}
+
+int create_local_listener_with_backlog(const char *listener_path,
+                                       int backlog)
 {
   int ret_sock = -1, ret_val;
   int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -142,7 +647,7 @@ int create_local_listener(const char *listener_path)
       goto error;
     }
 
-  strncpy(saddr.sun_path, listener_path, sizeof(saddr.sun_path));
+  strncpy(saddr.sun_path, listener_path, sizeof(saddr.sun_path) - 1);
   saddr.sun_family = AF_UNIX;
 
   ret_val = bind(sock_fd, (struct sockaddr *)&saddr, sizeof(saddr));
@@ -152,7 +657,7 @@ int create_local_listener(const char *listener_path)
       goto error;
     }
 
-  ret_val = listen(sock_fd, 100);
+  ret_val = listen(sock_fd, backlog);
   if (ret_val < 0)
     {
       warning("Could not start listening on socket: %m");
@@ -171,6 +676,83 @@ int create_local_listener(const char *listener_path)
   return ret_sock;
 }
 
+int create_tcp_listener(const char *host, int port, int backlog,
+                        Boolean reuse_port, Boolean no_delay)
+{
+  struct addrinfo hints = {0}, *addrs = NULL;
+  char service[16];
+  const int one = 1;
+  int sock_fd = -1, ret_val;
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  snprintf(service, sizeof(service), "%d", port);
+  ret_val = getaddrinfo(host, service, &hints, &addrs);
+  if (ret_val != 0)
+    {
+      warning("Could not resolve listener address: %s",
+              gai_strerror(ret_val));
+      return -1;
+    }
+
+  sock_fd = socket(addrs->ai_family, SOCK_STREAM, 0);
+  if (sock_fd < 0)
+    {
+      warning("Could not allocate socket.");
+      goto error;
+    }
+
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      (reuse_port &&
+       setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) ||
+      (no_delay &&
+       setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0))
+    {
+      warning("Could not set socket options: %m");
+      goto error;
+    }
+
+  if (bind(sock_fd, addrs->ai_addr, addrs->ai_addrlen) < 0)
+    {
+      warning("Could not bind socket: %m");
+      goto error;
+    }
+
+  if (listen(sock_fd, backlog) < 0)
+    {
+      warning("Could not start listening on socket: %m");
+      goto error;
+    }
+
+  freeaddrinfo(addrs);
+  return sock_fd;
+
+ error:
+  if (sock_fd >= 0)
+    close(sock_fd);
+  freeaddrinfo(addrs);
+  return -1;
+}
+
+int socket_local_port(int sock_fd)
+{
+  struct sockaddr_storage saddr;
+  socklen_t saddr_len = sizeof(saddr);
+
+  if (getsockname(sock_fd, (struct sockaddr *) &saddr, &saddr_len) < 0)
+    return -1;
+  switch (saddr.ss_family)
+    {
+    case AF_INET:
+      return ntohs(((struct sockaddr_in *) &saddr)->sin_port);
+    case AF_INET6:
+      return ntohs(((struct sockaddr_in6 *) &saddr)->sin6_port);
+    default:
+      return -1;
+    }
+}
+
 Boolean thread_create(void* (*thread_func)(void *context), void *context)
 {
   pthread_t thread;
@@ -215,105 +797,1173 @@ Boolean thread_create(void* (*thread_func)(void *context), void *context)
   return ret_val;
 }
 
+/* Mutexes are a futex word: 0 when unlocked, 1 when locked and 2 when
+   locked with threads possibly asleep on it (U. Drepper, "Futexes Are
+   Tricky"), so locking and unlocking without contention take one
+   atomic instruction and no system call.  A contended lock spins a
+   while before it sleeps, for about as long as it has lately taken to
+   get the lock that way (like glibc's adaptive mutexes), up to
+   MUTEX_SPIN_MAX rounds. */
+#define MUTEX_SPIN_MAX 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#ifdef CSERVER_LOCK_PROFILE
+typedef struct LockProfileRec
+{
+  uint64_t acquired, contended, waits;
+  uint64_t wait_ns, wait_max_ns, hold_ns, hold_max_ns;
+} LockProfileStruct, *LockProfile;
+
+/* The mutexes created at a call site.  Sites are never freed. */
+typedef struct LockSiteRec *LockSite;
+
+struct LockSiteRec
+{
+  LockSite next;
+  const char *name;
+  size_t locks;
+  /* The mutexes alive, and the sum of the profiles of those gone. */
+  Mutex mutexes;
+  LockProfileStruct retired;
+};
+
+/* Guards the sites and their lists of mutexes. */
+static pthread_mutex_t lock_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LockSite lock_sites;
+#endif
+
 typedef struct MutexRec
 {
-  pthread_mutex_t mutex;
-  Boolean locked;
+  uint32_t state;
+  /* The average rounds contended locks have spun. */
+  int spins;
+#ifdef CSERVER_LOCK_PROFILE
+  LockSite site;
+  Mutex prev, next;
+  /* When the holder got the mutex. */
+  uint64_t locked_ns;
+  /* Updated by the holder only; read by lock_profile_format() at any
+     time, so stored with relaxed atomics. */
+  LockProfileStruct profile;
+#endif
 } MutexStruct;
 
-Mutex mutex_create()
+static long futex(uint32_t * const word, const int op, const uint32_t value,
+                  const struct timespec * const timeout)
 {
-  Mutex mutex = xcalloc(1, sizeof(*mutex));
-  int ret;
+  return syscall(SYS_futex, word, op, value, timeout, NULL,
+                 FUTEX_BITSET_MATCH_ANY);
+}
 
-  ret = pthread_mutex_init(&mutex->mutex, NULL);
-  if (ret != 0)
-    fatal("Failed to initialize mutex: code %d", ret);
+#ifdef CSERVER_LOCK_PROFILE
+#define LOCK_PROFILE_ADD(field, value)                                  \
+  __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+#define LOCK_PROFILE_MAX(field, value)                                  \
+  do                                                                    \
+    if ((value) > (field))                                              \
+      __atomic_store_n(&(field), (value), __ATOMIC_RELAXED);            \
+  while (0)
+
+/* The holder has just got `mutex', having waited since `wait_start'
+   if that is not 0. */
+static void mutex_profile_locked(const Mutex mutex, const uint64_t wait_start)
+{
+  const LockProfile profile = &mutex->profile;
+  const uint64_t now = clock_monotonic_ns();
 
+  LOCK_PROFILE_ADD(profile->acquired, 1);
+  if (wait_start)
+    {
+      LOCK_PROFILE_ADD(profile->contended, 1);
+      LOCK_PROFILE_ADD(profile->wait_ns, now - wait_start);
+      LOCK_PROFILE_MAX(profile->wait_max_ns, now - wait_start);
+    }
+  mutex->locked_ns = now;
+}
+
+static void mutex_profile_unlocking(const Mutex mutex)
+{
+  const LockProfile profile = &mutex->profile;
+  const uint64_t held = clock_monotonic_ns() - mutex->locked_ns;
+
+  LOCK_PROFILE_ADD(profile->hold_ns, held);
+  LOCK_PROFILE_MAX(profile->hold_max_ns, held);
+}
+
+static void lock_profile_merge(const LockProfile sum,
+                               const LockProfile profile)
+{
+  sum->acquired += __atomic_load_n(&profile->acquired, __ATOMIC_RELAXED);
+  sum->contended += __atomic_load_n(&profile->contended, __ATOMIC_RELAXED);
+  sum->waits += __atomic_load_n(&profile->waits, __ATOMIC_RELAXED);
+  sum->wait_ns += __atomic_load_n(&profile->wait_ns, __ATOMIC_RELAXED);
+  sum->hold_ns += __atomic_load_n(&profile->hold_ns, __ATOMIC_RELAXED);
+  const uint64_t wait_max_ns = __atomic_load_n(&profile->wait_max_ns,
+                                               __ATOMIC_RELAXED);
+  const uint64_t hold_max_ns = __atomic_load_n(&profile->hold_max_ns,
+                                               __ATOMIC_RELAXED);
+  if (wait_max_ns > sum->wait_max_ns)
+    sum->wait_max_ns = wait_max_ns;
+  if (hold_max_ns > sum->hold_max_ns)
+    sum->hold_max_ns = hold_max_ns;
+}
+
+Mutex mutex_create_at(const char * const site)
+{
+  const Mutex mutex = xcalloc(1, sizeof(*mutex));
+  LockSite lock_site;
+
+  pthread_mutex_lock(&lock_profile_mutex);
+  for (lock_site = lock_sites; lock_site; lock_site = lock_site->next)
+    if (lock_site->name == site || !strcmp(lock_site->name, site))
+      break;
+  if (!lock_site)
+    {
+      lock_site = xcalloc(1, sizeof(*lock_site));
+      lock_site->name = site;
+      lock_site->next = lock_sites;
+      lock_sites = lock_site;
+    }
+  ++lock_site->locks;
+  mutex->site = lock_site;
+  mutex->next = lock_site->mutexes;
+  if (mutex->next)
+    mutex->next->prev = mutex;
+  lock_site->mutexes = mutex;
+  pthread_mutex_unlock(&lock_profile_mutex);
   return mutex;
 }
 
-void mutex_destroy(Mutex mutex)
+static int lock_profile_compare(const void *a, const void *b)
 {
-  int ret;
+  const LockProfileStruct *x = a, *y = b;
+  return x->wait_ns < y->wait_ns ? 1 : x->wait_ns > y->wait_ns ? -1 : 0;
+}
 
+char *lock_profile_format(void)
+{
+  /* The profile summed over each site. */
+  struct
+  {
+    LockProfileStruct profile;
+    LockSite site;
+  } *sums = NULL;
+  size_t count = 0, size = 0;
+  char *text = NULL;
+  FILE *out;
+
+  pthread_mutex_lock(&lock_profile_mutex);
+  for (LockSite site = lock_sites; site; site = site->next)
+    ++count;
+  sums = xcalloc(count ? count : 1, sizeof(*sums));
+  count = 0;
+  for (LockSite site = lock_sites; site; site = site->next, ++count)
+    {
+      sums[count].site = site;
+      lock_profile_merge(&sums[count].profile, &site->retired);
+      for (Mutex mutex = site->mutexes; mutex; mutex = mutex->next)
+        lock_profile_merge(&sums[count].profile, &mutex->profile);
+    }
+  qsort(sums, count, sizeof(*sums), lock_profile_compare);
+
+  if (!(out = open_memstream(&text, &size)))
+    fatal("memory allocation failed.");
+  for (size_t i = 0; i < count; ++i)
+    {
+      const LockProfile profile = &sums[i].profile;
+      fprintf(out, "%s locks=%zu acquired=%llu contended=%llu waits=%llu "
+              "wait_ns=%llu wait_max_ns=%llu hold_ns=%llu "
+              "hold_max_ns=%llu\n", sums[i].site->name, sums[i].site->locks,
+              (unsigned long long) profile->acquired,
+              (unsigned long long) profile->contended,
+              (unsigned long long) profile->waits,
+              (unsigned long long) profile->wait_ns,
+              (unsigned long long) profile->wait_max_ns,
+              (unsigned long long) profile->hold_ns,
+              (unsigned long long) profile->hold_max_ns);
+    }
+  pthread_mutex_unlock(&lock_profile_mutex);
+  fclose(out);
+  xfree(sums);
+  return text;
+}
+#else
+#define mutex_profile_locked(mutex, wait_start) ((void) 0)
+#define mutex_profile_unlocking(mutex) ((void) 0)
+
+Mutex mutex_create()
+{
+  return xcalloc(1, sizeof(struct MutexRec));
+}
+#endif
+
+void mutex_destroy(Mutex mutex)
+{
   if (!mutex)
     return;
 
-  if (mutex->locked)
+  if (__atomic_load_n(&mutex->state, __ATOMIC_RELAXED))
     {
       fatal("Destroying a locked mutex");
       /* For tests.*/
       return;
     }
-  ret = pthread_mutex_destroy(&mutex->mutex);
-  if (ret != 0)
-    warning("Failed to destroy mutex: code %d", ret);
+#ifdef CSERVER_LOCK_PROFILE
+  pthread_mutex_lock(&lock_profile_mutex);
+  lock_profile_merge(&mutex->site->retired, &mutex->profile);
+  if (mutex->prev)
+    mutex->prev->next = mutex->next;
+  else
+    mutex->site->mutexes = mutex->next;
+  if (mutex->next)
+    mutex->next->prev = mutex->prev;
+  pthread_mutex_unlock(&lock_profile_mutex);
+#endif
   xfree(mutex);
 }
 
+static void mutex_lock_contended(const Mutex mutex)
+{
+#ifdef CSERVER_LOCK_PROFILE
+  const uint64_t wait_start = clock_monotonic_ns();
+#endif
+  const int average = __atomic_load_n(&mutex->spins, __ATOMIC_RELAXED);
+  const int limit = 2 * average + 10 < MUTEX_SPIN_MAX ?
+    2 * average + 10 : MUTEX_SPIN_MAX;
+  int spins;
+
+  for (spins = 0; spins < limit; ++spins)
+    {
+      uint32_t state = 0;
+      if (!__atomic_load_n(&mutex->state, __ATOMIC_RELAXED) &&
+          __atomic_compare_exchange_n(&mutex->state, &state, 1, FALSE,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+      cpu_relax();
+    }
+  __atomic_store_n(&mutex->spins, average + (spins - average) / 8,
+                   __ATOMIC_RELAXED);
+
+  /* Sleep, marking the mutex so that unlocking wakes a sleeper. */
+  if (spins == limit)
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0)
+      futex(&mutex->state, FUTEX_WAIT_PRIVATE, 2, NULL);
+  mutex_profile_locked(mutex, wait_start);
+}
+
 void mutex_lock(Mutex mutex)
 {
-  int ret = pthread_mutex_lock(&mutex->mutex);
-  if (ret != 0)
-    fatal("Failed to lock mutex: code %d", ret);
-  mutex->locked = TRUE;
+  uint32_t state = 0;
+  if (__atomic_compare_exchange_n(&mutex->state, &state, 1, FALSE,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    mutex_profile_locked(mutex, 0);
+  else
+    mutex_lock_contended(mutex);
 }
 
 void mutex_unlock(Mutex mutex)
 {
-  int ret;
-  mutex->locked = FALSE;
-  ret = pthread_mutex_unlock(&mutex->mutex);
-  if (ret != 0)
-    fatal("Failed to unlock mutex: code %d", ret);
+  mutex_profile_unlocking(mutex);
+  if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2)
+    futex(&mutex->state, FUTEX_WAKE_PRIVATE, 1, NULL);
 }
 
+/* Conditions are event counts.  A waiter reads `sequence', counts
+   itself in `waiters' and sleeps as long as `sequence' keeps the value
+   it read; a signal bumps `sequence' and wakes a sleeper.  Waiters
+   count themselves before they let go of the mutex, so a signal that
+   finds none, the usual case, needs no system call. */
 typedef struct ConditionRec
 {
-  pthread_cond_t cond;
+  uint32_t sequence;
+  uint32_t waiters;
 } ConditionStruct;
 
 Condition condition_create(void)
 {
-  Condition cv = xcalloc(1, sizeof(*cv));
-  int ret = pthread_cond_init(&cv->cond, NULL);
-  if (ret != 0)
-    fatal("Failed to create condition variable");
-  return cv;
+  return xcalloc(1, sizeof(struct ConditionRec));
+}
+
+static void condition_wake(const Condition cv, const int count)
+{
+  if (!__atomic_load_n(&cv->waiters, __ATOMIC_SEQ_CST))
+    return;
+  __atomic_add_fetch(&cv->sequence, 1, __ATOMIC_SEQ_CST);
+  futex(&cv->sequence, FUTEX_WAKE_PRIVATE, count, NULL);
 }
 
 void condition_signal(Condition cv)
 {
-  int ret = pthread_cond_signal(&cv->cond);
-  if (ret != 0)
-    fatal("Failed to signal condition: code %d", ret);
+  condition_wake(cv, 1);
 }
 
 void condition_broadcast(Condition cv)
 {
-  int ret = pthread_cond_broadcast(&cv->cond);
-  if (ret != 0)
-    fatal("Failed to signal condition: code %d", ret);
+  condition_wake(cv, INT_MAX);
+}
+
+/* Wait until signaled or, unless `deadline' is NULL, until that time
+   on the monotonic clock.  Return FALSE if the wait timed out. */
+static Boolean condition_sleep(const Condition cv, const Mutex mutex,
+                               const struct timespec * const deadline)
+{
+  const uint32_t sequence = __atomic_load_n(&cv->sequence,
+                                            __ATOMIC_RELAXED);
+  Boolean signaled = TRUE;
+
+#ifdef CSERVER_LOCK_PROFILE
+  LOCK_PROFILE_ADD(mutex->profile.waits, 1);
+#endif
+  __atomic_add_fetch(&cv->waiters, 1, __ATOMIC_SEQ_CST);
+  mutex_unlock(mutex);
+  while (futex(&cv->sequence, FUTEX_WAIT_BITSET_PRIVATE, sequence,
+               deadline) < 0 && errno != EAGAIN)
+    if (errno == ETIMEDOUT)
+      {
+        signaled = FALSE;
+        break;
+      }
+    else if (errno != EINTR)
+      fatal("Failed to wait for condition: %m");
+  __atomic_sub_fetch(&cv->waiters, 1, __ATOMIC_SEQ_CST);
+  mutex_lock(mutex);
+  return signaled;
 }
 
 void condition_wait(Condition cv, Mutex mutex)
 {
-  mutex->locked = FALSE;
-  int ret = pthread_cond_wait(&cv->cond, &mutex->mutex);
-  if (ret != 0)
-    fatal("Failed to signal condition: code %d", ret);
-  mutex->locked = TRUE;
+  const int saved_errno = errno;
+  condition_sleep(cv, mutex, NULL);
+  errno = saved_errno;
 }
 
-void condition_destroy(Condition cv)
+uint64_t clock_monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t clock_monotonic_coarse_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+Boolean condition_timedwait(Condition cv, Mutex mutex, long timeout_ms)
+{
+  const int saved_errno = errno;
+  struct timespec deadline;
+  Boolean signaled;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+  signaled = condition_sleep(cv, mutex, &deadline);
+  errno = saved_errno;
+  return signaled;
+}
+
+/* Cells of the bounded queue carry a sequence number telling whether
+   they are free for the producer at a position or filled for the
+   consumer at it (D. Vyukov's bounded MPMC queue). */
+typedef struct WorkCellRec
+{
+  size_t sequence;
+  void *item;
+} WorkCellStruct;
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct WorkQueueRec
+{
+  /* Producers and consumers contend on different cache lines. */
+  size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  size_t mask __attribute__((aligned(CACHE_LINE_SIZE)));
+  WorkCellStruct *cells;
+} WorkQueueStruct;
+
+WorkQueue work_queue_create(size_t capacity)
+{
+  WorkQueue queue = NULL;
+  size_t size = 2;
+
+  while (size < capacity)
+    size <<= 1;
+  if (!(queue = xmemalign(CACHE_LINE_SIZE, sizeof(*queue))))
+    return NULL;
+  memset(queue, 0, sizeof(*queue));
+  queue->mask = size - 1;
+  queue->cells = xcalloc(size, sizeof(*queue->cells));
+  for (size_t i = 0; i < size; ++i)
+    queue->cells[i].sequence = i;
+  return queue;
+}
+
+void work_queue_destroy(WorkQueue queue)
+{
+  if (!queue)
+    return;
+  xfree(queue->cells);
+  xfree(queue);
+}
+
+Boolean work_queue_push(WorkQueue queue, void *item)
+{
+  size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+  WorkCellStruct *cell;
+
+  while (TRUE)
+    {
+      cell = &queue->cells[pos & queue->mask];
+      const size_t sequence = __atomic_load_n(&cell->sequence,
+                                              __ATOMIC_ACQUIRE);
+      const long diff = (long) sequence - (long) pos;
+      if (diff == 0)
+        {
+          if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1,
+                                          TRUE, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED))
+            break;
+        }
+      else if (diff < 0)
+        return FALSE;
+      else
+        pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    }
+
+  cell->item = item;
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+  return TRUE;
+}
+
+void *work_queue_pop(WorkQueue queue)
 {
+  size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+  WorkCellStruct *cell;
+  void *item;
+
+  while (TRUE)
+    {
+      cell = &queue->cells[pos & queue->mask];
+      const size_t sequence = __atomic_load_n(&cell->sequence,
+                                              __ATOMIC_ACQUIRE);
+      const long diff = (long) sequence - (long) (pos + 1);
+      if (diff == 0)
+        {
+          if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1,
+                                          TRUE, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED))
+            break;
+        }
+      else if (diff < 0)
+        return NULL;
+      else
+        pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    }
+
+  item = cell->item;
+  __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_HORIZON \
+  (((uint64_t) 1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+/* Slots are circular lists around a sentinel, so a timer unlinks
+   itself without knowing where it is. */
+struct TimerWheelRec
+{
+  uint64_t now;
+  size_t count;
+  TimerStruct slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+TimerWheel timer_wheel_create(const uint64_t now)
+{
+  const TimerWheel wheel = xcalloc(1, sizeof(*wheel));
+  wheel->now = now;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+      wheel->slots[level][slot].prev = wheel->slots[level][slot].next =
+        &wheel->slots[level][slot];
+  return wheel;
+}
+
+void timer_wheel_destroy(const TimerWheel wheel)
+{
+  xfree(wheel);
+}
+
+/* Link `timer' into the slot covering its expiry: the lowest level
+   whose turn reaches it from now.  A timer due now goes to the current
+   slot of the lowest level, which the caller is about to expire. */
+static void timer_wheel_link(const TimerWheel wheel, const Timer timer)
+{
+  const uint64_t delta = timer->expires > wheel->now ?
+    timer->expires - wheel->now : 0;
+  int level = 0;
+
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >> ((level + 1) * TIMER_WHEEL_BITS))
+    ++level;
+  const Timer head = &wheel->slots[level][(timer->expires >>
+                                           (level * TIMER_WHEEL_BITS)) &
+                                          TIMER_WHEEL_MASK];
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void timer_unlink(const Timer timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = NULL;
+}
+
+void timer_wheel_add(const TimerWheel wheel, const Timer timer,
+                     uint64_t expires)
+{
+  assert(!timer_armed(timer));
+  /* The current slot has been expired already. */
+  if (expires <= wheel->now)
+    expires = wheel->now + 1;
+  else if (expires - wheel->now > TIMER_WHEEL_HORIZON)
+    expires = wheel->now + TIMER_WHEEL_HORIZON;
+  timer->expires = expires;
+  timer_wheel_link(wheel, timer);
+  ++wheel->count;
+}
+
+void timer_wheel_cancel(const TimerWheel wheel, const Timer timer)
+{
+  if (!timer_armed(timer))
+    return;
+  timer_unlink(timer);
+  assert(wheel->count);
+  --wheel->count;
+}
+
+/* Expired timers are chained through `next' only. */
+Boolean timer_armed(const Timer timer)
+{
+  return timer->prev != NULL;
+}
+
+size_t timer_wheel_count(const TimerWheel wheel)
+{
+  return wheel->count;
+}
+
+Timer timer_wheel_advance(const TimerWheel wheel, const uint64_t now)
+{
+  Timer expired = NULL, *tail = &expired;
+
+  while (wheel->now < now)
+    {
+      if (!wheel->count)
+        {
+          wheel->now = now;
+          break;
+        }
+      const uint64_t tick = ++wheel->now;
+
+      /* Where a turn of level `top' - 1 starts, spread the next slot
+         of each level up to `top' over the levels below, highest
+         first. */
+      int top = 0;
+      while (top < TIMER_WHEEL_LEVELS - 1 &&
+             !(tick & (((uint64_t) 1 << ((top + 1) * TIMER_WHEEL_BITS)) - 1)))
+        ++top;
+      for (int level = top; level > 0; --level)
+        {
+          const Timer head =
+            &wheel->slots[level][(tick >> (level * TIMER_WHEEL_BITS)) &
+                                 TIMER_WHEEL_MASK];
+          while (head->next != head)
+            {
+              const Timer timer = head->next;
+              timer_unlink(timer);
+              timer_wheel_link(wheel, timer);
+            }
+        }
+
+      const Timer head = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+      while (head->next != head)
+        {
+          const Timer timer = head->next;
+          timer_unlink(timer);
+          --wheel->count;
+          *tail = timer;
+          tail = &timer->next;
+        }
+    }
+  *tail = NULL;
+  return expired;
+}
+
+size_t histogram_bucket(uint64_t value)
+{
+  if (value < (1 << HISTOGRAM_SUB_BITS))
+    return value;
+  if (value >> HISTOGRAM_MAX_BITS)
+    value = ((uint64_t) 1 << HISTOGRAM_MAX_BITS) - 1;
+  const int exponent = 63 - __builtin_clzll(value);
+  return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+    ((value >> (exponent - HISTOGRAM_SUB_BITS)) &
+     ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+uint64_t histogram_bucket_limit(const size_t bucket)
+{
+  if (bucket < (1 << HISTOGRAM_SUB_BITS))
+    return bucket;
+  const int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  const uint64_t first = (uint64_t) ((1 << HISTOGRAM_SUB_BITS) +
+                                     (bucket &
+                                      ((1 << HISTOGRAM_SUB_BITS) - 1)))
+    << shift;
+  return first + ((uint64_t) 1 << shift) - 1;
+}
+
+void histogram_record(const Histogram histogram, const uint64_t value,
+                      const uint64_t count)
+{
+  uint64_t * const bucket = &histogram->buckets[histogram_bucket(value)];
+
+  /* Only this thread writes; the stores are atomic for the sake of
+     histogram_merge() elsewhere, but need no locked instruction. */
+  __atomic_store_n(bucket, *bucket + count, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->count, histogram->count + count,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->sum, histogram->sum + value * count,
+                   __ATOMIC_RELAXED);
+  if (value > histogram->max)
+    __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+void histogram_merge(const Histogram into, const Histogram from)
+{
+  const uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+
+  into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+  into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+  if (max > into->max)
+    into->max = max;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_percentile(const Histogram histogram,
+                              const double fraction)
+{
+  uint64_t total = 0, seen = 0;
+
+  /* Count the buckets rather than trust `count', which may be ahead of
+     them in a merge taken while recording. */
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    total += histogram->buckets[i];
+  if (!total)
+    return 0;
+  uint64_t rank = fraction * total + 0.5;
+  if (rank < 1)
+    rank = 1;
+  else if (rank > total)
+    rank = total;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    if ((seen += histogram->buckets[i]) >= rank)
+      {
+        const uint64_t limit = histogram_bucket_limit(i);
+        return limit < histogram->max ? limit : histogram->max;
+      }
+  return histogram->max;
+}
+
+/* A batch of free objects travels as a chain linked through the
+   objects' first word; the depot links chains through the second word
+   of their heads. */
+typedef struct ObjectLinkRec
+{
+  struct ObjectLinkRec *next, *next_chain;
+} ObjectLinkStruct, *ObjectLink;
+
+typedef struct ObjectCacheRec
+{
+  ObjectPool pool;
+  struct ObjectCacheRec *prev, *next;
+  /* Up to twice the batch size, so a thread flipping between alloc and
+     free does not bounce batches with the depot. */
+  size_t count;
+  void *objects[];
+} ObjectCacheStruct, *ObjectCache;
+
+typedef struct ObjectSlabRec
+{
+  struct ObjectSlabRec *next;
+} ObjectSlabStruct, *ObjectSlab;
+
+typedef struct ObjectPoolRec
+{
+  size_t object_size, objects_per_slab, batch;
+  pthread_key_t cache_key;
+
+  /* Depot of full batches, slabs, and every thread's cache, all under
+     `mutex'. */
+  Mutex mutex;
+  ObjectLink depot;
+  size_t depot_objects;
+  ObjectSlab slabs;
+  size_t slab_count;
+  ObjectCache caches;
+
+  size_t live __attribute__((aligned(CACHE_LINE_SIZE)));
+} ObjectPoolStruct;
+
+/* Hand the objects of `cache' beyond the first `keep' back to the
+   depot, a batch per chain.  Called with the pool mutex held. */
+static void object_cache_drain(ObjectCache cache, size_t keep)
+{
+  ObjectPool pool = cache->pool;
+
+  while (cache->count > keep)
+    {
+      ObjectLink head = NULL;
+      for (size_t i = 0; i < pool->batch && cache->count > keep; ++i)
+        {
+          ObjectLink link = cache->objects[--cache->count];
+          link->next = head;
+          head = link;
+          ++pool->depot_objects;
+        }
+      head->next_chain = pool->depot;
+      pool->depot = head;
+    }
+}
+
+/* Thread exit: return the cached objects. */
+static void object_cache_release(void *context)
+{
+  ObjectCache cache = context;
+  ObjectPool pool = cache->pool;
+
+  mutex_lock(pool->mutex);
+  object_cache_drain(cache, 0);
+  if (cache->prev)
+    cache->prev->next = cache->next;
+  else
+    pool->caches = cache->next;
+  if (cache->next)
+    cache->next->prev = cache->prev;
+  mutex_unlock(pool->mutex);
+  xfree(cache);
+}
+
+static ObjectCache object_cache_get(ObjectPool pool)
+{
+  ObjectCache cache = pthread_getspecific(pool->cache_key);
+  if (cache)
+    return cache;
+
+  cache = xcalloc(1, sizeof(*cache) + 2 * pool->batch * sizeof(void *));
+  cache->pool = pool;
+  mutex_lock(pool->mutex);
+  cache->next = pool->caches;
+  if (pool->caches)
+    pool->caches->prev = cache;
+  pool->caches = cache;
+  mutex_unlock(pool->mutex);
+  if (pthread_setspecific(pool->cache_key, cache) != 0)
+    fatal("Failed to set the object cache");
+  return cache;
+}
+
+ObjectPool object_pool_create(size_t object_size, size_t objects_per_slab,
+                              size_t batch)
+{
+  ObjectPool pool = NULL;
   int ret;
 
+  /* The handler of the tests returns. */
+  if (!(pool = xmemalign(CACHE_LINE_SIZE, sizeof(*pool))))
+    return NULL;
+  memset(pool, 0, sizeof(*pool));
+  if (object_size < sizeof(ObjectLinkStruct))
+    object_size = sizeof(ObjectLinkStruct);
+  pool->object_size = (object_size + CACHE_LINE_SIZE - 1) &
+    ~(size_t) (CACHE_LINE_SIZE - 1);
+  pool->objects_per_slab = objects_per_slab ? objects_per_slab : 1;
+  pool->batch = batch ? batch : 1;
+  pool->mutex = mutex_create();
+  ret = pthread_key_create(&pool->cache_key, object_cache_release);
+  if (ret != 0)
+    fatal("Failed to create object cache key: code %d", ret);
+  return pool;
+}
+
+void object_pool_destroy(ObjectPool pool)
+{
+  if (!pool)
+    return;
+
+  /* Thread caches are released here rather than at thread exit. */
+  pthread_key_delete(pool->cache_key);
+  while (pool->caches)
+    {
+      ObjectCache cache = pool->caches;
+      pool->caches = cache->next;
+      xfree(cache);
+    }
+  while (pool->slabs)
+    {
+      ObjectSlab slab = pool->slabs;
+      pool->slabs = slab->next;
+      xfree(slab);
+    }
+  mutex_destroy(pool->mutex);
+  xfree(pool);
+}
+
+/* Refill an empty cache with a batch from the depot, or from a new
+   slab. */
+static void object_cache_refill(ObjectCache cache)
+{
+  ObjectPool pool = cache->pool;
+  ObjectLink head;
+
+  mutex_lock(pool->mutex);
+  if (!pool->depot)
+    {
+      /* The slab header takes the first slot, keeping objects aligned. */
+      const size_t slots = pool->objects_per_slab + 1;
+      char * const slab = xmemalign(CACHE_LINE_SIZE,
+                                    slots * pool->object_size);
+      ((ObjectSlab) slab)->next = pool->slabs;
+      pool->slabs = (ObjectSlab) slab;
+      ++pool->slab_count;
+
+      for (size_t i = slots - 1; i > 0; )
+        {
+          head = NULL;
+          for (size_t j = 0; j < pool->batch && i > 0; ++j, --i)
+            {
+              ObjectLink link = (ObjectLink) &slab[i * pool->object_size];
+              link->next = head;
+              head = link;
+              ++pool->depot_objects;
+            }
+          head->next_chain = pool->depot;
+          pool->depot = head;
+        }
+    }
+  head = pool->depot;
+  pool->depot = head->next_chain;
+  for (ObjectLink link = head; link; link = link->next)
+    {
+      cache->objects[cache->count++] = link;
+      --pool->depot_objects;
+    }
+  mutex_unlock(pool->mutex);
+}
+
+void *object_pool_alloc(ObjectPool pool)
+{
+  ObjectCache cache = object_cache_get(pool);
+  void *object;
+
+  if (!cache->count)
+    object_cache_refill(cache);
+  object = cache->objects[--cache->count];
+  __atomic_add_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+  memset(object, 0, pool->object_size);
+  return object;
+}
+
+void object_pool_free(ObjectPool pool, void *object)
+{
+  ObjectCache cache;
+
+  if (!object)
+    return;
+  cache = object_cache_get(pool);
+  __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+  if (cache->count == 2 * pool->batch)
+    {
+      /* Keep one batch, hand the other to the depot. */
+      mutex_lock(pool->mutex);
+      object_cache_drain(cache, pool->batch);
+      mutex_unlock(pool->mutex);
+    }
+  cache->objects[cache->count++] = object;
+}
+
+void object_pool_get_stats(ObjectPool pool, ObjectPoolStats stats_ret)
+{
+  mutex_lock(pool->mutex);
+  stats_ret->slabs = pool->slab_count;
+  stats_ret->live = __atomic_load_n(&pool->live, __ATOMIC_RELAXED);
+  stats_ret->free = pool->slab_count * pool->objects_per_slab -
+    stats_ret->live;
+  mutex_unlock(pool->mutex);
+}
+
+void condition_destroy(Condition cv)
+{
   if (!cv)
     return;
-  ret = pthread_cond_destroy(&cv->cond);
-  if (ret != 0)
-    fatal("Failed to destroy condition variable");
+  /* Waiters already woken may not have counted themselves out yet. */
+  while (__atomic_load_n(&cv->waiters, __ATOMIC_ACQUIRE))
+    sched_yield();
   xfree(cv);
 }
+
+/* Batch arithmetic. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VECTOR_X86 1
+#include <immintrin.h>
+#endif
+
+typedef Boolean (*VectorAddFunction)(const int32_t *a, const int32_t *b,
+                                     int32_t *sum, size_t count);
+
+/* Signed overflow happened exactly when both operands differ in sign
+   from the sum, so the sign bit of the AND of the two XORs flags it. */
+static Boolean vector_add_scalar(const int32_t *a, const int32_t *b,
+                                 int32_t *sum, size_t count)
+{
+  uint32_t overflow = 0;
+
+  for (size_t i = 0; i < count; ++i)
+    {
+      const uint32_t s = (uint32_t) a[i] + (uint32_t) b[i];
+      overflow |= ((uint32_t) a[i] ^ s) & ((uint32_t) b[i] ^ s);
+      sum[i] = s;
+    }
+  return !(overflow >> 31);
+}
+
+#ifdef VECTOR_X86
+__attribute__((target("sse2")))
+static Boolean vector_add_sse2(const int32_t *a, const int32_t *b,
+                               int32_t *sum, size_t count)
+{
+  __m128i overflow = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4)
+    {
+      const __m128i x = _mm_loadu_si128((const __m128i *) &a[i]);
+      const __m128i y = _mm_loadu_si128((const __m128i *) &b[i]);
+      const __m128i s = _mm_add_epi32(x, y);
+      overflow = _mm_or_si128(overflow,
+                              _mm_and_si128(_mm_xor_si128(x, s),
+                                            _mm_xor_si128(y, s)));
+      _mm_storeu_si128((__m128i *) &sum[i], s);
+    }
+  const Boolean tail = vector_add_scalar(&a[i], &b[i], &sum[i], count - i);
+  return tail && !_mm_movemask_ps(_mm_castsi128_ps(overflow));
+}
+
+__attribute__((target("avx2")))
+static Boolean vector_add_avx2(const int32_t *a, const int32_t *b,
+                               int32_t *sum, size_t count)
+{
+  __m256i overflow = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8)
+    {
+      const __m256i x = _mm256_loadu_si256((const __m256i *) &a[i]);
+      const __m256i y = _mm256_loadu_si256((const __m256i *) &b[i]);
+      const __m256i s = _mm256_add_epi32(x, y);
+      overflow = _mm256_or_si256(overflow,
+                                 _mm256_and_si256(_mm256_xor_si256(x, s),
+                                                  _mm256_xor_si256(y, s)));
+      _mm256_storeu_si256((__m256i *) &sum[i], s);
+    }
+  const Boolean tail = vector_add_sse2(&a[i], &b[i], &sum[i], count - i);
+  return tail && !_mm256_movemask_ps(_mm256_castsi256_ps(overflow));
+}
+#endif
+
+static const struct
+{
+  const char *name;
+  VectorAddFunction add;
+} vector_kernels[VECTOR_KERNEL_COUNT] =
+  {
+    [VECTOR_KERNEL_SCALAR] = { "scalar", vector_add_scalar },
+#ifdef VECTOR_X86
+    [VECTOR_KERNEL_SSE2] = { "sse2", vector_add_sse2 },
+    [VECTOR_KERNEL_AVX2] = { "avx2", vector_add_avx2 },
+#else
+    [VECTOR_KERNEL_SSE2] = { "sse2", NULL },
+    [VECTOR_KERNEL_AVX2] = { "avx2", NULL },
+#endif
+  };
+
+Boolean vector_kernel_supported(VectorKernel kernel)
+{
+  switch (kernel)
+    {
+    case VECTOR_KERNEL_SCALAR:
+      return TRUE;
+#ifdef VECTOR_X86
+    case VECTOR_KERNEL_SSE2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse2");
+    case VECTOR_KERNEL_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return FALSE;
+    }
+}
+
+VectorKernel vector_kernel_best(void)
+{
+  /* Racing threads agree on the answer, so no lock is needed. */
+  static int best = -1;
+  int kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+  if (kernel < 0)
+    {
+      kernel = VECTOR_KERNEL_COUNT - 1;
+      while (!vector_kernel_supported(kernel))
+        --kernel;
+      __atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+    }
+  return kernel;
+}
+
+const char *vector_kernel_name(VectorKernel kernel)
+{
+  return vector_kernels[kernel].name;
+}
+
+Boolean vector_add_i32_with(VectorKernel kernel, const int32_t *a,
+                            const int32_t *b, int32_t *sum, size_t count)
+{
+  return vector_kernels[kernel].add(a, b, sum, count);
+}
+
+Boolean vector_add_i32(const int32_t *a, const int32_t *b, int32_t *sum,
+                       size_t count)
+{
+  return vector_kernels[vector_kernel_best()].add(a, b, sum, count);
+}
+
+/* Eight ASCII digits in the little-endian word `chunk'? */
+static Boolean decimal_is_digits8(uint64_t chunk)
+{
+  return ((chunk & 0xf0f0f0f0f0f0f0f0ULL) |
+          (((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ==
+    0x3333333333333333ULL;
+}
+
+/* Convert eight digits at once: adjacent digits are combined into
+   pairs, then pairs into quads, then the quads into the result, each
+   step with one multiplication over the whole word. */
+static uint32_t decimal_parse8(uint64_t chunk)
+{
+  const uint64_t mask = 0x000000ff000000ffULL;
+
+  chunk -= 0x3030303030303030ULL;
+  chunk = chunk * 10 + (chunk >> 8);
+  return ((chunk & mask) * (100 + (1000000ULL << 32)) +
+          ((chunk >> 16) & mask) * (1 + (10000ULL << 32))) >> 32;
+}
+
+const char *decimal_parse_i32(const char *p, const char *end,
+                              int32_t *value_ret)
+{
+  Boolean negative = FALSE;
+  const char *digits, *significant;
+  uint64_t value = 0, chunk;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  digits = p;
+  while (p < end && *p == '0')
+    ++p;
+  significant = p;
+
+  if (end - p >= 8)
+    {
+      memcpy(&chunk, p, sizeof(chunk));
+      chunk = le64toh(chunk);
+      if (decimal_is_digits8(chunk))
+        {
+          value = decimal_parse8(chunk);
+          p += 8;
+        }
+    }
+  /* An int32_t has at most ten significant digits. */
+  while (p < end && *p >= '0' && *p <= '9' && p - significant < 10)
+    value = value * 10 + (*p++ - '0');
+
+  if (p == digits || (p < end && *p >= '0' && *p <= '9') ||
+      value > (uint64_t) INT32_MAX + negative)
+    return NULL;
+  *value_ret = negative ? (int32_t) -(int64_t) value : (int32_t) value;
+  return p;
+}
+
+static const char decimal_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+size_t decimal_format_i32(char *buf, int32_t value)
+{
+  char digits[DECIMAL_I32_SIZE], *p = digits + sizeof(digits);
+  uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+
+  /* Two digits per division. */
+  while (magnitude >= 100)
+    {
+      const char * const pair = &decimal_pairs[(magnitude % 100) * 2];
+      magnitude /= 100;
+      *--p = pair[1];
+      *--p = pair[0];
+    }
+  if (magnitude >= 10)
+    {
+      *--p = decimal_pairs[magnitude * 2 + 1];
+      *--p = decimal_pairs[magnitude * 2];
+    }
+  else
+    *--p = '0' + magnitude;
+  if (value < 0)
+    *--p = '-';
+
+  memcpy(buf, p, digits + sizeof(digits) - p);
+  return digits + sizeof(digits) - p;
+}
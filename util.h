@@ -2,6 +2,7 @@
 #define _UTIL_H_
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 
 /**************************** Utility functions. ****************************/
@@ -28,12 +29,53 @@ char *xstrdup(const char *ptr);
    memory-allocation failure.  */
 void *xcalloc(size_t num_objects, size_t size);
 
+/* Like posix_memalign(), but fatal() is called on failure.  The memory
+   is not cleared. */
+void *xmemalign(size_t alignment, size_t size);
+
+/* The heap allocations the calling thread has made through
+   string_format() and the x*() allocators, so tests can check that hot
+   paths do not allocate. */
+size_t allocation_count(void);
+
+/* Bump-pointer arena for short-lived allocations.  Nothing is freed
+   individually; arena_reset() releases everything at once and keeps
+   the blocks for reuse, so a steady workload stops calling malloc().
+   Not thread-safe.  Allocations larger than `block_size' get a block of
+   their own, which arena_reset() frees. */
+typedef struct ArenaRec *Arena;
+
+Arena arena_create(size_t block_size);
+void arena_destroy(Arena arena);
+void arena_reset(Arena arena);
+
+/* Arena counterparts of xcalloc(), xstrdup() and string_format(). */
+void *arena_calloc(Arena arena, size_t num_objects, size_t size);
+char *arena_strdup(Arena arena, const char *ptr);
+char *arena_string_format(Arena arena, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
 /* Inter-process communication. */
 
 /* Create a local listener to given `listener_path'.  Return -1 on
    failure.  A returned non-negative integer is the allocated socket
-   file descriptor. */
+   file descriptor.  The backlog is SOMAXCONN, which the kernel caps at
+   net.core.somaxconn. */
 int create_local_listener(const char *listener_path);
+/* The same with room for `backlog' pending connections. */
+int create_local_listener_with_backlog(const char *listener_path,
+                                       int backlog);
+
+/* Create a TCP listener bound to `host' (NULL for any address) and
+   `port' with room for `backlog' pending connections.  With
+   `reuse_port', several listeners may bind the same address and the
+   kernel spreads new connections over them.  With `no_delay',
+   accepted connections inherit TCP_NODELAY.  Return -1 on failure. */
+int create_tcp_listener(const char *host, int port, int backlog,
+                        Boolean reuse_port, Boolean no_delay);
+
+/* The local port a socket is bound to, or -1 on failure. */
+int socket_local_port(int sock_fd);
 
 /* Reporting functions. */
 
@@ -42,18 +84,49 @@ typedef enum { OM_QUIET, OM_NORMAL, OM_VERBOSE, OM_DEBUG } OutputMode;
 
 OutputMode get_output_mode();
 void set_output_mode(OutputMode output_mode);
+/* The mode, for DEBUG() to test without a call. */
+extern OutputMode current_output_mode;
 
 char *string_format(const char *fmt, ...);
 
+/* Log levels.  Messages below LOG_MIN_LEVEL are compiled out; build
+   with -DLOG_MIN_LEVEL=LOG_LEVEL_WARNING ("make LOG_LEVEL=WARNING") to
+   drop DEBUG(). */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_WARNING 1
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#if LOG_MIN_LEVEL > LOG_LEVEL_DEBUG
+/* Still type-checked, but never evaluated. */
+#define DEBUG(varcall)                                          \
+do {                                                            \
+  if (0)                                                        \
+    xfree(string_format varcall);                               \
+ } while(0)
+#else
 #define DEBUG(varcall)                                          \
 do {                                                            \
-  if (get_output_mode() == OM_DEBUG)                            \
+  if (__builtin_expect(current_output_mode == OM_DEBUG, 0))     \
     {                                                           \
       char * msg = string_format varcall;                       \
       debug("DEBUG: %s:%d: %s", __FILE__, __LINE__, msg);       \
       xfree(msg);                                               \
     }                                                           \
  } while(0)
+#endif
+
+/* Messages are formatted into a ring of the calling thread's own and
+   written by a background thread, so logging never blocks on the
+   output.  A thread logs at most LOG_BURST warnings a second of each
+   format; more are suppressed, and messages finding the ring full are
+   dropped, both counted and reported.  Debug messages are not rate
+   limited.  Runs of one message are written once with
+   the number of repeats.  Messages longer than LOG_MESSAGE_MAX bytes
+   are truncated. */
+#define LOG_BURST 100
+#define LOG_MESSAGE_MAX 256
 
 /* Emit a debug message. */
 void debug(const char *fmt, ...);
@@ -61,9 +134,26 @@ void debug(const char *fmt, ...);
 /* Emit a warning message. */
 void warning(const char *fmt, ...);
 
-/* Emit an error message and forcibly exit. */
+/* Emit an error message and forcibly exit.  Messages logged before are
+   written first. */
 void fatal(const char *fmt, ...);
 
+/* Write every message logged so far before returning.  Called at
+   exit. */
+void log_flush(void);
+/* Write messages to `fd' instead of standard error; returns the
+   previous descriptor. */
+int log_set_fd(int fd);
+
+typedef struct LogStatsRec
+{
+  /* Lines written, messages suppressed by the rate limit, dropped with
+     the ring full, and folded into a previous message as repeats. */
+  uint64_t written, suppressed, dropped, repeated;
+} LogStatsStruct, *LogStats;
+
+void log_get_stats(LogStats stats_ret);
+
 /* For testing, NEVER for production code. */
 void default_fatal_handler(const char *message, void *context);
 
@@ -79,7 +169,23 @@ void register_fatal_handler(void (*fatal_handler)(const char *message,
 typedef struct MutexRec *Mutex;
 typedef struct ConditionRec *Condition;
 
+/* Lock profiling, compiled in with -DCSERVER_LOCK_PROFILE ("make
+   LOCK_PROFILE=1"): every mutex counts its acquisitions, the contended
+   ones and the time spent waiting for and holding it, and the counts
+   are summed over the mutexes created at each call site of
+   mutex_create(). */
+#ifdef CSERVER_LOCK_PROFILE
+#define LOCK_PROFILE_STRING(x) #x
+#define LOCK_PROFILE_SITE(file, line) file ":" LOCK_PROFILE_STRING(line)
+#define mutex_create() mutex_create_at(LOCK_PROFILE_SITE(__FILE__, __LINE__))
+/* A mutex profiled under `site', a string that must outlive it. */
+Mutex mutex_create_at(const char *site);
+/* The profile, one line of name=value pairs per site, most waited for
+   first, each ending in a newline.  Free with xfree(). */
+char *lock_profile_format(void);
+#else
 Mutex mutex_create(void);
+#endif
 void mutex_destroy(Mutex mutex);
 
 /* Obtain mutex. */
@@ -95,6 +201,147 @@ void condition_broadcast(Condition cv);
 /* Wait for the condition variable to be signaled or broadcast.  This
    function will also atomically unlock the given mutex. */
 void condition_wait(Condition cv, Mutex mutex);
+/* Like condition_wait(), but give up after `timeout_ms' milliseconds.
+   Returns FALSE on timeout, TRUE otherwise. */
+Boolean condition_timedwait(Condition cv, Mutex mutex, long timeout_ms);
+
+/* Nanoseconds on the monotonic clock. */
+uint64_t clock_monotonic_ns(void);
+/* Milliseconds on the monotonic clock, read at the resolution of the
+   scheduler tick but without a system call. */
+uint64_t clock_monotonic_coarse_ms(void);
+
+/* Bounded lock-free queue of pointers.  Any number of threads may push
+   and pop concurrently; items come out in FIFO order. */
+typedef struct WorkQueueRec *WorkQueue;
+
+/* `capacity' is rounded up to a power of two. */
+WorkQueue work_queue_create(size_t capacity);
+void work_queue_destroy(WorkQueue queue);
+
+/* Returns FALSE if the queue is full. */
+Boolean work_queue_push(WorkQueue queue, void *item);
+/* Returns NULL if the queue is empty. */
+void *work_queue_pop(WorkQueue queue);
+
+/* Hierarchical timer wheel: four levels of 64 slots, each slot of a
+   level spanning a whole turn of the level below.  Adding and
+   cancelling a timer are O(1); a timer far out is moved down a level
+   as its time approaches.  Times are in ticks of the caller's choosing;
+   a timer is due at the first tick at or after its expiry, and one
+   more than 2^24 ticks out is kept at that horizon.  Not thread-safe.
+   Timers are embedded in the caller's objects. */
+typedef struct TimerRec
+{
+  struct TimerRec *prev, *next;
+  uint64_t expires;
+} TimerStruct, *Timer;
+
+typedef struct TimerWheelRec *TimerWheel;
+
+/* `now' is the current tick. */
+TimerWheel timer_wheel_create(uint64_t now);
+/* Timers still armed are left alone. */
+void timer_wheel_destroy(TimerWheel wheel);
+
+/* Arm `timer', which must not be armed, to expire at tick `expires'. */
+void timer_wheel_add(TimerWheel wheel, Timer timer, uint64_t expires);
+/* Disarm `timer' if it is armed. */
+void timer_wheel_cancel(TimerWheel wheel, Timer timer);
+Boolean timer_armed(Timer timer);
+
+/* Move the wheel to tick `now' and return the timers that expired on
+   the way, disarmed and chained through their `next' field. */
+Timer timer_wheel_advance(TimerWheel wheel, uint64_t now);
+/* Number of armed timers. */
+size_t timer_wheel_count(TimerWheel wheel);
+
+/* Log-linear histogram of values such as latencies in nanoseconds:
+   each power of two is split into 2^HISTOGRAM_SUB_BITS buckets, so a
+   bucket is within 1/16 of its values.  Values from 2^HISTOGRAM_MAX_BITS
+   on land in the last bucket.  One thread records into a histogram;
+   others may merge it at any time and see a slightly stale view. */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct HistogramRec
+{
+  uint64_t count, sum, max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} HistogramStruct, *Histogram;
+
+/* Record `count' occurrences of `value'. */
+void histogram_record(Histogram histogram, uint64_t value, uint64_t count);
+/* Add `from', which may be recorded into meanwhile, to `into'. */
+void histogram_merge(Histogram into, Histogram from);
+/* The bucket of `value', and the largest value in a bucket. */
+size_t histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_limit(size_t bucket);
+/* An upper bound of the value below which `fraction' of the values
+   fall, or 0 if the histogram is empty. */
+uint64_t histogram_percentile(Histogram histogram, double fraction);
+
+/* Pool of fixed-size objects carved from cache-line aligned slabs.
+   Each thread keeps a small cache of free objects and trades them with
+   a shared depot `batch' at a time, so allocation and release take no
+   lock in the common case. */
+typedef struct ObjectPoolRec *ObjectPool;
+
+typedef struct ObjectPoolStatsRec
+{
+  /* Objects handed out, objects cached or in the depot, and slabs. */
+  size_t live, free, slabs;
+} ObjectPoolStatsStruct, *ObjectPoolStats;
+
+/* `objects_per_slab' objects of `object_size' bytes, rounded up to the
+   cache line, are allocated at a time. */
+ObjectPool object_pool_create(size_t object_size, size_t objects_per_slab,
+                              size_t batch);
+/* Every object must have been released. */
+void object_pool_destroy(ObjectPool pool);
+
+/* Returns a zeroed object. */
+void *object_pool_alloc(ObjectPool pool);
+void object_pool_free(ObjectPool pool, void *object);
+
+void object_pool_get_stats(ObjectPool pool, ObjectPoolStats stats_ret);
+
+/* Batch arithmetic.  Each operation has a scalar kernel and, on x86,
+   SSE2 and AVX2 ones; the best kernel the CPU supports is picked at
+   run time. */
+typedef enum
+  {
+    VECTOR_KERNEL_SCALAR,
+    VECTOR_KERNEL_SSE2,
+    VECTOR_KERNEL_AVX2,
+    VECTOR_KERNEL_COUNT
+  } VectorKernel;
+
+VectorKernel vector_kernel_best(void);
+Boolean vector_kernel_supported(VectorKernel kernel);
+const char *vector_kernel_name(VectorKernel kernel);
+
+/* sum[i] = a[i] + b[i] for `count' elements, with the best kernel.
+   Returns FALSE if any sum overflowed; the sums then wrap around. */
+Boolean vector_add_i32(const int32_t *a, const int32_t *b, int32_t *sum,
+                       size_t count);
+/* The same with a given, supported, kernel. */
+Boolean vector_add_i32_with(VectorKernel kernel, const int32_t *a,
+                            const int32_t *b, int32_t *sum, size_t count);
+
+/* Longest decimal int32_t, "-2147483648". */
+#define DECIMAL_I32_SIZE 11
+
+/* Parse an optionally signed decimal number from `p' up to `end'.
+   Returns the end of the digits, or NULL if there are none or the
+   value does not fit. */
+const char *decimal_parse_i32(const char *p, const char *end,
+                              int32_t *value_ret);
+/* Format `value' into `buf', which needs DECIMAL_I32_SIZE bytes, and
+   return the length.  Nothing is NUL-terminated. */
+size_t decimal_format_i32(char *buf, int32_t value);
 
 /* Start a detached thread with the given function and argument.
    Returns TRUE if the thread was started successfully, FALSE otherwise.